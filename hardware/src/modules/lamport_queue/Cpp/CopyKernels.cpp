@@ -0,0 +1,117 @@
+/*
+  Created by Rut Vora
+*/
+
+#include "CopyKernels.hpp"
+
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace copyKernels {
+  static void plainCopy(void *destination, const void *source,
+                        size_t length) {
+    std::memcpy(destination, source, length);
+  }
+
+#if defined(__x86_64__)
+  /**
+   * @brief Copy the head with memcpy up to the given alignment of the
+   * destination (streaming stores need aligned destinations)
+   * @return The number of bytes copied
+   */
+  static inline size_t alignDestination(uint8_t *destination,
+                                        const uint8_t *source, size_t length,
+                                        size_t alignment) {
+    auto head = (alignment - (uintptr_t) destination % alignment) % alignment;
+    if (head > length) head = length;
+    std::memcpy(destination, source, head);
+    return head;
+  }
+
+  __attribute__((target("avx2")))
+  static void avx2Stream(void *destination, const void *source,
+                         size_t length) {
+    auto to = static_cast<uint8_t *>(destination);
+    auto from = static_cast<const uint8_t *>(source);
+    auto done = alignDestination(to, from, length, 32);
+    for (; done + 128 <= length; done += 128) {
+      auto a = _mm256_loadu_si256((const __m256i *) (from + done));
+      auto b = _mm256_loadu_si256((const __m256i *) (from + done + 32));
+      auto c = _mm256_loadu_si256((const __m256i *) (from + done + 64));
+      auto d = _mm256_loadu_si256((const __m256i *) (from + done + 96));
+      _mm256_stream_si256((__m256i *) (to + done), a);
+      _mm256_stream_si256((__m256i *) (to + done + 32), b);
+      _mm256_stream_si256((__m256i *) (to + done + 64), c);
+      _mm256_stream_si256((__m256i *) (to + done + 96), d);
+    }
+    std::memcpy(to + done, from + done, length - done);
+    // Streaming stores are weakly ordered. The queue publishes its new
+    // position right after the copy
+    _mm_sfence();
+  }
+
+  __attribute__((target("avx512f")))
+  static void avx512Stream(void *destination, const void *source,
+                           size_t length) {
+    auto to = static_cast<uint8_t *>(destination);
+    auto from = static_cast<const uint8_t *>(source);
+    auto done = alignDestination(to, from, length, 64);
+    for (; done + 256 <= length; done += 256) {
+      auto a = _mm512_loadu_si512(from + done);
+      auto b = _mm512_loadu_si512(from + done + 64);
+      auto c = _mm512_loadu_si512(from + done + 128);
+      auto d = _mm512_loadu_si512(from + done + 192);
+      _mm512_stream_si512((__m512i *) (to + done), a);
+      _mm512_stream_si512((__m512i *) (to + done + 64), b);
+      _mm512_stream_si512((__m512i *) (to + done + 128), c);
+      _mm512_stream_si512((__m512i *) (to + done + 192), d);
+    }
+    std::memcpy(to + done, from + done, length - done);
+    _mm_sfence();
+  }
+#endif
+
+  Kernel best() {
+    static const Kernel kernel = []() {
+#if defined(__x86_64__)
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx512f")) return AVX512_STREAM;
+      if (__builtin_cpu_supports("avx2")) return AVX2_STREAM;
+#endif
+      return MEMCPY;
+    }();
+    return kernel;
+  }
+
+  CopyFunction get(Kernel kernel) {
+    switch (kernel) {
+#if defined(__x86_64__)
+      case AVX2_STREAM:
+        return avx2Stream;
+      case AVX512_STREAM:
+        return avx512Stream;
+#endif
+      default:
+        return plainCopy;
+    }
+  }
+
+  CopyFunction forLength(size_t length) {
+    static const CopyFunction nonTemporal = get(best());
+    return length >= NON_TEMPORAL_THRESHOLD ? nonTemporal : plainCopy;
+  }
+
+  const char *name(Kernel kernel) {
+    switch (kernel) {
+      case AVX2_STREAM:
+        return "AVX2 streaming";
+      case AVX512_STREAM:
+        return "AVX-512 streaming";
+      default:
+        return "memcpy";
+    }
+  }
+}
@@ -0,0 +1,53 @@
+/*
+  Created by Rut Vora
+*/
+
+#ifndef MINESVPN_COPYKERNELS_H
+#define MINESVPN_COPYKERNELS_H
+
+#include <cstddef>
+#include <cstring>
+
+// Copies of at least this many bytes bypass the cache (if the CPU can)
+#define NON_TEMPORAL_THRESHOLD 65536
+
+/**
+ * @brief Copies in and out of the queues. Large copies are not read again
+ * by the copying core before they go to QUIC or a socket, so they are done
+ * with non-temporal (streaming) stores: they don't evict the working set of
+ * the shaper from the cache. The widest kernel the CPU supports is picked at
+ * runtime
+ */
+namespace copyKernels {
+  enum Kernel {
+    MEMCPY, AVX2_STREAM, AVX512_STREAM
+  };
+
+  using CopyFunction = void (*)(void *destination, const void *source,
+                                size_t length);
+
+  /**
+   * @return The widest non-temporal kernel the CPU supports (MEMCPY if none)
+   */
+  Kernel best();
+
+  /**
+   * @param kernel A kernel (that the CPU supports)
+   * @return The function of that kernel. Non-temporal kernels are fenced, so
+   * their stores are visible before anything stored after them
+   */
+  CopyFunction get(Kernel kernel);
+
+  /**
+   * @param length The number of bytes to copy
+   * @return The function to copy them with
+   */
+  CopyFunction forLength(size_t length);
+
+  /**
+   * @return The name of the kernel
+   */
+  const char *name(Kernel kernel);
+}
+
+#endif //MINESVPN_COPYKERNELS_H
@@ -4,6 +4,9 @@
 
 #include "LamportQueue.hpp"
 
+#include <algorithm>
+#include "CopyKernels.hpp"
+
 LamportQueue::LamportQueue(uint64_t queueID, size_t queueSize)
     : ID(queueID), bufferSize(queueSize) {
   front = 0;
@@ -12,11 +15,28 @@ LamportQueue::LamportQueue(uint64_t queueID, size_t queueSize)
   cachedBack = 0;
 }
 
+LamportQueue::LamportQueue(uint64_t queueID, size_t queueSize, SlabPool *pool)
+    : LamportQueue(queueID, queueSize) {
+  poolOffset = reinterpret_cast<uint8_t *>(pool) -
+               reinterpret_cast<uint8_t *>(this);
+  segmentSize = pool->segmentSize;
+  // A queue of queueSize bytes that doesn't start at the start of a segment
+  // spans one segment more
+  numSlots = (queueSize + segmentSize - 1) / segmentSize + 1;
+}
+
+size_t LamportQueue::footprint(size_t queueSize, size_t segmentSize) {
+  if (segmentSize == 0) return sizeof(LamportQueue) + queueSize;
+  auto numSlots = (queueSize + segmentSize - 1) / segmentSize + 1;
+  return (sizeof(LamportQueue) + numSlots * sizeof(uint32_t) + 63) & ~63UL;
+}
+
 // LamportQueue::~LamportQueue() {
 //   delete queueStorage;
 // }
 
 int LamportQueue::push(uint8_t *buffer, size_t length) {
+  if (poolOffset != 0) return pushSegmented(buffer, length);
   if (length > bufferSize) return -1;
   uint8_t *queueStorage = reinterpret_cast<uint8_t *>(this) + offset;
   size_t b, f;
@@ -30,19 +50,43 @@ int LamportQueue::push(uint8_t *buffer, size_t length) {
   if (freeSpace < length) {
     return -1;
   }
+  auto copy = copyKernels::forLength(length);
   if (b + length > bufferSize) {
     auto size1 = bufferSize - b;
-    std::memcpy(queueStorage + b, buffer, size1);
-    std::memcpy(queueStorage + b, buffer, size1);
-    std::memcpy(queueStorage, buffer + size1, length - size1);
+    copy(queueStorage + b, buffer, size1);
+    copy(queueStorage, buffer + size1, length - size1);
   } else {
-    std::memcpy(queueStorage + b, buffer, length);
+    copy(queueStorage + b, buffer, length);
   }
   this->back.store((b + length) % bufferSize, std::memory_order_release);
   return 0;
 }
 
+size_t LamportQueue::pushPartial(const uint8_t *buffer, size_t length) {
+  if (poolOffset != 0) return pushPartialSegmented(buffer, length);
+  uint8_t *queueStorage = reinterpret_cast<uint8_t *>(this) + offset;
+  size_t b, f;
+  b = this->back.load(std::memory_order_relaxed);
+  f = this->cachedFront;
+  if (this->getFreeSpaceLocal(f, b) < length) {
+    this->cachedFront = f = this->front.load(std::memory_order_acquire);
+  }
+  length = std::min(length, this->getFreeSpaceLocal(f, b));
+  if (length == 0) return 0;
+  auto copy = copyKernels::forLength(length);
+  if (b + length > bufferSize) {
+    auto size1 = bufferSize - b;
+    copy(queueStorage + b, buffer, size1);
+    copy(queueStorage, buffer + size1, length - size1);
+  } else {
+    copy(queueStorage + b, buffer, length);
+  }
+  this->back.store((b + length) % bufferSize, std::memory_order_release);
+  return length;
+}
+
 int LamportQueue::pop(uint8_t *buffer, size_t length) {
+  if (poolOffset != 0) return popSegmented(buffer, length);
   if (length > bufferSize) return -1;
   uint8_t *queueStorage = reinterpret_cast<uint8_t *>(this) + offset;
   size_t b, f;
@@ -56,30 +100,67 @@ int LamportQueue::pop(uint8_t *buffer, size_t length) {
   if (queueSize < length) {
     return -1;
   }
+  auto copy = copyKernels::forLength(length);
   if (f + length > bufferSize) {
     auto size1 = bufferSize - f;
-    std::memcpy(buffer, queueStorage + f, size1);
-    std::memcpy(buffer + size1, queueStorage, length - size1);
+    copy(buffer, queueStorage + f, size1);
+    copy(buffer + size1, queueStorage, length - size1);
   } else {
-    std::memcpy(buffer, queueStorage + f, length);
+    copy(buffer, queueStorage + f, length);
   }
   this->front.store((f + length) % bufferSize, std::memory_order_release);
   return 0;
 }
 
+size_t LamportQueue::peek(uint8_t *&first, size_t &firstLength,
+                          uint8_t *&second, size_t &secondLength) {
+  if (poolOffset != 0)
+    return peekSegmented(first, firstLength, second, secondLength);
+  uint8_t *queueStorage = reinterpret_cast<uint8_t *>(this) + offset;
+  size_t f = this->front.load(std::memory_order_relaxed);
+  size_t b = this->cachedBack = this->back.load(std::memory_order_acquire);
+  size_t queueSize = this->getQueueSizeLocal(f, b);
+  first = queueStorage + f;
+  firstLength = std::min(queueSize, bufferSize - f);
+  second = queueStorage;
+  secondLength = queueSize - firstLength;
+  return queueSize;
+}
+
+void LamportQueue::advance(size_t length) {
+  size_t f = this->front.load(std::memory_order_relaxed);
+  if (poolOffset != 0) {
+    releaseSegments(f / segmentSize, (f + length) / segmentSize);
+    this->front.store(f + length, std::memory_order_release);
+    return;
+  }
+  this->front.store((f + length) % bufferSize, std::memory_order_release);
+}
+
 size_t LamportQueue::size() {
   size_t f = this->front.load(std::memory_order_relaxed);
   size_t b = this->back.load(std::memory_order_acquire);
+  if (poolOffset != 0) return b - f;
   return this->getQueueSizeLocal(f, b);
 }
 
 void LamportQueue::clear() {
+  if (poolOffset != 0) {
+    releaseSegments(front / segmentSize,
+                    (back + segmentSize - 1) / segmentSize);
+  }
   front = back = cachedFront = cachedBack = 0;
 }
 
 size_t LamportQueue::freeSpace() {
   size_t f = this->front.load(std::memory_order_relaxed);
   size_t b = this->back.load(std::memory_order_acquire);
+  if (poolOffset != 0) {
+    // The rest of the last segment, and the free ones of the pool
+    auto held = b % segmentSize == 0 ? 0 : segmentSize - b % segmentSize;
+    return std::min(bufferSize - (b - f),
+                    held + pool()->available() * segmentSize);
+  }
   return this->getFreeSpaceLocal(f, b);
 }
 
@@ -94,4 +175,102 @@ size_t LamportQueue::getFreeSpaceLocal(size_t f, size_t b) {
 
 size_t LamportQueue::getQueueSizeLocal(size_t f, size_t b) {
   return this->mod(b - f, bufferSize);
-}
\ No newline at end of file
+}
+
+size_t LamportQueue::takeSegments(size_t b, size_t length) {
+  auto fits = b % segmentSize == 0 ? 0 : segmentSize - b % segmentSize;
+  auto next = (b + segmentSize - 1) / segmentSize;
+  while (fits < length) {
+    auto segment = pool()->allocate();
+    if (segment == SlabPool::NO_SEGMENT) break;
+    slots()[next++ % numSlots] = segment;
+    fits += segmentSize;
+  }
+  return std::min(fits, length);
+}
+
+void LamportQueue::releaseSegments(size_t from, size_t to) {
+  for (auto i = from; i < to; i++) pool()->free(slots()[i % numSlots]);
+}
+
+void LamportQueue::copyIn(size_t b, const uint8_t *buffer, size_t length) {
+  // Picked for the whole copy: the segments are smaller than the threshold
+  auto copy = copyKernels::forLength(length);
+  while (length > 0) {
+    auto chunk = std::min(length, segmentSize - b % segmentSize);
+    copy(at(b), buffer, chunk);
+    b += chunk;
+    buffer += chunk;
+    length -= chunk;
+  }
+}
+
+void LamportQueue::copyOut(size_t f, uint8_t *buffer, size_t length) {
+  auto copy = copyKernels::forLength(length);
+  while (length > 0) {
+    auto chunk = std::min(length, segmentSize - f % segmentSize);
+    copy(buffer, at(f), chunk);
+    f += chunk;
+    buffer += chunk;
+    length -= chunk;
+  }
+}
+
+int LamportQueue::pushSegmented(uint8_t *buffer, size_t length) {
+  if (length > bufferSize) return -1;
+  size_t b = this->back.load(std::memory_order_relaxed);
+  size_t f = this->cachedFront;
+  if (bufferSize - (b - f) < length) {
+    this->cachedFront = f = this->front.load(std::memory_order_acquire);
+  }
+  if (bufferSize - (b - f) < length) return -1;
+  auto fits = takeSegments(b, length);
+  if (fits < length) {
+    // The pool ran out. Give back what was taken for this push
+    releaseSegments((b + segmentSize - 1) / segmentSize,
+                    (b + fits + segmentSize - 1) / segmentSize);
+    return -1;
+  }
+  copyIn(b, buffer, length);
+  this->back.store(b + length, std::memory_order_release);
+  return 0;
+}
+
+size_t LamportQueue::pushPartialSegmented(const uint8_t *buffer,
+                                          size_t length) {
+  size_t b = this->back.load(std::memory_order_relaxed);
+  size_t f = this->cachedFront;
+  if (bufferSize - (b - f) < length) {
+    this->cachedFront = f = this->front.load(std::memory_order_acquire);
+  }
+  length = takeSegments(b, std::min(length, bufferSize - (b - f)));
+  if (length == 0) return 0;
+  copyIn(b, buffer, length);
+  this->back.store(b + length, std::memory_order_release);
+  return length;
+}
+
+int LamportQueue::popSegmented(uint8_t *buffer, size_t length) {
+  if (length > bufferSize) return -1;
+  size_t f = this->front.load(std::memory_order_relaxed);
+  size_t b = this->cachedBack;
+  if (b - f < length) {
+    this->cachedBack = b = this->back.load(std::memory_order_acquire);
+  }
+  if (b - f < length) return -1;
+  copyOut(f, buffer, length);
+  releaseSegments(f / segmentSize, (f + length) / segmentSize);
+  this->front.store(f + length, std::memory_order_release);
+  return 0;
+}
+
+size_t LamportQueue::peekSegmented(uint8_t *&first, size_t &firstLength,
+                                   uint8_t *&second, size_t &secondLength) {
+  size_t f = this->front.load(std::memory_order_relaxed);
+  size_t b = this->cachedBack = this->back.load(std::memory_order_acquire);
+  firstLength = std::min(b - f, segmentSize - f % segmentSize);
+  secondLength = std::min(b - f - firstLength, segmentSize);
+  first = firstLength > 0 ? at(f) : nullptr;
+  second = secondLength > 0 ? at(f + firstLength) : nullptr;
+  return firstLength + secondLength;
+}
@@ -12,6 +12,7 @@
 #include <atomic>
 #include <cstring>
 #include "../../Common.h"
+#include "SlabPool.hpp"
 
 class LamportQueue {
 public:
@@ -20,6 +21,26 @@ public:
    */
   explicit LamportQueue(uint64_t queueID, size_t queueSize);
 
+  /**
+   * @brief Constructor of a segmented queue. It holds up to queueSize bytes
+   * in segments that it takes from the given pool as it fills up, and gives
+   * back as it drains. The pool has to be in the same shared memory as the
+   * queue
+   * @param queueID The ID of the queue
+   * @param queueSize The maximum number of bytes in the queue
+   * @param pool The pool to take the segments from
+   */
+  LamportQueue(uint64_t queueID, size_t queueSize, SlabPool *pool);
+
+  /**
+   * @param queueSize The maximum number of bytes in the queue
+   * @param segmentSize The size of the segments of the pool. 0 for a
+   * contiguous queue
+   * @return The size of the queue, including its storage (contiguous) or the
+   * list of its segments (segmented)
+   */
+  static size_t footprint(size_t queueSize, size_t segmentSize);
+
   /**
    *
    * @param buffer byteArray
@@ -29,6 +50,15 @@ public:
    */
   int push(uint8_t *buffer, size_t length);
 
+  /**
+   * @brief Push as much of the given bytes as there is space for
+   * @param buffer byteArray
+   * @param length number of bytes to copy from the given byteArray
+   * @return The number of bytes pushed (the first ones of buffer). 0 if the
+   * queue is full
+   */
+  size_t pushPartial(const uint8_t *buffer, size_t length);
+
   /**
    *
    * @param buffer The empty buffer to be filled
@@ -39,6 +69,27 @@ public:
    */
   int pop(uint8_t *buffer, size_t length);
 
+  /**
+   * @brief Look at the bytes in the queue without removing them (to send
+   * them straight from the queue). The bytes may wrap around the end of the
+   * queue (or span segments), so they are given as two regions
+   * @param first Set to the start of the first region
+   * @param firstLength Set to the length of the first region
+   * @param second Set to the start of the second region
+   * @param secondLength Set to the length of the second region (0 if the
+   * bytes don't wrap around)
+   * @return The number of bytes in the two regions. All the bytes in the
+   * queue, unless it is segmented and they span more than two segments
+   */
+  size_t peek(uint8_t *&first, size_t &firstLength,
+              uint8_t *&second, size_t &secondLength);
+
+  /**
+   * @brief Remove bytes that were looked at with peek
+   * @param length The number of bytes to remove (at most what peek returned)
+   */
+  void advance(size_t length);
+
   /**
    * @brief Gives current size of the queue
    * @return The current size of the queue (number of bytes available)
@@ -46,10 +97,15 @@ public:
   size_t size();
 
   /**
-   * @brief Clear the queue
+   * @brief Clear the queue (giving its segments back to the pool). Only
+   * when neither the producer nor the consumer uses it
    */
   void clear();
 
+  /**
+   * @return The number of bytes that can be pushed. For a segmented queue,
+   * also limited by the free segments of the pool
+   */
   size_t freeSpace();
 
   /**
@@ -57,8 +113,26 @@ public:
    */
   addressPair addrPair;
   uint64_t ID;
-  bool markedForDeletion = false;
-  bool sentFIN = false;
+  /**
+   * @brief The state of the connection on the queue pair. Only the one of the
+   * fromShaped queue of a pair is used (see helpers::ConnectionState)
+   */
+  std::atomic<uint32_t> connectionState{0};
+  /**
+   * @brief Kept here for a restarted shaped process, which resumes the flow
+   * with them (only the shaped process touches them). The number of bytes of
+   * the flow it sent from this queue to the other middlebox (toShaped) or
+   * received into it (fromShaped), and the ID the other middlebox gave the
+   * flow if it is multiplexed (toShaped only, 0 if it is not)
+   */
+  uint64_t shapedBytes = 0;
+  uint64_t flowID = 0;
+  /**
+   * @brief The traffic class the flow is shaped in (see
+   * helpers::TrafficClasses). Set by the shaped process at SYN, on the
+   * toShaped queue only
+   */
+  std::atomic<uint32_t> trafficClass{0};
 
 private:
   const size_t bufferSize; // 2 MB
@@ -67,9 +141,59 @@ private:
   size_t cachedFront;
   size_t cachedBack;
   size_t offset = sizeof(LamportQueue);
+  // Segmented queues only. The storage at offset then holds the index of
+  // the segment of every slot, and front and back never wrap around: the
+  // segment of a position is in slot (position / segmentSize) % numSlots
+  ssize_t poolOffset = 0; // From this queue (0 if it is contiguous)
+  size_t segmentSize = 0;
+  size_t numSlots = 0;
 
   static size_t mod(ssize_t a, ssize_t b);
 
+  inline uint32_t *slots() {
+    return reinterpret_cast<uint32_t *>(
+        reinterpret_cast<uint8_t *>(this) + offset);
+  }
+
+  inline SlabPool *pool() {
+    return reinterpret_cast<SlabPool *>(
+        reinterpret_cast<uint8_t *>(this) + poolOffset);
+  }
+
+  /**
+   * @param position A position in a segmented queue
+   * @return Where the byte at that position is stored
+   */
+  inline uint8_t *at(size_t position) {
+    return pool()->segment(slots()[(position / segmentSize) % numSlots]) +
+           position % segmentSize;
+  }
+
+  /**
+   * @brief Take the segments from the pool to push the given number of bytes
+   * at the given position (segmented queues only)
+   * @return How many of the bytes fit in the segments held now
+   */
+  size_t takeSegments(size_t b, size_t length);
+
+  /**
+   * @brief Give the segments [from, to) of a segmented queue back to the pool
+   */
+  void releaseSegments(size_t from, size_t to);
+
+  void copyIn(size_t b, const uint8_t *buffer, size_t length);
+
+  void copyOut(size_t f, uint8_t *buffer, size_t length);
+
+  int pushSegmented(uint8_t *buffer, size_t length);
+
+  size_t pushPartialSegmented(const uint8_t *buffer, size_t length);
+
+  int popSegmented(uint8_t *buffer, size_t length);
+
+  size_t peekSegmented(uint8_t *&first, size_t &firstLength,
+                       uint8_t *&second, size_t &secondLength);
+
   size_t getQueueSizeLocal(size_t f, size_t b);
 
   size_t getFreeSpaceLocal(size_t f, size_t b);
@@ -0,0 +1,61 @@
+/*
+  Created by Rut Vora
+*/
+
+#include "SlabPool.hpp"
+
+#include <new>
+
+SlabPool::SlabPool(size_t segmentSize, size_t numSegments)
+    : segmentSize(alignUp(segmentSize, 64)), numSegments(numSegments) {
+  segmentsOffset =
+      alignUp(sizeof(SlabPool) + numSegments * sizeof(uint32_t), 4096);
+  auto link = links();
+  for (size_t i = 0; i < numSegments; i++) {
+    new(&link[i]) std::atomic<uint32_t>(
+        i + 1 < numSegments ? (uint32_t) (i + 1) : NO_SEGMENT);
+  }
+  head = numSegments > 0 ? 0 : NO_SEGMENT;
+  numFree = numSegments;
+}
+
+size_t SlabPool::footprint(size_t segmentSize, size_t numSegments) {
+  return alignUp(sizeof(SlabPool) + numSegments * sizeof(uint32_t), 4096) +
+         numSegments * alignUp(segmentSize, 64);
+}
+
+uint32_t SlabPool::allocate() {
+  auto current = head.load(std::memory_order_acquire);
+  while (true) {
+    auto segment = (uint32_t) current;
+    if (segment == NO_SEGMENT) return NO_SEGMENT;
+    // May be outdated if another thread took the segment meanwhile. The tag
+    // then makes the exchange fail
+    auto next = links()[segment].load(std::memory_order_relaxed);
+    auto tag = (current >> 32) + 1;
+    if (head.compare_exchange_weak(current, (tag << 32) | next,
+                                   std::memory_order_acq_rel,
+                                   std::memory_order_acquire)) {
+      numFree.fetch_sub(1, std::memory_order_relaxed);
+      return segment;
+    }
+  }
+}
+
+void SlabPool::free(uint32_t segment) {
+  auto current = head.load(std::memory_order_relaxed);
+  while (true) {
+    links()[segment].store((uint32_t) current, std::memory_order_relaxed);
+    auto tag = (current >> 32) + 1;
+    if (head.compare_exchange_weak(current, (tag << 32) | segment,
+                                   std::memory_order_release,
+                                   std::memory_order_relaxed)) {
+      numFree.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+size_t SlabPool::alignUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
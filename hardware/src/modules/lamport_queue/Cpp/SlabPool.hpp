@@ -0,0 +1,84 @@
+/*
+  Created by Rut Vora
+*/
+
+#ifndef MINESVPN_SLABPOOL_H
+#define MINESVPN_SLABPOOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief A pool of fixed-size segments that segmented LamportQueues take
+ * their memory from while they are backlogged, and return it to once they
+ * have drained. It lives in the shared memory (placement new) followed by its
+ * segments, and only refers to them by index, so that the processes can map
+ * it at different addresses. Any thread of either process can allocate and
+ * free segments without locking (a Treiber stack, with a tag against ABA)
+ */
+class SlabPool {
+public:
+  static constexpr uint32_t NO_SEGMENT = UINT32_MAX;
+
+  /**
+   * @brief Constructor. All segments start out free
+   * @param segmentSize The size of each segment (rounded up to 64 bytes)
+   * @param numSegments The number of segments
+   */
+  SlabPool(size_t segmentSize, size_t numSegments);
+
+  /**
+   * @param segmentSize The size of each segment
+   * @param numSegments The number of segments
+   * @return The size of the pool, including its segments
+   */
+  static size_t footprint(size_t segmentSize, size_t numSegments);
+
+  /**
+   * @return The index of a free segment. NO_SEGMENT if none is left
+   */
+  uint32_t allocate();
+
+  /**
+   * @brief Return a segment to the pool
+   * @param segment The index of the segment
+   */
+  void free(uint32_t segment);
+
+  /**
+   * @param segment The index of the segment
+   * @return The start of the segment
+   */
+  inline uint8_t *segment(uint32_t segment) {
+    return reinterpret_cast<uint8_t *>(this) + segmentsOffset +
+           segment * segmentSize;
+  }
+
+  /**
+   * @return The number of free segments (may be outdated at once)
+   */
+  [[nodiscard]] inline size_t available() const {
+    return numFree.load(std::memory_order_relaxed);
+  }
+
+  const size_t segmentSize;
+  const size_t numSegments;
+
+private:
+  // The index of the first free segment (lower half) and a tag that changes
+  // with every update (upper half)
+  std::atomic<uint64_t> head;
+  std::atomic<size_t> numFree;
+  size_t segmentsOffset;
+  // Followed by the link to the next free segment of every segment, then the
+  // segments
+
+  inline std::atomic<uint32_t> *links() {
+    return reinterpret_cast<std::atomic<uint32_t> *>(this + 1);
+  }
+
+  static size_t alignUp(size_t size, size_t alignment);
+};
+
+#endif //MINESVPN_SLABPOOL_H
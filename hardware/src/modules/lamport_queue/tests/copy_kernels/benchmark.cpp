@@ -0,0 +1,99 @@
+/*
+  Created by Rut Vora
+*/
+
+// Copy kernels of the queues. First the bandwidth of each kernel for copies
+// of 16 KB to 4 MB, between buffers spread over more memory than the caches
+// hold (as the queues are). Then the cache pollution: every tick, a
+// 500 KB shaper decision is copied out of a queue, and the time the shaper
+// then takes to walk its working set (1 MB) shows how much of it the copy
+// evicted.
+// Usage: ./benchmark [working set size] [ticks]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "../../Cpp/CopyKernels.hpp"
+
+#define ARENA_SIZE (256UL << 20)
+#define DECISION_SIZE 500000
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start).count();
+}
+
+static std::vector<copyKernels::Kernel> supportedKernels() {
+  std::vector<copyKernels::Kernel> kernels{copyKernels::MEMCPY};
+  if (copyKernels::best() >= copyKernels::AVX2_STREAM)
+    kernels.push_back(copyKernels::AVX2_STREAM);
+  if (copyKernels::best() >= copyKernels::AVX512_STREAM)
+    kernels.push_back(copyKernels::AVX512_STREAM);
+  return kernels;
+}
+
+static void bandwidth(uint8_t *source, uint8_t *destination) {
+  std::cout << "Bandwidth (GB/s)" << std::endl;
+  for (size_t size = 16384; size <= (4UL << 20); size *= 4) {
+    std::cout << "  " << size / 1024 << " KB:";
+    for (auto kernel: supportedKernels()) {
+      auto copy = copyKernels::get(kernel);
+      size_t copied = 0, offset = 0;
+      auto start = std::chrono::steady_clock::now();
+      while (copied < (4UL << 30)) {
+        if (offset + size > ARENA_SIZE / 2) offset = 0;
+        copy(destination + offset, source + offset, size);
+        offset += size;
+        copied += size;
+      }
+      std::cout << " " << copyKernels::name(kernel) << " "
+                << (double) copied / secondsSince(start) / 1e9 << ",";
+    }
+    std::cout << std::endl;
+  }
+}
+
+static void pollution(uint8_t *source, uint8_t *destination,
+                      size_t workingSetSize, int ticks) {
+  std::cout << "Walk of a " << workingSetSize / 1024 << " KB working set "
+            << "after a " << DECISION_SIZE << " byte copy (us)" << std::endl;
+  std::vector<uint64_t> workingSet(workingSetSize / sizeof(uint64_t), 1);
+  volatile uint64_t sink = 0;
+  for (auto kernel: supportedKernels()) {
+    auto copy = copyKernels::get(kernel);
+    size_t offset = 0;
+    double walk = 0, copying = 0;
+    for (int tick = 0; tick < ticks; tick++) {
+      if (offset + DECISION_SIZE > ARENA_SIZE / 2) offset = 0;
+      auto start = std::chrono::steady_clock::now();
+      copy(destination + offset, source + offset, DECISION_SIZE);
+      copying += secondsSince(start);
+      offset += DECISION_SIZE;
+
+      start = std::chrono::steady_clock::now();
+      uint64_t sum = 0;
+      for (size_t i = 0; i < workingSet.size(); i += 8) sum += workingSet[i];
+      sink = sink + sum;
+      walk += secondsSince(start);
+    }
+    std::cout << "  " << copyKernels::name(kernel) << ": walk "
+              << walk / ticks * 1e6 << ", copy " << copying / ticks * 1e6
+              << std::endl;
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t workingSetSize = argc > 1 ? std::stoul(argv[1]) : (1UL << 20);
+  int ticks = argc > 2 ? std::stoi(argv[2]) : 2000;
+  std::cout << "Best kernel: " << copyKernels::name(copyKernels::best())
+            << ", used from " << NON_TEMPORAL_THRESHOLD << " bytes"
+            << std::endl;
+  auto arena = static_cast<uint8_t *>(aligned_alloc(4096, ARENA_SIZE));
+  for (size_t i = 0; i < ARENA_SIZE; i += 4096) arena[i] = (uint8_t) i;
+  auto source = arena, destination = arena + ARENA_SIZE / 2;
+  bandwidth(source, destination);
+  pollution(source, destination, workingSetSize, ticks);
+  return 0;
+}
@@ -0,0 +1,300 @@
+/*
+  Created by Rut Vora
+*/
+
+// Correctness of the queues. Random pushes and pops (push, pushPartial, pop,
+// peek and advance) against a reference buffer, on a contiguous and on a
+// segmented queue. The segmented queue is small enough that its positions
+// wrap around its slots many times, and its pool is shared with a second
+// queue that takes most of it, so that pushes fail for lack of segments.
+// After every step, the segments held must be exactly those of the bytes in
+// the queue. Then one producer and one consumer thread move data through
+// each queue, the consumer checking every byte.
+// Usage: ./test [steps] [MB moved across threads]
+
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../../Cpp/LamportQueue.hpp"
+
+#define QUEUE_SIZE 4096
+#define SEGMENT_SIZE 256
+#define NUM_SEGMENTS 24
+#define MAX_LENGTH 1000
+
+// Pushes that failed because the pool had no segments left
+static size_t starvedPushes = 0;
+
+static void check(bool condition, const std::string &what) {
+  if (condition) return;
+  std::cerr << "FAILED: " << what << std::endl;
+  exit(1);
+}
+
+// The byte at the given position of the stream through a queue
+static inline uint8_t pattern(size_t position) {
+  return (uint8_t) (position % 251);
+}
+
+/**
+ * @brief A queue and the memory it is placed in (with its pool, if it is
+ * segmented), as in the shared memory
+ */
+struct TestQueue {
+  LamportQueue *queue;
+  SlabPool *pool;
+  // What the queue should hold, and the number of bytes pushed and popped
+  // (the back and front of a segmented queue)
+  std::deque<uint8_t> reference{};
+  size_t pushed = 0;
+  size_t popped = 0;
+
+  TestQueue(uint64_t ID, SlabPool *pool) : pool(pool) {
+    auto footprint = LamportQueue::footprint(
+        QUEUE_SIZE, pool == nullptr ? 0 : pool->segmentSize);
+    auto memory = aligned_alloc(64, (footprint + 63) & ~63UL);
+    queue = pool == nullptr ? new(memory) LamportQueue{ID, QUEUE_SIZE}
+                            : new(memory) LamportQueue{ID, QUEUE_SIZE, pool};
+  }
+
+  // The segments a segmented queue holds: those of [popped, pushed)
+  [[nodiscard]] size_t heldSegments() const {
+    auto size = pool->segmentSize;
+    return (pushed + size - 1) / size - popped / size;
+  }
+
+  void add(const uint8_t *buffer, size_t length) {
+    reference.insert(reference.end(), buffer, buffer + length);
+    pushed += length;
+  }
+
+  void remove(size_t length) {
+    reference.erase(reference.begin(), reference.begin() + length);
+    popped += length;
+  }
+};
+
+static SlabPool *newPool() {
+  auto memory = aligned_alloc(4096, (SlabPool::footprint(SEGMENT_SIZE,
+                                                         NUM_SEGMENTS) +
+                                     4095) & ~4095UL);
+  return new(memory) SlabPool{SEGMENT_SIZE, NUM_SEGMENTS};
+}
+
+/**
+ * @brief One random operation on the queue, checked against its reference
+ */
+static void step(TestQueue &test, std::mt19937 &random) {
+  auto queue = test.queue;
+  bool isSegmented = test.pool != nullptr;
+  std::vector<uint8_t> buffer(MAX_LENGTH);
+  auto length = std::uniform_int_distribution<size_t>(1, MAX_LENGTH)(random);
+  auto space = queue->freeSpace();
+  switch (std::uniform_int_distribution<int>(0, 3)(random)) {
+    case 0: {
+      for (auto &byte: buffer) byte = (uint8_t) random();
+      auto available = isSegmented ? test.pool->available() : 0;
+      if (queue->push(buffer.data(), length) == 0) {
+        check(length <= space, "push beyond freeSpace");
+        test.add(buffer.data(), length);
+      } else {
+        check(length > space, "push failed within freeSpace");
+        // A push the pool had no segments for gives back what it took
+        if (isSegmented) {
+          check(test.pool->available() == available,
+                "failed push kept segments");
+          if (length <= QUEUE_SIZE - test.reference.size()) starvedPushes++;
+        }
+      }
+      break;
+    }
+    case 1: {
+      for (auto &byte: buffer) byte = (uint8_t) random();
+      auto pushed = queue->pushPartial(buffer.data(), length);
+      check(pushed == std::min(length, space), "pushPartial length");
+      test.add(buffer.data(), pushed);
+      break;
+    }
+    case 2: {
+      if (queue->pop(buffer.data(), length) == 0) {
+        check(length <= test.reference.size(), "pop beyond size");
+        check(std::equal(buffer.begin(), buffer.begin() + (long) length,
+                         test.reference.begin()), "popped bytes");
+        test.remove(length);
+      } else {
+        check(length > test.reference.size(), "pop failed within size");
+      }
+      break;
+    }
+    case 3: {
+      uint8_t *first, *second;
+      size_t firstLength, secondLength;
+      auto peeked = queue->peek(first, firstLength, second, secondLength);
+      check(peeked == firstLength + secondLength, "peek length");
+      if (isSegmented) {
+        // At most two segments, split at the end of the first
+        auto size = test.pool->segmentSize;
+        auto inFirst = size - test.popped % size;
+        check(firstLength == std::min(test.reference.size(), inFirst),
+              "peek first region");
+        check(secondLength ==
+              std::min(test.reference.size() - firstLength, size),
+              "peek second region");
+      } else {
+        check(peeked == test.reference.size(), "peek size");
+      }
+      check(std::equal(first, first + firstLength, test.reference.begin()),
+            "peeked bytes (first region)");
+      check(std::equal(second, second + secondLength,
+                       test.reference.begin() + (long) firstLength),
+            "peeked bytes (second region)");
+      auto advanced = std::uniform_int_distribution<size_t>(0, peeked)(random);
+      queue->advance(advanced);
+      test.remove(advanced);
+      break;
+    }
+  }
+  check(queue->size() == test.reference.size(), "size");
+}
+
+static void singleThreaded(size_t steps) {
+  std::mt19937 random(42);
+  TestQueue contiguous{2, nullptr};
+  for (size_t i = 0; i < steps; i++) step(contiguous, random);
+  std::cout << "contiguous: " << contiguous.pushed << " bytes pushed"
+            << std::endl;
+
+  auto pool = newPool();
+  TestQueue segmented{4, pool}, hog{6, pool};
+  std::vector<uint8_t> buffer(QUEUE_SIZE, 0);
+  for (size_t i = 0; i < steps; i++) {
+    // Now and then, the other queue takes (or gives back) most of the pool
+    if (i % 1000 == 0) {
+      if (hog.queue->size() == 0) {
+        hog.add(buffer.data(),
+                hog.queue->pushPartial(buffer.data(), QUEUE_SIZE));
+      } else {
+        hog.queue->advance(hog.queue->size());
+        hog.remove(hog.reference.size());
+      }
+    }
+    step(segmented, random);
+    check(pool->available() ==
+          NUM_SEGMENTS - segmented.heldSegments() - hog.heldSegments(),
+          "segments held by the queues (step " + std::to_string(i) + ")");
+  }
+  std::cout << "segmented: " << segmented.pushed << " bytes pushed, "
+            << segmented.pushed / SEGMENT_SIZE /
+               ((QUEUE_SIZE + SEGMENT_SIZE - 1) / SEGMENT_SIZE + 1)
+            << " rounds over the slots, " << starvedPushes
+            << " pushes without segments" << std::endl;
+  check(starvedPushes > 0, "the pool never ran out");
+
+  // Drained, only the segment the next push goes to stays
+  segmented.queue->advance(segmented.queue->size());
+  segmented.remove(segmented.reference.size());
+  hog.queue->advance(hog.queue->size());
+  hog.remove(hog.reference.size());
+  check(pool->available() == NUM_SEGMENTS - segmented.heldSegments(),
+        "segments held after the drain");
+  check(segmented.heldSegments() <= 1, "drained queue holds one segment");
+
+  // clear gives everything back, and the queue starts over
+  check(segmented.queue->pushPartial(buffer.data(), 1000) == 1000,
+        "push before clear");
+  segmented.queue->clear();
+  check(segmented.queue->size() == 0, "size after clear");
+  check(pool->available() == NUM_SEGMENTS, "segments held after clear");
+  std::vector<uint8_t> popped(100);
+  for (size_t i = 0; i < popped.size(); i++) buffer[i] = pattern(i);
+  check(segmented.queue->push(buffer.data(), 100) == 0, "push after clear");
+  check(segmented.queue->pop(popped.data(), 100) == 0, "pop after clear");
+  check(std::equal(popped.begin(), popped.end(), buffer.begin()),
+        "bytes after clear");
+}
+
+/**
+ * @brief A producer and a consumer thread move the given number of bytes
+ * through the queue, in random lengths. The consumer checks every byte
+ */
+static void producerConsumer(LamportQueue *queue, size_t total) {
+  std::thread producer([queue, total]() {
+    std::mt19937 random(1);
+    std::vector<uint8_t> buffer(MAX_LENGTH);
+    size_t position = 0;
+    while (position < total) {
+      auto length = std::min(
+          std::uniform_int_distribution<size_t>(1, MAX_LENGTH)(random),
+          total - position);
+      for (size_t i = 0; i < length; i++) buffer[i] = pattern(position + i);
+      size_t pushed;
+      if (random() % 2 == 0) {
+        pushed = queue->push(buffer.data(), length) == 0 ? length : 0;
+      } else {
+        pushed = queue->pushPartial(buffer.data(), length);
+      }
+      // Full. Let the consumer run (there may be a single core)
+      if (pushed == 0) std::this_thread::yield();
+      position += pushed;
+    }
+  });
+
+  std::mt19937 random(2);
+  std::vector<uint8_t> buffer(MAX_LENGTH);
+  size_t position = 0;
+  while (position < total) {
+    if (random() % 2 == 0) {
+      auto length = std::min(
+          std::uniform_int_distribution<size_t>(1, MAX_LENGTH)(random),
+          total - position);
+      if (queue->pop(buffer.data(), length) != 0) {
+        std::this_thread::yield();
+        continue;
+      }
+      for (size_t i = 0; i < length; i++)
+        check(buffer[i] == pattern(position + i), "popped byte across "
+                                                  "threads");
+      position += length;
+    } else {
+      uint8_t *first, *second;
+      size_t firstLength, secondLength;
+      queue->peek(first, firstLength, second, secondLength);
+      for (size_t i = 0; i < firstLength; i++)
+        check(first[i] == pattern(position + i), "peeked byte across "
+                                                 "threads");
+      for (size_t i = 0; i < secondLength; i++)
+        check(second[i] == pattern(position + firstLength + i),
+              "peeked byte across threads");
+      if (firstLength + secondLength == 0) std::this_thread::yield();
+      queue->advance(firstLength + secondLength);
+      position += firstLength + secondLength;
+    }
+  }
+  producer.join();
+  check(queue->size() == 0, "size after the threads");
+}
+
+int main(int argc, char *argv[]) {
+  size_t steps = argc > 1 ? std::stoul(argv[1]) : 200000;
+  size_t total = (argc > 2 ? std::stoul(argv[2]) : 16) << 20;
+
+  singleThreaded(steps);
+
+  TestQueue contiguous{8, nullptr};
+  producerConsumer(contiguous.queue, total);
+  auto pool = newPool();
+  TestQueue segmented{10, pool};
+  producerConsumer(segmented.queue, total);
+  segmented.pushed = segmented.popped = total;
+  check(pool->available() == NUM_SEGMENTS - segmented.heldSegments(),
+        "segments held after the threads");
+  std::cout << "threads: " << (total >> 20) << " MB through each queue"
+            << std::endl;
+  std::cout << "OK" << std::endl;
+  return 0;
+}
@@ -8,6 +8,9 @@
 #include <utility>
 #include <ctime>
 #include <iomanip>
+#include <fstream>
+#include <thread>
+#include <algorithm>
 
 namespace QUIC {
   void Client::log(logLevels level, const std::string &log) {
@@ -131,7 +134,11 @@ namespace QUIC {
         ss << "Connected";
         client->log(DEBUG, ss.str());
 #endif
-        client->isConnected = true;
+        {
+          std::scoped_lock lock(client->connectionLock);
+          client->isConnected = true;
+          client->isResuming = false;
+        }
         client->connected.notify_all();
         break;
 
@@ -164,6 +171,9 @@ namespace QUIC {
         }
         client->log(DEBUG, ss.str());
 #endif
+        client->saveResumptionTicket(
+            event->RESUMPTION_TICKET_RECEIVED.ResumptionTicket,
+            event->RESUMPTION_TICKET_RECEIVED.ResumptionTicketLength);
         break;
 
       case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
@@ -171,11 +181,30 @@ namespace QUIC {
 
         ss << "closed successfully";
         client->log(WARNING, ss.str());
+        {
+          std::scoped_lock lock(client->connectionLock);
+          // A newer connection may already have replaced this one
+          if (client->connection != connection) break;
+          client->isConnected = client->isResuming = false;
+          client->connection = nullptr;
+          if (client->isClosing) {
+            client->connected.notify_all(); // See shutdown
+            break;
+          }
+        }
+        // Reconnect off the QUIC worker thread, as reconnecting waits on
+        // connection events that are delivered on that thread
+        {
+          std::thread reconnectThread(&Client::reconnect, client);
+          reconnectThread.detach();
+        }
         break;
 
       case QUIC_CONNECTION_EVENT_SHUTDOWN_INITIATED_BY_PEER:
         ss << "shut down by peer";
         client->log(WARNING, ss.str());
+        // Streams are cleaned up after this, so stop using them now
+        client->onDisconnect();
         break;
 
       case QUIC_CONNECTION_EVENT_SHUTDOWN_INITIATED_BY_TRANSPORT:
@@ -194,6 +223,7 @@ namespace QUIC {
           ss << "shut down by underlying transport layer";
           client->log(WARNING, ss.str());
         }
+        client->onDisconnect();
         break;
 
       default:
@@ -238,41 +268,147 @@ namespace QUIC {
                                     size_t length)> onReceiveFunc,
                  bool noServerValidation,
                  logLevels _logLevel,
-                 uint64_t idleTimeoutMs) : configuration(nullptr),
-                                           connection(nullptr) {
+                 uint64_t idleTimeoutMs,
+                 std::string ticketPath,
+                 std::function<void()> onDisconnectFunc,
+                 std::function<void()> onReconnectFunc) :
+      serverName(serverName), port(port), configuration(nullptr),
+      connection(nullptr), ticketPath(std::move(ticketPath)),
+      onDisconnect(std::move(onDisconnectFunc)),
+      onReconnect(std::move(onReconnectFunc)) {
     reg = new MsQuicRegistration{appName.c_str(), profile, autoCleanup};
     this->idleTimeoutMs = idleTimeoutMs;
     onReceive = std::move(onReceiveFunc);
     logLevel = _logLevel;
     loadConfiguration(noServerValidation);
-    connection = new MsQuicConnection(*reg, autoCleanup ? CleanUpAutoDelete :
-                                            CleanUpManual,
-                                      connectionHandler, this);
-    connection->Start(*configuration, serverName.c_str(), port);
-    if (!connection->IsValid()) {
+    loadResumptionTicket();
+    bool isResumed;
+    if (!connect(isResumed)) {
       std::stringstream ss;
       ss << "Connection to " << serverName << ":" << port << " failed!";
       log(ERROR, ss.str());
-      connection->Close();
       throw std::runtime_error("Connection Failed!");
     }
 
   }
 
-  MsQuicStream *Client::startStream() {
+  bool Client::connect(bool &isResumed) {
+    isResumed = false;
+    auto *newConnection =
+        new MsQuicConnection(*reg, autoCleanup ? CleanUpAutoDelete :
+                                   CleanUpManual,
+                             connectionHandler, this);
+    if (!newConnection->IsValid()) {
+      newConnection->Close();
+      return false;
+    }
+    bool resuming = false;
+    {
+      std::scoped_lock lock(connectionLock);
+      if (!resumptionTicket.empty()) {
+        resuming = QUIC_SUCCEEDED(newConnection->SetResumptionTicket(
+            resumptionTicket.data(), (uint32_t) resumptionTicket.size()));
+      }
+      connection = newConnection;
+      isConnected = false;
+    }
+    if (QUIC_FAILED(
+        newConnection->Start(*configuration, serverName.c_str(), port))) {
+      std::scoped_lock lock(connectionLock);
+      if (connection == newConnection) connection = nullptr;
+      newConnection->Close();
+      return false;
+    }
+    isResumed = resuming;
+    if (resuming) {
+      {
+        std::scoped_lock lock(connectionLock);
+        if (connection == newConnection && !isConnected) isResuming = true;
+      }
+      // Streams can now be started and sent on as 0-RTT
+      connected.notify_all();
+    }
+    return true;
+  }
+
+  void Client::shutdown() {
+    std::unique_lock lock(connectionLock);
+    isClosing = true;
+    if (connection == nullptr) return;
+    connection->Shutdown(0);
+    // Until the server has been told
+    connected.wait_for(lock, std::chrono::milliseconds(SHUTDOWN_TIMEOUT),
+                       [this] { return connection == nullptr; });
+  }
+
+  void Client::resetConnection() {
+    {
+      std::scoped_lock lock(connectionLock);
+      if (connection == nullptr || isClosing) return;
+    }
+    // No shutdown event is raised for a shutdown started here
+    onDisconnect();
+    std::scoped_lock lock(connectionLock);
+    // Re-established once it is closed (see SHUTDOWN_COMPLETE)
+    if (connection != nullptr) connection->Shutdown(RESET_ERROR_CODE);
+  }
+
+  void Client::reconnect() {
+    auto backoff = std::chrono::milliseconds(10);
+    bool isResumed;
+    while (!connect(isResumed)) {
+      log(ERROR, "Reconnecting to " + serverName + ":" + std::to_string(port)
+                 + " failed! Retrying...");
+      std::this_thread::sleep_for(backoff);
+      backoff = std::min(backoff * 2, std::chrono::milliseconds(1000));
+    }
+    log(WARNING, "Reconnecting to " + serverName + ":" + std::to_string(port)
+                 + (isResumed ? " (0-RTT)" : ""));
+    onReconnect();
+  }
+
+  void Client::loadResumptionTicket() {
+    if (ticketPath.empty()) return;
+    std::ifstream ticketFile(ticketPath, std::ios::binary);
+    if (!ticketFile.is_open()) return;
+    std::scoped_lock lock(connectionLock);
+    resumptionTicket.assign(std::istreambuf_iterator<char>(ticketFile),
+                            std::istreambuf_iterator<char>());
+#ifdef DEBUGGING
+    log(DEBUG, "Loaded resumption ticket of " +
+               std::to_string(resumptionTicket.size()) + " bytes from " +
+               ticketPath);
+#endif
+  }
+
+  void Client::saveResumptionTicket(const uint8_t *ticket, uint32_t length) {
+    std::scoped_lock lock(connectionLock);
+    resumptionTicket.assign(ticket, ticket + length);
+    if (ticketPath.empty()) return;
+    std::ofstream ticketFile(ticketPath, std::ios::binary | std::ios::trunc);
+    if (!ticketFile.is_open()) {
+      log(WARNING, "Could not persist resumption ticket to " + ticketPath);
+      return;
+    }
+    ticketFile.write(reinterpret_cast<const char *>(ticket), length);
+  }
+
+  MsQuicStream *Client::startStream(bool waitForConnection) {
     std::unique_lock<std::mutex> lock(connectionLock);
-    connected.wait(lock, [this]() { return isConnected; });
+    auto isReady = [this]() {
+      return connection != nullptr && (isConnected || isResuming);
+    };
+    if (!waitForConnection && !isReady()) return nullptr;
+    connected.wait(lock, isReady);
     auto *stream = new MsQuicStream{*connection, QUIC_STREAM_OPEN_FLAG_NONE,
                                     autoCleanup ? CleanUpAutoDelete
                                                 : CleanUpManual,
                                     streamCallbackHandler, this};
     if (stream->Handle == nullptr) {
       free(stream);
-      stream = nullptr;
-    } else {
-      stream->ID(); // Fetch the ID now, so we don't fetch it later
+      return nullptr;
     }
-    // variables
+    stream->ID(); // Fetch the ID now, so we don't fetch it later
     if (QUIC_FAILED(stream->Start())) {
       log(ERROR, "Stream could not be started");
       throw std::runtime_error("Stream could not be started");
@@ -293,7 +429,7 @@ namespace QUIC {
     ctx *context = reinterpret_cast<ctx *>(malloc(sizeof(ctx)));
     context->buffer = SendBuffer;
     if (QUIC_FAILED(
-        stream->Send(SendBuffer, 1, QUIC_SEND_FLAG_NONE, context))) {
+        stream->Send(SendBuffer, 1, QUIC_SEND_FLAG_ALLOW_0_RTT, context))) {
       std::stringstream ss;
       ss << "[Stream " << stream->ID() << "] ";
       ss << " could not send data";
@@ -15,15 +15,19 @@
 #include "../Common.h"
 #include "QUICBase.h"
 #include <condition_variable>
+#include <mutex>
+#include <vector>
 
 namespace QUIC {
   class Client : public QUICBase {
   public:
     /**
      * @brief Start a new stream on this connection
-     * @return The stream pointer
+     * @param waitForConnection Wait for the connection to be established (or
+     * resumed) instead of failing right away
+     * @return The stream pointer (nullptr if it could not be started)
      */
-    MsQuicStream *startStream();
+    MsQuicStream *startStream(bool waitForConnection = true);
 
     bool send(MsQuicStream *stream, uint8_t *data, size_t length) override;
 
@@ -37,23 +41,98 @@ namespace QUIC {
      * @param [opt] _logLevel The log level (DEBUG, WARNING, ERROR)
      * @param [opt] _idleTimeoutMs The time after which the connection will be
      * closed
+     * @param [opt] ticketPath The file in which the resumption ticket sent
+     * by the server is persisted. Tickets are kept in memory only if empty
+     * @param [opt] onDisconnectFunc The function to call as soon as the
+     * connection starts shutting down. Streams of this connection must not
+     * be used once this returns
+     * @param [opt] onReconnectFunc The function to call once the connection
+     * has been re-established after it was shut down. All streams of the
+     * previous connection are gone by the time this is called
      */
     Client(const std::string &serverName, uint16_t port,
            std::function<void(MsQuicStream *stream,
                               uint8_t *buffer,
                               size_t length)> onReceiveFunc,
            bool noServerValidation = false, logLevels _logLevel = DEBUG,
-           uint64_t idleTimeoutMs = 1000);
+           uint64_t idleTimeoutMs = 1000,
+           std::string ticketPath = "",
+           std::function<void()> onDisconnectFunc = [] {},
+           std::function<void()> onReconnectFunc = [] {});
 
+    /**
+     * @brief Shut the connection down for good (it is not re-established),
+     * so that the server learns of it without waiting for the idle timeout.
+     * Returns once it is closed (or after SHUTDOWN_TIMEOUT)
+     */
+    void shutdown();
+
+    /**
+     * @brief Shut the connection down (e.g. after a protocol error), and
+     * re-establish it. onDisconnect is called first, as for a connection
+     * shut down by the server
+     */
+    void resetConnection();
 
   private:
     std::mutex connectionLock;
     std::condition_variable connected;
     bool isConnected = false;
+    // Set while a connection that was started with a resumption ticket is
+    // still handshaking. Streams may be started (and sent on) as 0-RTT
+    bool isResuming = false;
+    // Set once the connection is shut down for good
+    bool isClosing = false;
+
+    std::string serverName;
+    uint16_t port;
 
     MsQuicConfiguration *configuration;
     MsQuicConnection *connection;
 
+    // The most recent resumption ticket received from the server
+    std::string ticketPath;
+    std::vector<uint8_t> resumptionTicket;
+
+    /**
+     * @brief The function that is called when the connection starts
+     * shutting down
+     */
+    std::function<void()> onDisconnect;
+
+    /**
+     * @brief The function that is called after the connection is
+     * re-established
+     */
+    std::function<void()> onReconnect;
+
+    /**
+     * @brief Open a new connection to the server, using the stored
+     * resumption ticket (if any) so that the handshake can be 0-RTT
+     * @param isResumed Set to true if the connection was started with a
+     * resumption ticket (0-RTT)
+     * @return true if the connection was started successfully
+     */
+    bool connect(bool &isResumed);
+
+    /**
+     * @brief Re-open the connection after it was shut down. Retries (with
+     * backoff) until a connection could be started
+     */
+    void reconnect();
+
+    /**
+     * @brief Load the resumption ticket persisted at ticketPath (if any)
+     */
+    void loadResumptionTicket();
+
+    /**
+     * @brief Store the given resumption ticket in memory and at ticketPath
+     * @param ticket The ticket received from the server
+     * @param length The length of the ticket
+     */
+    void saveResumptionTicket(const uint8_t *ticket, uint32_t length);
+
 
     /**
      * @brief load the client configuration
@@ -7,6 +7,9 @@
 
 #include "msquic.hpp"
 
+#define SHUTDOWN_TIMEOUT 1000 // Time (ms) to wait for connections to close
+#define RESET_ERROR_CODE 1 // Error code of connections reset by the app
+
 namespace QUIC {
   class QUICBase {
   public:
@@ -8,6 +8,8 @@
 #include <utility>
 #include <ctime>
 #include <iomanip>
+#include <chrono>
+#include <thread>
 #include "Server.h"
 
 namespace QUIC {
@@ -116,6 +118,11 @@ namespace QUIC {
         server->log(DEBUG, ss.str());
 #endif
         connection->SendResumptionTicket();
+        server->openConnections++;
+        {
+          std::scoped_lock lock(server->connectionsLock);
+          server->connections.insert(connection);
+        }
         break;
 
       case QUIC_CONNECTION_EVENT_PEER_STREAM_STARTED:
@@ -139,7 +146,14 @@ namespace QUIC {
         break;
 
       case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
+        {
+          std::scoped_lock lock(server->connectionsLock);
+          server->connections.erase(connection);
+        }
         connection->Close();
+        if (event->SHUTDOWN_COMPLETE.HandshakeCompleted) {
+          server->openConnections--;
+        }
         ss << "closed successfully";
         server->log(WARNING, ss.str());
         break;
@@ -147,6 +161,8 @@ namespace QUIC {
       case QUIC_CONNECTION_EVENT_SHUTDOWN_INITIATED_BY_PEER:
         ss << "shut down by peer";
         server->log(WARNING, ss.str());
+        // Streams are cleaned up after this, so stop using them now
+        server->onConnectionShutdown();
         break;
 
       case QUIC_CONNECTION_EVENT_SHUTDOWN_INITIATED_BY_TRANSPORT:
@@ -165,6 +181,7 @@ namespace QUIC {
           ss << "shut down by underlying transport layer";
           server->log(WARNING, ss.str());
         }
+        server->onConnectionShutdown();
         break;
 
       default:
@@ -216,11 +233,12 @@ namespace QUIC {
                                               uint8_t *buffer,
                                               size_t length)> onReceiveFunc,
                  logLevels level, int maxPeerStreams, uint64_t
-                 idleTimeoutMs) : configuration(nullptr),
-                                  listener(nullptr),
-                                  addr(new QuicAddr(
-                                      QUIC_ADDRESS_FAMILY_UNSPEC)),
-                                  maxPeerStreams(maxPeerStreams) {
+                 idleTimeoutMs, std::function<void()> onShutdownFunc) :
+      configuration(nullptr),
+      listener(nullptr),
+      addr(new QuicAddr(QUIC_ADDRESS_FAMILY_UNSPEC)),
+      maxPeerStreams(maxPeerStreams),
+      onConnectionShutdown(std::move(onShutdownFunc)) {
     reg = new MsQuicRegistration{appName.c_str(), profile, autoCleanup};
     this->idleTimeoutMs = idleTimeoutMs;
     this->logLevel = level;
@@ -268,6 +286,25 @@ namespace QUIC {
 #endif
   }
 
+  void Server::shutdown() {
+    stopListening();
+    reg->Shutdown(QUIC_CONNECTION_SHUTDOWN_FLAG_NONE, 0);
+    // Until the clients have been told
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(SHUTDOWN_TIMEOUT);
+    while (openConnections.load() > 0
+           && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  void Server::resetConnections() {
+    // No shutdown event is raised for a shutdown started here
+    onConnectionShutdown();
+    std::scoped_lock lock(connectionsLock);
+    for (auto connection: connections) connection->Shutdown(RESET_ERROR_CODE);
+  }
+
   bool Server::send(MsQuicStream *stream, uint8_t *data, size_t length) {
     auto SendBuffer =
         reinterpret_cast<QUIC_BUFFER *>(malloc(sizeof(QUIC_BUFFER)));
@@ -14,6 +14,9 @@
 #include "msquic.hpp"
 #include "../Common.h"
 #include "QUICBase.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
 
 namespace QUIC {
   class Server : public QUICBase {
@@ -30,6 +33,9 @@ namespace QUIC {
      * allowed to start
      * @param [opt] idleTimeoutMs The time after which the connection will be
      * closed
+     * @param [opt] onShutdownFunc The function to call as soon as a
+     * connection starts shutting down. Streams of that connection must not
+     * be used once this returns
      */
     Server(const std::string &certFile, const std::string &keyFile,
            int port = 4567, std::function<void(MsQuicStream *stream,
@@ -37,7 +43,8 @@ namespace QUIC {
                                                size_t length)> onReceiveFunc
     = [](auto &&...) {},
            logLevels _logLevel = DEBUG, int maxPeerStreams = 1,
-           uint64_t idleTimeoutMs = 1000);
+           uint64_t idleTimeoutMs = 1000,
+           std::function<void()> onShutdownFunc = [] {});
 
     /**
      * @brief Start Listening on this server
@@ -50,6 +57,19 @@ namespace QUIC {
      */
     void stopListening();
 
+    /**
+     * @brief Stop listening and shut all connections down, so that the
+     * clients learn of it without waiting for the idle timeout. Returns once
+     * they are closed (or after SHUTDOWN_TIMEOUT)
+     */
+    void shutdown();
+
+    /**
+     * @brief Shut all connections down (e.g. after a protocol error), but
+     * keep listening, so that the clients can reconnect. onShutdownFunc is
+     * called first, as for a connection shut down by the client
+     */
+    void resetConnections();
 
     bool send(MsQuicStream *stream, uint8_t *data, size_t length) override;
 
@@ -66,6 +86,16 @@ namespace QUIC {
     //
     const int maxPeerStreams;
 
+    // Connections that completed the handshake and are not closed yet
+    std::atomic<int> openConnections = 0;
+    std::mutex connectionsLock;
+    std::unordered_set<MsQuicConnection *> connections;
+
+    /**
+     * @brief The function that is called when a connection is shut down
+     */
+    std::function<void()> onConnectionShutdown;
+
     /**
      * @brief load the X.509 certificate and private file
      * @param certFile The path to the X.509 certificate
@@ -51,6 +51,24 @@ namespace TCP {
 #endif
   }
 
+  Client::Client(int connectedSocket, const std::string &remoteHost,
+                 int remotePort,
+                 std::function<void(TCP::Client *,
+                                    uint8_t *buffer, size_t length,
+                                    connectionStatus connStatus)>
+                 onReceiveFunc, logLevels level)
+      : remoteSocket(connectedSocket), remoteHost(remoteHost),
+        remotePort(remotePort), logLevel(level) {
+    onReceive = std::move(onReceiveFunc);
+
+    std::thread receive(&Client::startReceiving, this);
+    receive.detach();
+#ifdef DEBUGGING
+    log(DEBUG, "Client initialised on connected socket " +
+               std::to_string(remoteSocket));
+#endif
+  }
+
   Client::~Client() {
     close(remoteSocket);
 #ifdef DEBUGGING
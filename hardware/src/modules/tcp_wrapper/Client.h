@@ -6,7 +6,6 @@
 #define MINESVPN_TCP_CLIENT_H
 
 #define BUF_SIZE 16384
-#define BACKLOG 20 // Number of pending connections the queue should hold
 #define CLIENT_SOCKET_ERROR (-5)
 #define CLIENT_RESOLVE_ERROR (-6)
 #define CLIENT_CONNECT_ERROR (-7)
@@ -35,6 +34,21 @@ namespace TCP {
            onReceiveFunc = [](
                auto &&...) {}, logLevels level = DEBUG);
 
+    /**
+     * @brief Constructor for a socket that is already connected (e.g. by the
+     * TCP::Connector). Starts receiving on it
+     * @param connectedSocket The connected socket. Owned by the client
+     * @param remoteHost The remote host the socket is connected to
+     * @param remotePort The port on the remote host
+     * @param onReceiveFunc The function to be called when a buffer is
+     * received
+     * @param [opt] level Log Level (ERROR, WARNING, DEBUG)
+     */
+    Client(int connectedSocket, const std::string &remoteHost, int remotePort,
+           std::function<void(TCP::Client *, uint8_t *buffer,
+                              size_t length, connectionStatus connStatus)>
+           onReceiveFunc, logLevels level = DEBUG);
+
     /**
      * @brief Calls the send() function on the remoteSocket with given buffer
      * @param buffer The buffer to be sent
@@ -0,0 +1,191 @@
+//
+// Created by Rut Vora
+//
+
+#include "ConnectionPool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+
+namespace TCP {
+  ConnectionPool::ConnectionPool(Connector *connector, int poolSize,
+                                 int maxDestinations, int maxIdle,
+                                 int checkInterval, logLevels level) :
+      connector(connector), poolSize(std::max(poolSize, 0)),
+      maxDestinations(std::max(maxDestinations, 0)), maxIdle(maxIdle),
+      checkInterval(checkInterval), logLevel(level) {
+    if (this->poolSize == 0) return;
+    std::thread maintain(&ConnectionPool::maintainLoop, this);
+    maintain.detach();
+  }
+
+  void ConnectionPool::warm(const std::string &remoteHost, int remotePort) {
+    if (poolSize == 0) return;
+    std::scoped_lock lock(poolLock);
+    auto destination = findOrAdd(remoteHost, remotePort);
+    if (destination == nullptr) {
+      log(WARNING, "No space to keep " + remoteHost + ":" +
+                   std::to_string(remotePort) + " warm");
+      return;
+    }
+    destination->pinned = true;
+    refill(remoteHost + ":" + std::to_string(remotePort), *destination);
+  }
+
+  void ConnectionPool::acquire(const std::string &remoteHost, int remotePort,
+                               const Connector::ConnectedFunc &onConnected) {
+    if (poolSize == 0) {
+      connector->connect(remoteHost, remotePort, onConnected);
+      return;
+    }
+
+    int socket = -1;
+    {
+      std::scoped_lock lock(poolLock);
+      auto destination = findOrAdd(remoteHost, remotePort);
+      if (destination != nullptr) {
+        destination->lastUsed = std::chrono::steady_clock::now();
+        // The newest connection is the least likely to be closed by the remote
+        while (socket < 0 && !destination->idle.empty()) {
+          auto connection = destination->idle.back();
+          destination->idle.pop_back();
+          if (isHealthy(connection.socket)) socket = connection.socket;
+          else close(connection.socket);
+        }
+        refill(remoteHost + ":" + std::to_string(remotePort), *destination);
+      }
+    }
+
+    if (socket >= 0) {
+#ifdef DEBUGGING
+      log(DEBUG, "Using idle connection " + std::to_string(socket) + " to " +
+                 remoteHost + ":" + std::to_string(remotePort));
+#endif
+      onConnected(socket, 0);
+    } else {
+      connector->connect(remoteHost, remotePort, onConnected);
+    }
+  }
+
+  ConnectionPool::Destination *
+  ConnectionPool::findOrAdd(const std::string &remoteHost, int remotePort) {
+    auto key = remoteHost + ":" + std::to_string(remotePort);
+    auto destinationIter = destinations.find(key);
+    if (destinationIter != destinations.end()) return &destinationIter->second;
+
+    if (destinations.size() >= maxDestinations) {
+      // Make space by dropping the least recently used destination
+      auto lru = destinations.end();
+      for (auto iter = destinations.begin(); iter != destinations.end();
+           iter++) {
+        if (iter->second.pinned) continue;
+        if (lru == destinations.end()
+            || iter->second.lastUsed < lru->second.lastUsed)
+          lru = iter;
+      }
+      if (lru == destinations.end()) return nullptr;
+      for (auto &connection: lru->second.idle) close(connection.socket);
+      destinations.erase(lru);
+    }
+
+    auto &destination = destinations[key];
+    destination.host = remoteHost;
+    destination.port = remotePort;
+    destination.lastUsed = std::chrono::steady_clock::now();
+    return &destination;
+  }
+
+  void ConnectionPool::refill(const std::string &key,
+                              Destination &destination) {
+    while (destination.idle.size() + destination.connecting < poolSize) {
+      destination.connecting++;
+      connector->connect(destination.host, destination.port,
+                         [this, key](int socket, int error) {
+                           onWarmed(key, socket, error);
+                         });
+    }
+  }
+
+  void ConnectionPool::onWarmed(const std::string &key, int socket,
+                                int error) {
+    std::scoped_lock lock(poolLock);
+    auto destinationIter = destinations.find(key);
+    if (destinationIter == destinations.end()) {
+      // The destination was dropped while connecting
+      if (socket >= 0) close(socket);
+      return;
+    }
+    auto &destination = destinationIter->second;
+    // The destination may have been dropped and added again meanwhile
+    if (destination.connecting > 0) destination.connecting--;
+    // Failures are retried by the next check, not right away
+    if (error < 0) return;
+    destination.idle.push_back({socket, std::chrono::steady_clock::now()});
+  }
+
+  [[noreturn]] void ConnectionPool::maintainLoop() {
+    while (true) {
+      std::this_thread::sleep_for(checkInterval);
+      std::scoped_lock lock(poolLock);
+      auto now = std::chrono::steady_clock::now();
+      for (auto destinationIter = destinations.begin();
+           destinationIter != destinations.end();) {
+        auto &destination = destinationIter->second;
+        auto &idle = destination.idle;
+        for (auto connection = idle.begin(); connection != idle.end();) {
+          if (now - connection->since < maxIdle
+              && isHealthy(connection->socket)) {
+            connection++;
+            continue;
+          }
+          close(connection->socket);
+          connection = idle.erase(connection);
+        }
+
+        if (!destination.pinned && now - destination.lastUsed >= maxIdle) {
+#ifdef DEBUGGING
+          log(DEBUG, "No longer keeping " + destinationIter->first + " warm");
+#endif
+          for (auto &connection: idle) close(connection.socket);
+          destinationIter = destinations.erase(destinationIter);
+          continue;
+        }
+        refill(destinationIter->first, destination);
+        destinationIter++;
+      }
+    }
+  }
+
+  bool ConnectionPool::isHealthy(int socket) {
+    uint8_t byte;
+    auto result = recv(socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+
+  void ConnectionPool::log(logLevels level, const std::string &log) {
+    auto time = std::time(nullptr);
+    auto localTime = std::localtime(&time);
+    std::string levelStr;
+    switch (level) {
+      case DEBUG:
+        levelStr = "TcpConnectionPool:DEBUG: ";
+        break;
+      case ERROR:
+        levelStr = "TcpConnectionPool:ERROR: ";
+        break;
+      case WARNING:
+        levelStr = "TcpConnectionPool:WARNING: ";
+        break;
+
+    }
+    if (logLevel >= level) {
+      std::cerr << std::put_time(localTime, "[%H:%M:%S] ") << levelStr
+                << log << std::endl;
+    }
+  }
+}
@@ -0,0 +1,135 @@
+//
+// Created by Rut Vora
+//
+
+#ifndef MINESVPN_TCP_CONNECTION_POOL_H
+#define MINESVPN_TCP_CONNECTION_POOL_H
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Connector.h"
+
+namespace TCP {
+  /**
+   * @brief Keeps a few idle, established connections to each destination so
+   * that a new flow does not wait for the TCP handshake. A destination is
+   * kept warm from its first use (or from the start, if configured) until it
+   * has not been used for maxIdle. A background thread drops idle
+   * connections that were closed by the remote or are too old, and opens new
+   * ones through the connector
+   */
+  class ConnectionPool {
+  public:
+    /**
+     * @brief Constructor for the connection pool. Starts the maintenance
+     * thread
+     * @param connector The connector used to open the connections
+     * @param poolSize The number of idle connections to keep per destination.
+     * 0 disables the pool (every connection is opened on acquire)
+     * @param maxDestinations The maximum number of destinations kept warm.
+     * The least recently used one is dropped to make space
+     * @param maxIdle The time (in s) after which an idle connection is
+     * replaced, and an unused destination is no longer kept warm
+     * @param checkInterval The interval (in ms) with which idle connections
+     * are checked and the pools refilled
+     * @param [opt] level Log Level (ERROR, WARNING, DEBUG)
+     */
+    ConnectionPool(Connector *connector, int poolSize, int maxDestinations,
+                   int maxIdle, int checkInterval, logLevels level = DEBUG);
+
+    /**
+     * @brief Keep the given destination warm from now on, even if it is not
+     * used
+     * @param remoteHost The host of the destination
+     * @param remotePort The port of the destination
+     */
+    void warm(const std::string &remoteHost, int remotePort);
+
+    /**
+     * @brief Get a connection to the given destination. An idle connection is
+     * handed over at once (from the calling thread). Else a new one is opened
+     * @param remoteHost The host to connect to
+     * @param remotePort The port on the remote host to connect to
+     * @param onConnected Called with the connected socket (or the error)
+     */
+    void acquire(const std::string &remoteHost, int remotePort,
+                 const Connector::ConnectedFunc &onConnected);
+
+  private:
+    struct IdleConnection {
+      int socket;
+      std::chrono::steady_clock::time_point since;
+    };
+
+    struct Destination {
+      std::string host;
+      int port;
+      bool pinned = false; // Configured to be warm, never dropped
+      std::deque<IdleConnection> idle{};
+      int connecting = 0;
+      std::chrono::steady_clock::time_point lastUsed;
+    };
+
+    Connector *connector;
+    const size_t poolSize;
+    const size_t maxDestinations;
+    const std::chrono::seconds maxIdle;
+    const std::chrono::milliseconds checkInterval;
+    const enum logLevels logLevel;
+
+    std::unordered_map<std::string, Destination> destinations{};
+    std::mutex poolLock;
+
+    /**
+     * @brief Get the entry of the destination, creating it if needed. Must be
+     * called with the poolLock held
+     * @param remoteHost The host of the destination
+     * @param remotePort The port of the destination
+     * @return The destination. nullptr if there is no space for it
+     */
+    Destination *findOrAdd(const std::string &remoteHost, int remotePort);
+
+    /**
+     * @brief Open connections until the pool of the destination is full. Must
+     * be called with the poolLock held
+     * @param key The key of the destination
+     * @param destination The destination
+     */
+    void refill(const std::string &key, Destination &destination);
+
+    /**
+     * @brief Called when a connection opened by refill completes
+     * @param key The key of the destination
+     * @param socket The connected socket (-1 if failed)
+     * @param error 0 on success
+     */
+    void onWarmed(const std::string &key, int socket, int error);
+
+    /**
+     * @brief Periodically drop dead, old and unused connections and refill
+     * the pools
+     */
+    [[noreturn]] void maintainLoop();
+
+    /**
+     * @param socket An idle connection
+     * @return true if the remote has neither closed the connection nor sent
+     * anything on it
+     */
+    static bool isHealthy(int socket);
+
+    /**
+     * @brief If log level set by user is equal or more verbose than the log
+     * level passed to this function, print the given string
+     * @param level The log level of the given string
+     * @param log The string to be logged
+     */
+    void log(logLevels level, const std::string &log);
+  };
+}
+
+#endif //MINESVPN_TCP_CONNECTION_POOL_H
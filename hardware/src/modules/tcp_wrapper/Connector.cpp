@@ -0,0 +1,261 @@
+//
+// Created by Rut Vora
+//
+
+#include "Connector.h"
+#include "Client.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+namespace TCP {
+  Connector::Connector(int connectTimeout, int cacheTTL, int numResolvers,
+                       logLevels level) :
+      connectTimeout(connectTimeout), cacheTTL(cacheTTL), logLevel(level) {
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (wakeFd < 0 || epollFd < 0) {
+      throw std::runtime_error("Could not set up the connector");
+    }
+    struct epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+
+    for (int i = 0; i < std::max(numResolvers, 1); i++) {
+      std::thread resolver(&Connector::resolveLoop, this);
+      resolver.detach();
+    }
+    std::thread connector(&Connector::connectLoop, this);
+    connector.detach();
+  }
+
+  void Connector::connect(const std::string &remoteHost, int remotePort,
+                          ConnectedFunc onConnected) {
+    auto request = new Request{remoteHost, remotePort, std::move(onConnected)};
+    {
+      std::scoped_lock lock(cacheLock);
+      auto cached = addressCache.find(cacheKey(remoteHost, remotePort));
+      if (cached != addressCache.end()
+          && cached->second.expiry > std::chrono::steady_clock::now()) {
+        request->addresses = cached->second.addresses;
+      }
+    }
+    if (!request->addresses.empty()) {
+      queueConnect(request);
+      return;
+    }
+    {
+      std::scoped_lock lock(resolveLock);
+      toResolve.push_back(request);
+    }
+    resolveCondition.notify_one();
+  }
+
+  [[noreturn]] void Connector::resolveLoop() {
+    while (true) {
+      Request *request;
+      {
+        std::unique_lock lock(resolveLock);
+        resolveCondition.wait(lock, [this]() { return !toResolve.empty(); });
+        request = toResolve.front();
+        toResolve.pop_front();
+      }
+
+      struct addrinfo hints{}, *res = nullptr;
+      hints.ai_flags = AI_NUMERICSERV;
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      auto port = std::to_string(request->port);
+      if (getaddrinfo(request->host.c_str(), port.c_str(), &hints, &res)
+          != 0) {
+        log(ERROR, "Could not resolve " + cacheKey(request->host,
+                                                    request->port));
+        finish(request, -1, CLIENT_RESOLVE_ERROR);
+        continue;
+      }
+      for (auto info = res; info != nullptr; info = info->ai_next) {
+        Address address{};
+        memcpy(&address.address, info->ai_addr, info->ai_addrlen);
+        address.length = info->ai_addrlen;
+        request->addresses.push_back(address);
+      }
+      freeaddrinfo(res);
+
+      {
+        std::scoped_lock lock(cacheLock);
+        addressCache[cacheKey(request->host, request->port)] =
+            {request->addresses, std::chrono::steady_clock::now() + cacheTTL};
+      }
+      queueConnect(request);
+    }
+  }
+
+  void Connector::queueConnect(Request *request) {
+    {
+      std::scoped_lock lock(connectLock);
+      toConnect.push_back(request);
+    }
+    uint64_t wake = 1;
+    if (write(wakeFd, &wake, sizeof(wake)) < 0 && errno != EAGAIN) {
+      log(ERROR, "Could not wake up the connect loop");
+    }
+  }
+
+  [[noreturn]] void Connector::connectLoop() {
+    struct epoll_event events[64];
+    while (true) {
+      // Sleep until the next connect times out
+      int timeout = -1;
+      auto now = std::chrono::steady_clock::now();
+      for (const auto &[socket, request]: inFlight) {
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+            request->deadline - now).count();
+        wait = std::max(wait, (decltype(wait)) 0);
+        if (timeout < 0 || wait < timeout) timeout = (int) wait;
+      }
+
+      int numEvents = epoll_wait(epollFd, events, 64, timeout);
+      for (int i = 0; i < numEvents; i++) {
+        int socket = events[i].data.fd;
+        if (socket == wakeFd) {
+          uint64_t count;
+          while (read(wakeFd, &count, sizeof(count)) > 0);
+          std::deque<Request *> requests;
+          {
+            std::scoped_lock lock(connectLock);
+            requests.swap(toConnect);
+          }
+          for (auto request: requests) connectNext(request);
+          continue;
+        }
+
+        auto requestIter = inFlight.find(socket);
+        if (requestIter == inFlight.end()) continue;
+        auto request = requestIter->second;
+        inFlight.erase(requestIter);
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, nullptr);
+
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error == 0) {
+          // Users of the socket expect blocking sends and receives
+          fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) & ~O_NONBLOCK);
+          finish(request, socket, 0);
+        } else {
+#ifdef DEBUGGING
+          log(DEBUG, "Connect to " + cacheKey(request->host, request->port) +
+                     " failed: " + strerror(error));
+#endif
+          close(socket);
+          request->error = CLIENT_CONNECT_ERROR;
+          connectNext(request);
+        }
+      }
+
+      // Give up on the addresses that took too long
+      now = std::chrono::steady_clock::now();
+      for (auto requestIter = inFlight.begin();
+           requestIter != inFlight.end();) {
+        auto [socket, request] = *requestIter;
+        if (request->deadline > now) {
+          requestIter++;
+          continue;
+        }
+        requestIter = inFlight.erase(requestIter);
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, nullptr);
+        close(socket);
+        log(WARNING, "Connect to " + cacheKey(request->host, request->port) +
+                     " timed out");
+        request->error = CLIENT_CONNECT_ERROR;
+        connectNext(request);
+      }
+    }
+  }
+
+  void Connector::connectNext(Request *request) {
+    while (request->nextAddress < request->addresses.size()) {
+      auto &address = request->addresses[request->nextAddress++];
+      int socket = ::socket(address.address.ss_family,
+                            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (socket < 0) {
+        request->error = CLIENT_SOCKET_ERROR;
+        continue;
+      }
+      if (::connect(socket, (struct sockaddr *) &address.address,
+                    address.length) == 0) {
+        fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) & ~O_NONBLOCK);
+        finish(request, socket, 0);
+        return;
+      }
+      if (errno != EINPROGRESS) {
+        close(socket);
+        request->error = CLIENT_CONNECT_ERROR;
+        continue;
+      }
+
+      struct epoll_event event{};
+      event.events = EPOLLOUT;
+      event.data.fd = socket;
+      epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event);
+      request->socket = socket;
+      request->deadline = std::chrono::steady_clock::now() + connectTimeout;
+      inFlight[socket] = request;
+      return;
+    }
+
+    // None of the addresses worked. They may be stale, resolve again next time
+    {
+      std::scoped_lock lock(cacheLock);
+      addressCache.erase(cacheKey(request->host, request->port));
+    }
+    log(ERROR, "Could not connect to " + cacheKey(request->host,
+                                                   request->port));
+    finish(request, -1,
+           request->error != 0 ? request->error : CLIENT_CONNECT_ERROR);
+  }
+
+  void Connector::finish(Request *request, int socket, int error) {
+#ifdef DEBUGGING
+    if (error == 0) {
+      log(DEBUG, "Connected to " + cacheKey(request->host, request->port) +
+                 " at socket " + std::to_string(socket));
+    }
+#endif
+    request->onConnected(socket, error);
+    delete request;
+  }
+
+  void Connector::log(logLevels level, const std::string &log) {
+    auto time = std::time(nullptr);
+    auto localTime = std::localtime(&time);
+    std::string levelStr;
+    switch (level) {
+      case DEBUG:
+        levelStr = "TcpConnector:DEBUG: ";
+        break;
+      case ERROR:
+        levelStr = "TcpConnector:ERROR: ";
+        break;
+      case WARNING:
+        levelStr = "TcpConnector:WARNING: ";
+        break;
+
+    }
+    if (logLevel >= level) {
+      std::cerr << std::put_time(localTime, "[%H:%M:%S] ") << levelStr
+                << log << std::endl;
+    }
+  }
+}
@@ -0,0 +1,153 @@
+//
+// Created by Rut Vora
+//
+
+#ifndef MINESVPN_TCP_CONNECTOR_H
+#define MINESVPN_TCP_CONNECTOR_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/socket.h>
+#include "../Common.h"
+
+namespace TCP {
+  /**
+   * @brief Opens connections to remote hosts without blocking the caller.
+   * Host names are resolved by resolver threads (and cached), and the
+   * connects themselves are non-blocking, all of them in flight at once on
+   * one epoll loop. Each connect tries the resolved addresses in order, each
+   * with a timeout
+   */
+  class Connector {
+  public:
+    /**
+     * @brief Called once the connect finished
+     * @param socket The connected (blocking) socket. -1 if the connect failed
+     * @param error 0 on success. Else CLIENT_RESOLVE_ERROR,
+     * CLIENT_SOCKET_ERROR or CLIENT_CONNECT_ERROR
+     */
+    typedef std::function<void(int socket, int error)> ConnectedFunc;
+
+    /**
+     * @brief Constructor for the connector. Starts its threads
+     * @param [opt] connectTimeout The time (in ms) to wait for each address
+     * to accept the connection
+     * @param [opt] cacheTTL The time (in s) for which resolved addresses are
+     * re-used
+     * @param [opt] numResolvers The number of threads resolving host names
+     * @param [opt] level Log Level (ERROR, WARNING, DEBUG)
+     */
+    explicit Connector(int connectTimeout = 5000, int cacheTTL = 60,
+                       int numResolvers = 2, logLevels level = DEBUG);
+
+    /**
+     * @brief Start connecting to the given host. Returns immediately
+     * @param remoteHost The host to connect to
+     * @param remotePort The port on the remote host to connect to
+     * @param onConnected Called (from one of the connector's threads) when
+     * the connect succeeded or failed
+     */
+    void connect(const std::string &remoteHost, int remotePort,
+                 ConnectedFunc onConnected);
+
+  private:
+    struct Address {
+      struct sockaddr_storage address;
+      socklen_t length;
+    };
+
+    struct Request {
+      std::string host;
+      int port;
+      ConnectedFunc onConnected;
+      std::vector<Address> addresses{};
+      size_t nextAddress = 0;
+      int socket = -1;
+      int error = 0;
+      std::chrono::steady_clock::time_point deadline{};
+    };
+
+    struct CachedAddresses {
+      std::vector<Address> addresses;
+      std::chrono::steady_clock::time_point expiry;
+    };
+
+    const std::chrono::milliseconds connectTimeout;
+    const std::chrono::seconds cacheTTL;
+    const enum logLevels logLevel;
+
+    std::unordered_map<std::string, CachedAddresses> addressCache{};
+    std::mutex cacheLock;
+
+    // Requests waiting for a resolver thread
+    std::deque<Request *> toResolve{};
+    std::mutex resolveLock;
+    std::condition_variable resolveCondition;
+
+    // Requests waiting for the connect loop (which is woken through wakeFd)
+    std::deque<Request *> toConnect{};
+    std::mutex connectLock;
+    int wakeFd;
+    int epollFd;
+
+    // Sockets that are connecting (only used by the connect loop)
+    std::unordered_map<int, Request *> inFlight{};
+
+    /**
+     * @brief Resolve the host names of queued requests
+     */
+    [[noreturn]] void resolveLoop();
+
+    /**
+     * @brief Start the connects of queued requests and finish them as the
+     * sockets become writable (or time out)
+     */
+    [[noreturn]] void connectLoop();
+
+    /**
+     * @brief Hand a request with addresses to the connect loop
+     * @param request The request
+     */
+    void queueConnect(Request *request);
+
+    /**
+     * @brief Start connecting to the next address of the request. Finishes
+     * the request if no address is left (or the connect completed at once)
+     * @param request The request
+     */
+    void connectNext(Request *request);
+
+    /**
+     * @brief Call the callback of the request and delete it
+     * @param request The request
+     * @param socket The connected socket (-1 if failed)
+     * @param error 0 or the error of the request
+     */
+    void finish(Request *request, int socket, int error);
+
+    /**
+     * @param host The host
+     * @param port The port
+     * @return The key of the host in the address cache
+     */
+    static inline std::string cacheKey(const std::string &host, int port) {
+      return host + ":" + std::to_string(port);
+    }
+
+    /**
+     * @brief If log level set by user is equal or more verbose than the log
+     * level passed to this function, print the given string
+     * @param level The log level of the given string
+     * @param log The string to be logged
+     */
+    void log(logLevels level, const std::string &log);
+  };
+}
+
+#endif //MINESVPN_TCP_CONNECTOR_H
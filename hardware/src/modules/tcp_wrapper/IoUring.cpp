@@ -0,0 +1,151 @@
+//
+// Created by Rut Vora
+//
+
+#include "IoUring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace TCP {
+  IoUring::IoUring(unsigned entries) {
+    struct io_uring_params params{};
+    ringFd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd < 0) {
+      throw std::runtime_error(std::string("io_uring_setup failed: ") +
+                               strerror(errno));
+    }
+    sqEntries = params.sq_entries;
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes +
+                 params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+      sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    cqRing = singleMmap ? sqRing :
+             mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    auto sqesMemory = mmap(nullptr,
+                           params.sq_entries * sizeof(struct io_uring_sqe),
+                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ringFd, IORING_OFF_SQES);
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED ||
+        sqesMemory == MAP_FAILED) {
+      auto error = errno;
+      if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+      if (!singleMmap && cqRing != MAP_FAILED) munmap(cqRing, cqRingSize);
+      if (sqesMemory != MAP_FAILED)
+        munmap(sqesMemory, params.sq_entries * sizeof(struct io_uring_sqe));
+      close(ringFd);
+      throw std::runtime_error(std::string("Could not map io_uring: ") +
+                               strerror(error));
+    }
+    sqes = static_cast<io_uring_sqe *>(sqesMemory);
+
+    auto sqBase = static_cast<uint8_t *>(sqRing);
+    sqHead = reinterpret_cast<unsigned *>(sqBase + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned *>(sqBase + params.sq_off.tail);
+    sqMask = *reinterpret_cast<unsigned *>(sqBase + params.sq_off.ring_mask);
+    // Entries are always submitted in order, so the indirection array maps
+    // every slot to itself
+    auto sqArray = reinterpret_cast<unsigned *>(sqBase + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) sqArray[i] = i;
+    sqeTail = *sqTail;
+
+    auto cqBase = static_cast<uint8_t *>(cqRing);
+    cqHead = reinterpret_cast<unsigned *>(cqBase + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned *>(cqBase + params.cq_off.tail);
+    cqMask = *reinterpret_cast<unsigned *>(cqBase + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cqBase + params.cq_off.cqes);
+  }
+
+  IoUring::~IoUring() {
+    close(ringFd);
+    munmap(sqes, sqEntries * sizeof(struct io_uring_sqe));
+    if (cqRing != sqRing) munmap(cqRing, cqRingSize);
+    munmap(sqRing, sqRingSize);
+    if (bufferRing != nullptr) {
+      munmap(bufferRing, bufferCount * sizeof(struct io_uring_buf));
+      free(bufferMemory);
+    }
+  }
+
+  io_uring_sqe *IoUring::getSQE() {
+    while (sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+      submit();
+    }
+    auto sqe = &sqes[sqeTail & sqMask];
+    sqeTail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  int IoUring::submit(unsigned waitFor) {
+    __atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+    auto toSubmit = sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    unsigned flags = waitFor > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (true) {
+      auto submitted = (int) syscall(__NR_io_uring_enter, ringFd, toSubmit,
+                                     waitFor, flags, nullptr, 0);
+      if (submitted >= 0) return submitted;
+      if (errno != EINTR) return -errno;
+      // Interrupted while waiting. The entries were already submitted
+      toSubmit = 0;
+    }
+  }
+
+  bool IoUring::registerBuffers(const struct iovec *buffers, unsigned count) {
+    return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS,
+                   buffers, count) == 0;
+  }
+
+  void IoUring::unregisterBuffers() {
+    syscall(__NR_io_uring_register, ringFd, IORING_UNREGISTER_BUFFERS,
+            nullptr, 0);
+  }
+
+  bool IoUring::setupBufferRing(uint16_t groupID, uint16_t count,
+                                size_t size) {
+    auto ringSize = count * sizeof(struct io_uring_buf);
+    auto ring = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) return false;
+
+    struct io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = count;
+    reg.bgid = groupID;
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) != 0) {
+      munmap(ring, ringSize);
+      return false;
+    }
+    bufferRing = static_cast<io_uring_buf *>(ring);
+    bufferMemory = static_cast<uint8_t *>(malloc(count * size));
+    bufferSize = size;
+    bufferCount = count;
+    for (uint16_t i = 0; i < count; i++) recycleBuffer(i);
+    return true;
+  }
+
+  void IoUring::recycleBuffer(uint16_t bufferID) {
+    auto &buffer = bufferRing[bufferTail & (bufferCount - 1)];
+    buffer.addr = reinterpret_cast<uint64_t>(providedBuffer(bufferID));
+    buffer.len = bufferSize;
+    buffer.bid = bufferID;
+    bufferTail++;
+    __atomic_store_n(&bufferRing[0].resv, bufferTail, __ATOMIC_RELEASE);
+  }
+}
@@ -0,0 +1,133 @@
+//
+// Created by Rut Vora
+//
+
+#ifndef MINESVPN_TCP_IO_URING_H
+#define MINESVPN_TCP_IO_URING_H
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+namespace TCP {
+  /**
+   * @brief Minimal io_uring instance on top of the raw system calls. Owned by
+   * one thread: submissions and completions are not thread-safe
+   */
+  class IoUring {
+  public:
+    /**
+     * @brief Set up the submission and completion rings
+     * @param entries The number of submission queue entries
+     * Throws a runtime error if io_uring is not available
+     */
+    explicit IoUring(unsigned entries);
+
+    ~IoUring();
+
+    IoUring(const IoUring &) = delete;
+
+    IoUring &operator=(const IoUring &) = delete;
+
+    /**
+     * @brief Get a cleared submission queue entry to fill in. If the
+     * submission queue is full, the entries in it are submitted first
+     */
+    io_uring_sqe *getSQE();
+
+    /**
+     * @brief Submit all filled in entries with a single system call
+     * @param waitFor The number of completions to wait for
+     * @return The number of entries submitted (-errno on failure)
+     */
+    int submit(unsigned waitFor = 0);
+
+    /**
+     * @brief Call the given function on every available completion
+     * @param onCompletion Called with every io_uring_cqe
+     * @return The number of completions handled
+     */
+    template<typename F>
+    unsigned forEachCQE(F &&onCompletion) {
+      auto head = *cqHead;
+      auto tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+      unsigned count = 0;
+      for (; head != tail; head++, count++) {
+        onCompletion(cqes[head & cqMask]);
+      }
+      __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+      return count;
+    }
+
+    /**
+     * @brief Register memory that sends are done from, so that the kernel
+     * pins it once instead of on every send (IORING_OP_WRITE_FIXED, or
+     * IORING_OP_SEND with IORING_RECVSEND_FIXED_BUF)
+     * @param buffers The memory regions to register
+     * @param count The number of memory regions
+     * @return false if the memory could not be registered
+     */
+    bool registerBuffers(const struct iovec *buffers, unsigned count);
+
+    /**
+     * @brief Unregister the memory registered with registerBuffers
+     */
+    void unregisterBuffers();
+
+    /**
+     * @brief Set up a ring of buffers that the kernel picks from on receive
+     * (IOSQE_BUFFER_SELECT), so that no buffer is tied up by idle sockets
+     * @param groupID The ID of the buffer group
+     * @param count The number of buffers (power of 2)
+     * @param size The size of each buffer
+     * @return false if the buffer ring could not be set up
+     */
+    bool setupBufferRing(uint16_t groupID, uint16_t count, size_t size);
+
+    /**
+     * @param bufferID The ID of a buffer from the buffer ring
+     * @return The buffer
+     */
+    inline uint8_t *providedBuffer(uint16_t bufferID) {
+      return bufferMemory + (size_t) bufferID * bufferSize;
+    }
+
+    /**
+     * @brief Hand a buffer from the buffer ring back to the kernel
+     * @param bufferID The ID of the buffer
+     */
+    void recycleBuffer(uint16_t bufferID);
+
+  private:
+    int ringFd = -1;
+    unsigned sqEntries = 0;
+
+    void *sqRing = nullptr;
+    void *cqRing = nullptr;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe *sqes = nullptr;
+
+    unsigned *sqHead = nullptr;
+    unsigned *sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqeTail = 0; // Entries handed out (not yet visible to the kernel)
+
+    unsigned *cqHead = nullptr;
+    unsigned *cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe *cqes = nullptr;
+
+    // The ring is an array of io_uring_buf whose tail overlays the reserved
+    // field of the first entry (io_uring_buf_ring). Indexed as a plain array
+    // since the flexible array of the uapi header is misplaced in C++
+    io_uring_buf *bufferRing = nullptr;
+    uint8_t *bufferMemory = nullptr;
+    size_t bufferSize = 0;
+    uint16_t bufferCount = 0;
+    uint16_t bufferTail = 0;
+  };
+}
+
+#endif //MINESVPN_TCP_IO_URING_H
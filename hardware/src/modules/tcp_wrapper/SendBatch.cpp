@@ -0,0 +1,195 @@
+//
+// Created by Rut Vora
+//
+
+#include "SendBatch.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <stdexcept>
+#include <sys/socket.h>
+
+#ifdef IO_URING
+#include "IoUring.h"
+#endif
+
+// The kernel accepts registered buffers of up to 1 GB each
+#define MAX_REGISTERED_SIZE (1UL << 30)
+
+namespace TCP {
+  SendBatch::SendBatch(unsigned maxSends, logLevels level, bool nonBlocking) :
+      maxSends(maxSends), logLevel(level), nonBlocking(nonBlocking) {
+    sends.reserve(maxSends);
+#ifdef IO_URING
+    try {
+      ring = new IoUring(maxSends);
+    } catch (std::runtime_error &e) {
+      log(WARNING, std::string(e.what()) + ". Using blocking sends");
+    }
+#endif
+  }
+
+  SendBatch::~SendBatch() {
+#ifdef IO_URING
+    delete ring;
+#endif
+  }
+
+  void SendBatch::registerMemory(uint8_t *address, size_t length) {
+#ifdef IO_URING
+    if (ring == nullptr || !registered.empty()) return;
+    for (size_t offset = 0; offset < length; offset += MAX_REGISTERED_SIZE) {
+      auto size = std::min(MAX_REGISTERED_SIZE, length - offset);
+      registered.push_back({address + offset, size});
+    }
+    if (!ring->registerBuffers(registered.data(), registered.size())) {
+      log(WARNING, std::string("Could not register the send memory: ") +
+                   strerror(errno));
+      registered.clear();
+    }
+#else
+    (void) address;
+    (void) length;
+#endif
+  }
+
+  bool SendBatch::send(int socket, const uint8_t *buffer, size_t length,
+                       void *context) {
+    if (sends.size() >= maxSends) return false;
+    sends.push_back({socket, buffer, length, context, 0});
+    return true;
+  }
+
+  void SendBatch::flush(
+      const std::function<void(void *context, ssize_t sent)> &onSent) {
+    if (sends.empty()) return;
+    if (ring == nullptr || !submitToRing()) {
+      for (size_t i = 0; i < sends.size(); i++) {
+        auto &request = sends[i];
+        if (i > 0 && sends[i - 1].socket == request.socket
+            && sends[i - 1].result != (ssize_t) sends[i - 1].length) {
+          request.result = -ECANCELED;
+          continue;
+        }
+        request.result = ::send(request.socket, request.buffer,
+                                request.length,
+                                nonBlocking ? MSG_DONTWAIT : 0);
+        if (request.result < 0) request.result = -errno;
+      }
+    }
+    for (auto &request: sends) onSent(request.context, request.result);
+    sends.clear();
+  }
+
+  int SendBatch::registeredIndex(const uint8_t *buffer, size_t length) {
+    for (size_t i = 0; i < registered.size(); i++) {
+      auto start = static_cast<uint8_t *>(registered[i].iov_base);
+      if (buffer >= start && buffer + length <= start + registered[i].iov_len)
+        return (int) i;
+    }
+    return -1;
+  }
+
+  bool SendBatch::submitToRing() {
+#ifdef IO_URING
+    for (size_t i = 0; i < sends.size(); i++) {
+      auto &request = sends[i];
+      auto sqe = ring->getSQE();
+      auto index = registeredIndex(request.buffer, request.length);
+      if (index >= 0 && !nonBlocking) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = index;
+      } else if (index >= 0) {
+        // A write can't be told not to wait. A zero-copy send can, and is the
+        // only send that takes registered memory
+        sqe->opcode = IORING_OP_SEND_ZC;
+        sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+        sqe->buf_index = index;
+        sqe->msg_flags = MSG_DONTWAIT;
+      } else {
+        sqe->opcode = IORING_OP_SEND;
+        // The kernel then completes the send with -EAGAIN instead of polling
+        if (nonBlocking) sqe->msg_flags = MSG_DONTWAIT;
+      }
+      sqe->fd = request.socket;
+      sqe->addr = reinterpret_cast<uint64_t>(request.buffer);
+      sqe->len = request.length;
+      if (i + 1 < sends.size() && sends[i + 1].socket == request.socket) {
+        sqe->flags |= IOSQE_IO_LINK;
+      }
+      sqe->user_data = i;
+    }
+
+    auto result = ring->submit(sends.size());
+    if (result < 0) {
+      log(ERROR, std::string("Could not submit the sends: ") +
+                 strerror(-result));
+      // Nothing was submitted. Drop the entries and send them the slow way
+      delete ring;
+      ring = nullptr;
+      registered.clear();
+      return false;
+    }
+    size_t pending = sends.size();
+    while (true) {
+      ring->forEachCQE([this, &pending](io_uring_cqe &cqe) {
+        pending--;
+        // A zero-copy send is followed by a notification once the kernel is
+        // done with its memory. Until then, the memory must not be reused
+        if (cqe.flags & IORING_CQE_F_NOTIF) return;
+        if (cqe.flags & IORING_CQE_F_MORE) pending++;
+        sends[cqe.user_data].result = cqe.res;
+      });
+      if (pending == 0) break;
+      ring->submit(pending);
+    }
+    if (nonBlocking && !registered.empty()) checkFixedSends();
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void SendBatch::checkFixedSends() {
+#ifdef IO_URING
+    bool isRejected = false;
+    for (auto &request: sends) {
+      if (request.result != -EINVAL && request.result != -EOPNOTSUPP)
+        continue;
+      if (registeredIndex(request.buffer, request.length) < 0) continue;
+      request.result = -EAGAIN;
+      isRejected = true;
+    }
+    if (!isRejected) return;
+    log(WARNING, "The kernel can't send from the registered memory. Sending "
+                 "without it");
+    ring->unregisterBuffers();
+    registered.clear();
+#endif
+  }
+
+  void SendBatch::log(logLevels level, const std::string &log) {
+    auto time = std::time(nullptr);
+    auto localTime = std::localtime(&time);
+    std::string levelStr;
+    switch (level) {
+      case DEBUG:
+        levelStr = "TcpSendBatch:DEBUG: ";
+        break;
+      case ERROR:
+        levelStr = "TcpSendBatch:ERROR: ";
+        break;
+      case WARNING:
+        levelStr = "TcpSendBatch:WARNING: ";
+        break;
+
+    }
+    if (logLevel >= level) {
+      std::cerr << std::put_time(localTime, "[%H:%M:%S] ") << levelStr
+                << log << std::endl;
+    }
+  }
+}
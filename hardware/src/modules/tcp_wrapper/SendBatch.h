@@ -0,0 +1,134 @@
+//
+// Created by Rut Vora
+//
+
+#ifndef MINESVPN_TCP_SEND_BATCH_H
+#define MINESVPN_TCP_SEND_BATCH_H
+
+#include <functional>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "../Common.h"
+
+namespace TCP {
+  class IoUring;
+
+  /**
+   * @brief Collects the sends of one pass over the queues and hands them to
+   * the kernel together. With io_uring (TCPWrapper built with TCP_IO_URING),
+   * the whole batch costs a single system call, and sends from registered
+   * memory don't pin their pages every time. Otherwise (or if io_uring is
+   * not available at runtime) every send is a send().
+   * Sends are blocking unless the batch is non-blocking, in which case a send
+   * on a full socket fails with -EAGAIN instead of holding up the others.
+   * Owned by one thread
+   */
+  class SendBatch {
+  public:
+    /**
+     * @brief Constructor for the send batch
+     * @param maxSends The maximum number of sends in one batch
+     * @param [opt] level Log Level (ERROR, WARNING, DEBUG)
+     * @param [opt] nonBlocking Never wait for space in the socket buffers
+     */
+    explicit SendBatch(unsigned maxSends = 256, logLevels level = DEBUG,
+                       bool nonBlocking = false);
+
+    ~SendBatch();
+
+    /**
+     * @brief Register the memory that the sends are (mostly) done from, e.g.
+     * the shared memory holding the queues. Call at most once. A
+     * non-blocking batch sends from it with zero-copy sends, which (unlike a
+     * write) can be told not to wait
+     * @param address The start of the memory
+     * @param length The length of the memory
+     */
+    void registerMemory(uint8_t *address, size_t length);
+
+    /**
+     * @brief Queue a send. Consecutive sends on the same socket are linked:
+     * if one fails or is cut short, the ones after it are cancelled. With
+     * io_uring, a non-blocking batch only cancels them after a failure, so
+     * queue at most one non-blocking send per socket (they are often cut
+     * short)
+     * @param socket The socket to send on
+     * @param buffer The data to send (must stay valid until flush returns)
+     * @param length The length of the data
+     * @param context Passed back to onSent by flush
+     * @return false if the batch is full (flush it first)
+     */
+    bool send(int socket, const uint8_t *buffer, size_t length,
+              void *context);
+
+    /**
+     * @brief Send everything that is queued and wait for it
+     * @param onSent Called (in the order the sends were queued) with the
+     * context of every send and the number of bytes sent. Negative (-errno)
+     * if the send failed or was cancelled
+     */
+    void flush(const std::function<void(void *context, ssize_t sent)> &onSent);
+
+    /**
+     * @return The number of sends that can still be queued in this batch
+     */
+    [[nodiscard]] inline size_t available() const {
+      return maxSends - sends.size();
+    }
+
+    /**
+     * @return true if the sends of this batch never wait for the sockets
+     */
+    [[nodiscard]] inline bool isNonBlocking() const {
+      return nonBlocking;
+    }
+
+  private:
+    struct Send {
+      int socket;
+      const uint8_t *buffer;
+      size_t length;
+      void *context;
+      ssize_t result;
+    };
+
+    std::vector<Send> sends;
+    unsigned maxSends;
+    std::vector<struct iovec> registered{};
+    IoUring *ring = nullptr;
+    const enum logLevels logLevel;
+    const bool nonBlocking;
+
+    /**
+     * @param buffer The buffer to look up
+     * @param length The length of the buffer
+     * @return The index of the registered memory that holds the buffer (-1
+     * if it isn't registered)
+     */
+    int registeredIndex(const uint8_t *buffer, size_t length);
+
+    /**
+     * @brief Send the queued sends through io_uring and fill in their results
+     * @return false if the batch could not be submitted
+     */
+    bool submitToRing();
+
+    /**
+     * @brief Stop sending from the registered memory if the kernel rejected
+     * a zero-copy send from it. Those sends are reported as -EAGAIN, so that
+     * their data is sent (without the registered memory) with the next batch
+     */
+    void checkFixedSends();
+
+    /**
+     * @brief If log level set by user is equal or more verbose than the log
+     * level passed to this function, print the given string
+     * @param level The log level of the given string
+     * @param log The string to be logged
+     */
+    void log(logLevels level, const std::string &log);
+  };
+}
+
+#endif //MINESVPN_TCP_SEND_BATCH_H
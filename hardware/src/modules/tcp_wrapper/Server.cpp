@@ -8,9 +8,25 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 #include <thread>
 #include <cstring>
 #include <iomanip>
+#include <algorithm>
+#include <unordered_set>
+
+#ifdef IO_URING
+#include "IoUring.h"
+
+// Tags of the completions in user_data (the lower half holds the socket)
+#define ACCEPT_TAG (1ULL << 32)
+#define RECV_TAG (2ULL << 32)
+#define CANCEL_TAG (3ULL << 32)
+#define TIMEOUT_TAG (4ULL << 32)
+#define WAKE_TAG (5ULL << 32)
+#endif
 
 namespace TCP {
   Server::Server(std::string bindAddr, int localPort,
@@ -19,7 +35,11 @@ namespace TCP {
                                     uint8_t *buffer, size_t length,
                                     enum connectionStatus connStatus)>
                  onReceiveFunc,
-                 logLevels level) : logLevel(level) {
+                 logLevels level, int numIOThreads,
+                 std::vector<int> ioCores, int backlog, bool incomingCPU) :
+      logLevel(level), numIOThreads(std::max(numIOThreads, 1)),
+      ioCores(std::move(ioCores)), backlog(backlog),
+      incomingCPU(incomingCPU) {
     if (bindAddr.empty()) bindAddr = "0.0.0.0";
     inetFamily = checkIPVersion(bindAddr);
     if (inetFamily == -1) {
@@ -29,16 +49,16 @@ namespace TCP {
     this->bindAddr = std::move(bindAddr);
     this->localPort = localPort;
     onReceive = std::move(onReceiveFunc);
-
-    // Initialise localSocket to -1 (invalid value)
-    this->localSocket = -1;
 #ifdef DEBUGGING
     log(DEBUG, "Server initialised");
 #endif
   }
 
   Server::~Server() {
-    close(localSocket);
+    for (auto listenSocket: listenSockets) {
+      if (listenSocket >= 0) close(listenSocket);
+    }
+    for (auto &pending: pendingSockets) close(pending->wakeFd);
 #ifdef DEBUGGING
     log(DEBUG, "Server destructed");
 #endif
@@ -46,8 +66,108 @@ namespace TCP {
   }
 
   void Server::startListening() {
-    localSocket = openSocket();
-    switch (localSocket) {
+    // Open all listeners before any I/O thread starts accepting, so that the
+    // kernel spreads connections across all of them from the start
+    for (int i = 0; i < numIOThreads; i++) {
+      listenSockets.push_back(
+          openSocket(ioCores.empty() ? -1 : ioCores[i % ioCores.size()]));
+      throwOnError(listenSockets.back());
+    }
+#ifdef DEBUGGING
+    log(DEBUG, "Started listening on " + bindAddr + ":"
+               + std::to_string(localPort));
+#endif
+    startIOThreads();
+  }
+
+  void Server::startReading() {
+    listenSockets.assign(numIOThreads, -1);
+    startIOThreads();
+  }
+
+  void Server::startIOThreads() {
+    for (int i = 0; i < numIOThreads; i++) {
+      pendingSockets.push_back(std::make_unique<PendingSockets>());
+      pendingSockets.back()->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (pendingSockets.back()->wakeFd < 0) {
+        throw std::runtime_error("Could not create the eventfd of an I/O "
+                                 "thread");
+      }
+    }
+    for (int i = 0; i < numIOThreads; i++) {
+      std::thread ioThread(&Server::ioLoop, this, i);
+      ioThread.detach();
+    }
+  }
+
+  void Server::setReceiveSpace(std::function<size_t(int socket)> receiveSpace,
+                               int retryInterval) {
+    this->receiveSpace = std::move(receiveSpace);
+    this->retryInterval = std::chrono::microseconds(std::max(retryInterval, 1));
+  }
+
+  void Server::closeClient(int socket) {
+    int owner;
+    {
+      std::scoped_lock lock(ownersLock);
+      auto ownerIter = owners.find(socket);
+      if (ownerIter == owners.end()) {
+        // Never watched by an I/O thread
+        close(socket);
+        return;
+      }
+      owner = ownerIter->second;
+    }
+    handOver(owner, socket, "");
+  }
+
+  void Server::readFrom(int socket, std::string address) {
+    auto owner = (int) (nextReader++ % numIOThreads);
+    {
+      // Before the handover, so that a closeClient right after finds it
+      std::scoped_lock lock(ownersLock);
+      owners[socket] = owner;
+    }
+    handOver(owner, socket, std::move(address));
+  }
+
+  void Server::handOver(int threadIndex, int socket, std::string address) {
+    auto &pending = *pendingSockets[threadIndex];
+    {
+      std::scoped_lock lock(pending.lock);
+      if (address.empty()) pending.closes.push_back(socket);
+      else pending.reads.emplace_back(socket, std::move(address));
+    }
+    uint64_t wake = 1;
+    if (write(pending.wakeFd, &wake, sizeof(wake)) < 0 && errno != EAGAIN) {
+      log(ERROR, std::string("Could not wake up I/O thread ") +
+                 std::to_string(threadIndex) + ": " + strerror(errno));
+    }
+  }
+
+  void Server::releaseClient(int socket) {
+    {
+      // Before the close, after which an accept may get the same socket
+      std::scoped_lock lock(ownersLock);
+      owners.erase(socket);
+    }
+    close(socket);
+  }
+
+  void Server::takePending(int threadIndex, std::vector<int> &closes,
+                           std::vector<std::pair<int, std::string>> &reads) {
+    auto &pending = *pendingSockets[threadIndex];
+    uint64_t wakes;
+    while (read(pending.wakeFd, &wakes, sizeof(wakes)) < 0 && errno == EINTR);
+    closes.clear();
+    reads.clear();
+    std::scoped_lock lock(pending.lock);
+    closes.swap(pending.closes);
+    reads.swap(pending.reads);
+  }
+
+  void Server::throwOnError(int socket) {
+    switch (socket) {
       case CLIENT_RESOLVE_ERROR:
         throw std::invalid_argument("Could not resolve the given bind Address "
                                     "and port");
@@ -63,17 +183,11 @@ namespace TCP {
         throw std::runtime_error("Could not start listening on given address "
                                  "and port");
       default:
-#ifdef DEBUGGING
-        log(DEBUG, "Started listening on " + bindAddr + ":"
-                   + std::to_string(localPort));
-#endif
-        std::thread loop(&Server::serverLoop, this);
-        loop.detach();
+        break;
     }
-
   }
 
-  int Server::openSocket() {
+  int Server::openSocket(int core) {
     struct addrinfo hints = {}, *res = nullptr;
 
     // getaddrinfo(...) requires the port in the c_string format
@@ -108,13 +222,31 @@ namespace TCP {
         (optVal)) < 0) {
       return SERVER_SETSOCKOPT_ERROR;
     }
+    // Every I/O thread listens on the same address and port
+    if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &optVal, sizeof
+        (optVal)) < 0) {
+      return SERVER_SETSOCKOPT_ERROR;
+    }
+    if (incomingCPU && core >= 0 &&
+        setsockopt(serverSocket, SOL_SOCKET, SO_INCOMING_CPU, &core,
+                   sizeof(core)) < 0) {
+      log(WARNING, "Could not steer connections from core " +
+                   std::to_string(core) + " to their I/O thread: " +
+                   strerror(errno));
+    }
+
+    // The I/O threads accept until there is no client left
+    int flags = fcntl(serverSocket, F_GETFL, 0);
+    if (flags < 0 || fcntl(serverSocket, F_SETFL, flags | O_NONBLOCK) < 0) {
+      return SERVER_SETSOCKOPT_ERROR;
+    }
 
     if (bind(serverSocket, res->ai_addr, res->ai_addrlen) == -1) {
       close(serverSocket);
       return SERVER_BIND_ERROR;
     }
 
-    if (listen(serverSocket, BACKLOG) < 0) {
+    if (listen(serverSocket, backlog) < 0) {
       return SERVER_LISTEN_ERROR;
     }
 
@@ -152,66 +284,480 @@ namespace TCP {
     }
   }
 
-  [[noreturn]] void Server::serverLoop() {
-    struct sockaddr_storage clientAddress{};
-    socklen_t addrLen = sizeof(clientAddress);
+  void Server::ioLoop(int threadIndex) {
+    if (!ioCores.empty()) {
+      cpu_set_t mask;
+      CPU_ZERO(&mask);
+      CPU_SET(ioCores[threadIndex % ioCores.size()], &mask);
+      if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) != 0) {
+        log(ERROR, "Could not set CPU affinity of I/O thread " +
+                   std::to_string(threadIndex));
+      }
+    }
 #ifdef DEBUGGING
-    log(DEBUG, "Starting Server loop");
+    log(DEBUG, "Starting I/O thread " + std::to_string(threadIndex));
 #endif
+#ifdef IO_URING
+    uringLoop(threadIndex);
+#endif
+    epollLoop(threadIndex);
+  }
+
+  void Server::epollLoop(int threadIndex) {
+    auto listenSocket = listenSockets[threadIndex];
+    auto wakeFd = pendingSockets[threadIndex]->wakeFd;
+    int epollFd = epoll_create1(0);
+    if (epollFd < 0) {
+      log(ERROR, std::string("Could not create epoll instance: ") +
+                 strerror(errno));
+      return;
+    }
+    struct epoll_event listenEvent{};
+    listenEvent.events = EPOLLIN;
+    listenEvent.data.fd = listenSocket;
+    if (listenSocket >= 0 &&
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSocket, &listenEvent) < 0) {
+      log(ERROR, std::string("Could not watch the listening socket: ") +
+                 strerror(errno));
+      close(epollFd);
+      return;
+    }
+    struct epoll_event wakeEvent{};
+    wakeEvent.events = EPOLLIN;
+    wakeEvent.data.fd = wakeFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &wakeEvent) < 0) {
+      log(ERROR, std::string("Could not watch the eventfd: ") +
+                 strerror(errno));
+      close(epollFd);
+      return;
+    }
+
+    std::unordered_map<int, std::string> clients{};
+    // Clients that are not read until onReceive can take their data
+    std::unordered_set<int> paused{};
+    auto retryMs = (int) std::max(
+        std::chrono::duration_cast<std::chrono::milliseconds>(retryInterval)
+            .count(), (decltype(retryInterval.count())) 1);
+    struct epoll_event events[MAX_EVENTS];
+    std::vector<int> closes{};
+    std::vector<std::pair<int, std::string>> reads{};
     while (true) {
-      int clientSocket =
-          accept(localSocket, (struct sockaddr *) &clientAddress,
-                 &addrLen);
+      int numEvents = epoll_wait(epollFd, events, MAX_EVENTS,
+                                 paused.empty() ? -1 : retryMs);
+      if (numEvents < 0) {
+        if (errno != EINTR) {
+          log(ERROR, std::string("epoll_wait failed: ") + strerror(errno));
+        }
+        continue;
+      }
+      for (int i = 0; i < numEvents; i++) {
+        int socket = events[i].data.fd;
+        if (listenSocket >= 0 && socket == listenSocket) {
+          acceptClients(threadIndex, epollFd, clients);
+          continue;
+        }
+        if (socket == wakeFd) {
+          takePending(threadIndex, closes, reads);
+          for (auto &[readSocket, address]: reads) {
+            watchClient(epollFd, readSocket, std::move(address), clients);
+          }
+          // Stop watching the clients to close before closing them, else an
+          // event of the old client could be taken for one of a new client
+          // that got the same socket
+          for (auto closing: closes) {
+            if (clients.erase(closing) > 0) {
+              epoll_ctl(epollFd, EPOLL_CTL_DEL, closing, nullptr);
+              paused.erase(closing);
+            }
+            releaseClient(closing);
+          }
+          continue;
+        }
+        auto clientIter = clients.find(socket);
+        // A paused client is read (up to the new edge) once it is resumed
+        if (clientIter == clients.end() || paused.contains(socket)) continue;
+        bool isPaused = false;
+        if (!receiveData(socket, clientIter->second, isPaused)) {
+          epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, nullptr);
+          clients.erase(clientIter);
+        } else if (isPaused) {
+          paused.insert(socket);
+        }
+      }
+
+      for (auto pausedIter = paused.begin(); pausedIter != paused.end();) {
+        auto socket = *pausedIter;
+        if (receiveSpace(socket) == 0) {
+          pausedIter++;
+          continue;
+        }
+        auto clientIter = clients.find(socket);
+        bool isPaused = false;
+        if (!receiveData(socket, clientIter->second, isPaused)) {
+          epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, nullptr);
+          clients.erase(clientIter);
+        }
+        pausedIter = isPaused ? std::next(pausedIter) : paused.erase(pausedIter);
+      }
+    }
+  }
 
+  void Server::acceptClients(int threadIndex, int epollFd,
+                             std::unordered_map<int, std::string> &clients) {
+    auto listenSocket = listenSockets[threadIndex];
+    while (true) {
+      struct sockaddr_storage clientAddress{};
+      socklen_t addrLen = sizeof(clientAddress);
+      int clientSocket =
+          accept(listenSocket, (struct sockaddr *) &clientAddress, &addrLen);
+      if (clientSocket < 0) {
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          log(ERROR, std::string("Could not accept a client: ") +
+                     strerror(errno));
+        }
+        return;
+      }
 
-      try {
-        auto address = getAddress(*(struct sockaddr *) (&clientAddress));
-        std::thread clientHandler(&Server::handleClient, this, clientSocket,
-                                  address);
-        clientHandler.detach();
-      } catch (...) {
-        log(ERROR, "Could not parse client address");
+      std::string address;
+      if (!addClient(threadIndex, clientSocket,
+                     (struct sockaddr *) &clientAddress, address)) {
+        continue;
       }
+      watchClient(epollFd, clientSocket, std::move(address), clients);
     }
+  }
 
+  void Server::watchClient(int epollFd, int clientSocket, std::string address,
+                           std::unordered_map<int, std::string> &clients) {
+    // Edge triggered: receiveData reads until the socket is drained. Data
+    // that arrived before this is reported right away
+    struct epoll_event event{};
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    event.data.fd = clientSocket;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0) {
+      log(ERROR, "Could not watch the socket of client at " + address +
+                 ": " + strerror(errno));
+      shutdown(clientSocket, SHUT_RD);
+      onReceive(clientSocket, address, nullptr, 0, FIN);
+      return;
+    }
+    clients.insert_or_assign(clientSocket, std::move(address));
   }
 
-  void Server::handleClient(int clientSocket, std::string clientAddress) {
+  bool Server::addClient(int threadIndex, int clientSocket,
+                         struct sockaddr *clientAddress,
+                         std::string &address) {
+    try {
+      address = getAddress(*clientAddress);
+    } catch (...) {
+      log(ERROR, "Could not parse client address");
+      close(clientSocket);
+      return false;
+    }
+    {
+      std::scoped_lock lock(ownersLock);
+      owners[clientSocket] = threadIndex;
+    }
 #ifdef DEBUGGING
-    log(DEBUG, "Client at " + clientAddress + " connected on socket " +
+    log(DEBUG, "Client at " + address + " connected on socket " +
                std::to_string(clientSocket));
 #endif
-    if (!onReceive(clientSocket, clientAddress, nullptr, 0, SYN)) {
+    if (!onReceive(clientSocket, address, nullptr, 0, SYN)) {
       // No queues for this client. Don't receive data from it
-      close(clientSocket);
+      releaseClient(clientSocket);
+      return false;
+    }
+    return true;
+  }
+
+#ifdef IO_URING
+  void Server::uringLoop(int threadIndex) {
+    auto listenSocket = listenSockets[threadIndex];
+    auto wakeFd = pendingSockets[threadIndex]->wakeFd;
+    IoUring *ring;
+    try {
+      ring = new IoUring(URING_ENTRIES);
+    } catch (std::runtime_error &e) {
+      log(WARNING, std::string(e.what()) + ". Using epoll");
+      return;
+    }
+    // Received data lands in buffers the kernel picks from a shared ring, so
+    // idle clients don't hold any buffer
+    if (!ring->setupBufferRing(0, URING_BUFFERS, BUF_SIZE)) {
+      log(WARNING, std::string("Could not set up the receive buffers: ") +
+                   strerror(errno) + ". Using epoll");
+      delete ring;
       return;
     }
-    // Read data from the client socket
-    receiveData(clientSocket, clientAddress);
+
+    // Multishot accept and receive: one submission keeps producing
+    // completions until it is stopped (or the connection ends)
+    auto armAccept = [ring, listenSocket]() {
+      auto sqe = ring->getSQE();
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = listenSocket;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->user_data = ACCEPT_TAG;
+    };
+    auto armReceive = [ring](int socket) {
+      auto sqe = ring->getSQE();
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = socket;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = 0;
+      sqe->user_data = RECV_TAG | (uint32_t) socket;
+    };
+
+    // Stops the multishot receive of a client that is held back
+    auto cancelReceive = [ring](int socket) {
+      auto sqe = ring->getSQE();
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = RECV_TAG | (uint32_t) socket;
+      sqe->user_data = CANCEL_TAG;
+    };
+    uint64_t wakes;
+    auto armWake = [ring, wakeFd, &wakes]() {
+      auto sqe = ring->getSQE();
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = wakeFd;
+      sqe->addr = reinterpret_cast<uint64_t>(&wakes);
+      sqe->len = sizeof(wakes);
+      sqe->user_data = WAKE_TAG;
+    };
+    struct __kernel_timespec retryTime{
+        (long long) (retryInterval.count() / 1000000),
+        (long long) (retryInterval.count() % 1000000) * 1000};
+    auto armRetry = [ring, &retryTime]() {
+      auto sqe = ring->getSQE();
+      sqe->opcode = IORING_OP_TIMEOUT;
+      sqe->addr = reinterpret_cast<uint64_t>(&retryTime);
+      sqe->len = 1;
+      sqe->user_data = TIMEOUT_TAG;
+    };
+
+    // Clients that onReceive can't take more data from. Data that was
+    // received before their receive was cancelled is held here
+    struct HeldBack {
+      std::vector<uint8_t> data{};
+      bool isArmed = true; // The multishot receive has not ended yet
+      bool isClosed = false; // The FIN follows the held data
+    };
+    std::unordered_map<int, HeldBack> heldBack{};
+    bool isRetryArmed = false;
+
+    std::unordered_map<int, std::string> clients{};
+    // Hand the received FIN of a client to onReceive and forget the client
+    auto finishClient = [&](std::unordered_map<int, std::string>::iterator
+                            clientIter) {
+      shutdown(clientIter->first, SHUT_RD);
+      onReceive(clientIter->first, clientIter->second, nullptr, 0, FIN);
+      clients.erase(clientIter);
+    };
+    // Clients closed by closeClient whose receive is still armed. They are
+    // closed once it ends: the ring holds on to the socket until then, and
+    // its completions would be taken for those of a new client with the
+    // same socket
+    std::unordered_set<int> closing{};
+    std::vector<int> closes{};
+    std::vector<std::pair<int, std::string>> reads{};
+    auto handlePending = [&]() {
+      takePending(threadIndex, closes, reads);
+      for (auto &[socket, address]: reads) {
+        clients.insert_or_assign(socket, std::move(address));
+        armReceive(socket);
+      }
+      for (auto socket: closes) {
+        auto held = heldBack.find(socket);
+        bool isArmed = clients.contains(socket);
+        if (held != heldBack.end()) {
+          // Its receive is being cancelled already (if it is armed)
+          isArmed = held->second.isArmed;
+          heldBack.erase(held);
+        } else if (isArmed) {
+          cancelReceive(socket);
+        }
+        if (isArmed) {
+          closing.insert(socket);
+          continue;
+        }
+        clients.erase(socket);
+        releaseClient(socket);
+      }
+    };
+
+    if (listenSocket >= 0) armAccept();
+    armWake();
+    while (true) {
+      if (!heldBack.empty() && !isRetryArmed) {
+        armRetry();
+        isRetryArmed = true;
+      }
+      auto result = ring->submit(1);
+      if (result < 0 && result != -EBUSY) {
+        log(ERROR, std::string("io_uring_enter failed: ") + strerror(-result));
+        continue;
+      }
+      bool retry = false;
+      ring->forEachCQE([&](io_uring_cqe &cqe) {
+        bool isArmed = cqe.flags & IORING_CQE_F_MORE;
+        if (cqe.user_data == ACCEPT_TAG) {
+          if (cqe.res >= 0) {
+            struct sockaddr_storage clientAddress{};
+            socklen_t addrLen = sizeof(clientAddress);
+            getpeername(cqe.res, (struct sockaddr *) &clientAddress,
+                        &addrLen);
+            std::string address;
+            if (addClient(threadIndex, cqe.res,
+                          (struct sockaddr *) &clientAddress, address)) {
+              clients.insert_or_assign(cqe.res, std::move(address));
+              armReceive(cqe.res);
+            }
+          } else if (cqe.res != -EAGAIN && cqe.res != -EINTR) {
+            log(ERROR, std::string("Could not accept a client: ") +
+                       strerror(-cqe.res));
+          }
+          if (!isArmed) armAccept();
+          return;
+        }
+        if (cqe.user_data == CANCEL_TAG) return;
+        if (cqe.user_data == WAKE_TAG) {
+          armWake();
+          handlePending();
+          return;
+        }
+        if (cqe.user_data == TIMEOUT_TAG) {
+          isRetryArmed = false;
+          retry = true;
+          return;
+        }
+
+        auto socket = (int) (uint32_t) cqe.user_data;
+        auto clientIter = clients.find(socket);
+        if (clientIter == clients.end()) return;
+        if (closing.contains(socket)) {
+          // Nobody takes its data anymore
+          if (cqe.res > 0) {
+            ring->recycleBuffer(
+                (uint16_t) (cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+          }
+          if (isArmed) return;
+          closing.erase(socket);
+          clients.erase(clientIter);
+          releaseClient(socket);
+          return;
+        }
+        auto held = heldBack.find(socket);
+        if (held != heldBack.end() && !isArmed) held->second.isArmed = false;
+        if (cqe.res > 0) {
+          auto bufferID = (uint16_t) (cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+          auto buffer = ring->providedBuffer(bufferID);
+#ifdef DEBUGGING
+          log(DEBUG, "Data received on socket " + std::to_string(socket));
+#endif
+          if (held != heldBack.end()) {
+            // Still held back: keep the order of the data
+            held->second.data.insert(held->second.data.end(), buffer,
+                                     buffer + cqe.res);
+            ring->recycleBuffer(bufferID);
+            return;
+          }
+          auto length = std::min((size_t) cqe.res, receiveSpace(socket));
+          if (length > 0) {
+            onReceive(socket, clientIter->second, buffer, length, ONGOING);
+          }
+          if (length < (size_t) cqe.res) {
+            heldBack[socket] = {{buffer + length, buffer + cqe.res}, isArmed};
+            if (isArmed) cancelReceive(socket);
+          } else if (!isArmed) {
+            armReceive(socket);
+          }
+          ring->recycleBuffer(bufferID);
+          return;
+        }
+        if (cqe.res == -ENOBUFS || (cqe.res == -ECANCELED
+                                    && held != heldBack.end())) {
+          // Every buffer was in use (they have been handed back since), or
+          // the receive of a held back client was stopped
+          if (held == heldBack.end()) armReceive(socket);
+          return;
+        }
+        if (cqe.res < 0) {
+          log(ERROR, "Client at " + clientIter->second +
+                     " disconnected abruptly with error " +
+                     strerror(-cqe.res));
+        }
+        if (held != heldBack.end()) {
+          held->second.isClosed = true;
+          return;
+        }
+        finishClient(clientIter);
+      });
+
+      if (!retry) continue;
+      // Hand the held data to onReceive as far as it can take it now
+      for (auto held = heldBack.begin(); held != heldBack.end();) {
+        auto socket = held->first;
+        auto clientIter = clients.find(socket);
+        auto &data = held->second.data;
+        auto length = std::min(data.size(), receiveSpace(socket));
+        if (length > 0) {
+          onReceive(socket, clientIter->second, data.data(), length, ONGOING);
+          data.erase(data.begin(), data.begin() + (ssize_t) length);
+        }
+        // Resume once the held data is gone and the old receive has ended
+        if (!data.empty() || held->second.isArmed) {
+          held++;
+          continue;
+        }
+        if (held->second.isClosed) finishClient(clientIter);
+        else armReceive(socket);
+        held = heldBack.erase(held);
+      }
+    }
   }
+#endif
 
-  void Server::receiveData(int socket, std::string &clientAddress) {
+  bool Server::receiveData(int socket, std::string &clientAddress,
+                           bool &isPaused) {
     ssize_t bytesReceived;  // Number of bytes received
     uint8_t buffer[BUF_SIZE];
 
-    // Read from fromSocket and send to toSocket
-    while ((bytesReceived = recv(socket, buffer, BUF_SIZE, 0)) > 0) {
+    // The socket itself stays blocking (for sendData), only reads don't wait
+    while (true) {
+      // Only read what onReceive can take. The rest stays in the socket
+      auto space = std::min(receiveSpace(socket), (size_t) BUF_SIZE);
+      if (space == 0) {
+        isPaused = true;
+        return true;
+      }
+      bytesReceived = recv(socket, buffer, space, MSG_DONTWAIT);
+      if (bytesReceived > 0) {
 #ifdef DEBUGGING
-      log(DEBUG, "Data received on socket " + std::to_string(socket));
+        log(DEBUG, "Data received on socket " + std::to_string(socket));
 #endif
-      onReceive(socket, clientAddress, buffer, bytesReceived, ONGOING);
+        onReceive(socket, clientAddress, buffer, bytesReceived, ONGOING);
+        continue;
+      }
+      if (bytesReceived < 0) {
+        if (errno == EINTR) continue;
+        // Drained. Wait for the next edge
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+        log(ERROR, "Client at " + clientAddress + " disconnected abruptly "
+                                                  "with error " +
+                   strerror(errno));
+      }
+      break;
     }
 
-    if (bytesReceived < 0) {
-      log(ERROR, "Client at " + clientAddress + " disconnected abruptly with "
-                                                "error " + strerror(errno));
-    }
     // Stop other processes from using these sockets
 #ifdef DEBUGGING
     log(DEBUG, "Shutting down read on socket " + std::to_string(socket));
 #endif
     shutdown(socket, SHUT_RD);
     onReceive(socket, clientAddress, nullptr, 0, FIN);
+    return false;
   }
 
   ssize_t Server::sendData(int toSocket, uint8_t *buffer, size_t length) {
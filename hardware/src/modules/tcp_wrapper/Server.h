@@ -6,7 +6,10 @@
 #define MINESVPN_TCP_SERVER_H
 
 #define BUF_SIZE 16384
-#define BACKLOG 20 // Number of pending connections the queue should hold
+#define BACKLOG 1024 // Number of pending connections each listener holds
+#define MAX_EVENTS 64 // Number of epoll events handled per wakeup
+#define URING_ENTRIES 256 // Size of the submission queue of each I/O thread
+#define URING_BUFFERS 64 // Number of receive buffers of each I/O thread
 #define SERVER_SOCKET_ERROR (-1)
 #define SERVER_SETSOCKOPT_ERROR (-2)
 #define SERVER_BIND_ERROR (-3)
@@ -18,10 +21,16 @@
 #endif
 
 
+#include <chrono>
 #include <iostream>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 #include "../Common.h"
 
 namespace TCP {
@@ -35,6 +44,17 @@ namespace TCP {
  * received. Pass a free function as a function pointer, a class member
  * function by using std::bind or lambda functions
  * @param [opt] level Log Level (ERROR, WARNING, DEBUG)
+ * @param [opt] numIOThreads The number of threads that accept and read from
+ * the clients. Each has its own listening socket (SO_REUSEPORT, the kernel
+ * spreads new connections across them) and runs its own event loop over the
+ * clients it accepted
+ * @param [opt] ioCores The cores to pin the I/O threads to (round robin).
+ * Not pinned if empty
+ * @param [opt] backlog The number of pending connections each listening
+ * socket holds (capped by net.core.somaxconn)
+ * @param [opt] incomingCPU Steer new connections to the listener of the I/O
+ * thread pinned to the core that received them (SO_INCOMING_CPU). Needs
+ * ioCores
  */
     explicit Server(std::string bindAddr = "",
                     int localPort = 8000,
@@ -44,14 +64,49 @@ namespace TCP {
                                        size_t length,
                                        enum connectionStatus connStatus)>
                     onReceiveFunc = [](auto &&...) { return true; },
-                    logLevels level = DEBUG);
+                    logLevels level = DEBUG,
+                    int numIOThreads = 1,
+                    std::vector<int> ioCores = {},
+                    int backlog = BACKLOG,
+                    bool incomingCPU = false);
 
     /**
      * @brief Start listening on given bind Address and port
-     * Will throw an error if startup fails. Else will go into a loop
+     * Will throw an error if startup fails. Else starts the I/O threads
      */
     void startListening();
 
+    /**
+     * @brief Start the I/O threads without listening, for a server that only
+     * reads from the sockets handed to it with readFrom
+     */
+    void startReading();
+
+    /**
+     * @brief Hand a socket that was connected elsewhere (e.g. by the
+     * TCP::Connector) to one of the I/O threads (round robin). It is read
+     * like an accepted client from then on: its data and its FIN go to
+     * onReceive (there is no SYN), and it is closed with closeClient.
+     * Thread-safe
+     * @param socket The connected socket
+     * @param address The address of the other end ("address:port")
+     */
+    void readFrom(int socket, std::string address);
+
+    /**
+     * @brief Hold back clients whose data can't be taken yet. The server never
+     * reads more from a client than receiveSpace returns for its socket. At 0,
+     * the socket is not read (so the client is held back by TCP flow control)
+     * until receiveSpace returns more, which is checked every retryInterval.
+     * Call before startListening
+     * @param receiveSpace Returns the number of bytes that onReceive can take
+     * from the given socket right now
+     * @param retryInterval The interval (in us) with which held back clients
+     * are checked
+     */
+    void setReceiveSpace(std::function<size_t(int socket)> receiveSpace,
+                         int retryInterval);
+
     /**
      * @brief Wrapper for send()
      * @param toSocket Send data to given socket
@@ -67,13 +122,43 @@ namespace TCP {
       shutdown(socket, SHUT_WR);
     };
 
+    /**
+     * @brief Close the socket of a client. The I/O thread that accepted the
+     * client closes it once it stopped reading from it (an armed io_uring
+     * receive is cancelled first), so that its socket number can't be reused
+     * while that thread still knows the old client. Thread-safe
+     * @param socket The socket of the client
+     */
+    void closeClient(int socket);
+
 
   private:
     std::string bindAddr;
     int localPort;
-    int localSocket;
+    std::vector<int> listenSockets{}; // One per I/O thread
     int inetFamily = 0; //Valid values are AF_INET or AF_INET6
     const enum logLevels logLevel;
+    int numIOThreads;
+    std::vector<int> ioCores;
+    int backlog;
+    bool incomingCPU;
+    std::function<size_t(int socket)> receiveSpace = [](int) {
+      return (size_t) BUF_SIZE;
+    };
+    std::chrono::microseconds retryInterval{1000};
+
+    // The sockets that closeClient and readFrom handed to an I/O thread
+    struct PendingSockets {
+      std::mutex lock;
+      std::vector<int> closes{};
+      std::vector<std::pair<int, std::string>> reads{};
+      int wakeFd = -1; // eventfd that wakes the I/O thread up
+    };
+    std::vector<std::unique_ptr<PendingSockets>> pendingSockets{};
+    std::atomic<unsigned int> nextReader = 0;
+    // The I/O thread (index) that accepted each open client socket
+    std::unordered_map<int, int> owners{};
+    std::mutex ownersLock;
 
     /**
      * @brief If log level set by user is equal or more verbose than the log
@@ -85,9 +170,17 @@ namespace TCP {
 
     /** Opens a socket listening on bindAddr:localPort
      *
-     * @return valid localSocket that the proxy is listening on
+     * @param core The core that the I/O thread of this socket is pinned to
+     * (-1 if not pinned)
+     * @return valid socket that the proxy is listening on
      */
-    int openSocket();
+    int openSocket(int core);
+
+    /**
+     * @brief Throw the error matching the return value of openSocket
+     * @param socket The return value of openSocket
+     */
+    static void throwOnError(int socket);
 
     /**
      * @brief check if the given IP address is IPv4 or IPv6
@@ -97,23 +190,102 @@ namespace TCP {
     int checkIPVersion(const std::string &);
 
     /**
-     * @brief Handles the given client (called from serverLoop)
-     * @param clientSocket The socket where the client connected
-     * @param clientAddress The address of the client
+     * @brief Entry point of an I/O thread. Accepts new clients on its own
+     * listening socket (and handles them from then on) and reads from its
+     * clients, with
+     * io_uring if TCPWrapper was built with TCP_IO_URING (and the kernel
+     * supports it), else with epoll
+     * @param threadIndex The index of this I/O thread
+     */
+    void ioLoop(int threadIndex);
+
+    /**
+     * @brief Edge-triggered epoll event loop of an I/O thread
+     * @param threadIndex The index of this I/O thread
      */
-    void handleClient(int clientSocket, std::string clientAddress);
+    void epollLoop(int threadIndex);
 
     /**
-     * @brief Main loop of the server. Spawns of child processes for each new
-     * client
+     * @brief io_uring event loop of an I/O thread: multishot accept and
+     * multishot receive into a ring of provided buffers
+     * Only returns if io_uring could not be set up
+     * @param threadIndex The index of this I/O thread
      */
-    [[noreturn]] void serverLoop();
+    void uringLoop(int threadIndex);
 
     /**
-     * @brief Receive data from the given socket and call serverOnReceive
+     * @brief Announce a newly accepted client (closes it if it is refused)
+     * @param threadIndex The index of the accepting I/O thread
+     * @param clientSocket The socket of the new client
+     * @param clientAddress The address of the new client
+     * @param address Set to the address of the client as a string
+     * @return false if the client was refused
+     */
+    bool addClient(int threadIndex, int clientSocket,
+                   struct sockaddr *clientAddress, std::string &address);
+
+    /**
+     * @brief Forget the owner of a client socket and close it. Only called by
+     * its owning I/O thread, once nothing reads from it anymore
+     * @param socket The socket of the client
+     */
+    void releaseClient(int socket);
+
+    /**
+     * @brief Open the eventfds of the I/O threads and start them
+     */
+    void startIOThreads();
+
+    /**
+     * @brief Hand a socket to the given I/O thread and wake it up
+     * @param threadIndex The index of the I/O thread
+     * @param socket The socket
+     * @param address The address of the socket to read from it, or empty to
+     * close it
+     */
+    void handOver(int threadIndex, int socket, std::string address);
+
+    /**
+     * @brief Take the sockets that closeClient and readFrom handed to an I/O
+     * thread. The sockets to read from are watched before the closes are
+     * handled, since readFrom may be followed by closeClient right away
+     * @param threadIndex The index of the calling I/O thread
+     * @param closes Set to the sockets to close
+     * @param reads Set to the sockets to read from (with their addresses)
+     */
+    void takePending(int threadIndex, std::vector<int> &closes,
+                     std::vector<std::pair<int, std::string>> &reads);
+
+    /**
+     * @brief Add a client socket to the given epoll instance
+     * @param epollFd The epoll instance of the calling I/O thread
+     * @param clientSocket The socket of the client
+     * @param address The address of the client
+     * @param clients The clients of the calling I/O thread
+     */
+    void watchClient(int epollFd, int clientSocket, std::string address,
+                     std::unordered_map<int, std::string> &clients);
+
+    /**
+     * @brief Accept all pending clients and add them to the given epoll
+     * instance
+     * @param threadIndex The index of the calling I/O thread
+     * @param epollFd The epoll instance of the calling I/O thread
+     * @param clients The clients of the calling I/O thread (socket to
+     * client address)
+     */
+    void acceptClients(int threadIndex, int epollFd,
+                       std::unordered_map<int, std::string> &clients);
+
+    /**
+     * @brief Read all available data from the given socket and call onReceive
      * @param socket The socket to read the data from
+     * @param clientAddress The address of the client
+     * @param isPaused Set to true if reading stopped because onReceive can't
+     * take more data (see setReceiveSpace)
+     * @return false if the client closed its side of the connection
      */
-    void receiveData(int socket, std::string &clientAddress);
+    bool receiveData(int socket, std::string &clientAddress, bool &isPaused);
 
     /**
      * @brief Returns a string of the form "address:port"
@@ -0,0 +1,160 @@
+//
+// Created by Rut Vora
+//
+
+// Connection-scaling benchmark for TCP::Server. For 10 to 10k clients, it
+// measures how long the server takes to accept all of them, to receive a
+// message from each, and to see all of them close, along with the number of
+// threads the process needs for that.
+// Usage: ./benchmark [I/O threads] [cores...]
+// 10k clients need an open file limit of a bit over 20k (ulimit -Hn)
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "../../Server.h"
+
+#define PORT 18000
+#define MESSAGE_SIZE 1024
+
+std::atomic<size_t> numConnected{0};
+std::atomic<size_t> numClosed{0};
+std::atomic<size_t> bytesReceived{0};
+
+static bool onReceive(int socket, std::string &, uint8_t *, size_t length,
+                      connectionStatus connStatus) {
+  switch (connStatus) {
+    case SYN:
+      numConnected++;
+      break;
+    case ONGOING:
+      bytesReceived += length;
+      break;
+    case FIN:
+      close(socket);
+      numClosed++;
+      break;
+  }
+  return true;
+}
+
+static std::string threadCount() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.rfind("Threads:", 0) == 0) {
+      return line.substr(line.find_first_not_of(" \t", 8));
+    }
+  }
+  return "?";
+}
+
+static double millisSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+template<typename F>
+static bool waitFor(F &&condition) {
+  auto start = std::chrono::steady_clock::now();
+  while (!condition()) {
+    if (millisSince(start) > 30000) return false;
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  return true;
+}
+
+static int connectClient(const struct addrinfo *addr) {
+  int sock = socket(addr->ai_family, SOCK_STREAM, 0);
+  if (sock < 0) return -1;
+  // The listen backlog is small, so retry while the server catches up
+  for (int attempt = 0; attempt < 1000; attempt++) {
+    if (connect(sock, addr->ai_addr, addr->ai_addrlen) == 0) return sock;
+    if (errno != ECONNREFUSED && errno != EAGAIN) break;
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  close(sock);
+  return -1;
+}
+
+int main(int argc, char *argv[]) {
+  int ioThreads = argc > 1 ? atoi(argv[1]) : 1;
+  std::vector<int> cores{};
+  for (int i = 2; i < argc; i++) cores.push_back(atoi(argv[i]));
+
+  // Every client needs a socket on both sides
+  struct rlimit limit{32768, 32768};
+  if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  TCP::Server server{"127.0.0.1", PORT, onReceive, ERROR, ioThreads, cores};
+  server.startListening();
+
+  struct addrinfo hints{}, *addr;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo("127.0.0.1", std::to_string(PORT).c_str(), &hints, &addr)
+      != 0) {
+    std::cerr << "Could not resolve the server address" << std::endl;
+    return -1;
+  }
+
+  uint8_t message[MESSAGE_SIZE];
+  memset(message, 'x', MESSAGE_SIZE);
+  std::cout << "I/O threads: " << ioThreads << "\n";
+  std::cout << "clients\taccept(ms)\treceive(ms)\tclose(ms)\tthreads\n";
+  for (size_t numClients: {10, 100, 1000, 10000}) {
+    if (2 * numClients + 64 > limit.rlim_cur) {
+      std::cout << numClients << "\tskipped (open file limit is "
+                << limit.rlim_cur << ")" << std::endl;
+      continue;
+    }
+    numConnected = numClosed = bytesReceived = 0;
+    std::vector<int> clients{};
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < numClients; i++) {
+      // Don't overflow the listen backlog (dropped SYNs are only retried
+      // after a second, which would hide the time the server takes)
+      while (i - numConnected >= BACKLOG / 2) std::this_thread::yield();
+      int sock = connectClient(addr);
+      if (sock < 0) {
+        std::cerr << "Could not connect client " << i << std::endl;
+        return -1;
+      }
+      clients.push_back(sock);
+    }
+    bool ok = waitFor([&] { return numConnected == numClients; });
+    auto acceptTime = millisSince(start);
+    auto threads = threadCount();
+
+    start = std::chrono::steady_clock::now();
+    for (auto sock: clients) send(sock, message, MESSAGE_SIZE, 0);
+    ok &= waitFor([&] {
+      return bytesReceived == numClients * MESSAGE_SIZE;
+    });
+    auto receiveTime = millisSince(start);
+
+    start = std::chrono::steady_clock::now();
+    for (auto sock: clients) close(sock);
+    ok &= waitFor([&] { return numClosed == numClients; });
+    auto closeTime = millisSince(start);
+
+    std::cout << numClients << "\t" << acceptTime << "\t" << receiveTime
+              << "\t" << closeTime << "\t" << threads
+              << (ok ? "" : "\t(timed out)") << std::endl;
+  }
+  freeaddrinfo(addr);
+  _exit(0);
+}
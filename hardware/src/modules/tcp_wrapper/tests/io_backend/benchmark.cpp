@@ -0,0 +1,154 @@
+//
+// Created by Rut Vora
+//
+
+// Compares the socket I/O backends of the TCP wrapper (benchmark_epoll:
+// epoll and send(), benchmark_uring: io_uring). Moves 1 GB through
+// TCP::Server (ingress) and 1 GB through a non-blocking TCP::SendBatch
+// (egress, as the drain workers use it) over loopback and reports the CPU
+// time the I/O thread spent per Gbps.
+// `make syscalls` runs both under strace for the system calls per GB.
+// Usage: ./benchmark_epoll [connections]
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../../Server.h"
+#include "../../SendBatch.h"
+
+#define PORT 18001
+#define TOTAL_BYTES (1UL << 30)
+#define CHUNK_SIZE 65536
+
+std::atomic<size_t> bytesReceived{0};
+std::atomic<double> ioThreadCPU{0};
+std::atomic<bool> isDone{false};
+
+static double threadCPU() {
+  struct timespec time{};
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+static bool onReceive(int socket, std::string &, uint8_t *, size_t length,
+                      connectionStatus connStatus) {
+  static thread_local double startCPU = -1;
+  if (connStatus == FIN) {
+    close(socket);
+  } else if (connStatus == ONGOING) {
+    if (startCPU < 0) startCPU = threadCPU();
+    if (bytesReceived.fetch_add(length) + length >= TOTAL_BYTES) {
+      ioThreadCPU = threadCPU() - startCPU;
+      isDone = true;
+    }
+  }
+  return true;
+}
+
+static int connectTo(const struct addrinfo *addr) {
+  int sock = socket(addr->ai_family, SOCK_STREAM, 0);
+  if (sock < 0 || connect(sock, addr->ai_addr, addr->ai_addrlen) < 0) {
+    return -1;
+  }
+  return sock;
+}
+
+static void report(const std::string &direction, double seconds,
+                   double cpuSeconds) {
+  auto gigabits = TOTAL_BYTES * 8 / 1e9;
+  std::cout << direction << "\t" << gigabits / seconds << " Gbps\t"
+            << cpuSeconds << " s CPU\t" << cpuSeconds / gigabits
+            << " cores per Gbps" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  int numConnections = argc > 1 ? atoi(argv[1]) : 8;
+
+  TCP::Server server{"127.0.0.1", PORT, onReceive, WARNING};
+  server.startListening();
+
+  struct addrinfo hints{}, *addr;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  getaddrinfo("127.0.0.1", std::to_string(PORT).c_str(), &hints, &addr);
+
+  // Ingress: the clients blast data at the server
+  std::vector<int> clients{};
+  for (int i = 0; i < numConnections; i++) {
+    auto sock = connectTo(addr);
+    if (sock < 0) {
+      std::cerr << "Could not connect to the server" << std::endl;
+      return -1;
+    }
+    clients.push_back(sock);
+  }
+  std::vector<uint8_t> chunk(CHUNK_SIZE, 'x');
+  auto start = std::chrono::steady_clock::now();
+  std::thread sender([&]() {
+    while (!isDone) {
+      for (auto sock: clients) send(sock, chunk.data(), CHUNK_SIZE, 0);
+    }
+  });
+  while (!isDone) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  report("ingress", secondsSince(start), ioThreadCPU);
+  sender.join();
+  for (auto sock: clients) close(sock);
+
+  // Egress: a batch of non-blocking sends per pass, from registered memory,
+  // to sockets that a sink thread drains
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int optVal = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(optVal));
+  auto sinkAddr = *reinterpret_cast<struct sockaddr_in *>(addr->ai_addr);
+  sinkAddr.sin_port = htons(PORT + 1);
+  bind(listener, (struct sockaddr *) &sinkAddr, sizeof(sinkAddr));
+  listen(listener, numConnections);
+  std::vector<int> senders{}, sinks{};
+  for (int i = 0; i < numConnections; i++) {
+    senders.push_back(socket(AF_INET, SOCK_STREAM, 0));
+    connect(senders.back(), (struct sockaddr *) &sinkAddr, sizeof(sinkAddr));
+    sinks.push_back(accept(listener, nullptr, nullptr));
+  }
+  std::atomic<bool> isSent{false};
+  std::thread sink([&]() {
+    std::vector<uint8_t> buffer(CHUNK_SIZE);
+    while (!isSent) {
+      for (auto sock: sinks) recv(sock, buffer.data(), CHUNK_SIZE, MSG_DONTWAIT);
+    }
+  });
+
+  std::vector<uint8_t> memory(2 * CHUNK_SIZE * numConnections, 'y');
+  TCP::SendBatch sendBatch{256, WARNING, true};
+  sendBatch.registerMemory(memory.data(), memory.size());
+  size_t bytesSent = 0;
+  start = std::chrono::steady_clock::now();
+  auto startCPU = threadCPU();
+  auto onSent = [&bytesSent](void *, ssize_t sent) {
+    if (sent > 0) bytesSent += sent;
+  };
+  while (bytesSent < TOTAL_BYTES) {
+    for (int i = 0; i < numConnections; i++) {
+      // Like a queue: one send per socket and pass, whatever fits is sent
+      auto region = memory.data() + 2 * CHUNK_SIZE * i;
+      sendBatch.send(senders[i], region, 2 * CHUNK_SIZE, nullptr);
+    }
+    sendBatch.flush(onSent);
+  }
+  report("egress", secondsSince(start), threadCPU() - startCPU);
+  isSent = true;
+  sink.join();
+
+  freeaddrinfo(addr);
+  _exit(0);
+}
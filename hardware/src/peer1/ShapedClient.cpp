@@ -8,15 +8,30 @@
 ShapedClient::ShapedClient(config::Peer1Config &peer1Config) {
   this->appName = peer1Config.appName;
   this->logLevel = peer1Config.logLevel;
+  this->hugePageSize = peer1Config.hugePageSize;
+  // The real-time shaper must not take page faults on the SHM
+  this->prefaultSHM = peer1Config.prefaultSHM
+                      || peer1Config.shapedClient.realTimePriority > 0;
+  this->fused = peer1Config.fused;
   unshapedProcessLoopInterval =
       peer1Config.unshapedServer.checkQueuesInterval;
   dummyStream = controlStream = nullptr;
-  size_t controlMessageQueueSize =
-      4 * peer1Config.maxClients * sizeof(ControlMessage);
-  controlMessageQueue =
-      reinterpret_cast<LamportQueue *>(malloc(sizeof(LamportQueue)
-                                              + controlMessageQueueSize));
-  new(controlMessageQueue) LamportQueue{INT_MAX, controlMessageQueueSize};
+  numMuxStreams = std::max(peer1Config.shapedClient.multiplexStreams, 0);
+  // Only multiplexed flows can be resumed: a flow's data stream does not
+  // outlive the connection
+  if (numMuxStreams > 0) {
+    resumeTimeout =
+        std::chrono::milliseconds(peer1Config.shapedClient.resumeTimeout);
+  }
+  // Multiplexed flows don't need streams of their own
+  numWarmStreams = numMuxStreams > 0
+                   ? 0 : std::max(peer1Config.shapedClient.warmStreams, 0);
+  // Every client has at most a SYN and a FIN in flight (plus the control
+  // and dummy stream announcements)
+  controlEncoder = new ControlFrameEncoder(2 * peer1Config.maxClients + 2);
+  controlDecoder = new ControlFrameDecoder(
+      4 * peer1Config.maxClients * MAX_CONTROL_RECORD_SIZE);
+  sendQueue = new SendQueue(2 * (peer1Config.maxClients + 2));
   queuesToStream =
       new std::unordered_map<QueuePair,
           MsQuicStream *, QueuePairHash>(peer1Config.maxClients);
@@ -24,15 +39,13 @@ ShapedClient::ShapedClient(config::Peer1Config &peer1Config) {
       new std::unordered_map<MsQuicStream *, QueuePair>(peer1Config.maxClients);
   streamToID = new std::unordered_map<MsQuicStream *, QUIC_UINT62>(
       peer1Config.maxClients);
-  pendingSignal =
-      new std::unordered_map<uint64_t, connectionStatus>(
-          peer1Config.maxClients);
 
   auto config = peer1Config.shapedClient;
   noiseGenerator = new NoiseGenerator{config.noiseMultiplier,
                                       config.sensitivity,
                                       config.maxDecisionSize,
                                       config.minDecisionSize};
+  trafficClasses = TrafficClasses{peer1Config.trafficClasses};
   // Connect to the other middlebox
 
   auto onResponseFunc = [this](auto &&PH1, auto &&PH2, auto &&PH3) {
@@ -48,51 +61,81 @@ ShapedClient::ShapedClient(config::Peer1Config &peer1Config) {
                                   onResponseFunc,
                                   true,
                                   logLevel,
-                                  config.idleTimeout};
+                                  config.idleTimeout,
+                                  config.resumptionTicketPath,
+                                  [this]() { invalidateStreams(); },
+                                  [this]() { rebuildStreams(); }};
 
   // We map a pair of queues over the shared memory region to every stream
   // CAUTION: we assume the shared queues are already initialized in unshaped process
-  initialiseSHM(peer1Config.maxClients, peer1Config.queueSize);
+  initialiseSHM(peer1Config.maxClients, peer1Config.queueSize,
+                peer1Config.segmentSize, peer1Config.slabPoolSize);
 
   // Start the control stream
   startControlStream();
 
   // Start the dummy stream
   startDummyStream();
-  std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-
-  std::thread senderLoopThread(helpers::shaperLoop, queuesToStream,
-                               noiseGenerator,
-                               [this](auto &&PH1) -> PreparedBuffer {
-                                 return prepareDummy(std::forward<decltype(PH1)>
-                                                         (PH1));
-                               },
-                               [this](auto &&PH1) ->
-                                   std::vector<PreparedBuffer> {
-                                 return prepareData(std::forward<decltype(PH1)>
-                                                        (PH1));
-                               },
-                               [this](MsQuicStream *stream, uint8_t *buffer,
-                                      size_t length) {
-                                 shapedClient->send(stream, buffer, length);
-                               },
-                               config.sendingLoopInterval,
-                               config.DPCreditorLoopInterval,
-                               config.strategy, std::ref(mapLock),
-                               config.shaperCores);
+
+  // Start the streams the flows are multiplexed on
+  startMuxStreams();
+
+  // The flows of the previous process (if restarted)
+  resumeFlows();
+
+  // Data streams are bound to queues on the first SYN. Open a few ahead
+  // of time so that new clients don't wait for them
+  mapLock.lock();
+  fillWarmStreams();
+  mapLock.unlock();
+
+  // One buffer per queue pair, and the dummy
+  auto maxBuffers = queuesToStream->size() + 1;
+  std::thread senderLoopThread([this, config, maxBuffers]() {
+    helpers::runShaper(*this, noiseGenerator, config.sendingLoopInterval,
+                       config.DPCreditorLoopInterval, config.strategy,
+                       maxBuffers, config.shaperCores,
+                       config.realTimePriority, config.pipelined);
+  });
   senderLoopThread.detach();
+  for (uint32_t i = 1; i < trafficClasses.size(); i++) {
+    auto trafficClass = peer1Config.trafficClasses[i - 1];
+    auto classNoiseGenerator =
+        new NoiseGenerator{trafficClass.noiseMultiplier,
+                           trafficClass.sensitivity,
+                           trafficClass.maxDecisionSize,
+                           trafficClass.minDecisionSize};
+    std::thread classLoopThread(
+        [this, config, trafficClass, classNoiseGenerator, maxBuffers, i]() {
+          helpers::runShaper(*this, classNoiseGenerator,
+                             trafficClass.sendingLoopInterval,
+                             trafficClass.DPCreditorLoopInterval,
+                             trafficClass.strategy, maxBuffers,
+                             trafficClass.shaperCores,
+                             config.realTimePriority, config.pipelined, i,
+                             trafficClasses.name(i));
+        });
+    classLoopThread.detach();
+  }
 
+  // In fused mode, the unshaped half hands the SYNs over directly from now on.
+  // The loop still handles the ones it queued before, and retries filling
+  // the warm streams
+  if (fused) {
+    sigInfo->setHandler(SignalInfo::toShaped,
+                        [](void *context, SignalInfo::queueInfo &info) {
+                          static_cast<ShapedClient *>(context)
+                              ->receivedSignal(info);
+                        }, this);
+  }
   std::thread updateQueueStatus([this]() { getUpdatedConnectionStatus(); });
   updateQueueStatus.detach();
 }
 
 QueuePair ShapedClient::findQueuesByID(uint64_t queueID) {
-  for (const auto &[queues, stream]: *queuesToStream) {
-    if (queues.toShaped->ID == queueID) {
-      return queues;
-    }
-  }
-  return {nullptr, nullptr};
+  auto queuesIter = flowToQueues.find(queueID);
+  if (queuesIter == flowToQueues.end()) return {nullptr, nullptr};
+  return queuesIter->second;
 }
 
 MsQuicStream *ShapedClient::findStreamByID(QUIC_UINT62 ID) {
@@ -114,172 +157,528 @@ void ShapedClient::updateConnectionStatus(uint64_t ID,
 
 [[noreturn]] void ShapedClient::getUpdatedConnectionStatus() {
   struct SignalInfo::queueInfo queueInfo{};
-  auto sleepUntil = std::chrono::steady_clock::now();
+  uint32_t seen = 0;
+  // The SYNs the previous process did not get to (see restoreFlows)
+  mapLock.lock();
+  controlLock.lock();
+  for (auto &signal: pendingSignals) {
+    handleSignal(signal);
+  }
+  pendingSignals.clear();
+  flushControlMessages(controlStream);
+  controlLock.unlock();
+  mapLock.unlock();
   while (true) {
-    sleepUntil = std::chrono::steady_clock::now() +
-                 std::chrono::milliseconds(1);
+    // Wakes up at least every WARM_STREAMS_RETRY to retry filling the warm
+    // streams, which may have failed
+    sigInfo->waitForSignal(SignalInfo::toShaped, seen,
+                           std::chrono::milliseconds(WARM_STREAMS_RETRY));
 //    std::scoped_lock lock(readLock);
+    mapLock.lock();
+    controlLock.lock();
     while (sigInfo->dequeue(SignalInfo::toShaped, queueInfo)) {
-      auto queues = findQueuesByID(queueInfo.queueID);
-      if (queueInfo.connStatus == SYN) {
-        auto *message =
-            reinterpret_cast<struct ControlMessage *>(malloc(
-                sizeof(struct ControlMessage)));
-        auto *stream = (*queuesToStream)[queues];
-        message->streamID = (*streamToID)[stream];
+      handleSignal(queueInfo);
+    }
+    // All SYNs of this round go out in one frame
+    flushControlMessages(controlStream);
+    controlLock.unlock();
+    expireSuspendedFlows();
+    // Replace the warm streams that were bound above
+    if (controlStream != nullptr) fillWarmStreams();
+    mapLock.unlock();
+  }
+}
+
+void ShapedClient::receivedSignal(SignalInfo::queueInfo &queueInfo) {
+  mapLock.lock();
+  controlLock.lock();
+  handleSignal(queueInfo);
+  flushControlMessages(controlStream);
+  controlLock.unlock();
+  if (controlStream != nullptr) fillWarmStreams();
+  mapLock.unlock();
+}
+
+void ShapedClient::handleSignal(SignalInfo::queueInfo &queueInfo) {
+  if (queueInfo.connStatus != SYN) return;
+  auto queues = findQueuesByID(queueInfo.queueID);
+  // Before its stream is bound, so no shaper loop sends its data yet
+  trafficClasses.classify(queues);
+  auto *stream = controlStream == nullptr ? nullptr : bindStream(queues);
+  if (stream == nullptr) {
+    // Not connected to the other middlebox. Refuse the flow
+    log(WARNING, "Not connected to peer2, terminating the flow on "
+                 "queue (toShaped) " + std::to_string(queueInfo.queueID));
+    {
+      std::scoped_lock flowsLock(flowLock);
+      staleFlows.insert(queues.toShaped->ID);
+    }
+    ConnectionState::set(queues, ConnectionState::FROM_SHAPED_FIN);
+    return;
+  }
+  {
+    std::scoped_lock flowsLock(flowLock);
+    staleFlows.erase(queues.toShaped->ID);
+    activeFlows.insert(queues.toShaped->ID);
+  }
+  // Counted from the start of the flow (see resumeFlows)
+  queues.toShaped->shapedBytes = queues.fromShaped->shapedBytes = 0;
+  ConnectionState::open(queues);
+  if (numMuxStreams > 0) {
 #ifdef DEBUGGING
-        log(DEBUG,
-            "Sending SYN on stream " + std::to_string(message->streamID) +
-            " mapped to queues {" + std::to_string(queues.fromShaped->ID) +
-            "," + std::to_string(queues.toShaped->ID) + "}");
+    log(DEBUG, "Sending SYN for flow " + std::to_string(queues.toShaped->ID) +
+               " multiplexed on stream " + std::to_string(stream->ID()));
 #endif
-        message->streamType = Data;
-        message->connStatus = SYN;
-        std::strcpy(message->addrPair.clientAddress,
-                    queues.toShaped->addrPair.clientAddress);
-        std::strcpy(message->addrPair.clientPort,
-                    queues.toShaped->addrPair.clientPort);
-        std::strcpy(message->addrPair.serverAddress,
-                    queues.toShaped->addrPair.serverAddress);
-        std::strcpy(message->addrPair.serverPort,
-                    queues.toShaped->addrPair.serverPort);
-        shapedClient->send(controlStream,
-                           reinterpret_cast<uint8_t *>(message),
-                           sizeof(*message));
-      } else if (queueInfo.connStatus == FIN) {
+    controlEncoder->addFlowSYN(queues.toShaped->ID,
+                               queues.toShaped->addrPair);
+  } else {
+    auto streamID = (*streamToID)[stream];
 #ifdef DEBUGGING
-        log(DEBUG, "Got a FIN signal " + std::to_string(queueInfo.queueID));
+    log(DEBUG,
+        "Sending SYN on stream " + std::to_string(streamID) +
+        " mapped to queues {" + std::to_string(queues.fromShaped->ID) +
+        "," + std::to_string(queues.toShaped->ID) + "}");
 #endif
-        (*pendingSignal)[queueInfo.queueID] = FIN;
+    controlEncoder->addSYN(streamID, queues.toShaped->addrPair);
+  }
+}
+
+void ShapedClient::invalidateStreams() {
+  mapLock.lock();
+  if (controlStream == nullptr) {
+    // Already invalidated
+    mapLock.unlock();
+    return;
+  }
+  log(WARNING, "Connection to peer2 dropped, unmapping all streams");
+  controlStream = dummyStream = nullptr;
+  for (auto &[queues, stream]: *queuesToStream) {
+    stream = nullptr;
+  }
+  streamToQueues->clear();
+  streamToID->clear();
+  warmStreams.clear();
+  muxStreams.clear();
+  muxDemuxers.clear();
+  // Drop any partially received control frame of the old connection
+  controlDecoder->clear();
+
+  // The other middlebox lost the state of the flows that were open. Ask
+  // the unshaped side to terminate them, unless they can be resumed
+  paused = false;
+  {
+    std::scoped_lock flowsLock(flowLock);
+    if (resumeTimeout.count() > 0) {
+      suspendedFlows.insert(activeFlows.begin(), activeFlows.end());
+      resumeDeadline = std::chrono::steady_clock::now() + resumeTimeout;
+    } else {
+      for (auto queueID: activeFlows) {
+        auto queues = findQueuesByID(queueID);
+        if (queues.toShaped == nullptr) continue;
+        staleFlows.insert(queueID);
+        ConnectionState::set(queues, ConnectionState::FROM_SHAPED_FIN);
       }
     }
-    std::this_thread::sleep_until(sleepUntil);
+    activeFlows.clear();
   }
+  mapLock.unlock();
 }
 
-inline void ShapedClient::initialiseSHM(int maxClients, size_t queueSize) {
-  auto shmAddr = helpers::initialiseSHM(maxClients, appName, queueSize, true);
+void ShapedClient::rebuildStreams() {
+  // Start the control stream
+  startControlStream();
+
+  // Start the dummy stream
+  startDummyStream();
 
-  // The beginning of the SHM contains the signalStruct struct
-  sigInfo = reinterpret_cast<class SignalInfo *>(shmAddr);
+  // Start the streams the flows are multiplexed on
+  startMuxStreams();
 
-  // The rest of the SHM contains the queues
-  shmAddr += (sizeof(SignalInfo) + (2 * sizeof(LamportQueue)) +
-              (4 * maxClients * sizeof(SignalInfo::queueInfo)));
-  for (int i = 0; i < maxClients * 2 + 2; i += 2) {
-    auto queue1 =
-        (LamportQueue *) (shmAddr +
-                          (i * (sizeof(class LamportQueue) + queueSize)));
-    auto queue2 =
-        (LamportQueue *) (shmAddr +
-                          ((i + 1) * (sizeof(class LamportQueue) + queueSize)));
-    if (i > 0) {
-      MsQuicStream *stream = nullptr;
-      while (stream == nullptr) {
-        stream = shapedClient->startStream();
+  resumeFlows();
+
+  // Data streams are bound to queues again on the next SYN
+  mapLock.lock();
+  fillWarmStreams();
+  mapLock.unlock();
+  log(WARNING, "Reconnected to peer2, streams rebuilt");
+}
+
+void ShapedClient::restoreFlows() {
+  // Queued by the unshaped process while no shaped process was attached
+  std::unordered_set<uint64_t> pendingSYNs;
+  SignalInfo::queueInfo queueInfo{};
+  while (sigInfo->dequeue(SignalInfo::toShaped, queueInfo)) {
+    pendingSignals.push_back(queueInfo);
+    if (queueInfo.connStatus == SYN) pendingSYNs.insert(queueInfo.queueID);
+  }
+  size_t numSuspended = 0, numTerminated = 0;
+  for (const auto &[queueID, queues]: flowToQueues) {
+    auto state = ConnectionState::load(queues);
+    if (ConnectionState::phase(state) == ConnectionState::FREE
+        || ConnectionState::has(state, ConnectionState::SHAPED_RELEASED)
+        || pendingSYNs.contains(queueID)) {
+      continue;
+    }
+    // A flow still in SYN was never announced to the other middlebox
+    if (resumeTimeout.count() > 0
+        && ConnectionState::phase(state) != ConnectionState::SYN) {
+      suspendedFlows.insert(queueID);
+      numSuspended++;
+      continue;
+    }
+    staleFlows.insert(queueID);
+    ConnectionState::set(queues, ConnectionState::FROM_SHAPED_FIN);
+    numTerminated++;
+  }
+  resumeDeadline = std::chrono::steady_clock::now() + resumeTimeout;
+  log(WARNING, "Restarted: resuming " + std::to_string(numSuspended) +
+               " flows, terminating " + std::to_string(numTerminated));
+}
+
+void ShapedClient::resumeFlows() {
+  mapLock.lock();
+  controlLock.lock();
+  {
+    std::scoped_lock flowsLock(flowLock);
+    for (auto queueID: suspendedFlows) {
+      auto queues = findQueuesByID(queueID);
+      controlEncoder->addFlowResume(queueID, queues.toShaped->shapedBytes,
+                                    queues.fromShaped->shapedBytes);
+    }
+  }
+  flushControlMessages(controlStream);
+  controlLock.unlock();
+  mapLock.unlock();
+}
+
+void ShapedClient::applyResumeAnswers() {
+  if (resumeAnswers.empty()) return;
+  mapLock.lock();
+  {
+    std::scoped_lock flowsLock(flowLock);
+    for (const auto &[queueID, isResumed]: resumeAnswers) {
+      // May have expired meanwhile
+      if (suspendedFlows.erase(queueID) == 0) continue;
+      auto queues = findQueuesByID(queueID);
+      if (isResumed && bindStream(queues) != nullptr) {
+        activeFlows.insert(queueID);
+        continue;
       }
+      log(WARNING, "Peer2 could not resume the flow on queue (toShaped) " +
+                   std::to_string(queueID) + ", terminating it");
+      staleFlows.insert(queueID);
+      ConnectionState::set(queues, ConnectionState::FROM_SHAPED_FIN);
+    }
+  }
+  resumeAnswers.clear();
+  mapLock.unlock();
+}
 
-      // Data streams
-      (*queuesToStream)[{queue1, queue2}] = stream;
-      (*streamToQueues)[stream] = {queue1, queue2};
-      (*streamToID)[stream] = stream->ID();
+void ShapedClient::expireSuspendedFlows() {
+  std::scoped_lock flowsLock(flowLock);
+  if (suspendedFlows.empty()
+      || std::chrono::steady_clock::now() < resumeDeadline) {
+    return;
+  }
+  log(WARNING, std::to_string(suspendedFlows.size()) +
+               " flows were not resumed in time, terminating them");
+  for (auto queueID: suspendedFlows) {
+    staleFlows.insert(queueID);
+    ConnectionState::set(findQueuesByID(queueID),
+                         ConnectionState::FROM_SHAPED_FIN);
+  }
+  suspendedFlows.clear();
+}
+
+void ShapedClient::suspendForRestart() {
+  if (resumeTimeout.count() == 0) return;
+  log(WARNING, "Pausing the flows for the restart");
+  paused = true;
+  mapLock.lock_shared();
+  controlLock.lock();
+  controlEncoder->addPause();
+  flushControlMessages(controlStream);
+  controlLock.unlock();
+  mapLock.unlock_shared();
+  // The data either middlebox sent before arrives meanwhile
+  std::this_thread::sleep_for(std::chrono::milliseconds(RESTART_DRAIN_TIME));
+  shapedClient->shutdown();
+}
+
+void ShapedClient::fillWarmStreams() {
+  while (warmStreams.size() < numWarmStreams
+         && streamToQueues->size() + warmStreams.size() <
+            queuesToStream->size()) {
+    // Never wait for the connection here, as mapLock is held
+    auto stream = shapedClient->startStream(false);
+    if (stream == nullptr) return;
+    warmStreams.push_back(stream);
+  }
+}
+
+MsQuicStream *ShapedClient::bindStream(QueuePair queues) {
+  auto &stream = (*queuesToStream)[queues];
+  if (stream != nullptr) return stream;
+  if (numMuxStreams > 0) {
+    // Spread the flows over the multiplexed streams
+    if (muxStreams.empty()) return nullptr;
+    stream = muxStreams[queues.toShaped->ID % muxStreams.size()];
+    return stream;
+  }
+  if (!warmStreams.empty()) {
+    stream = warmStreams.front();
+    warmStreams.pop_front();
+  } else {
+    stream = shapedClient->startStream(false);
+    if (stream == nullptr) return nullptr;
+  }
+  (*streamToQueues)[stream] = queues;
+  (*streamToID)[stream] = stream->ID();
 #ifdef DEBUGGING
-      log(DEBUG, "Mapping stream " + std::to_string((*streamToID)[stream]) +
-                 " to queues {" + std::to_string(queue1->ID) + "," +
-                 std::to_string(queue2->ID) + "}");
+  log(DEBUG, "Mapping stream " + std::to_string((*streamToID)[stream]) +
+             " to queues {" + std::to_string(queues.fromShaped->ID) + "," +
+             std::to_string(queues.toShaped->ID) + "}");
 #endif
+  return stream;
+}
+
+inline bool ShapedClient::dropStaleFlow(QueuePair queues) {
+  std::scoped_lock flowsLock(flowLock);
+  auto toShaped = queues.toShaped;
+  if (staleFlows.find(toShaped->ID) == staleFlows.end()) return false;
+  auto state = ConnectionState::load(queues);
+  auto size = toShaped->size();
+  if (size > 0) {
+    auto buffer = reinterpret_cast<uint8_t *>(malloc(size));
+    if (buffer != nullptr) {
+      toShaped->pop(buffer, size);
+      free(buffer);
+    }
+  }
+  // The flow is done once the unshaped side has terminated it as well. Its
+  // FIN has nowhere to go
+  if (ConnectionState::has(state, ConnectionState::TO_SHAPED_FIN)) {
+    ConnectionState::set(queues, ConnectionState::TO_SHAPED_FIN_SENT
+                                 | ConnectionState::SHAPED_RELEASED);
+    staleFlows.erase(toShaped->ID);
+  }
+  return true;
+}
+
+void ShapedClient::flushControlMessages(MsQuicStream *stream) {
+  size_t length;
+  auto frame = controlEncoder->finish(length);
+  if (frame == nullptr) return;
+  // Dropped if not connected to the other middlebox
+  send(stream, frame, length);
+}
+
+void ShapedClient::send(MsQuicStream *stream, uint8_t *buffer,
+                        size_t length) {
+  sendQueue->send({stream, buffer, length}, [this](SendRequest &request) {
+    // The connection may have dropped since the buffer was queued
+    if (isLiveStream(request.stream)) {
+      shapedClient->send(request.stream, request.buffer, request.length);
+    } else {
+      free(request.buffer);
+    }
+  });
+}
+
+inline bool ShapedClient::isLiveStream(MsQuicStream *stream) {
+  return stream != nullptr
+         && (stream == dummyStream || stream == controlStream
+             || streamToQueues->find(stream) != streamToQueues->end()
+             || muxDemuxers.find(stream) != muxDemuxers.end());
+}
+
+inline void ShapedClient::initialiseSHM(int maxClients, size_t queueSize,
+                                        size_t segmentSize,
+                                        size_t slabPoolSize) {
+  // Waits for the unshaped process to initialise the SHM
+  auto layout = helpers::layoutSHM(maxClients, queueSize, segmentSize,
+                                   slabPoolSize);
+  auto shmAddr = helpers::attachSHM(appName, layout, prefaultSHM);
+
+  // The SHM header is followed by the signalStruct struct
+  sigInfo = reinterpret_cast<class SignalInfo *>(
+      shmAddr + layout.signalInfoOffset);
+
+  // The rest of the SHM contains the queues
+  for (int i = 0; i < maxClients * 2 + 2; i += 2) {
+    auto queue1 = (LamportQueue *) layout.queue(shmAddr, i);
+    auto queue2 = (LamportQueue *) layout.queue(shmAddr, i + 1);
+    if (i > 0) {
+      // Data streams are bound on the first SYN for these queues
+      (*queuesToStream)[{queue1, queue2}] = nullptr;
+      flowToQueues[queue2->ID] = {queue1, queue2};
     } else {
       dummyQueues = {queue1, queue2};
     }
   }
+  if (helpers::isReattached(shmAddr)) restoreFlows();
 }
 
-std::vector<PreparedBuffer> ShapedClient::prepareData(size_t dataSize) {
-  std::vector<PreparedBuffer> preparedBuffers{};
+void ShapedClient::prepareData(uint32_t trafficClass, size_t dataSize,
+                               PreparedBuffers &preparedBuffers) {
+  if (paused) return;
+  mapLock.lock_shared();
   // TODO: Add prioritisation
   for (const auto &[queues, stream]: *queuesToStream) {
     auto toShaped = queues.toShaped;
+    if (toShaped->trafficClass != trafficClass) continue;
+    if (dropStaleFlow(queues) || stream == nullptr) continue;
+    auto state = ConnectionState::load(queues);
     auto queueSize = toShaped->size();
     if (queueSize == 0) {
-      if ((*pendingSignal)[toShaped->ID] == FIN) {
-        // Send a termination control message
-        auto *message =
-            reinterpret_cast<struct ControlMessage *>(malloc(sizeof(struct
-                ControlMessage)));
-        message->streamID = (*streamToID)[stream];
+      if (ConnectionState::isPendingFIN(state, ConnectionState::TO_SHAPED_FIN,
+                                        ConnectionState::TO_SHAPED_FIN_SENT)) {
+        // Send a termination control message. The engines of the other
+        // traffic classes share the encoder
+        std::scoped_lock ctrlLock(controlLock);
+        auto idIter = streamToID->find(stream);
+        if (numMuxStreams > 0) {
 #ifdef DEBUGGING
-        log(DEBUG,
-            "Sending FIN on stream " + std::to_string(message->streamID) +
-            " mapped to queues " +
-            std::to_string(queues.fromShaped->ID) + "," +
-            std::to_string(queues.toShaped->ID) + "}"
-        );
+          log(DEBUG, "Sending FIN for flow " + std::to_string(toShaped->ID));
 #endif
-        message->streamType = Data;
-        message->connStatus = FIN;
-        shapedClient->send(controlStream,
-                           reinterpret_cast<uint8_t *>(message),
-                           sizeof(*message));
-        (*pendingSignal).erase(toShaped->ID);
+          controlEncoder->addFlowFIN(toShaped->ID);
+        } else if (idIter != streamToID->end()) {
+          auto streamID = idIter->second;
+#ifdef DEBUGGING
+          log(DEBUG,
+              "Sending FIN on stream " + std::to_string(streamID) +
+              " mapped to queues {" +
+              std::to_string(queues.fromShaped->ID) + "," +
+              std::to_string(queues.toShaped->ID) + "}"
+          );
+#endif
+          controlEncoder->addFIN(streamID);
+        }
+        ConnectionState::set(queues, ConnectionState::TO_SHAPED_FIN_SENT);
+        state |= ConnectionState::TO_SHAPED_FIN_SENT;
+      }
+      // Until the other middlebox sent its FIN as well, the flow is still
+      // terminated if the connection to it drops (see invalidateStreams)
+      if (ConnectionState::has(state, ConnectionState::SHAPED_DONE)
+          && ConnectionState::set(queues, ConnectionState::SHAPED_RELEASED)) {
+        std::scoped_lock flowsLock(flowLock);
+        activeFlows.erase(toShaped->ID);
       }
       continue;
     }
-    if (dataSize == 0) break;
+    if (dataSize == 0 || preparedBuffers.full()) break;
     auto sizeToSend = std::min(dataSize, queueSize);
-    auto buffer = reinterpret_cast<uint8_t *>(malloc(sizeToSend));
+    // Multiplexed data is framed with the ID of its flow
+    auto headerSize =
+        numMuxStreams > 0 ? flowHeaderSize(toShaped->ID, sizeToSend) : 0;
+    auto buffer =
+        reinterpret_cast<uint8_t *>(malloc(headerSize + sizeToSend));
     if (buffer == nullptr) continue;
-    queues.toShaped->pop(buffer, sizeToSend);
-    preparedBuffers.push_back({stream, buffer, sizeToSend});
+    if (headerSize > 0) putFlowHeader(buffer, toShaped->ID, sizeToSend);
+    // Counted before they leave the queue: if this process dies in between,
+    // the flow can't be resumed
+    toShaped->shapedBytes += sizeToSend;
+    queues.toShaped->pop(buffer + headerSize, sizeToSend);
+    preparedBuffers.push({stream, buffer, headerSize + sizeToSend});
     dataSize -= sizeToSend;
   }
-  return preparedBuffers;
+  // All FINs of this tick go out in one frame
+  controlLock.lock();
+  flushControlMessages(controlStream);
+  controlLock.unlock();
+  mapLock.unlock_shared();
 }
 
 PreparedBuffer ShapedClient::prepareDummy(size_t dummySize) {
+  // Not connected to the other middlebox
+  if (dummyStream == nullptr) return {nullptr, nullptr, 0};
   auto buffer = reinterpret_cast<uint8_t *>(malloc(dummySize));
   memset(buffer, 0, dummySize);
   return {dummyStream, buffer, dummySize};
 }
 
-void ShapedClient::handleControlMessages(MsQuicStream *ctrlStream,
+bool ShapedClient::handleControlMessages(MsQuicStream *ctrlStream,
                                          uint8_t *buffer,
                                          size_t length) {
   (void) (ctrlStream);
-  auto ctrlMsgSize = sizeof(ControlMessage);
-  controlMessageQueue->push(buffer, length);
-  auto ctrlMsg = reinterpret_cast<ControlMessage *>(malloc(ctrlMsgSize));
-  while (controlMessageQueue->pop((uint8_t *) ctrlMsg, ctrlMsgSize) != -1) {
-    if (ctrlMsg->connStatus == FIN) {
-      auto dataStream = findStreamByID(ctrlMsg->streamID);
-      auto &queues = (*streamToQueues)[dataStream];
-      queues.fromShaped->markedForDeletion = true;
-      updateConnectionStatus(queues.fromShaped->ID, FIN);
+  controlDecoder->push(buffer, length);
+  ControlEvent ctrlMsg;
+  while (controlDecoder->next(ctrlMsg)) {
+    if (ctrlMsg.action == ControlEvent::PAUSE) {
+      log(WARNING, "Peer2 is restarting, pausing the flows");
+      paused = true;
+      continue;
+    }
+    if (ctrlMsg.action != ControlEvent::NO_ACTION) {
+      // Applied once mapLock can be taken exclusively
+      resumeAnswers.emplace_back(ctrlMsg.flowID,
+                                 ctrlMsg.action == ControlEvent::RESUME);
+      continue;
+    }
+    if (ctrlMsg.connStatus != FIN) continue;
+    QueuePair queues{nullptr, nullptr};
+    if (ctrlMsg.streamType == Multiplexed) {
+      queues = findQueuesByID(ctrlMsg.flowID);
+    } else if (ctrlMsg.streamType == Data) {
+      auto queuesIter = streamToQueues->find(findStreamByID(ctrlMsg.streamID));
+      if (queuesIter != streamToQueues->end()) queues = queuesIter->second;
+    }
+    if (queues.fromShaped != nullptr) {
+      // Picked up by the unshaped process once it sent the data before it
+      ConnectionState::set(queues, ConnectionState::FROM_SHAPED_FIN);
 #ifdef DEBUGGING
-      log(DEBUG, "Received FIN from stream " +
-                 std::to_string(ctrlMsg->streamID) + ", marking (fromShaped)"
-                 + std::to_string(queues.fromShaped->ID) + " for deletion");
+      log(DEBUG, "Received FIN for (toShaped) " +
+                 std::to_string(queues.toShaped->ID) + ", closing (fromShaped)"
+                 + std::to_string(queues.fromShaped->ID));
 #endif
     }
   }
+  if (controlDecoder->failed()) {
+    // The frames that follow can't be told apart anymore
+    log(ERROR, "Received a malformed control frame (or one of an "
+               "unsupported version), resetting the connection");
+    controlDecoder->clear();
+    return false;
+  }
+  return true;
 }
 
 void
 ShapedClient::receivedShapedData(MsQuicStream *stream, uint8_t *buffer,
                                  size_t length) {
+  mapLock.lock_shared();
   if (stream == controlStream) {
-    handleControlMessages(controlStream, buffer, length);
+    auto isValid = handleControlMessages(controlStream, buffer, length);
+    mapLock.unlock_shared();
+    if (!isValid) {
+      shapedClient->resetConnection();
+      return;
+    }
+    applyResumeAnswers();
     return;
   }
   if (stream == dummyStream) {
     dummyQueues.fromShaped->push(buffer, length);
+    mapLock.unlock_shared();
+    return;
+  }
+  auto demuxIter = muxDemuxers.find(stream);
+  if (demuxIter != muxDemuxers.end()) {
+    // Only the receive thread of this stream uses its demuxer
+    auto &demuxer = demuxIter->second;
+    mapLock.unlock_shared();
+    receivedMuxData(demuxer, buffer, length);
     return;
   }
 
   // All other streams that are not dummy or control
-  auto fromShaped = (*streamToQueues)[stream].fromShaped;
+  auto queuesIter = streamToQueues->find(stream);
+  auto fromShaped = queuesIter == streamToQueues->end()
+                    ? nullptr : queuesIter->second.fromShaped;
+  mapLock.unlock_shared();
   if (fromShaped == nullptr) {
     log(ERROR, "Received data on unmapped stream " +
-               std::to_string((*streamToID)[stream]));
+               std::to_string(stream->ID()));
     return;
   }
   while (fromShaped->push(buffer, length) == -1) {
@@ -291,43 +690,98 @@ ShapedClient::receivedShapedData(MsQuicStream *stream, uint8_t *buffer,
         std::chrono::microseconds(unshapedProcessLoopInterval));
 #endif
   }
+  fromShaped->shapedBytes += length;
+}
+
+void ShapedClient::receivedMuxData(FlowDemuxer &demuxer, uint8_t *buffer,
+                                   size_t length) {
+  auto isValid = demuxer.demux(
+      buffer, length, [this](uint64_t flowID, uint8_t *payload, size_t size) {
+        auto fromShaped = findQueuesByID(flowID).fromShaped;
+        if (fromShaped == nullptr) {
+          log(ERROR, "Received data for unknown flow " +
+                     std::to_string(flowID));
+          return;
+        }
+        while (fromShaped->push(payload, size) == -1) {
+          log(WARNING, "(fromShaped) " + std::to_string(fromShaped->ID) +
+                       " of flow " + std::to_string(flowID) +
+                       " is full, waiting for it to be empty!");
+#ifdef SHAPING
+          std::this_thread::sleep_for(
+              std::chrono::microseconds(unshapedProcessLoopInterval));
+#endif
+        }
+        fromShaped->shapedBytes += size;
+      });
+  if (!isValid) {
+    log(ERROR, "Received a malformed flow frame, resetting the stream's "
+               "demultiplexer");
+    demuxer = FlowDemuxer{};
+  }
 }
 
 inline void ShapedClient::startControlStream() {
-  while (controlStream == nullptr) {
-    controlStream = shapedClient->startStream();
-  }
-  auto *message =
-      reinterpret_cast<struct ControlMessage *>(calloc(1, sizeof(struct
-          ControlMessage)));
-  message->streamID = controlStream->ID();
-  message->streamType = Control;
-  shapedClient->send(controlStream,
-                     reinterpret_cast<uint8_t *>(message),
-                     sizeof(*message));
+  MsQuicStream *stream = nullptr;
+  while (stream == nullptr) {
+    stream = shapedClient->startStream();
+  }
+  mapLock.lock();
+  controlStream = stream;
+  // Announce the stream before anything else is sent on it
+  controlLock.lock();
+  controlEncoder->addStream(Control, stream->ID(), numMuxStreams);
+  flushControlMessages(stream);
+  controlLock.unlock();
+  mapLock.unlock();
 #ifdef DEBUGGING
-  log(DEBUG, "Control stream is at " + std::to_string(message->streamID));
+  log(DEBUG, "Control stream is at " + std::to_string(stream->ID()));
 #endif
 }
 
 inline void ShapedClient::startDummyStream() {
-  while (dummyStream == nullptr) {
-    dummyStream = shapedClient->startStream();
-  }
-  auto *message =
-      reinterpret_cast<struct ControlMessage *>(calloc(1, sizeof(struct
-          ControlMessage)));
-  message->streamID = dummyStream->ID();
-  message->streamType = Dummy;
-  shapedClient->send(controlStream,
-                     reinterpret_cast<uint8_t *>(message),
-                     sizeof(*message));
+  MsQuicStream *stream = nullptr;
+  while (stream == nullptr) {
+    stream = shapedClient->startStream();
+  }
+  mapLock.lock();
+  dummyStream = stream;
+  controlLock.lock();
+  controlEncoder->addStream(Dummy, stream->ID());
+  flushControlMessages(controlStream);
+  controlLock.unlock();
+  auto dummy = malloc(4096);
+  send(stream, reinterpret_cast<uint8_t *>(dummy), 4096);
+  mapLock.unlock();
 #ifdef DEBUGGING
-  log(DEBUG, "Dummy stream is at " +
-             std::to_string(message->streamID));
+  log(DEBUG, "Dummy stream is at " + std::to_string(stream->ID()));
+#endif
+}
+
+inline void ShapedClient::startMuxStreams() {
+  std::vector<MsQuicStream *> streams{};
+  for (size_t i = 0; i < numMuxStreams; i++) {
+    MsQuicStream *stream = nullptr;
+    while (stream == nullptr) {
+      stream = shapedClient->startStream();
+    }
+    streams.push_back(stream);
+  }
+  if (streams.empty()) return;
+  mapLock.lock();
+  for (auto stream: streams) {
+    muxStreams.push_back(stream);
+    muxDemuxers[stream];
+    // Send an empty frame so that the other middlebox sees the stream
+    auto frame = reinterpret_cast<uint8_t *>(malloc(MAX_FLOW_HEADER_SIZE));
+    auto frameSize = putFlowHeader(frame, 0, 0);
+    send(stream, frame, frameSize);
+  }
+  mapLock.unlock();
+#ifdef DEBUGGING
+  log(DEBUG, "Multiplexing the flows on " + std::to_string(streams.size()) +
+             " streams");
 #endif
-  auto dummy = malloc(4096);
-  shapedClient->send(dummyStream, reinterpret_cast<uint8_t *>(dummy), 4096);
 }
 
 void ShapedClient::log(logLevels level, const std::string &log) {
@@ -14,15 +14,56 @@
 #include "../modules/shaper/NoiseGenerator.h"
 #include "../util/config.h"
 #include "../util/Shaped.h"
+#include "../util/ShaperEngine.h"
+#include "../util/FlowFrame.h"
 #include <shared_mutex>
+#include <unordered_set>
+#include <deque>
 
+#define WARM_STREAMS_RETRY 100 // Interval (ms) to retry opening warm streams
 
 using namespace helpers;
 
-class ShapedClient : Shaped {
+class ShapedClient final : Shaped {
 private:
+  // Runs the shaper loop on this peer, calling it directly
+  template<class, sendingStrategy> friend
+  class helpers::ShaperEngine;
+
   QUIC::Client *shapedClient;
 
+  // IDs of the (toShaped) queues whose flows have been announced to the
+  // other middlebox with a SYN and not yet released (after both FINs)
+  std::unordered_set<uint64_t> activeFlows;
+  // IDs of the (toShaped) queues whose flows were open when the connection
+  // to the other middlebox dropped. Their data is discarded until the
+  // unshaped side terminates them
+  std::unordered_set<uint64_t> staleFlows;
+  // IDs of the (toShaped) queues whose multiplexed flows were open when the
+  // connection dropped (or this process restarted). Their data is kept, to
+  // resume them on the next connection before resumeDeadline
+  std::unordered_set<uint64_t> suspendedFlows;
+  std::chrono::steady_clock::time_point resumeDeadline;
+  std::mutex flowLock;
+  // The answers of the other middlebox to the resumes (true if resumed), by
+  // flow. Only used by the receive thread of the control stream
+  std::vector<std::pair<uint64_t, bool>> resumeAnswers;
+  // The signals a restarted process took over from the previous one
+  std::vector<SignalInfo::queueInfo> pendingSignals;
+
+  // Data streams that are open but not yet bound to any queues
+  std::deque<MsQuicStream *> warmStreams;
+  size_t numWarmStreams;
+
+  // Data streams that the data of all flows is multiplexed on (if
+  // numMuxStreams > 0), framed with the ID of the flow's (toShaped) queue
+  size_t numMuxStreams;
+  std::vector<MsQuicStream *> muxStreams;
+  std::unordered_map<MsQuicStream *, FlowDemuxer> muxDemuxers;
+  // Queue pairs by the ID of their (toShaped) queue. Never changes after
+  // initialiseSHM
+  std::unordered_map<uint64_t, QueuePair> flowToQueues;
+
   /**
  * @brief Find a queue pair by the ID of it's "toShaped" queue
  * @param queueID The ID of the "toShaped" queue to find
@@ -41,9 +82,114 @@ private:
  */
   inline void startDummyStream();
 
+  /**
+   * @brief Starts the streams the flows are multiplexed on (if any)
+   */
+  inline void startMuxStreams();
+
+  /**
+   * @brief Push the data received on a multiplexed stream to the queues of
+   * the flows it belongs to
+   * @param demuxer The demultiplexer of the stream
+   * @param buffer The received data
+   * @param length The length of the received data
+   */
+  void receivedMuxData(FlowDemuxer &demuxer, uint8_t *buffer, size_t length);
+
+  /**
+   * @brief Open data streams till there are numWarmStreams unbound streams.
+   * Must be called with mapLock held (exclusively)
+   */
+  void fillWarmStreams();
+
+  /**
+   * @brief Get the data stream bound to the given queues, binding a warm
+   * (or a newly opened) stream to them if there is none yet. Must be called
+   * with mapLock held (exclusively)
+   * @param queues The queues to get the stream of
+   * @return The stream (nullptr if no stream could be opened)
+   */
+  MsQuicStream *bindStream(QueuePair queues);
+
+  /**
+   * @brief Handle a signal of the unshaped process (a SYN binds a stream to
+   * the new flow and announces it). Must be called with mapLock and
+   * controlLock held
+   * @param queueInfo The signal and the queue associated with it
+   */
+  void handleSignal(SignalInfo::queueInfo &queueInfo);
+
+  /**
+   * @brief Handle a signal handed over directly by the unshaped half (fused
+   * mode), on its thread
+   * @param queueInfo The signal and the queue associated with it
+   */
+  void receivedSignal(SignalInfo::queueInfo &queueInfo);
+
+  /**
+   * @brief Unmap all streams of the connection that is shutting down and
+   * terminate (or suspend, see suspendedFlows) the flows that were open on it
+   */
+  void invalidateStreams();
+
+  /**
+   * @brief Start the control and dummy streams on the new connection,
+   * refill the warm data streams and resume the suspended flows
+   */
+  void rebuildStreams();
+
+  /**
+   * @brief Rebuild the flows of the previous shaped process from the queue
+   * pairs, after a restart. The open multiplexed flows are suspended (if
+   * resumeTimeout allows it), all others are terminated
+   */
+  void restoreFlows();
+
+  /**
+   * @brief Ask the other middlebox to resume the suspended flows on the new
+   * connection
+   */
+  void resumeFlows();
+
+  /**
+   * @brief Bind the flows that the other middlebox resumed to their
+   * multiplexed stream, and terminate the ones it refused
+   */
+  void applyResumeAnswers();
+
+  /**
+   * @brief Terminate the suspended flows once resumeDeadline has passed.
+   * Must be called with mapLock held
+   */
+  void expireSuspendedFlows();
+
+  /**
+   * @brief Drop the data (and the FIN) of a flow that was open when the
+   * connection dropped
+   * @param queues The queues of the flow
+   * @return true if the flow was stale (and hence handled)
+   */
+  inline bool dropStaleFlow(QueuePair queues);
+
+  /**
+   * @brief Send all control messages added to controlEncoder as one frame.
+   * Must be called with mapLock and controlLock held
+   * @param stream The stream to send the frame on (the frame is dropped if
+   * nullptr)
+   */
+  void flushControlMessages(MsQuicStream *stream);
+
+  /**
+   * @brief Check if the given stream still belongs to the live connection.
+   * Must be called with mapLock held
+   * @param stream The stream to check
+   */
+  inline bool isLiveStream(MsQuicStream *stream);
+
   MsQuicStream *findStreamByID(QUIC_UINT62 ID) override;
 
-  void initialiseSHM(int maxClients, size_t queueSize) override;
+  void initialiseSHM(int maxClients, size_t queueSize, size_t segmentSize,
+                     size_t slabPoolSize) override;
 
   void
   updateConnectionStatus(uint64_t ID, connectionStatus connStatus) override;
@@ -51,9 +197,11 @@ private:
   void receivedShapedData(MsQuicStream *stream, uint8_t *buffer, size_t
   length) override;
 
-  void handleControlMessages(MsQuicStream *ctrlStream,
+  bool handleControlMessages(MsQuicStream *ctrlStream,
                              uint8_t *buffer, size_t length) override;
 
+  void send(MsQuicStream *stream, uint8_t *buffer, size_t length) override;
+
   void log(logLevels level, const std::string &log) override;
 
 public:
@@ -65,9 +213,22 @@ public:
 
   PreparedBuffer prepareDummy(size_t dummySize) override;
 
-  std::vector<PreparedBuffer> prepareData(size_t dataSize) override;
+  void prepareData(uint32_t trafficClass, size_t dataSize,
+                   PreparedBuffers &preparedBuffers) override;
+
+  /**
+   * @brief Handle the SYNs signalled by the unshaped process (by binding a
+   * stream to the new flow)
+   */
+  [[noreturn]] void getUpdatedConnectionStatus();
 
-  [[noreturn]] void getUpdatedConnectionStatus() override;
+  /**
+   * @brief Before this process exits: stop sending, ask the other middlebox
+   * to stop as well, wait for the data in flight and close the connection.
+   * The next shaped process can then resume the multiplexed flows without
+   * losing any of their bytes. Does nothing without resumeTimeout
+   */
+  void suspendForRestart();
 
 };
 
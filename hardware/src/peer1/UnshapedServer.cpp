@@ -11,21 +11,29 @@ UnshapedServer::UnshapedServer(config::Peer1Config &peer1Config) :
     serverAddr(peer1Config.unshapedServer.serverAddr) {
   this->appName = peer1Config.appName;
   this->logLevel = peer1Config.logLevel;
+  this->hugePageSize = peer1Config.hugePageSize;
+  // The real-time shaper must not take page faults on the SHM
+  this->prefaultSHM = peer1Config.prefaultSHM
+                      || peer1Config.shapedClient.realTimePriority > 0;
+  this->fused = peer1Config.fused;
+  // Where the shaper and the drain of the queues run
+  if (peer1Config.numaAware) {
+    auto &cores = peer1Config.shapedClient.shaperCores;
+    this->numaNode = helpers::numaNodeOf(
+        cores.empty() ? peer1Config.unshapedServer.cores : cores);
+  }
   this->shapedProcessLoopInterval =
-      peer1Config.shapedClient.strategy == UNIFORM
-      ? peer1Config.shapedClient.sendingLoopInterval
-      : peer1Config.shapedClient.DPCreditorLoopInterval;
+      config::shortestShaperInterval(peer1Config.shapedClient,
+                                     peer1Config.trafficClasses);
 
   socketToQueues =
       new std::unordered_map<int, QueuePair>(peer1Config.maxClients);
   queuesToSocket = new std::unordered_map<QueuePair,
       int, QueuePairHash>(peer1Config.maxClients);
-  pendingSignal =
-      new std::unordered_map<uint64_t, connectionStatus>(
-          peer1Config.maxClients);
   unassignedQueues = new std::queue<QueuePair>{};
 
-  initialiseSHM(peer1Config.maxClients, peer1Config.queueSize);
+  initialiseSHM(peer1Config.maxClients, peer1Config.queueSize,
+                peer1Config.segmentSize, peer1Config.slabPoolSize);
 
   auto config = peer1Config.unshapedServer;
   // Start listening for unshaped traffic
@@ -39,24 +47,37 @@ UnshapedServer::UnshapedServer(config::Peer1Config &peer1Config) :
   };
 
   unshapedServer = new TCP::Server{config.bindAddr, config.bindPort,
-                                   tcpReceiveFunc, logLevel};
+                                   tcpReceiveFunc, logLevel,
+                                   config.ioThreads, config.cores,
+                                   config.backlog, config.incomingCPU};
+  // Stop reading from a client while its toShaped queue is full, instead of
+  // waiting for space with its data in hand
+  unshapedServer->setReceiveSpace([this](int socket) {
+    return receiveSpace(socket);
+  }, (int) shapedProcessLoopInterval);
   unshapedServer->startListening();
 
-  std::thread responseLoop([=, this]() {
-    checkQueuesForData(config.checkQueuesInterval, peer1Config.queueSize);
-  });
-  responseLoop.detach();
-
-  std::thread updateQueueStatus([this]() { getUpdatedConnectionStatus(); });
-  updateQueueStatus.detach();
-
+  startDrainWorkers(config.drainThreads, config.cores,
+                    config.checkQueuesInterval, peer1Config.queueSize);
 }
 
-[[noreturn]] void UnshapedServer::checkQueuesForData(__useconds_t interval,
+[[noreturn]] void UnshapedServer::checkQueuesForData(int worker,
+                                                     __useconds_t interval,
                                                      size_t queueSize) {
-  if (!peer1Config.unshapedServer.cores.empty())
-    setCPUAffinity(peer1Config.unshapedServer.cores);
   auto buffer = reinterpret_cast<uint8_t *>(malloc(queueSize));
+  // Non-blocking, so that a client that doesn't read holds up nobody else
+  TCP::SendBatch sendBatch{256, logLevel, true};
+  sendBatch.registerMemory(queueMemory, queueMemorySize);
+  auto [first, last] = ownedRange(worker);
+  // The queue pairs of this worker that have something to send this pass
+  struct Pending {
+    QueuePair queues;
+    int socket;
+    uint32_t state;
+    size_t size;
+  };
+  std::vector<Pending> pending{};
+  pending.reserve(last - first);
 #ifdef SHAPING
   auto nextCheck = std::chrono::steady_clock::now();
   while (true) {
@@ -66,15 +87,28 @@ UnshapedServer::UnshapedServer(config::Peer1Config &peer1Config) :
 #else
   while (true) {
 #endif
+    if (worker == 0)
+      dummyQueues.fromShaped->pop(buffer, dummyQueues.fromShaped->size());
+    // Only look up the sockets of the pairs with data or a FIN to handle
     mapLock.lock_shared();
-    auto tempMap = *queuesToSocket;
-    mapLock.unlock_shared();
-    dummyQueues.fromShaped->pop(buffer, dummyQueues.fromShaped->size());
-    for (const auto &[queues, socket]: tempMap) {
-//      if (socket == 0) continue;
+    for (auto index = first; index < last; index++) {
+      const auto &queues = queuePairs[index];
+      auto state = ConnectionState::load(queues);
       auto size = queues.fromShaped->size();
+      if (size == 0 && !ConnectionState::has(
+          state, ConnectionState::FROM_SHAPED_FIN)) {
+        continue;
+      }
+      auto mapping = queuesToSocket->find(queues);
+      if (mapping == queuesToSocket->end()) continue;
+      pending.push_back({queues, mapping->second, state, size});
+    }
+    mapLock.unlock_shared();
+    for (auto [queues, socket, state, size]: pending) {
       if (size == 0) {
-        if ((*pendingSignal)[queues.fromShaped->ID] == FIN) {
+        if (ConnectionState::isPendingFIN(
+            state, ConnectionState::FROM_SHAPED_FIN,
+            ConnectionState::FROM_SHAPED_FIN_SENT)) {
 #ifdef DEBUGGING
           log(DEBUG,
               "Sending FIN to socket " + std::to_string(socket) +
@@ -83,30 +117,30 @@ UnshapedServer::UnshapedServer(config::Peer1Config &peer1Config) :
               std::to_string(queues.toShaped->ID) + "}");
 #endif
           TCP::Server::sendFIN(socket);
-          (*pendingSignal).erase(queues.fromShaped->ID);
-          queues.fromShaped->sentFIN = true;
+          ConnectionState::set(queues, ConnectionState::FROM_SHAPED_FIN_SENT);
+          state |= ConnectionState::FROM_SHAPED_FIN_SENT;
         }
-        if (queues.toShaped->markedForDeletion
-            && queues.fromShaped->markedForDeletion
-            && queues.fromShaped->sentFIN) {
+        if (ConnectionState::has(state, ConnectionState::UNSHAPED_DONE)) {
           eraseMapping(socket);
         }
       }
-      if (size > 0) {
-        queues.fromShaped->pop(buffer, size);
-        unshapedServer->sendData(socket, buffer, size);
-      }
+      if (size > 0) batchSend(sendBatch, socket, queues.fromShaped);
     }
+    pending.clear();
+    sendBatch.flush(sentFromQueue);
   }
 }
 
 inline QueuePair
 UnshapedServer::assignQueue(int clientSocket, std::string &clientAddress,
                             std::string serverAddress) {
-  if (unassignedQueues->empty()) return {nullptr, nullptr};
   mapLock.lock();
-  auto queues = unassignedQueues->front();
-  unassignedQueues->pop();
+  // The shaped process may still be sending the FIN of a released pair
+  auto queues = ConnectionState::assignFrom(*unassignedQueues);
+  if (queues.toShaped == nullptr) {
+    mapLock.unlock();
+    return queues;
+  }
 #ifdef DEBUGGING
   log(DEBUG, "Assigning socket " +
              std::to_string(clientSocket) + " (client: " + clientAddress
@@ -119,9 +153,6 @@ UnshapedServer::assignQueue(int clientSocket, std::string &clientAddress,
   // Set client of queue to the new client
   auto address = clientAddress.substr(0, clientAddress.find(':'));
   auto port = clientAddress.substr(address.size() + 1);
-  queues.toShaped->markedForDeletion = false;
-  queues.fromShaped->markedForDeletion = false;
-  queues.toShaped->sentFIN = queues.fromShaped->sentFIN = false;
   queues.toShaped->clear();
   queues.fromShaped->clear();
   mapLock.unlock();
@@ -142,11 +173,17 @@ UnshapedServer::assignQueue(int clientSocket, std::string &clientAddress,
 }
 
 inline void UnshapedServer::eraseMapping(int socket) {
-  auto queues = (*socketToQueues)[socket];
-  if (!queues.fromShaped->markedForDeletion
-      || !queues.toShaped->markedForDeletion) {
-    log(ERROR, "eraseMapping called before both queues were marked for "
-               "deletion");
+  mapLock.lock();
+  auto mapping = socketToQueues->find(socket);
+  if (mapping == socketToQueues->end()) {
+    mapLock.unlock();
+    return;
+  }
+  auto queues = mapping->second;
+  if (ConnectionState::phase(ConnectionState::load(queues))
+      != ConnectionState::CLOSING) {
+    mapLock.unlock();
+    log(ERROR, "eraseMapping called before both directions got a FIN");
     return;
   }
 #ifdef DEBUGGING
@@ -154,12 +191,13 @@ inline void UnshapedServer::eraseMapping(int socket) {
              + " mapped to queues {" + std::to_string(queues.fromShaped->ID) +
              "," + std::to_string(queues.toShaped->ID) + "}");
 #endif
-  close(socket);
-  mapLock.lock();
-  (*socketToQueues).erase(socket);
+  socketToQueues->erase(mapping);
   (*queuesToSocket).erase(queues);
   unassignedQueues->push(queues);
+  ConnectionState::set(queues, ConnectionState::UNSHAPED_RELEASED);
   mapLock.unlock();
+  // Only once the mapping is gone: a new client may get the same socket
+  unshapedServer->closeClient(socket);
 }
 
 void UnshapedServer::updateConnectionStatus(uint64_t queueID,
@@ -172,19 +210,11 @@ void UnshapedServer::updateConnectionStatus(uint64_t queueID,
 //  kill(sigInfo->shaped, SIGUSR1);
 }
 
-[[noreturn]] void UnshapedServer::getUpdatedConnectionStatus() {
-  struct SignalInfo::queueInfo queueInfo{};
-  auto sleepUntil = std::chrono::steady_clock::now();
-  while (true) {
-    sleepUntil = std::chrono::steady_clock::now() +
-                 std::chrono::milliseconds(1);
-    while (sigInfo->dequeue(SignalInfo::fromShaped, queueInfo)) {
-      if (queueInfo.connStatus == FIN) {
-        (*pendingSignal)[queueInfo.queueID] = FIN;
-      }
-    }
-    std::this_thread::sleep_until(sleepUntil);
-  }
+size_t UnshapedServer::receiveSpace(int socket) {
+  std::shared_lock lock(mapLock);
+  auto queues = socketToQueues->find(socket);
+  if (queues == socketToQueues->end()) return 0;
+  return queues->second.toShaped->freeSpace();
 }
 
 bool UnshapedServer::receivedUnshapedData(int fromSocket,
@@ -212,25 +242,26 @@ bool UnshapedServer::receivedUnshapedData(int fromSocket,
     }
     case ONGOING: {
       mapLock.lock_shared();
-      auto queues = (*socketToQueues)[fromSocket];
-      mapLock.unlock_shared();
-      auto toShaped = queues.toShaped;
-      while (toShaped->push(buffer, length) == -1) {
-        log(WARNING, "(toShaped) " + std::to_string(toShaped->ID) +
-                     +" mapped to socket " + std::to_string(fromSocket) +
-                     " is full, waiting for it to be empty!");
-#ifdef SHAPING
-        // Sleep for some time. For performance reasons, this is the same as
-        // the interval with which DP Logic thread runs in Shaped component.
-        std::this_thread::sleep_for(
-            std::chrono::microseconds(shapedProcessLoopInterval));
-#endif
+      auto mapping = socketToQueues->find(fromSocket);
+      if (mapping == socketToQueues->end()) {
+        mapLock.unlock_shared();
+        return false;
       }
+      auto queues = mapping->second;
+      mapLock.unlock_shared();
+      // The server only reads what fits (see receiveSpace), so this doesn't
+      // wait
+      pushAll(queues.toShaped, buffer, length);
       return true;
     }
     case FIN: {
       mapLock.lock_shared();
-      auto queues = (*socketToQueues)[fromSocket];
+      auto mapping = socketToQueues->find(fromSocket);
+      if (mapping == socketToQueues->end()) {
+        mapLock.unlock_shared();
+        return false;
+      }
+      auto queues = mapping->second;
       mapLock.unlock_shared();
 #ifdef DEBUGGING
       log(DEBUG, "Received FIN from socket " + std::to_string(fromSocket)
@@ -238,8 +269,8 @@ bool UnshapedServer::receivedUnshapedData(int fromSocket,
                  std::to_string(queues.fromShaped->ID) + "," +
                  std::to_string(queues.toShaped->ID) + "}");
 #endif
-      queues.toShaped->markedForDeletion = true;
-      updateConnectionStatus(queues.toShaped->ID, FIN);
+      // Picked up by the shaped process once it sent the data before it
+      ConnectionState::set(queues, ConnectionState::TO_SHAPED_FIN);
       return true;
     }
 
@@ -248,27 +279,47 @@ bool UnshapedServer::receivedUnshapedData(int fromSocket,
   }
 }
 
-inline void UnshapedServer::initialiseSHM(int maxClients, size_t queueSize) {
-  auto shmAddr = helpers::initialiseSHM(maxClients, appName, queueSize);
+inline void UnshapedServer::initialiseSHM(int maxClients, size_t queueSize,
+                                          size_t segmentSize,
+                                          size_t slabPoolSize) {
+  auto layout = helpers::layoutSHM(maxClients, queueSize, segmentSize,
+                                   slabPoolSize);
+  auto shmAddr =
+      helpers::createSHM(appName, layout, hugePageSize, prefaultSHM,
+                         numaNode);
 
-  // The beginning of the SHM contains the signalStruct struct
-  sigInfo = new(shmAddr) SignalInfo{maxClients};
+  // The SHM header is followed by the signalStruct struct
+  sigInfo = new(shmAddr + layout.signalInfoOffset) SignalInfo{maxClients};
 
-  // The rest of the SHM contains the queues
-  shmAddr += (sizeof(SignalInfo) + (2 * sizeof(LamportQueue)) +
-              (4 * maxClients * sizeof(SignalInfo::queueInfo)));
+  // The rest of the SHM contains the queues, and the slab pool they take
+  // their segments from
+  auto pool = layout.pool(shmAddr);
+  if (pool != nullptr)
+    new(pool) SlabPool{layout.segmentSize, layout.numSegments};
+  auto newQueue = [&](uint64_t i) {
+    auto queue = layout.queue(shmAddr, i);
+    return pool == nullptr ? new(queue) LamportQueue{i, queueSize}
+                           : new(queue) LamportQueue{i, queueSize, pool};
+  };
+  queueMemory = layout.queue(shmAddr, 0);
+  numQueuePairs = maxClients;
+  queueMemorySize = layout.size - layout.queuesOffset;
   for (unsigned long i = 0; i < maxClients * 2 + 2; i += 2) {
     // Initialise a queue class at that shared memory and put it in the maps
-    auto queue1 =
-        new(shmAddr +
-            (i * (sizeof(class LamportQueue) + queueSize)))
-            LamportQueue{i, queueSize};
-    auto queue2 =
-        new(shmAddr + ((i + 1) * (sizeof(class LamportQueue) + queueSize)))
-            LamportQueue{i + 1, queueSize};
-    if (i > 0) unassignedQueues->push({queue1, queue2});
-    else dummyQueues = {queue1, queue2};
+    auto queue1 = newQueue(i);
+    auto queue2 = newQueue(i + 1);
+    if (i > 0) {
+      unassignedQueues->push({queue1, queue2});
+      queuePairs.push_back({queue1, queue2});
+    } else {
+      dummyQueues = {queue1, queue2};
+    }
   }
+
+  // In fused mode, only the shaped half in this process attaches
+  if (fused) helpers::keepSHMInProcess(appName, shmAddr);
+  // The shaped process attaches as soon as this is done
+  helpers::publishSHM(shmAddr);
 }
 
 void UnshapedServer::log(logLevels level, const std::string &log) {
@@ -26,6 +26,8 @@ private:
   std::unordered_map<int, QueuePair> *socketToQueues;
   std::unordered_map<QueuePair, int, QueuePairHash> *queuesToSocket;
   std::queue<QueuePair> *unassignedQueues;
+  // All queue pairs, by index (see ownedRange)
+  std::vector<QueuePair> queuePairs{};
 
   std::shared_mutex mapLock;
 
@@ -71,10 +73,17 @@ private:
                             uint8_t *buffer, size_t length, enum
                                 connectionStatus connStatus);
 
-  [[noreturn]] void checkQueuesForData(__useconds_t interval,
+  /**
+   * @param socket The socket of a client
+   * @return The number of bytes the toShaped queue of the client has space for
+   */
+  size_t receiveSpace(int socket);
+
+  [[noreturn]] void checkQueuesForData(int worker, __useconds_t interval,
                                        size_t queueSize) override;
 
-  void initialiseSHM(int maxClients, size_t queueSize) override;
+  void initialiseSHM(int maxClients, size_t queueSize, size_t segmentSize,
+                     size_t slabPoolSize) override;
 
   void log(logLevels level, const std::string &log) override;
 
@@ -85,8 +94,6 @@ public:
    */
   explicit UnshapedServer(config::Peer1Config &peer1Config);
 
-  [[noreturn]] void getUpdatedConnectionStatus() override;
-
 };
 
 
@@ -9,7 +9,6 @@
 #include <fstream>
 #include "../../../msquic/src/inc/external_sync.h"
 
-pthread_rwlock_t quicSendLock;
 
 UnshapedServer *unshapedServer = nullptr;
 ShapedClient *shapedClient = nullptr;
@@ -73,39 +72,82 @@ inline config::Peer1Config loadConfig(char *configFileName) {
       }
     }
   }
+  warnIfCoresSpanNUMANodes(
+      {{"shaperCores", peer1Config.shapedClient.shaperCores},
+       {"workerCores", peer1Config.shapedClient.workerCores},
+       {"unshapedServer.cores", peer1Config.unshapedServer.cores}});
+  if (peer1Config.shapedClient.realTimePriority > 0)
+    warnIfCoresNotIsolated(peer1Config.shapedClient.shaperCores);
   std::cout << "Config:" << peer1Config << std::endl;
   return peer1Config;
 }
 
+/**
+ * @brief Start the shaped half in this process
+ * @param config The configuration
+ */
+inline void startShapedClient(config::Peer1Config &config) {
+  // Set CPU affinity of this process to worker cores.
+  // The instantiation of ShapedClient will set the shaper thread affinity
+  // separately
+  if (!config.shapedClient.workerCores.empty())
+    setCPUAffinity(config.shapedClient.workerCores);
+  // Locked before anything is allocated: the shaper (and what it uses) then
+  // takes no page faults
+  if (config.shapedClient.realTimePriority > 0)
+    lockMemory(2 * config.shapedClient.maxDecisionSize);
+  MsQuic = new MsQuicApi{};
+  shapedClient = new ShapedClient{config};
+  std::cout << "Peer is ready!" << std::endl;
+}
+
 int main(int argc, char *argv[]) {
-  pthread_rwlock_init(&quicSendLock, nullptr);
-  // Load configurations
-  if (argc != 2) {
+  // With --restart, only the shaped half is started, in place of one that
+  // exited. It takes the queues of the running unshaped half over
+  bool restart = argc == 3 && std::string(argv[2]) == "--restart";
+  if (argc != 2 && !restart) {
     std::cerr <<
               "No config file entered! Please call this using `./peer_1 "
-              "config.json`" << std::endl;
+              "config.json [--restart]`" << std::endl;
     exit(1);
   }
+  // Load configurations
   auto config = loadConfig(argv[1]);
+  // The shaped process must not attach to the SHM of a previous run
+  if (!restart) removeSHM(config.appName);
+  // Both processes (and all their threads) allocate from the node of the
+  // shaper, like the SHM
+  if (config.numaAware) {
+    auto &cores = config.shapedClient.shaperCores;
+    preferNUMANode(
+        numaNodeOf(cores.empty() ? config.unshapedServer.cores : cores));
+  }
 
-  if (fork() == 0) {
+  if (restart) {
+    startShapedClient(config);
+    // Wait for signal to exit
+    waitForSignal(true);
+    shapedClient->suspendForRestart();
+  } else if (config.fused) {
+    // Both halves in this process. The unshaped half goes first: the shaped
+    // half takes its queues over directly
+    unshapedServer = new UnshapedServer{config};
+    startShapedClient(config);
+    // Wait for signal to exit
+    waitForSignal(true);
+  } else if (fork() == 0) {
     // Child process - Unshaped Server
     unshapedServer = new UnshapedServer{config};
     // Wait for signal to exit
     waitForSignal(false);
+    // No shaped process can take its queues over anymore
+    removeSHM(config.appName);
   } else {
     // Parent Process - Shaped Client
-    // Set CPU affinity of this process to worker cores.
-    // The instantiation of ShapedClient will set the shaper thread affinity
-    // separately
-    if (!config.shapedClient.workerCores.empty())
-      setCPUAffinity(config.shapedClient.workerCores);
-    sleep(2); // Wait for unshapedServer to initialise
-    MsQuic = new MsQuicApi{};
-    shapedClient = new ShapedClient{config};
-    sleep(2);
-    std::cout << "Peer is ready!" << std::endl;
+    startShapedClient(config);
     // Wait for signal to exit
     waitForSignal(true);
+    // For the shaped process that replaces this one (see --restart)
+    shapedClient->suspendForRestart();
   }
 }
\ No newline at end of file
@@ -10,15 +10,21 @@ ShapedServer::ShapedServer(config::Peer2Config &peer2Config) :
     dummyStreamID(QUIC_UINT62_MAX) {
   this->appName = peer2Config.appName;
   this->logLevel = peer2Config.logLevel;
+  this->hugePageSize = peer2Config.hugePageSize;
+  // The real-time shaper must not take page faults on the SHM
+  this->prefaultSHM = peer2Config.prefaultSHM
+                      || peer2Config.shapedServer.realTimePriority > 0;
+  this->fused = peer2Config.fused;
   unshapedProcessLoopInterval = peer2Config.unshapedClient.checkQueuesInterval;
   controlStream = dummyStream = nullptr;
-  size_t controlMessageQueueSize =
+  // Only FINs are sent from here, at most one per client
+  controlEncoder = new ControlFrameEncoder(
+      peer2Config.maxPeers * peer2Config.maxStreamsPerPeer);
+  controlDecoder = new ControlFrameDecoder(
       4 * peer2Config.maxPeers * peer2Config.maxStreamsPerPeer *
-      sizeof(ControlMessage);
-  controlMessageQueue =
-      reinterpret_cast<LamportQueue *>(malloc(sizeof(LamportQueue)
-                                              + controlMessageQueueSize));
-  new(controlMessageQueue) LamportQueue{INT_MAX, controlMessageQueueSize};
+      MAX_CONTROL_RECORD_SIZE);
+  sendQueue = new SendQueue(
+      2 * (peer2Config.maxPeers * peer2Config.maxStreamsPerPeer + 2));
   queuesToStream =
       new std::unordered_map<QueuePair,
           MsQuicStream *, QueuePairHash>(peer2Config.maxStreamsPerPeer);
@@ -28,13 +34,13 @@ ShapedServer::ShapedServer(config::Peer2Config &peer2Config) :
   streamToID =
       new std::unordered_map<MsQuicStream *, QUIC_UINT62>(
           peer2Config.maxStreamsPerPeer);
-  pendingSignal =
-      new std::unordered_map<uint64_t, connectionStatus>(
-          peer2Config.maxStreamsPerPeer);
   unassignedQueues = new std::queue<QueuePair>{};
+  resumeTimeout =
+      std::chrono::milliseconds(peer2Config.shapedServer.resumeTimeout);
 
   initialiseSHM(peer2Config.maxPeers * peer2Config.maxStreamsPerPeer,
-                peer2Config.queueSize);
+                peer2Config.queueSize, peer2Config.segmentSize,
+                peer2Config.slabPoolSize);
 
   auto receivedShapedDataFunc = [this](auto &&PH1, auto &&PH2, auto &&PH3) {
     receivedShapedData(std::forward<decltype(PH1)>(PH1),
@@ -47,59 +53,94 @@ ShapedServer::ShapedServer(config::Peer2Config &peer2Config) :
   shapedServer =
       new QUIC::Server{config.serverCert, config.serverKey,
                        config.listeningPort, receivedShapedDataFunc, logLevel,
-                       peer2Config.maxStreamsPerPeer + 2, config.idleTimeout};
+                       peer2Config.maxStreamsPerPeer + 2, config.idleTimeout,
+                       [this]() { resetPeer(); }};
   shapedServer->startListening();
 
   noiseGenerator = new NoiseGenerator{config.noiseMultiplier,
                                       config.sensitivity,
                                       config.maxDecisionSize,
                                       config.minDecisionSize};
-
-  std::thread senderLoopThread(helpers::shaperLoop, queuesToStream,
-                               noiseGenerator,
-                               [this](auto &&PH1) -> PreparedBuffer {
-                                 return prepareDummy(std::forward<decltype(PH1)>
-                                                         (PH1));
-                               },
-                               [this](auto &&PH1) ->
-                                   std::vector<PreparedBuffer> {
-                                 return prepareData(std::forward<decltype(PH1)>
-                                                        (PH1));
-                               },
-                               [this](MsQuicStream *stream, uint8_t *buffer,
-                                      size_t length) {
-                                 shapedServer->send(stream, buffer, length);
-                               },
-                               config.sendingLoopInterval,
-                               config.DPCreditorLoopInterval,
-                               config.strategy, std::ref(mapLock),
-                               config.shaperCores);
+  trafficClasses = TrafficClasses{peer2Config.trafficClasses};
+
+  // One buffer per queue pair, and the dummy. Queue pairs are only mapped
+  // once their streams start, so count all of them
+  auto maxBuffers =
+      (size_t) peer2Config.maxPeers * peer2Config.maxStreamsPerPeer + 1;
+  std::thread senderLoopThread([this, config, maxBuffers]() {
+    helpers::runShaper(*this, noiseGenerator, config.sendingLoopInterval,
+                       config.DPCreditorLoopInterval, config.strategy,
+                       maxBuffers, config.shaperCores,
+                       config.realTimePriority, config.pipelined);
+  });
   senderLoopThread.detach();
-
-  std::thread updateQueueStatus([this]() { getUpdatedConnectionStatus(); });
-  updateQueueStatus.detach();
+  for (uint32_t i = 1; i < trafficClasses.size(); i++) {
+    auto trafficClass = peer2Config.trafficClasses[i - 1];
+    auto classNoiseGenerator =
+        new NoiseGenerator{trafficClass.noiseMultiplier,
+                           trafficClass.sensitivity,
+                           trafficClass.maxDecisionSize,
+                           trafficClass.minDecisionSize};
+    std::thread classLoopThread(
+        [this, config, trafficClass, classNoiseGenerator, maxBuffers, i]() {
+          helpers::runShaper(*this, classNoiseGenerator,
+                             trafficClass.sendingLoopInterval,
+                             trafficClass.DPCreditorLoopInterval,
+                             trafficClass.strategy, maxBuffers,
+                             trafficClass.shaperCores,
+                             config.realTimePriority, config.pipelined, i,
+                             trafficClasses.name(i));
+        });
+    classLoopThread.detach();
+  }
 }
 
-inline void ShapedServer::initialiseSHM(int numStreams, size_t queueSize) {
-  auto shmAddr = helpers::initialiseSHM(numStreams, appName, queueSize, true);
+inline void ShapedServer::initialiseSHM(int numStreams, size_t queueSize,
+                                        size_t segmentSize,
+                                        size_t slabPoolSize) {
+  // Waits for the unshaped process to initialise the SHM
+  auto layout = helpers::layoutSHM(numStreams, queueSize, segmentSize,
+                                   slabPoolSize);
+  auto shmAddr = helpers::attachSHM(appName, layout, prefaultSHM);
 
-  // The beginning of the SHM contains the signalStruct struct
-  sigInfo = reinterpret_cast<class SignalInfo *>(shmAddr);
+  // The SHM header is followed by the signalStruct struct
+  sigInfo = reinterpret_cast<class SignalInfo *>(
+      shmAddr + layout.signalInfoOffset);
 
   // The rest of the SHM contains the queues
-  shmAddr += (sizeof(SignalInfo) + (2 * sizeof(LamportQueue)) +
-              (4 * numStreams * sizeof(SignalInfo::queueInfo)));
+  auto isRestarted = helpers::isReattached(shmAddr);
   for (int i = 0; i < numStreams * 2 + 2; i += 2) {
-    auto queue1 =
-        (LamportQueue *) (shmAddr +
-                          (i * (sizeof(class LamportQueue) + queueSize)));
-    auto queue2 =
-        (LamportQueue *) (shmAddr +
-                          ((i + 1) * (sizeof(class LamportQueue) + queueSize)));
-
-    if (i > 0) unassignedQueues->push({queue1, queue2});
-    else dummyQueues = {queue1, queue2};
+    auto queue1 = (LamportQueue *) layout.queue(shmAddr, i);
+    auto queue2 = (LamportQueue *) layout.queue(shmAddr, i + 1);
+
+    if (i == 0) dummyQueues = {queue1, queue2};
+    else if (!isRestarted || !restoreFlow({queue1, queue2}))
+      unassignedQueues->push({queue1, queue2});
+  }
+  if (isRestarted) {
+    resumeDeadline = std::chrono::steady_clock::now() + resumeTimeout;
+    log(WARNING, "Restarted: resuming " +
+                 std::to_string(suspendedFlows.size()) + " flows, "
+                 "terminating the rest");
+  }
+}
+
+bool ShapedServer::restoreFlow(QueuePair queues) {
+  auto state = ConnectionState::load(queues);
+  if (ConnectionState::phase(state) == ConnectionState::FREE
+      || ConnectionState::has(state, ConnectionState::SHAPED_RELEASED)) {
+    return false;
+  }
+  auto flowID = queues.toShaped->flowID;
+  if (resumeTimeout.count() > 0 && flowID != 0) {
+    (*queuesToStream)[queues] = nullptr;
+    flowToQueues[flowID] = queues;
+    queuesToFlow[queues] = flowID;
+    suspendedFlows.insert(flowID);
+  } else {
+    terminateFlow(queues);
   }
+  return true;
 }
 
 MsQuicStream *ShapedServer::findStreamByID(QUIC_UINT62 ID) {
@@ -109,21 +150,6 @@ MsQuicStream *ShapedServer::findStreamByID(QUIC_UINT62 ID) {
   return nullptr;
 }
 
-[[noreturn]] void ShapedServer::getUpdatedConnectionStatus() {
-  struct SignalInfo::queueInfo queueInfo{};
-  auto sleepUntil = std::chrono::steady_clock::now();
-  while (true) {
-    sleepUntil = std::chrono::steady_clock::now() +
-                 std::chrono::milliseconds(1);
-    while (sigInfo->dequeue(SignalInfo::toShaped, queueInfo)) {
-      if (queueInfo.connStatus == FIN) {
-        (*pendingSignal)[queueInfo.queueID] = FIN;
-      }
-    }
-    std::this_thread::sleep_until(sleepUntil);
-  }
-}
-
 void ShapedServer::updateConnectionStatus(uint64_t queueID,
                                           connectionStatus connStatus) {
   std::scoped_lock lock(writeLock);
@@ -158,9 +184,8 @@ void ShapedServer::copyClientInfo(QueuePair queues,
 }
 
 inline bool ShapedServer::assignQueues(MsQuicStream *stream) {
-  if (unassignedQueues->empty()) return false;
-  auto queues = unassignedQueues->front();
-  unassignedQueues->pop();
+  auto queues = ConnectionState::assignFrom(*unassignedQueues);
+  if (queues.fromShaped == nullptr) return false;
   (*streamToQueues)[stream] = queues;
   (*queuesToStream)[queues] = stream;
   (*streamToID)[stream] = stream->ID();
@@ -173,14 +198,11 @@ inline bool ShapedServer::assignQueues(MsQuicStream *stream) {
       std::to_string(queues.toShaped->ID) + "}");
 #endif
 
-  queues.fromShaped->markedForDeletion = false;
-  queues.toShaped->markedForDeletion = false;
-  queues.toShaped->sentFIN = queues.fromShaped->sentFIN = false;
-  queues.toShaped->clear();
-  queues.fromShaped->clear();
+  resetQueues(queues);
 
   if (streamIDtoCtrlMsg.find(streamID) != streamIDtoCtrlMsg.end()) {
     copyClientInfo(queues, &streamIDtoCtrlMsg[streamID]);
+    trafficClasses.classify(queues);
     updateConnectionStatus((*streamToQueues)[stream].fromShaped->ID,
                            SYN);
 
@@ -190,71 +212,259 @@ inline bool ShapedServer::assignQueues(MsQuicStream *stream) {
   return true;
 }
 
-inline void ShapedServer::eraseMapping(MsQuicStream *stream) {
-  auto queues = (*streamToQueues)[stream];
+QueuePair ShapedServer::assignFlowQueues(uint64_t flowID,
+                                         MsQuicStream *stream) {
+  auto flowIter = flowToQueues.find(flowID);
+  if (flowIter != flowToQueues.end()) return flowIter->second;
+  auto queues = ConnectionState::assignFrom(*unassignedQueues);
+  if (queues.fromShaped == nullptr) return queues;
+  if (stream == nullptr && !muxStreams.empty()) {
+    stream = muxStreams[flowID % muxStreams.size()];
+  }
+  // If there is no multiplexed stream yet, the flow gets one when the first
+  // one starts
+  (*queuesToStream)[queues] = stream;
+  flowToQueues[flowID] = queues;
+  queuesToFlow[queues] = flowID;
+#ifdef DEBUGGING
+  log(DEBUG,
+      "Assigning flow " + std::to_string(flowID) + " to queues {" +
+      std::to_string(queues.fromShaped->ID) + "," +
+      std::to_string(queues.toShaped->ID) + "}");
+#endif
+  resetQueues(queues);
+  // Kept for a restarted process (see restoreFlow)
+  queues.toShaped->flowID = flowID;
+  return queues;
+}
+
+void ShapedServer::resetQueues(QueuePair queues) {
+  queues.toShaped->clear();
+  queues.fromShaped->clear();
+  queues.toShaped->shapedBytes = queues.fromShaped->shapedBytes = 0;
+  queues.toShaped->flowID = 0;
+  queues.toShaped->trafficClass = 0;
+}
+
+bool ShapedServer::resumeFlow(const ControlEvent &resume) {
+  auto flowIter = flowToQueues.find(resume.flowID);
+  if (flowIter == flowToQueues.end()
+      || !suspendedFlows.contains(resume.flowID)) {
+    return false;
+  }
+  auto queues = flowIter->second;
+  suspendedFlows.erase(resume.flowID);
+  // Whatever either middlebox sent must have been received
+  if (resume.sentBytes != queues.fromShaped->shapedBytes
+      || resume.receivedBytes != queues.toShaped->shapedBytes) {
+    log(WARNING, "Flow " + std::to_string(resume.flowID) +
+                 " lost data in flight, terminating it");
+    terminateFlow(queues);
+    return false;
+  }
+  // If there is no multiplexed stream yet, the flow gets one when the first
+  // one starts
+  (*queuesToStream)[queues] = muxStreams.empty()
+                              ? nullptr
+                              : muxStreams[resume.flowID % muxStreams.size()];
+  return true;
+}
+
+void ShapedServer::terminateFlow(QueuePair queues) {
+  auto flowIter = queuesToFlow.find(queues);
+  if (flowIter != queuesToFlow.end()) {
+    suspendedFlows.erase(flowIter->second);
+    flowToQueues.erase(flowIter->second);
+    queuesToFlow.erase(flowIter);
+  }
+  // Its data is discarded till the unshaped side terminates it as well
+  (*queuesToStream)[queues] = nullptr;
+  ConnectionState::set(queues, ConnectionState::FROM_SHAPED_FIN
+                               | ConnectionState::TO_SHAPED_FIN_SENT);
+}
+
+void ShapedServer::expireSuspendedFlows() {
+  mapLock.lock();
+  if (!suspendedFlows.empty()) {
+    log(WARNING, std::to_string(suspendedFlows.size()) +
+                 " flows were not resumed in time, terminating them");
+  }
+  while (!suspendedFlows.empty()) {
+    terminateFlow(flowToQueues[*suspendedFlows.begin()]);
+  }
+  mapLock.unlock();
+}
+
+void ShapedServer::suspendForRestart() {
+  if (resumeTimeout.count() == 0) return;
+  log(WARNING, "Pausing the flows for the restart");
+  paused = true;
+  {
+    std::shared_lock mapReadLock(mapLock);
+    size_t length;
+    controlLock.lock();
+    controlEncoder->addPause();
+    auto frame = controlEncoder->finish(length);
+    controlLock.unlock();
+    send(controlStream, frame, length);
+  }
+  // The data either middlebox sent before arrives meanwhile
+  std::this_thread::sleep_for(std::chrono::milliseconds(RESTART_DRAIN_TIME));
+  shapedServer->shutdown();
+}
+
+inline void ShapedServer::eraseMapping(QueuePair queues) {
   if (queues.toShaped->size() != 0) {
     log(ERROR, "Requested map clearing before all data was sent!");
     return;
   }
+  auto stream = (*queuesToStream)[queues];
 #ifdef DEBUGGING
   log(DEBUG, "Clearing the mapping for the stream " +
-             std::to_string((*streamToID)[stream]) + " mapped to queues {" +
+             (stream == nullptr ? std::string{"(closed)"}
+                                : std::to_string((*streamToID)[stream])) +
+             " mapped to queues {" +
              std::to_string(queues.fromShaped->ID) + "," +
              std::to_string(queues.toShaped->ID) + "}");
 #endif
-  mapLock.lock();
-  (*streamToQueues).erase(stream);
+  auto flowIter = queuesToFlow.find(queues);
+  if (flowIter != queuesToFlow.end()) {
+    // The multiplexed stream is shared with other flows
+    flowToQueues.erase(flowIter->second);
+    queuesToFlow.erase(flowIter);
+  } else if (stream != nullptr) {
+    (*streamToQueues).erase(stream);
+  }
   (*queuesToStream).erase(queues);
   unassignedQueues->push(queues);
+  ConnectionState::set(queues, ConnectionState::SHAPED_RELEASED);
+}
+
+void ShapedServer::resetPeer() {
+  mapLock.lock();
+  if (controlStream == nullptr && dummyStream == nullptr
+      && streamToQueues->empty()) {
+    // Nothing was received on this connection
+    mapLock.unlock();
+    return;
+  }
+  // Only multiplexed flows outlive their streams
+  auto isResumable = isMultiplexed && resumeTimeout.count() > 0;
+  log(WARNING, isResumable
+               ? "Connection to peer1 dropped, suspending all open flows"
+               : "Connection to peer1 dropped, terminating all open flows");
+  controlStream = dummyStream = nullptr;
+  dummyStreamID = QUIC_UINT62_MAX;
+  streamIDtoCtrlMsg.clear();
+  // Drop any partially received control frame of the old connection
+  controlDecoder->clear();
+  isMultiplexed = false;
+  paused = false;
+  muxStreams.clear();
+  muxDemuxers.clear();
+  if (isResumable) {
+    for (const auto &[flowID, queues]: flowToQueues) {
+      suspendedFlows.insert(flowID);
+    }
+    resumeDeadline = std::chrono::steady_clock::now() + resumeTimeout;
+  } else {
+    flowToQueues.clear();
+    queuesToFlow.clear();
+  }
+  for (auto &[queues, stream]: *queuesToStream) {
+    stream = nullptr;
+    if (isResumable && queuesToFlow.contains(queues)) continue;
+    // There is no peer left to send a FIN to, so only the unshaped side has
+    // to terminate the flow before the queues can be re-used
+    ConnectionState::set(queues, ConnectionState::FROM_SHAPED_FIN
+                                 | ConnectionState::TO_SHAPED_FIN_SENT);
+  }
+  streamToQueues->clear();
+  streamToID->clear();
   mapLock.unlock();
 }
 
-void ShapedServer::handleControlMessages(MsQuicStream *ctrlStream,
+void ShapedServer::send(MsQuicStream *stream, uint8_t *buffer,
+                        size_t length) {
+  sendQueue->send({stream, buffer, length}, [this](SendRequest &request) {
+    // The connection may have dropped since the buffer was queued
+    if (isLiveStream(request.stream)) {
+      shapedServer->send(request.stream, request.buffer, request.length);
+    } else {
+      free(request.buffer);
+    }
+  });
+}
+
+inline bool ShapedServer::isLiveStream(MsQuicStream *stream) {
+  return stream != nullptr
+         && (stream == dummyStream || stream == controlStream
+             || streamToQueues->find(stream) != streamToQueues->end()
+             || muxDemuxers.find(stream) != muxDemuxers.end());
+}
+
+bool ShapedServer::handleControlMessages(MsQuicStream *ctrlStream,
                                          uint8_t *buffer, size_t length) {
-  auto ctrlMsgSize = sizeof(ControlMessage);
-  controlMessageQueue->push(buffer, length);
-  auto ctrlMsg = reinterpret_cast<ControlMessage *>(malloc(ctrlMsgSize));
-  while (controlMessageQueue->pop((uint8_t *) ctrlMsg, ctrlMsgSize) != -1) {
-    switch (ctrlMsg->streamType) {
+  controlDecoder->push(buffer, length);
+  ControlEvent ctrlMsg;
+  // The answers to resume requests (true if resumed), by flow
+  std::vector<std::pair<uint64_t, bool>> resumeAnswers;
+  while (controlDecoder->next(ctrlMsg)) {
+    if (ctrlMsg.action == ControlEvent::PAUSE) {
+      log(WARNING, "Peer1 is restarting, pausing the flows");
+      paused = true;
+      continue;
+    }
+    if (ctrlMsg.action == ControlEvent::RESUME) {
+      mapLock.lock();
+      resumeAnswers.emplace_back(ctrlMsg.flowID, resumeFlow(ctrlMsg));
+      mapLock.unlock();
+      continue;
+    }
+    if (ctrlMsg.action != ControlEvent::NO_ACTION) continue;
+    switch (ctrlMsg.streamType) {
       case Dummy:
 #ifdef DEBUGGING
-        log(DEBUG, "Dummy stream is at " + std::to_string(ctrlMsg->streamID));
+        log(DEBUG, "Dummy stream is at " + std::to_string(ctrlMsg.streamID));
 #endif
-        dummyStreamID = ctrlMsg->streamID;
+        dummyStreamID = ctrlMsg.streamID;
         break;
       case Data: {
         mapLock.lock();
-        auto dataStream = findStreamByID(ctrlMsg->streamID);
+        auto dataStream = findStreamByID(ctrlMsg.streamID);
         QueuePair queues = {nullptr, nullptr};
-        switch (ctrlMsg->connStatus) {
-          case SYN:
+        switch (ctrlMsg.connStatus) {
+          case SYN: {
 #ifdef DEBUGGING
             log(DEBUG, "Received SYN on stream " +
-                       std::to_string(ctrlMsg->streamID));
+                       std::to_string(ctrlMsg.streamID));
 #endif
+            ControlMessage synMsg{ctrlMsg.streamID, Data, SYN};
+            copyAddresses(ctrlMsg, synMsg.addrPair);
             if (dataStream != nullptr
                 &&
                 (*streamToQueues).find(dataStream) != (*streamToQueues).end()) {
               queues = (*streamToQueues)[dataStream];
-              copyClientInfo(queues, ctrlMsg);
+              copyClientInfo(queues, &synMsg);
+              trafficClasses.classify(queues);
               updateConnectionStatus(queues.fromShaped->ID, SYN);
             } else {
               // Map from stream (which has not yet started) to client
-              streamIDtoCtrlMsg[ctrlMsg->streamID] = *ctrlMsg;
+              streamIDtoCtrlMsg[ctrlMsg.streamID] = synMsg;
             }
+          }
             break;
           case FIN:
             queues = (*streamToQueues)[dataStream];
             if (queues.fromShaped != nullptr) {
 #ifdef DEBUGGING
               log(DEBUG, "Received FIN from stream " +
-                         std::to_string(ctrlMsg->streamID) +
+                         std::to_string(ctrlMsg.streamID) +
                          " mapped to queues {" +
                          std::to_string(queues.fromShaped->ID) + "," +
                          std::to_string(queues.toShaped->ID) + "}");
 #endif
-              queues.fromShaped->markedForDeletion = true;
-              updateConnectionStatus(queues.fromShaped->ID, FIN);
+              ConnectionState::set(queues, ConnectionState::FROM_SHAPED_FIN);
             }
             break;
           default:
@@ -263,23 +473,119 @@ void ShapedServer::handleControlMessages(MsQuicStream *ctrlStream,
         mapLock.unlock();
       }
         break;
+      case Multiplexed: {
+        mapLock.lock();
+        QueuePair queues = {nullptr, nullptr};
+        switch (ctrlMsg.connStatus) {
+          case SYN:
+#ifdef DEBUGGING
+            log(DEBUG, "Received SYN for flow " +
+                       std::to_string(ctrlMsg.flowID));
+#endif
+            // A suspended flow of the same ID was not resumed by the other
+            // middlebox, which has re-used the ID
+            if (suspendedFlows.contains(ctrlMsg.flowID)) {
+              terminateFlow(flowToQueues[ctrlMsg.flowID]);
+            }
+            // The flow's data may have arrived (and got it queues) first
+            queues = assignFlowQueues(ctrlMsg.flowID, nullptr);
+            if (queues.fromShaped == nullptr) {
+              log(ERROR, "More flows from peer than queues!");
+              break;
+            }
+            copyAddresses(ctrlMsg, queues.toShaped->addrPair);
+            copyAddresses(ctrlMsg, queues.fromShaped->addrPair);
+            // The flow is shaped by the default loop till its SYN
+            trafficClasses.classify(queues);
+            updateConnectionStatus(queues.fromShaped->ID, SYN);
+            break;
+          case FIN: {
+            auto flowIter = flowToQueues.find(ctrlMsg.flowID);
+            if (flowIter == flowToQueues.end()) break;
+            queues = flowIter->second;
+#ifdef DEBUGGING
+            log(DEBUG, "Received FIN for flow " +
+                       std::to_string(ctrlMsg.flowID) +
+                       " mapped to queues {" +
+                       std::to_string(queues.fromShaped->ID) + "," +
+                       std::to_string(queues.toShaped->ID) + "}");
+#endif
+            ConnectionState::set(queues, ConnectionState::FROM_SHAPED_FIN);
+          }
+            break;
+          default:
+            break;
+        }
+        mapLock.unlock();
+      }
+        break;
       case Control:
-        if (controlStream == nullptr) controlStream = ctrlStream;
+        if (controlStream == nullptr) {
+          controlStream = ctrlStream;
+          isMultiplexed = ctrlMsg.numMuxStreams > 0;
+#ifdef DEBUGGING
+          if (isMultiplexed) {
+            log(DEBUG, "Peer multiplexes its flows on " +
+                       std::to_string(ctrlMsg.numMuxStreams) + " streams");
+          }
+#endif
+        }
         // Else, this (re-identification of control stream) should never happen
         break;
     }
   }
+  if (controlDecoder->failed()) {
+    controlDecoder->clear();
+    // Also happens if data on another stream arrives before the control
+    // stream is identified. Only the identified control stream is lost
+    if (controlStream == nullptr || ctrlStream != controlStream) {
+      log(ERROR, "Received a malformed control frame (or one of an "
+                 "unsupported version), dropping it");
+      return true;
+    }
+    log(ERROR, "Received a malformed control frame (or one of an "
+               "unsupported version), resetting the connection");
+    return false;
+  }
+  if (resumeAnswers.empty()) return true;
+  mapLock.lock_shared();
+  controlLock.lock();
+  for (const auto &[flowID, isResumed]: resumeAnswers) {
+    auto flowIter = flowToQueues.find(flowID);
+    if (isResumed && flowIter != flowToQueues.end()) {
+      controlEncoder->addFlowResume(flowID,
+                                    flowIter->second.toShaped->shapedBytes,
+                                    flowIter->second.fromShaped->shapedBytes);
+    } else {
+      controlEncoder->addFlowReset(flowID);
+    }
+  }
+  size_t frameLength;
+  auto frame = controlEncoder->finish(frameLength);
+  controlLock.unlock();
+  send(controlStream, frame, frameLength);
+  mapLock.unlock_shared();
+  return true;
 }
 
 void ShapedServer::receivedShapedData(MsQuicStream *stream,
                                       uint8_t *buffer, size_t length) {
   // Check if this is first byte from the other middlebox
   if (stream == controlStream || controlStream == nullptr) {
-    handleControlMessages(stream, buffer, length);
+    if (!handleControlMessages(stream, buffer, length)) {
+      shapedServer->resetConnections();
+    }
     return;
   }
 
   // Not a control stream... Check for other types
+  if (isMultiplexed && dummyStreamID != QUIC_UINT62_MAX
+      && stream->ID() != dummyStreamID) {
+    // The dummy stream is announced before the multiplexed streams start,
+    // so every other stream is a multiplexed one
+    receivedMuxData(stream, buffer, length);
+    return;
+  }
   if (dummyStream == nullptr || stream == dummyStream) {
     if (stream->ID() == dummyStreamID) {
       if (dummyStream == nullptr) dummyStream = stream;
@@ -290,15 +596,21 @@ void ShapedServer::receivedShapedData(MsQuicStream *stream,
 
   // This is a data stream
   mapLock.lock_shared();
-  if ((*streamToQueues)[stream].fromShaped == nullptr) {
-    if (!assignQueues(stream)) {
+  auto queuesIter = streamToQueues->find(stream);
+  auto fromShaped = queuesIter == streamToQueues->end()
+                    ? nullptr : queuesIter->second.fromShaped;
+  mapLock.unlock_shared();
+  if (fromShaped == nullptr) {
+    // First data on this stream. The shaper loops iterate the maps under the
+    // shared lock, so they are only changed under the exclusive one
+    mapLock.lock();
+    if (assignQueues(stream)) fromShaped = (*streamToQueues)[stream].fromShaped;
+    mapLock.unlock();
+    if (fromShaped == nullptr) {
       log(ERROR, "More streams from peer than allowed!");
       return;
     }
   }
-
-  auto fromShaped = (*streamToQueues)[stream].fromShaped;
-  mapLock.unlock_shared();
   while (fromShaped->push(buffer, length) == -1) {
     log(WARNING, "(fromShaped) " + std::to_string(fromShaped->ID) +
                  " is full, waiting for it to be empty");
@@ -309,6 +621,64 @@ void ShapedServer::receivedShapedData(MsQuicStream *stream,
         std::chrono::microseconds(unshapedProcessLoopInterval));
 #endif
   }
+  fromShaped->shapedBytes += length;
+}
+
+void ShapedServer::receivedMuxData(MsQuicStream *stream, uint8_t *buffer,
+                                   size_t length) {
+  mapLock.lock();
+  auto demuxIter = muxDemuxers.find(stream);
+  if (demuxIter == muxDemuxers.end()) {
+    // First data on this stream. Flows waiting for a stream to send their
+    // data on get this one
+    demuxIter = muxDemuxers.try_emplace(stream).first;
+    muxStreams.push_back(stream);
+    (*streamToID)[stream] = stream->ID();
+    for (const auto &[queues, flowID]: queuesToFlow) {
+      auto &flowStream = (*queuesToStream)[queues];
+      // Suspended flows wait for the other middlebox to resume them
+      if (flowStream == nullptr && !suspendedFlows.contains(flowID))
+        flowStream = stream;
+    }
+  }
+  // Only the receive thread of this stream uses its demuxer
+  auto &demuxer = demuxIter->second;
+  mapLock.unlock();
+
+  auto isValid = demuxer.demux(
+      buffer, length,
+      [this, stream](uint64_t flowID, uint8_t *payload, size_t size) {
+        mapLock.lock_shared();
+        auto flowIter = flowToQueues.find(flowID);
+        auto fromShaped = flowIter == flowToQueues.end()
+                          ? nullptr : flowIter->second.fromShaped;
+        mapLock.unlock_shared();
+        if (fromShaped == nullptr) {
+          // Data of a new flow can arrive before its SYN
+          mapLock.lock();
+          fromShaped = assignFlowQueues(flowID, stream).fromShaped;
+          mapLock.unlock();
+        }
+        if (fromShaped == nullptr) {
+          log(ERROR, "More flows from peer than queues!");
+          return;
+        }
+        while (fromShaped->push(payload, size) == -1) {
+          log(WARNING, "(fromShaped) " + std::to_string(fromShaped->ID) +
+                       " of flow " + std::to_string(flowID) +
+                       " is full, waiting for it to be empty");
+#ifdef SHAPING
+          std::this_thread::sleep_for(
+              std::chrono::microseconds(unshapedProcessLoopInterval));
+#endif
+        }
+        fromShaped->shapedBytes += size;
+      });
+  if (!isValid) {
+    log(ERROR, "Received a malformed flow frame, resetting the stream's "
+               "demultiplexer");
+    demuxer = FlowDemuxer{};
+  }
 }
 
 PreparedBuffer ShapedServer::prepareDummy(size_t dummySize) {
@@ -319,55 +689,100 @@ PreparedBuffer ShapedServer::prepareDummy(size_t dummySize) {
   return {dummyStream, buffer, dummySize};
 }
 
-std::vector<PreparedBuffer> ShapedServer::prepareData(size_t dataSize) {
-  std::vector<PreparedBuffer> preparedBuffers{};
+void ShapedServer::prepareData(uint32_t trafficClass, size_t dataSize,
+                               PreparedBuffers &preparedBuffers) {
+  if (paused) return;
   mapLock.lock_shared();
-  auto tempMap = *queuesToStream;
+  auto hasExpired = !suspendedFlows.empty()
+                    && std::chrono::steady_clock::now() >= resumeDeadline;
   mapLock.unlock_shared();
-  for (const auto &[queues, stream]: tempMap) {
-//    if (stream == nullptr) continue;
+  if (hasExpired) expireSuspendedFlows();
+  // The mappings of the flows that are done are erased after the loop, once
+  // mapLock can be taken exclusively
+  std::vector<QueuePair> released{};
+  mapLock.lock_shared();
+  for (const auto &[queues, stream]: *queuesToStream) {
+    if (queues.toShaped->trafficClass != trafficClass) continue;
+    auto flowIter = queuesToFlow.find(queues);
+    auto isFlow = flowIter != queuesToFlow.end();
+    // A multiplexed flow without a stream waits for the first one to start
+    if (isFlow && stream == nullptr) continue;
+    auto state = ConnectionState::load(queues);
     auto queueSize = queues.toShaped->size();
+    if (stream == nullptr && queueSize > 0) {
+      // The connection this flow was on dropped. Discard its data
+      auto buffer = reinterpret_cast<uint8_t *>(malloc(queueSize));
+      if (buffer == nullptr) continue;
+      queues.toShaped->pop(buffer, queueSize);
+      free(buffer);
+      queueSize = 0;
+    }
     // No data in this queue, check for FINs and erase mappings
     if (queueSize == 0) {
-      if ((*pendingSignal)[queues.toShaped->ID] == FIN) {
-        // Send a termination control message
-        auto *message =
-            reinterpret_cast<struct ControlMessage *>(malloc(sizeof(struct
-                ControlMessage)));
-        message->streamID = (*streamToID)[stream];
+      if (stream != nullptr
+          && ConnectionState::isPendingFIN(
+              state, ConnectionState::TO_SHAPED_FIN,
+              ConnectionState::TO_SHAPED_FIN_SENT)) {
+        // Send a termination control message (with the rest of this tick's).
+        // The engines of the other traffic classes share the encoder
+        std::scoped_lock ctrlLock(controlLock);
+        auto idIter = streamToID->find(stream);
+        if (isFlow) {
 #ifdef DEBUGGING
-        log(DEBUG,
-            "Sending FIN on stream " + std::to_string(message->streamID)
-            + " mapped to queues {" +
-            std::to_string(queues.fromShaped->ID) + "," +
-            std::to_string(queues.toShaped->ID) + "}");
+          log(DEBUG, "Sending FIN for flow " +
+                     std::to_string(flowIter->second));
 #endif
-        message->streamType = Data;
-        message->connStatus = FIN;
-        shapedServer->send(controlStream,
-                           reinterpret_cast<uint8_t *>(message),
-                           sizeof(*message));
-        (*pendingSignal).erase(queues.toShaped->ID);
-        queues.toShaped->sentFIN = true;
+          controlEncoder->addFlowFIN(flowIter->second);
+        } else if (idIter != streamToID->end()) {
+#ifdef DEBUGGING
+          log(DEBUG,
+              "Sending FIN on stream " + std::to_string(idIter->second)
+              + " mapped to queues {" +
+              std::to_string(queues.fromShaped->ID) + "," +
+              std::to_string(queues.toShaped->ID) + "}");
+#endif
+          controlEncoder->addFIN(idIter->second);
+        }
+        ConnectionState::set(queues, ConnectionState::TO_SHAPED_FIN_SENT);
+        state |= ConnectionState::TO_SHAPED_FIN_SENT;
       }
-      if (queues.toShaped->markedForDeletion
-          && queues.fromShaped->markedForDeletion
-          && queues.toShaped->sentFIN) {
-        eraseMapping(stream);
+      if (ConnectionState::has(state, ConnectionState::SHAPED_DONE)) {
+        released.push_back(queues);
       }
       continue;
     }
 
     // We have sent enough
-    if (dataSize == 0) break;
+    if (dataSize == 0 || preparedBuffers.full()) break;
     auto sizeToSendFromQueue = std::min(queueSize, dataSize);
-    auto buffer =
-        reinterpret_cast<uint8_t *>(malloc(sizeToSendFromQueue + 1));
+    // Multiplexed data is framed with the ID of its flow
+    auto headerSize =
+        isFlow ? flowHeaderSize(flowIter->second, sizeToSendFromQueue) : 0;
+    auto buffer = reinterpret_cast<uint8_t *>(
+        malloc(headerSize + sizeToSendFromQueue + 1));
     if (buffer == nullptr) continue;
-    queues.toShaped->pop(buffer, sizeToSendFromQueue);
-    preparedBuffers.push_back({stream, buffer, sizeToSendFromQueue});
+    if (isFlow) putFlowHeader(buffer, flowIter->second, sizeToSendFromQueue);
+    // Counted before they leave the queue: if this process dies in between,
+    // the flow can't be resumed
+    queues.toShaped->shapedBytes += sizeToSendFromQueue;
+    queues.toShaped->pop(buffer + headerSize, sizeToSendFromQueue);
+    preparedBuffers.push({stream, buffer, headerSize + sizeToSendFromQueue});
+    dataSize -= sizeToSendFromQueue;
   }
-  return preparedBuffers;
+
+  // All FINs of this tick go out in one frame
+  size_t length;
+  controlLock.lock();
+  auto frame = controlEncoder->finish(length);
+  controlLock.unlock();
+  // Dropped if the other middlebox is not connected
+  if (frame != nullptr) send(controlStream, frame, length);
+  mapLock.unlock_shared();
+
+  if (released.empty()) return;
+  mapLock.lock();
+  for (const auto &queues: released) eraseMapping(queues);
+  mapLock.unlock();
 }
 
 void ShapedServer::log(logLevels level, const std::string &log) {
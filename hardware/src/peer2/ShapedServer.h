@@ -11,17 +11,24 @@
 #include <thread>
 #include <queue>
 #include <shared_mutex>
+#include <unordered_set>
 #include "../modules/quic_wrapper/Server.h"
 #include "../modules/lamport_queue/Cpp/LamportQueue.hpp"
 #include "../util/helpers.h"
 #include "../modules/shaper/NoiseGenerator.h"
 #include "../util/config.h"
 #include "../util/Shaped.h"
+#include "../util/ShaperEngine.h"
+#include "../util/FlowFrame.h"
 
 using namespace helpers;
 
-class ShapedServer : Shaped {
+class ShapedServer final : Shaped {
 private:
+  // Runs the shaper loop on this peer, calling it directly
+  template<class, sendingStrategy> friend
+  class helpers::ShaperEngine;
+
   QUIC::Server *shapedServer;
   std::queue<QueuePair> *unassignedQueues;
 
@@ -33,6 +40,20 @@ private:
   // before the dummy stream begins.
   QUIC_UINT62 dummyStreamID;
 
+  // Set if the other middlebox multiplexes the data of all flows on a few
+  // streams (announced with the control stream). Flows are then identified
+  // by the flow ID in their frames instead of by their stream
+  bool isMultiplexed = false;
+  std::vector<MsQuicStream *> muxStreams;
+  std::unordered_map<MsQuicStream *, FlowDemuxer> muxDemuxers;
+  std::unordered_map<uint64_t, QueuePair> flowToQueues;
+  std::unordered_map<QueuePair, uint64_t, QueuePairHash> queuesToFlow;
+  // Multiplexed flows that were open when the connection dropped (or this
+  // process restarted). Their data is kept, for the other middlebox to
+  // resume them before resumeDeadline. Guarded by mapLock
+  std::unordered_set<uint64_t> suspendedFlows;
+  std::chrono::steady_clock::time_point resumeDeadline;
+
 /**
  * @brief Signal the shaped process on change of queue status
  * @param queueID The ID of the queue whose status has changed
@@ -50,31 +71,106 @@ private:
   static void copyClientInfo(QueuePair queues, struct ControlMessage *ctrlMsg);
 
 /**
- * @brief assign a new queue for a new client
+ * @brief assign a new queue for a new client. Must be called with mapLock
+ * held (exclusively)
  * @param stream The new stream (representing a new client)
  * @return true if queue was assigned successfully
  */
   inline bool assignQueues(MsQuicStream *stream);
 
   /**
-   * @brief Erase mapping once the stream finishes sending
-   * @param stream The stream pointer to erase the mapping of
+   * @brief Get the queues of a multiplexed flow, assigning new queues to it
+   * if it has none yet. Must be called with mapLock held (exclusively)
+   * @param flowID The ID of the flow
+   * @param stream The stream to send the flow's data on (nullptr to pick one)
+   * @return The queues (nullptrs if none are left)
+   */
+  QueuePair assignFlowQueues(uint64_t flowID, MsQuicStream *stream);
+
+  /**
+   * @brief Empty the queues that are being re-used
+   * @param queues The queues to reset
+   */
+  static void resetQueues(QueuePair queues);
+
+  /**
+   * @brief Push the data received on a multiplexed stream to the queues of
+   * the flows it belongs to
+   * @param stream The stream the data was received on
+   * @param buffer The received data
+   * @param length The length of the received data
+   */
+  void receivedMuxData(MsQuicStream *stream, uint8_t *buffer, size_t length);
+
+  /**
+   * @brief Erase mapping once the stream finishes sending. Must be called
+   * with mapLock held (exclusively)
+   * @param queues The queues to erase the mapping of
+   */
+  inline void eraseMapping(QueuePair queues);
+
+  /**
+   * @brief Forget the streams of the connection that is shutting down and
+   * terminate the flows that were open on it (or suspend them, see
+   * suspendedFlows). The next connection from the other middlebox starts
+   * afresh
+   */
+  void resetPeer();
+
+  /**
+   * @brief Resume a suspended flow on the multiplexed streams, if neither
+   * middlebox lost any of its bytes. Terminates it otherwise. Must be called
+   * with mapLock held (exclusively)
+   * @param resume The resume request of the other middlebox
+   * @return true if the flow was resumed
+   */
+  bool resumeFlow(const ControlEvent &resume);
+
+  /**
+   * @brief Terminate a flow that has no stream (anymore), without sending a
+   * FIN. Must be called with mapLock held (exclusively)
+   * @param queues The queues of the flow
+   */
+  void terminateFlow(QueuePair queues);
+
+  /**
+   * @brief Terminate the suspended flows once resumeDeadline has passed
+   */
+  void expireSuspendedFlows();
+
+  /**
+   * @brief Take the flow on the given queue pair over from the previous
+   * shaped process, after a restart. An open multiplexed flow is suspended
+   * (if resumeTimeout allows it), any other one is terminated
+   * @param queues The queue pair
+   * @return false if the queue pair is not in use (by this process)
+   */
+  bool restoreFlow(QueuePair queues);
+
+  /**
+   * @brief Check if the given stream still belongs to the live connection.
+   * Must be called with mapLock held
+   * @param stream The stream to check
    */
-  inline void eraseMapping(MsQuicStream *stream);
+  inline bool isLiveStream(MsQuicStream *stream);
 
-  void initialiseSHM(int numStreams, size_t queueSize) override;
+  void initialiseSHM(int numStreams, size_t queueSize, size_t segmentSize,
+                     size_t slabPoolSize) override;
 
   MsQuicStream *findStreamByID(QUIC_UINT62 ID) override;
 
-  void handleControlMessages(MsQuicStream *ctrlStream,
+  bool handleControlMessages(MsQuicStream *ctrlStream,
                              uint8_t *buffer, size_t length) override;
 
+  void send(MsQuicStream *stream, uint8_t *buffer, size_t length) override;
+
   void receivedShapedData(MsQuicStream *stream, uint8_t *buffer, size_t
   length) override;
 
   PreparedBuffer prepareDummy(size_t dummySize) override;
 
-  std::vector<PreparedBuffer> prepareData(size_t dataSize) override;
+  void prepareData(uint32_t trafficClass, size_t dataSize,
+                   PreparedBuffers &preparedBuffers) override;
 
   void log(logLevels level, const std::string &log) override;
 
@@ -86,7 +182,13 @@ public:
    */
   explicit ShapedServer(config::Peer2Config &peer2Config);
 
-  [[noreturn]] void getUpdatedConnectionStatus() override;
+  /**
+   * @brief Pause the multiplexed flows on both middleboxes and close the
+   * connection once the data in flight arrived, before this process exits.
+   * The restarted process takes them over intact. Does nothing without
+   * resumeTimeout
+   */
+  void suspendForRestart();
 };
 
 
@@ -11,119 +11,219 @@ UnshapedClient::UnshapedClient(config::Peer2Config &peer2Config) :
     peer2Config(peer2Config) {
   this->appName = peer2Config.appName;
   this->logLevel = peer2Config.logLevel;
+  this->hugePageSize = peer2Config.hugePageSize;
+  // The real-time shaper must not take page faults on the SHM
+  this->prefaultSHM = peer2Config.prefaultSHM
+                      || peer2Config.shapedServer.realTimePriority > 0;
+  this->fused = peer2Config.fused;
+  // Where the shaper and the drain of the queues run
+  if (peer2Config.numaAware) {
+    auto &cores = peer2Config.shapedServer.shaperCores;
+    this->numaNode = helpers::numaNodeOf(
+        cores.empty() ? peer2Config.unshapedClient.cores : cores);
+  }
   shapedProcessLoopInterval =
-      peer2Config.shapedServer.strategy == UNIFORM
-      ? peer2Config.shapedServer.sendingLoopInterval
-      : peer2Config.shapedServer.DPCreditorLoopInterval;
+      config::shortestShaperInterval(peer2Config.shapedServer,
+                                     peer2Config.trafficClasses);
 
-  queuesToClient =
-      new std::unordered_map<QueuePair, TCP::Client *,
+  queuesToSocket =
+      new std::unordered_map<QueuePair, int,
           QueuePairHash>(peer2Config.maxStreamsPerPeer);
-  pendingSignal =
-      new std::unordered_map<uint64_t, connectionStatus>(
-          peer2Config.maxStreamsPerPeer);
-  clientToQueues =
-      new std::unordered_map<TCP::Client *, QueuePair>();
+  socketToQueues = new std::unordered_map<int, QueuePair>();
+
+  auto onResponseFunc = [this](auto &&PH1, auto &&PH2, auto &&PH3, auto &&PH4,
+                               auto &&PH5) {
+    return onResponse(std::forward<decltype(PH1)>(PH1),
+                      std::forward<decltype(PH2)>(PH2),
+                      std::forward<decltype(PH3)>(PH3),
+                      std::forward<decltype(PH4)>(PH4),
+                      std::forward<decltype(PH5)>(PH5));
+  };
+  // Not listening: only reads the sockets the connector opened
+  upstreams = new TCP::Server{"", 0, onResponseFunc, logLevel,
+                              peer2Config.unshapedClient.ioThreads,
+                              peer2Config.unshapedClient.cores};
+  // Stop reading from a destination while its toShaped queue is full,
+  // instead of waiting for space with its data in hand
+  upstreams->setReceiveSpace([this](int socket) {
+    return receiveSpace(socket);
+  }, (int) shapedProcessLoopInterval);
+  upstreams->startReading();
+
+  connector = new TCP::Connector(peer2Config.unshapedClient.connectTimeout,
+                                 peer2Config.unshapedClient.addressCacheTTL,
+                                 2, logLevel);
+  connectionPool = new TCP::ConnectionPool(
+      connector, peer2Config.unshapedClient.poolSize,
+      peer2Config.unshapedClient.poolMaxDestinations,
+      peer2Config.unshapedClient.poolMaxIdle,
+      peer2Config.unshapedClient.poolCheckInterval, logLevel);
+  for (const auto &destination: peer2Config.unshapedClient.poolDestinations) {
+    auto separator = destination.rfind(':');
+    if (separator == std::string::npos) {
+      log(WARNING, "Ignoring pool destination " + destination +
+                   " (expected host:port)");
+      continue;
+    }
+    connectionPool->warm(destination.substr(0, separator),
+                         std::stoi(destination.substr(separator + 1)));
+  }
 
   initialiseSHM(peer2Config.maxPeers * peer2Config.maxStreamsPerPeer,
-                peer2Config.queueSize);
+                peer2Config.queueSize, peer2Config.segmentSize,
+                peer2Config.slabPoolSize);
 
-  auto checkQueuesFunc = [=, this]() {
-    checkQueuesForData(peer2Config.unshapedClient.checkQueuesInterval,
-                       peer2Config.queueSize);
-  };
-  std::thread checkQueuesLoop(checkQueuesFunc);
-  checkQueuesLoop.detach();
+  startDrainWorkers(peer2Config.unshapedClient.drainThreads,
+                    peer2Config.unshapedClient.cores,
+                    peer2Config.unshapedClient.checkQueuesInterval,
+                    peer2Config.queueSize);
 
-  std::thread updateQueueStatus([this]() { getUpdatedConnectionStatus(); });
-  updateQueueStatus.detach();
+  if (fused) {
+    // The shaped half (constructed after this) hands the SYNs over directly
+    sigInfo->setHandler(SignalInfo::fromShaped,
+                        [](void *context, SignalInfo::queueInfo &info) {
+                          static_cast<UnshapedClient *>(context)
+                              ->handleSignal(info);
+                        }, this);
+  } else {
+    std::thread updateQueueStatus([this]() { getUpdatedConnectionStatus(); });
+    updateQueueStatus.detach();
+  }
 }
 
-inline void UnshapedClient::initialiseSHM(int numStreams, size_t queueSize) {
-  auto shmAddr = helpers::initialiseSHM(numStreams, appName, queueSize);
+inline void UnshapedClient::initialiseSHM(int numStreams, size_t queueSize,
+                                          size_t segmentSize,
+                                          size_t slabPoolSize) {
+  auto layout = helpers::layoutSHM(numStreams, queueSize, segmentSize,
+                                   slabPoolSize);
+  auto shmAddr =
+      helpers::createSHM(appName, layout, hugePageSize, prefaultSHM,
+                         numaNode);
 
-  // The beginning of the SHM contains the signalStruct struct
-  sigInfo = new(shmAddr) SignalInfo{numStreams};
+  // The SHM header is followed by the signalStruct struct
+  sigInfo = new(shmAddr + layout.signalInfoOffset) SignalInfo{numStreams};
 
-  // The rest of the SHM contains the queues
-  shmAddr += (sizeof(SignalInfo) + (2 * sizeof(LamportQueue)) +
-              (4 * numStreams * sizeof(SignalInfo::queueInfo)));
+  // The rest of the SHM contains the queues, and the slab pool they take
+  // their segments from
+  auto pool = layout.pool(shmAddr);
+  if (pool != nullptr)
+    new(pool) SlabPool{layout.segmentSize, layout.numSegments};
+  auto newQueue = [&](uint64_t i) {
+    auto queue = layout.queue(shmAddr, i);
+    return pool == nullptr ? new(queue) LamportQueue{i, queueSize}
+                           : new(queue) LamportQueue{i, queueSize, pool};
+  };
+  queueMemory = layout.queue(shmAddr, 0);
+  numQueuePairs = numStreams;
+  queueMemorySize = layout.size - layout.queuesOffset;
   for (unsigned long i = 0; i < numStreams * 2 + 2; i += 2) {
-    auto queue1 =
-        new(shmAddr +
-            (i * (sizeof(class LamportQueue) + queueSize)))
-            LamportQueue{i, queueSize};
-    auto queue2 =
-        new(shmAddr + ((i + 1) * (sizeof(class LamportQueue) + queueSize)))
-            LamportQueue{i + 1, queueSize};
-    if (i > 0) (*queuesToClient)[{queue1, queue2}] = nullptr;
-    else dummyQueues = {queue1, queue2};
+    auto queue1 = newQueue(i);
+    auto queue2 = newQueue(i + 1);
+    if (i > 0) {
+      (*queuesToSocket)[{queue1, queue2}] = -1;
+      queuePairs.push_back({queue1, queue2});
+    } else {
+      dummyQueues = {queue1, queue2};
+    }
   }
+
+  // In fused mode, only the shaped half in this process attaches
+  if (fused) helpers::keepSHMInProcess(appName, shmAddr);
+  // The shaped process attaches as soon as this is done
+  helpers::publishSHM(shmAddr);
 }
 
-void UnshapedClient::onResponse(TCP::Client *client,
+bool UnshapedClient::onResponse(int socket, std::string &address,
                                 uint8_t *buffer, size_t length,
                                 connectionStatus connStatus) {
-  if (connStatus == ONGOING) {
-    mapLock.lock_shared();
-    auto toShaped = (*clientToQueues).at(client).toShaped;
+  mapLock.lock_shared();
+  auto mapping = socketToQueues->find(socket);
+  if (mapping == socketToQueues->end()) {
     mapLock.unlock_shared();
-
-    while (toShaped->push(buffer, length) == -1) {
-      log(WARNING, "(toShaped) " + std::to_string(toShaped->ID) +
-                   " is full, waiting for it to be empty!");
-#ifdef SHAPING
-      // Sleep for some time. For performance reasons, this is the same as
-      // the interval with which DP Logic thread runs in Shaped component.
-      std::this_thread::sleep_for(
-          std::chrono::microseconds(shapedProcessLoopInterval));
-#endif
-    }
+    log(WARNING, "No queues mapped to the socket of " + address + "!");
+    return false;
+  }
+  auto queues = mapping->second;
+  mapLock.unlock_shared();
+  if (connStatus == ONGOING) {
+    // The server only reads what fits (see receiveSpace), so this doesn't
+    // wait
+    pushAll(queues.toShaped, buffer, length);
   } else if (connStatus == FIN) {
-    auto &queues = (*clientToQueues)[client];
-    if (queues.fromShaped == nullptr || queues.toShaped == nullptr) {
-      log(WARNING, "No queues mapped to the client!");
-      return;
-    }
 #ifdef DEBUGGING
-    log(DEBUG, "Received FIN from client connected to queues {" +
+    log(DEBUG, "Received FIN from " + address + " connected to queues {" +
                std::to_string(queues.fromShaped->ID) + "," +
                std::to_string(queues.toShaped->ID) + "}");
 #endif
-    queues.toShaped->markedForDeletion = true;
-//    if (queues.fromShaped->markedForDeletion
-//        && queues.fromShaped->size() == 0) {
-//      eraseMapping(client);
-//    }
-    updateConnectionStatus(queues.toShaped->ID, FIN);
+    // Picked up by the shaped process once it sent the data before it
+    ConnectionState::set(queues, ConnectionState::TO_SHAPED_FIN);
   }
+  return true;
 }
 
-inline void UnshapedClient::eraseMapping(TCP::Client *client) {
-  QueuePair queues;
-  // Clear mappings
+size_t UnshapedClient::receiveSpace(int socket) {
+  std::shared_lock lock(mapLock);
+  auto queues = socketToQueues->find(socket);
+  if (queues == socketToQueues->end()) return 0;
+  return queues->second.toShaped->freeSpace();
+}
+
+void UnshapedClient::onConnected(QueuePair queues, int socket, int error) {
+  if (error < 0) {
+    log(ERROR, std::string("Could not connect to ") +
+               queues.fromShaped->addrPair.serverAddress + ":" +
+               queues.fromShaped->addrPair.serverPort + " for queues {" +
+               std::to_string(queues.fromShaped->ID) + "," +
+               std::to_string(queues.toShaped->ID) + "}");
+    // No data ever comes back. The pair is released once the shaped process
+    // is done with it as well (see checkQueuesForData)
+    ConnectionState::set(queues, ConnectionState::TO_SHAPED_FIN);
+    return;
+  }
+
+  auto address = std::string(queues.fromShaped->addrPair.serverAddress) +
+                 ":" + queues.fromShaped->addrPair.serverPort;
+#ifdef DEBUGGING
+  log(DEBUG, "Socket " + std::to_string(socket) + " connected to " +
+             address + " paired to queues {" +
+             std::to_string(queues.fromShaped->ID) + "," +
+             std::to_string(queues.toShaped->ID) + "}");
+#endif
   mapLock.lock();
-  queues = (*clientToQueues)[client];
-  (*clientToQueues).erase(client);
+  (*queuesToSocket)[queues] = socket;
+  (*socketToQueues)[socket] = queues;
   mapLock.unlock();
+  ConnectionState::open(queues);
+  // Mapped first: the responses are read from here on
+  upstreams->readFrom(socket, std::move(address));
+}
 
+inline void UnshapedClient::eraseMapping(int socket) {
+  mapLock.lock();
+  auto mapping = socketToQueues->find(socket);
+  if (mapping == socketToQueues->end()) {
+    mapLock.unlock();
+    return;
+  }
+  auto queues = mapping->second;
 #ifdef DEBUGGING
   log(DEBUG, "Clearing the mapping for the queues {" +
              std::to_string(queues.fromShaped->ID) + "," +
              std::to_string(queues.toShaped->ID) + "}");
 #endif
-
-  delete client;
-  (*queuesToClient)[queues] = nullptr;
+  socketToQueues->erase(mapping);
+  (*queuesToSocket)[queues] = -1;
+  ConnectionState::set(queues, ConnectionState::UNSHAPED_RELEASED);
+  mapLock.unlock();
+  // Only once the mapping is gone: a new connect may get the same socket
+  upstreams->closeClient(socket);
 }
 
 QueuePair UnshapedClient::findQueuesByID(uint64_t queueID) {
-  for (const auto &[queues, client]: *queuesToClient) {
-    if (queues.fromShaped->ID == queueID) {
-      return queues;
-    }
-  }
-  return {nullptr, nullptr};
+  // The dummy queues take IDs 0 and 1, pair n holds IDs 2n + 2 and 2n + 3
+  auto index = queueID / 2 - 1;
+  if (queueID < 2 || index >= queuePairs.size()) return {nullptr, nullptr};
+  return queuePairs[index];
 }
 
 void UnshapedClient::updateConnectionStatus(uint64_t queueID,
@@ -138,52 +238,50 @@ void UnshapedClient::updateConnectionStatus(uint64_t queueID,
 
 [[noreturn]] void UnshapedClient::getUpdatedConnectionStatus() {
   struct SignalInfo::queueInfo queueInfo{};
-  auto sleepUntil = std::chrono::steady_clock::now();
+  uint32_t seen = 0;
   while (true) {
-    sleepUntil = std::chrono::steady_clock::now() +
-                 std::chrono::milliseconds(1);
+    sigInfo->waitForSignal(SignalInfo::fromShaped, seen);
     while (sigInfo->dequeue(SignalInfo::fromShaped, queueInfo)) {
-      auto queues = findQueuesByID(queueInfo.queueID);
-      if (queueInfo.connStatus == SYN) {
-#ifdef DEBUGGING
-        log(DEBUG, "Received SYN on queue (fromShaped) " +
-                   std::to_string(queues.fromShaped->ID));
-#endif
-        auto onResponseFunc = [this](auto &&PH1, auto &&PH2,
-                                     auto &&PH3, auto &&PH4) {
-          onResponse(std::forward<decltype(PH1)>(PH1),
-                     std::forward<decltype(PH2)>(PH2),
-                     std::forward<decltype(PH3)>(PH3),
-                     std::forward<decltype(PH4)>(PH4));
-        };
-        mapLock.lock();
-        auto unshapedClient = new TCP::Client{
-            queues.fromShaped->addrPair.serverAddress,
-            std::stoi(queues.fromShaped->addrPair.serverPort),
-            onResponseFunc, logLevel};
+      handleSignal(queueInfo);
+    }
+  }
+}
 
+void UnshapedClient::handleSignal(SignalInfo::queueInfo &queueInfo) {
+  if (queueInfo.connStatus != SYN) return;
+  auto queues = findQueuesByID(queueInfo.queueID);
 #ifdef DEBUGGING
-        log(DEBUG, "Starting a new client paired to queues {" +
-                   std::to_string(queues.fromShaped->ID) + "," +
-                   std::to_string(queues.toShaped->ID) + "}");
+  log(DEBUG, "Received SYN on queue (fromShaped) " +
+             std::to_string(queues.fromShaped->ID));
 #endif
-        (*queuesToClient)[queues] = unshapedClient;
-        (*clientToQueues)[unshapedClient] = queues;
-        mapLock.unlock();
-      } else if (queueInfo.connStatus == FIN) {
-        (*pendingSignal)[queueInfo.queueID] = FIN;
-      }
-    }
-    std::this_thread::sleep_until(sleepUntil);
-  }
+  // The queues are bound to the client once it has a connection (at once if
+  // the pool has an idle one). Until then, data from the shaped process
+  // waits in fromShaped
+  connectionPool->acquire(
+      queues.fromShaped->addrPair.serverAddress,
+      std::stoi(queues.fromShaped->addrPair.serverPort),
+      [this, queues](int socket, int error) {
+        onConnected(queues, socket, error);
+      });
 }
 
-[[noreturn]] void UnshapedClient::checkQueuesForData(__useconds_t interval,
+[[noreturn]] void UnshapedClient::checkQueuesForData(int worker,
+                                                     __useconds_t interval,
                                                      size_t queueSize) {
-  if (!peer2Config.unshapedClient.cores.empty())
-    setCPUAffinity(peer2Config.unshapedClient.cores);
-
   auto buffer = reinterpret_cast<uint8_t *>(malloc(queueSize));
+  // Non-blocking, so that a server that doesn't read holds up nobody else
+  TCP::SendBatch sendBatch{256, logLevel, true};
+  sendBatch.registerMemory(queueMemory, queueMemorySize);
+  auto [first, last] = ownedRange(worker);
+  // The queue pairs of this worker that have something to do this pass
+  struct Pending {
+    QueuePair queues;
+    int socket;
+    uint32_t state;
+    size_t size;
+  };
+  std::vector<Pending> pending{};
+  pending.reserve(last - first);
 #ifdef SHAPING
   auto nextCheck = std::chrono::steady_clock::now();
 
@@ -194,30 +292,53 @@ void UnshapedClient::updateConnectionStatus(uint64_t queueID,
 #else
   while (true) {
 #endif
-    dummyQueues.fromShaped->pop(buffer, dummyQueues.fromShaped->size());
-    for (const auto &[queues, client]: *queuesToClient) {
-      if (client == nullptr) continue;
+    if (worker == 0)
+      dummyQueues.fromShaped->pop(buffer, dummyQueues.fromShaped->size());
+    // Only look up the sockets of the pairs with data or a FIN to handle
+    mapLock.lock_shared();
+    for (auto index = first; index < last; index++) {
+      const auto &queues = queuePairs[index];
+      auto state = ConnectionState::load(queues);
       auto size = queues.fromShaped->size();
+      if (size == 0 && !ConnectionState::has(
+          state, ConnectionState::FROM_SHAPED_FIN)) {
+        continue;
+      }
+      pending.push_back({queues, queuesToSocket->at(queues), state, size});
+    }
+    mapLock.unlock_shared();
+    for (auto [queues, socket, state, size]: pending) {
+      if (socket < 0) {
+        // The connect failed. Nothing can be forwarded, so the pair is done
+        // as soon as the shaped process got the FIN of the other middlebox
+        if (ConnectionState::has(state, ConnectionState::TO_SHAPED_FIN
+                                        | ConnectionState::FROM_SHAPED_FIN)) {
+          ConnectionState::set(queues, ConnectionState::FROM_SHAPED_FIN_SENT
+                                       | ConnectionState::UNSHAPED_RELEASED);
+        }
+        continue;
+      }
       if (size == 0) {
-        if ((*pendingSignal)[queues.fromShaped->ID] == FIN) {
+        if (ConnectionState::isPendingFIN(
+            state, ConnectionState::FROM_SHAPED_FIN,
+            ConnectionState::FROM_SHAPED_FIN_SENT)) {
 #ifdef DEBUGGING
-          log(DEBUG, "Sending FIN to client connected to (fromShaped)" +
+          log(DEBUG, "Sending FIN to socket connected to (fromShaped)" +
                      std::to_string(queues.fromShaped->ID));
 #endif
-          client->sendFIN();
-          (*pendingSignal).erase(queues.fromShaped->ID);
-          queues.fromShaped->sentFIN = true;
+          TCP::Server::sendFIN(socket);
+          ConnectionState::set(queues, ConnectionState::FROM_SHAPED_FIN_SENT);
+          state |= ConnectionState::FROM_SHAPED_FIN_SENT;
         }
-        if (queues.fromShaped->markedForDeletion
-            && queues.toShaped->markedForDeletion
-            && queues.fromShaped->sentFIN) {
-          eraseMapping(client);
+        if (ConnectionState::has(state, ConnectionState::UNSHAPED_DONE)) {
+          eraseMapping(socket);
         }
       } else {
-        queues.fromShaped->pop(buffer, size);
-        client->sendData(buffer, size);
+        batchSend(sendBatch, socket, queues.fromShaped);
       }
     }
+    pending.clear();
+    sendBatch.flush(sentFromQueue);
   }
 }
 
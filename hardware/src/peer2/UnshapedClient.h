@@ -7,7 +7,10 @@
 
 #include <thread>
 #include <algorithm>
-#include "../modules/tcp_wrapper/Client.h"
+#include <shared_mutex>
+#include "../modules/tcp_wrapper/Server.h"
+#include "../modules/tcp_wrapper/ConnectionPool.h"
+#include "../modules/tcp_wrapper/Connector.h"
 #include "../modules/lamport_queue/Cpp/LamportQueue.hpp"
 #include "../util/helpers.h"
 #include "../util/config.h"
@@ -17,30 +20,66 @@ using namespace helpers;
 
 class UnshapedClient : Unshaped {
 private:
-  std::unordered_map<QueuePair, TCP::Client *, QueuePairHash> *queuesToClient;
-
-  // Client to queue_in and queue_out. queue_out contains response received on
-  // the sending socket
-  std::unordered_map<TCP::Client *, QueuePair> *clientToQueues;
+  // The socket connected to the destination of each queue pair (-1 if none)
+  std::unordered_map<QueuePair, int, QueuePairHash> *queuesToSocket;
+
+  // Socket to queue_in and queue_out. queue_out contains response received on
+  // the socket
+  std::unordered_map<int, QueuePair> *socketToQueues;
+  // All queue pairs, by index (see ownedRange)
+  std::vector<QueuePair> queuePairs{};
   std::shared_mutex mapLock;
 
+  // Reads the responses on the connected sockets, on its I/O threads
+  TCP::Server *upstreams;
+
   config::Peer2Config peer2Config;
 
+  // Opens the upstream connections without blocking the signal loop
+  TCP::Connector *connector;
+  // Idle upstream connections, handed out on SYN
+  TCP::ConnectionPool *connectionPool;
 
   /**
  * @brief Handle responses received on the sockets
- * @param client The UnshapedClient (socket) on which the response was received
+ * @param socket The socket on which the response was received
+ * @param address The address of the destination
  * @param buffer The buffer where the response is stored
  * @param length The length of the response
+ * @param connStatus ONGOING for data, FIN once the destination closed its side
+ * @return false if no queues are mapped to the socket
  */
-  void onResponse(TCP::Client *client,
-                  uint8_t *buffer, size_t length, connectionStatus connStatus);
+  bool onResponse(int socket, std::string &address, uint8_t *buffer,
+                  size_t length, connectionStatus connStatus);
 
   /**
-   * @brief Erase the mapping of the given client once both sides are done
-   * @param client The client whose mapping has to be erased
+   * @param socket A connected socket
+   * @return The number of bytes the toShaped queue of the socket has space for
    */
-  inline void eraseMapping(TCP::Client *client);
+  size_t receiveSpace(int socket);
+
+  /**
+   * @brief Bind the connected upstream socket to the queues it was opened for.
+   * If the connect failed, the connection is closed towards the shaped process
+   * @param queues The queue pair that received the SYN
+   * @param socket The connected socket (-1 if the connect failed)
+   * @param error 0 on success, else the error of the connect
+   */
+  void onConnected(QueuePair queues, int socket, int error);
+
+  /**
+   * @brief Erase the mapping of the given socket once both sides are done,
+   * and close it
+   * @param socket The socket whose mapping has to be erased
+   */
+  inline void eraseMapping(int socket);
+
+  /**
+   * @brief Handle a signal of the shaped process (a SYN opens the connection
+   * to the server)
+   * @param queueInfo The signal and the queue associated with it
+   */
+  void handleSignal(SignalInfo::queueInfo &queueInfo);
 
   /**
  * @brief Find a queue pair by the ID of it's "fromShaped" queue
@@ -49,9 +88,11 @@ private:
  */
   QueuePair findQueuesByID(uint64_t queueID);
 
-  inline void initialiseSHM(int numStreams, size_t queueSize) override;
+  inline void initialiseSHM(int numStreams, size_t queueSize,
+                            size_t segmentSize,
+                            size_t slabPoolSize) override;
 
-  [[noreturn]] void checkQueuesForData(__useconds_t interval,
+  [[noreturn]] void checkQueuesForData(int worker, __useconds_t interval,
                                        size_t queueSize) override;
 
   void
@@ -77,7 +118,11 @@ public:
    */
   explicit UnshapedClient(config::Peer2Config &peer2Config);
 
-  [[noreturn]] void getUpdatedConnectionStatus() override;
+  /**
+   * @brief Handle the SYNs signalled by the shaped process (by opening the
+   * connection to the server)
+   */
+  [[noreturn]] void getUpdatedConnectionStatus();
 };
 
 
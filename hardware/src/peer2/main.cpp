@@ -7,7 +7,6 @@
 #include <fstream>
 #include "../../../msquic/src/inc/external_sync.h"
 
-pthread_rwlock_t quicSendLock;
 
 UnshapedClient *unshapedClient = nullptr;
 ShapedServer *shapedServer = nullptr;
@@ -73,39 +72,84 @@ inline config::Peer2Config loadConfig(char *configFileName) {
       }
     }
   }
+  warnIfCoresSpanNUMANodes(
+      {{"shaperCores", peer2Config.shapedServer.shaperCores},
+       {"workerCores", peer2Config.shapedServer.workerCores},
+       {"unshapedClient.cores", peer2Config.unshapedClient.cores}});
+  if (peer2Config.shapedServer.realTimePriority > 0)
+    warnIfCoresNotIsolated(peer2Config.shapedServer.shaperCores);
   std::cout << "Config:" << peer2Config << std::endl;
   return peer2Config;
 }
 
+/**
+ * @brief Start the shaped half in this process
+ * @param config The configuration
+ */
+inline void startShapedServer(config::Peer2Config &config) {
+  // Set CPU affinity of this process to worker cores.
+  // The instantiation of ShapedServer will set the shaper thread affinity
+  // separately
+  if (!config.shapedServer.workerCores.empty())
+    setCPUAffinity(config.shapedServer.workerCores);
+  // Locked before anything is allocated: the shaper (and what it uses) then
+  // takes no page faults
+  if (config.shapedServer.realTimePriority > 0)
+    lockMemory(2 * config.shapedServer.maxDecisionSize);
+  MsQuic = new MsQuicApi{};
+  shapedServer = new ShapedServer{config};
+}
+
 int main(int argc, char *argv[]) {
-  pthread_rwlock_init(&quicSendLock, nullptr);
-  // Load configurations
-  if (argc != 2) {
+  // With --restart, only the shaped half is started, in place of one that
+  // exited. It takes the queues of the running unshaped half over
+  bool restart = argc == 3 && std::string(argv[2]) == "--restart";
+  if (argc != 2 && !restart) {
     std::cerr <<
               "No config file entered! Please call this using `./peer_2 "
-              "config.json`" << std::endl;
+              "config.json [--restart]`" << std::endl;
     exit(1);
   }
+  // Load configurations
   auto config = loadConfig(argv[1]);
+  // The shaped process must not attach to the SHM of a previous run
+  if (!restart) removeSHM(config.appName);
+  // Both processes (and all their threads) allocate from the node of the
+  // shaper, like the SHM
+  if (config.numaAware) {
+    auto &cores = config.shapedServer.shaperCores;
+    preferNUMANode(
+        numaNodeOf(cores.empty() ? config.unshapedClient.cores : cores));
+  }
 
-  if (fork() == 0) {
+  if (restart) {
+    startShapedServer(config);
+    std::cout << "Peer is ready!" << std::endl;
+    // Wait for signal to exit
+    waitForSignal(true);
+    shapedServer->suspendForRestart();
+  } else if (config.fused) {
+    // Both halves in this process. The unshaped half goes first: the shaped
+    // half takes its queues over directly
+    unshapedClient = new UnshapedClient{config};
+    startShapedServer(config);
+    std::cout << "Peer is ready!" << std::endl;
+    // Wait for signal to exit
+    waitForSignal(true);
+  } else if (fork() == 0) {
     // Child process - Unshaped Client
     unshapedClient = new UnshapedClient{config};
     // Wait for signal to exit
     waitForSignal(false);
+    // No shaped process can take its queues over anymore
+    removeSHM(config.appName);
   } else {
     // Parent Process - Shaped Server
-    // Set CPU affinity of this process to worker cores.
-    // The instantiation of ShapedServer will set the shaper thread affinity
-    // separately
-    if (!config.shapedServer.workerCores.empty())
-      setCPUAffinity(config.shapedServer.workerCores);
-    sleep(2); // Wait for unshapedClient to initialise
-    MsQuic = new MsQuicApi{};
-    shapedServer = new ShapedServer{config};
-    sleep(1);
+    startShapedServer(config);
     std::cout << "Peer is ready!" << std::endl;
     // Wait for signal to exit
     waitForSignal(true);
+    // For the shaped process that replaces this one (see --restart)
+    shapedServer->suspendForRestart();
   }
 }
\ No newline at end of file
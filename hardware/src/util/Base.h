@@ -10,12 +10,18 @@
 #include <mutex>
 #include "../modules/Common.h"
 #include "helpers.h"
+#include "ConnectionState.h"
 
 class Base {
 protected:
   std::string appName;
   logLevels logLevel;
-  std::unordered_map<uint64_t, connectionStatus> *pendingSignal;
+  // How the SHM is backed (see helpers::createSHM)
+  size_t hugePageSize = 0;
+  bool prefaultSHM = false;
+  int numaNode = -1;
+  // Both halves run in this process (see config::Peer1Config::fused)
+  bool fused = false;
   std::mutex logWriter;
 
   class helpers::SignalInfo *sigInfo;
@@ -32,9 +38,10 @@ protected:
   virtual void log(logLevels level, const std::string &log) = 0;
 
   /**
-   * @brief Signal the shaped process
+   * @brief Signal the other process. FINs are not signalled, they are in the
+   * state of the queue pair (see ConnectionState)
    * @param queueID The queue to send the signal about
-   * @param connStatus The connection status (should be FIN)
+   * @param connStatus The connection status (should be SYN)
    */
   virtual void updateConnectionStatus(uint64_t queueID,
                                       connectionStatus connStatus) = 0;
@@ -43,15 +50,11 @@ protected:
  * @brief Create numStreams number of shared memory streams and initialise
  * Lamport Queues for each stream
  */
-  virtual void initialiseSHM(int numStreams, size_t queueSize) = 0;
+  virtual void initialiseSHM(int numStreams, size_t queueSize,
+                             size_t segmentSize, size_t slabPoolSize) = 0;
 
 public:
-  /**
-* @brief Handle signal from the shaped process regarding a new client
-*/
-  virtual void getUpdatedConnectionStatus() = 0;
-
-  Base() : logLevel(ERROR), pendingSignal(nullptr), sigInfo(nullptr) {};
+  Base() : logLevel(ERROR), sigInfo(nullptr) {};
 };
 
 
@@ -0,0 +1,182 @@
+//
+// Created by Rut Vora
+//
+
+#ifndef MINESVPN_CONNECTION_STATE_H
+#define MINESVPN_CONNECTION_STATE_H
+
+#include <atomic>
+#include <cstdint>
+#include <queue>
+#include "helpers.h"
+
+namespace helpers {
+  /**
+   * @brief The lifecycle of the connection on a queue pair. It is one atomic
+   * word in the header of the pair's fromShaped queue, so both processes read
+   * it with a single load. A pair goes
+   * FREE -> SYN -> OPEN -> HALF_CLOSED -> CLOSING -> FREE. Next to the phase,
+   * the word holds which FINs were received and forwarded, and which of the
+   * processes are done with the pair. Every change is a CAS, so no process
+   * (or thread) loses the change of another
+   */
+  class ConnectionState {
+  public:
+    enum Phase : uint32_t {
+      FREE = 0, // Not bound to a connection
+      SYN = 1, // Bound to a connection, not yet accepted by the other process
+      OPEN = 2, // Accepted by both processes
+      HALF_CLOSED = 3, // One of the directions got a FIN
+      CLOSING = 4 // Both directions got a FIN
+    };
+
+    enum Flag : uint32_t {
+      // The unshaped process got the FIN of its endpoint. Nothing more is
+      // pushed to toShaped
+      TO_SHAPED_FIN = 1 << 3,
+      // The shaped process got the FIN of the other middlebox. Nothing more
+      // is pushed to fromShaped
+      FROM_SHAPED_FIN = 1 << 4,
+      // The shaped process forwarded the FIN of toShaped (after its data)
+      TO_SHAPED_FIN_SENT = 1 << 5,
+      // The unshaped process forwarded the FIN of fromShaped (after its data)
+      FROM_SHAPED_FIN_SENT = 1 << 6,
+      // The process no longer touches the pair. Once both are, it is FREE
+      UNSHAPED_RELEASED = 1 << 7,
+      SHAPED_RELEASED = 1 << 8
+    };
+
+    // What each process waits for before it releases the pair: both FINs,
+    // and its own one forwarded
+    static constexpr uint32_t UNSHAPED_DONE =
+        TO_SHAPED_FIN | FROM_SHAPED_FIN | FROM_SHAPED_FIN_SENT;
+    static constexpr uint32_t SHAPED_DONE =
+        TO_SHAPED_FIN | FROM_SHAPED_FIN | TO_SHAPED_FIN_SENT;
+
+    /**
+     * @param queues A queue pair
+     * @return The current state word of the pair. Load it before looking at
+     * the sizes of its queues: data pushed before a FIN is then never missed
+     */
+    static inline uint32_t load(const QueuePair &queues) {
+      return word(queues).load(std::memory_order_acquire);
+    }
+
+    /**
+     * @param state A state word
+     * @return The phase of the connection
+     */
+    static inline Phase phase(uint32_t state) {
+      return static_cast<Phase>(state & PHASE_MASK);
+    }
+
+    /**
+     * @param state A state word
+     * @param flags One or more flags
+     * @return true if all of the given flags are set
+     */
+    static inline bool has(uint32_t state, uint32_t flags) {
+      return (state & flags) == flags;
+    }
+
+    /**
+     * @param state A state word
+     * @param fin TO_SHAPED_FIN or FROM_SHAPED_FIN
+     * @param sent The matching TO_SHAPED_FIN_SENT or FROM_SHAPED_FIN_SENT
+     * @return true if the FIN was received and not yet forwarded
+     */
+    static inline bool isPendingFIN(uint32_t state, Flag fin, Flag sent) {
+      return has(state, fin) && !has(state, sent);
+    }
+
+    /**
+     * @brief Bind a FREE pair to a new connection (FREE -> SYN)
+     * @param queues The queue pair
+     * @return false if the pair is not FREE
+     */
+    static inline bool assign(const QueuePair &queues) {
+      uint32_t expected = FREE;
+      return word(queues).compare_exchange_strong(expected, SYN);
+    }
+
+    /**
+     * @brief Take the first FREE pair of the pool and bind it to a new
+     * connection. Pairs that the other process is not done with yet stay in
+     * the pool
+     * @param pool The pairs released by this process
+     * @return The pair (nullptrs if none of them is FREE)
+     */
+    static QueuePair assignFrom(std::queue<QueuePair> &pool) {
+      for (auto remaining = pool.size(); remaining > 0; remaining--) {
+        auto queues = pool.front();
+        pool.pop();
+        if (assign(queues)) return queues;
+        pool.push(queues);
+      }
+      return {nullptr, nullptr};
+    }
+
+    /**
+     * @brief Mark the connection as accepted by the other process
+     * (SYN -> OPEN)
+     * @param queues The queue pair
+     * @return false if it is no longer in SYN (it may have got a FIN already)
+     */
+    static inline bool open(const QueuePair &queues) {
+      auto &state = word(queues);
+      auto current = state.load(std::memory_order_acquire);
+      while (phase(current) == SYN) {
+        if (state.compare_exchange_weak(current,
+                                        (current & ~PHASE_MASK) | OPEN))
+          return true;
+      }
+      return false;
+    }
+
+    /**
+     * @brief Set the given flags and move on to the phase they lead to. A
+     * process that releases the pair first clears the queue it consumes (its
+     * producer is done after the FIN), so that an idle pair holds no
+     * segments of the slab pool
+     * @param queues The queue pair
+     * @param flags One or more flags
+     * @return true if this call set any of them. false if they all were set
+     * already, or the pair is FREE
+     */
+    static inline bool set(const QueuePair &queues, uint32_t flags) {
+      auto &state = word(queues);
+      auto current = state.load(std::memory_order_acquire);
+      if (phase(current) != FREE) {
+        if ((flags & UNSHAPED_RELEASED) && !has(current, UNSHAPED_RELEASED))
+          queues.fromShaped->clear();
+        if ((flags & SHAPED_RELEASED) && !has(current, SHAPED_RELEASED))
+          queues.toShaped->clear();
+      }
+      while (phase(current) != FREE && !has(current, flags)) {
+        if (state.compare_exchange_weak(current, next(current | flags)))
+          return true;
+      }
+      return false;
+    }
+
+  private:
+    static constexpr uint32_t PHASE_MASK = 0x7;
+
+    static inline std::atomic<uint32_t> &word(const QueuePair &queues) {
+      return queues.fromShaped->connectionState;
+    }
+
+    /**
+     * @param state A state word with new flags (and the old phase)
+     * @return The state word with the phase the flags lead to
+     */
+    static inline uint32_t next(uint32_t state) {
+      if (has(state, UNSHAPED_RELEASED | SHAPED_RELEASED)) return FREE;
+      auto fins = has(state, TO_SHAPED_FIN) + has(state, FROM_SHAPED_FIN);
+      if (fins == 0) return state;
+      return (state & ~PHASE_MASK) | (fins == 2 ? CLOSING : HALF_CLOSED);
+    }
+  };
+}
+
+#endif //MINESVPN_CONNECTION_STATE_H
@@ -0,0 +1,371 @@
+//
+// Created by Rut Vora
+//
+
+#include "ControlFrame.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+  // Record types. Unknown types are skipped by the decoder
+  enum RecordType : uint8_t {
+    STREAM_CONTROL = 1, STREAM_DUMMY = 2, DATA_SYN = 3, DATA_FIN = 4,
+    FLOW_SYN = 5, FLOW_FIN = 6, FLOW_RESUME = 7, FLOW_RESET = 8, PAUSE = 9
+  };
+
+}
+
+void helpers::copyAddresses(const ControlEvent &event,
+                            addressPair &addrPair) {
+  auto copy = [](std::string_view from, char *to, size_t size) {
+    auto length = std::min(from.size(), size - 1);
+    memcpy(to, from.data(), length);
+    to[length] = '\0';
+  };
+  copy(event.clientAddress, addrPair.clientAddress,
+       sizeof(addrPair.clientAddress));
+  copy(event.clientPort, addrPair.clientPort, sizeof(addrPair.clientPort));
+  copy(event.serverAddress, addrPair.serverAddress,
+       sizeof(addrPair.serverAddress));
+  copy(event.serverPort, addrPair.serverPort, sizeof(addrPair.serverPort));
+}
+
+helpers::ControlFrameEncoder::ControlFrameEncoder(size_t maxEvents) {
+  payload.reserve(maxEvents * MAX_CONTROL_RECORD_SIZE);
+  frameStarts.reserve(
+      maxEvents * MAX_CONTROL_RECORD_SIZE / MAX_CONTROL_FRAME_PAYLOAD + 1);
+}
+
+void helpers::ControlFrameEncoder::reserveRecord() {
+  auto frameStart = frameStarts.empty() ? 0 : frameStarts.back();
+  if (payload.size() - frameStart + MAX_CONTROL_RECORD_SIZE
+      > MAX_CONTROL_FRAME_PAYLOAD) {
+    frameStarts.push_back(payload.size());
+  }
+}
+
+void helpers::ControlFrameEncoder::putVarint(uint64_t value) {
+  uint8_t encoded[MAX_VARINT_SIZE];
+  payload.insert(payload.end(), encoded, helpers::putVarint(encoded, value));
+}
+
+void helpers::ControlFrameEncoder::putString(std::string_view str) {
+  putVarint(str.size());
+  payload.insert(payload.end(), str.begin(), str.end());
+}
+
+void helpers::ControlFrameEncoder::addStream(enum StreamType streamType,
+                                             uint64_t streamID,
+                                             uint64_t numMuxStreams) {
+  reserveRecord();
+  if (streamType == Dummy) {
+    payload.push_back(STREAM_DUMMY);
+    putVarint(varintSize(streamID));
+    putVarint(streamID);
+    return;
+  }
+  payload.push_back(STREAM_CONTROL);
+  if (numMuxStreams == 0) {
+    putVarint(varintSize(streamID));
+    putVarint(streamID);
+    return;
+  }
+  putVarint(varintSize(streamID) + varintSize(numMuxStreams));
+  putVarint(streamID);
+  putVarint(numMuxStreams);
+}
+
+void helpers::ControlFrameEncoder::addSYN(uint64_t streamID,
+                                          const addressPair &addrPair) {
+  putSYN(DATA_SYN, streamID, addrPair);
+}
+
+void helpers::ControlFrameEncoder::addFlowSYN(uint64_t flowID,
+                                              const addressPair &addrPair) {
+  putSYN(FLOW_SYN, flowID, addrPair);
+}
+
+void helpers::ControlFrameEncoder::putSYN(uint8_t type, uint64_t ID,
+                                          const addressPair &addrPair) {
+  std::string_view clientAddress{addrPair.clientAddress,
+                                 strnlen(addrPair.clientAddress,
+                                         sizeof(addrPair.clientAddress))};
+  std::string_view clientPort{addrPair.clientPort,
+                              strnlen(addrPair.clientPort,
+                                      sizeof(addrPair.clientPort))};
+  std::string_view serverAddress{addrPair.serverAddress,
+                                 strnlen(addrPair.serverAddress,
+                                         sizeof(addrPair.serverAddress))};
+  std::string_view serverPort{addrPair.serverPort,
+                              strnlen(addrPair.serverPort,
+                                      sizeof(addrPair.serverPort))};
+  size_t valueSize = varintSize(ID);
+  for (auto &str: {clientAddress, clientPort, serverAddress, serverPort}) {
+    valueSize += varintSize(str.size()) + str.size();
+  }
+
+  reserveRecord();
+  payload.push_back(type);
+  putVarint(valueSize);
+  putVarint(ID);
+  putString(clientAddress);
+  putString(clientPort);
+  putString(serverAddress);
+  putString(serverPort);
+}
+
+void helpers::ControlFrameEncoder::addFIN(uint64_t streamID) {
+  reserveRecord();
+  payload.push_back(DATA_FIN);
+  putVarint(varintSize(streamID));
+  putVarint(streamID);
+}
+
+void helpers::ControlFrameEncoder::addFlowFIN(uint64_t flowID) {
+  reserveRecord();
+  payload.push_back(FLOW_FIN);
+  putVarint(varintSize(flowID));
+  putVarint(flowID);
+}
+
+void helpers::ControlFrameEncoder::addFlowResume(uint64_t flowID,
+                                                 uint64_t sentBytes,
+                                                 uint64_t receivedBytes) {
+  reserveRecord();
+  payload.push_back(FLOW_RESUME);
+  putVarint(varintSize(flowID) + varintSize(sentBytes) +
+            varintSize(receivedBytes));
+  putVarint(flowID);
+  putVarint(sentBytes);
+  putVarint(receivedBytes);
+}
+
+void helpers::ControlFrameEncoder::addFlowReset(uint64_t flowID) {
+  reserveRecord();
+  payload.push_back(FLOW_RESET);
+  putVarint(varintSize(flowID));
+  putVarint(flowID);
+}
+
+void helpers::ControlFrameEncoder::addPause() {
+  reserveRecord();
+  payload.push_back(PAUSE);
+  putVarint(varintSize(0));
+  putVarint(0);
+}
+
+uint8_t *helpers::ControlFrameEncoder::finish(size_t &length) {
+  length = 0;
+  if (payload.empty()) return nullptr;
+
+  // Every frame is a slice of the payload, between two frame starts
+  frameStarts.push_back(payload.size());
+  size_t frameStart = 0;
+  for (auto frameEnd: frameStarts) {
+    length += 1 + varintSize(frameEnd - frameStart) + frameEnd - frameStart;
+    frameStart = frameEnd;
+  }
+  auto frames = (uint8_t *) malloc(length);
+  if (frames == nullptr) {
+    frameStarts.pop_back();
+    length = 0;
+    return nullptr;
+  }
+
+  auto pos = frames;
+  frameStart = 0;
+  for (auto frameEnd: frameStarts) {
+    *pos++ = CONTROL_FRAME_VERSION;
+    pos = helpers::putVarint(pos, frameEnd - frameStart);
+    memcpy(pos, payload.data() + frameStart, frameEnd - frameStart);
+    pos += frameEnd - frameStart;
+    frameStart = frameEnd;
+  }
+
+  // Keep the capacity for the next frame
+  payload.clear();
+  frameStarts.clear();
+  return frames;
+}
+
+helpers::ControlFrameDecoder::ControlFrameDecoder(size_t capacity) :
+    capacity(std::max(capacity, MAX_CONTROL_FRAME_SIZE)) {
+  storage = (uint8_t *) malloc(this->capacity);
+}
+
+helpers::ControlFrameDecoder::~ControlFrameDecoder() {
+  free(storage);
+}
+
+bool helpers::ControlFrameDecoder::push(const uint8_t *buffer, size_t length) {
+  if (isCorrupt) return false;
+  input = buffer;
+  inputLength = length;
+  return true;
+}
+
+bool helpers::ControlFrameDecoder::refill() {
+  if (inputLength == 0) return false;
+  // Move the undecoded bytes to the front so the buffer never grows
+  if (begin > 0) {
+    memmove(storage, storage + begin, end - begin);
+    end -= begin;
+    if (frameEnd != 0) frameEnd -= begin;
+    begin = 0;
+  }
+  auto length = std::min(inputLength, capacity - end);
+  if (length == 0) return false;
+
+  memcpy(storage + end, input, length);
+  end += length;
+  input += length;
+  inputLength -= length;
+  return true;
+}
+
+bool helpers::ControlFrameDecoder::getString(const uint8_t *&pos,
+                                             const uint8_t *limit,
+                                             std::string_view &str) {
+  uint64_t size;
+  if (!getVarint(pos, limit, size) || size > (uint64_t) (limit - pos)) {
+    return false;
+  }
+  str = {(const char *) pos, size};
+  pos += size;
+  return true;
+}
+
+void helpers::ControlFrameDecoder::fail() {
+  isCorrupt = true;
+  begin = end = frameEnd = 0;
+  input = nullptr;
+  inputLength = 0;
+}
+
+bool helpers::ControlFrameDecoder::next(ControlEvent &event) {
+  while (!isCorrupt) {
+    if (frameEnd == 0) {
+      // Read the header of the next frame
+      const uint8_t *pos = storage + begin;
+      const uint8_t *limit = storage + end;
+      if (pos == limit) {
+        if (refill()) continue;
+        return false;
+      }
+      if (*pos != CONTROL_FRAME_VERSION) {
+        fail();
+        return false;
+      }
+      pos++;
+      uint64_t payloadSize;
+      if (!getVarint(pos, limit, payloadSize)) {
+        // Either incomplete or an overlong varint
+        if (pos - (storage + begin + 1) >= (long) MAX_VARINT_SIZE) fail();
+        else if (refill()) continue;
+        return false;
+      }
+      size_t headerSize = pos - (storage + begin);
+      if (payloadSize > capacity - headerSize) {
+        fail(); // Could never fit in the buffer
+        return false;
+      }
+      if (payloadSize > (uint64_t) (limit - pos)) {
+        // Incomplete. The whole frame fits once the buffer is compacted
+        if (refill()) continue;
+        return false;
+      }
+      begin += headerSize;
+      frameEnd = begin + payloadSize;
+    }
+
+    if (begin == frameEnd) {
+      frameEnd = 0;
+      continue;
+    }
+
+    // Read the next record of the frame
+    const uint8_t *pos = storage + begin;
+    const uint8_t *limit = storage + frameEnd;
+    uint8_t type = *pos++;
+    uint64_t valueSize;
+    if (!getVarint(pos, limit, valueSize) ||
+        valueSize > (uint64_t) (limit - pos)) {
+      fail();
+      return false;
+    }
+    const uint8_t *valueEnd = pos + valueSize;
+    begin = valueEnd - storage;
+    if (type < STREAM_CONTROL || type > PAUSE) {
+      continue; // Unknown record type (newer peer). Skip it
+    }
+
+    event = ControlEvent{};
+    uint64_t ID;
+    if (!getVarint(pos, valueEnd, ID)) {
+      fail();
+      return false;
+    }
+    if (type == FLOW_SYN || type == FLOW_FIN || type == FLOW_RESUME ||
+        type == FLOW_RESET) {
+      event.flowID = ID;
+    } else event.streamID = ID;
+    switch (type) {
+      case STREAM_CONTROL:
+        event.streamType = Control;
+        // Only present if the flows are multiplexed
+        if (pos < valueEnd && !getVarint(pos, valueEnd, event.numMuxStreams)) {
+          fail();
+          return false;
+        }
+        return true;
+      case STREAM_DUMMY:
+        event.streamType = Dummy;
+        return true;
+      case DATA_FIN:
+        event.streamType = Data;
+        event.connStatus = FIN;
+        return true;
+      case FLOW_FIN:
+        event.streamType = Multiplexed;
+        event.connStatus = FIN;
+        return true;
+      case FLOW_RESUME:
+        event.streamType = Multiplexed;
+        event.action = ControlEvent::RESUME;
+        if (!getVarint(pos, valueEnd, event.sentBytes) ||
+            !getVarint(pos, valueEnd, event.receivedBytes)) {
+          fail();
+          return false;
+        }
+        return true;
+      case FLOW_RESET:
+        event.streamType = Multiplexed;
+        event.action = ControlEvent::RESET;
+        return true;
+      case PAUSE:
+        event.action = ControlEvent::PAUSE;
+        return true;
+      case DATA_SYN:
+      case FLOW_SYN:
+        event.streamType = type == FLOW_SYN ? Multiplexed : Data;
+        event.connStatus = SYN;
+        if (!getString(pos, valueEnd, event.clientAddress) ||
+            !getString(pos, valueEnd, event.clientPort) ||
+            !getString(pos, valueEnd, event.serverAddress) ||
+            !getString(pos, valueEnd, event.serverPort)) {
+          fail();
+          return false;
+        }
+        return true;
+    }
+  }
+  return false;
+}
+
+void helpers::ControlFrameDecoder::clear() {
+  begin = end = frameEnd = 0;
+  isCorrupt = false;
+  input = nullptr;
+  inputLength = 0;
+}
@@ -0,0 +1,257 @@
+//
+// Created by Rut Vora
+//
+
+#ifndef MINESVPN_CONTROL_FRAME_H
+#define MINESVPN_CONTROL_FRAME_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+#include <vector>
+#include "../modules/Common.h"
+#include "helpers.h"
+#include "Varint.h"
+
+namespace helpers {
+  /**
+   * @brief Version of the control frame format. Frames of any other version
+   * are rejected by the decoder
+   */
+  inline constexpr uint8_t CONTROL_FRAME_VERSION = 1;
+
+  /**
+   * @brief Upper bound on the encoded size of a single control record
+   */
+  inline constexpr size_t MAX_CONTROL_RECORD_SIZE =
+      1 + 2 + MAX_VARINT_SIZE + 2 * (2 + sizeof(addressPair::clientAddress))
+      + 2 * (1 + sizeof(addressPair::clientPort));
+
+  /**
+   * @brief Upper bound on the payload of a single control frame. Batches
+   * with more messages are split into several frames
+   */
+  inline constexpr size_t MAX_CONTROL_FRAME_PAYLOAD = 64 * 1024;
+  static_assert(MAX_CONTROL_RECORD_SIZE <= MAX_CONTROL_FRAME_PAYLOAD);
+
+  /**
+   * @brief Upper bound on the size of a single control frame (with its
+   * header). Every decoder can hold at least one such frame
+   */
+  inline constexpr size_t MAX_CONTROL_FRAME_SIZE =
+      1 + MAX_VARINT_SIZE + MAX_CONTROL_FRAME_PAYLOAD;
+
+  /**
+   * @brief One control message, as decoded from a control frame. The
+   * addresses point into the decoder's buffer and are only valid till the
+   * next call to ControlFrameDecoder::next (or push)
+   */
+  struct ControlEvent {
+    // Messages about the connection or a flow, rather than a stream
+    enum ControlAction {
+      NO_ACTION, PAUSE, RESUME, RESET
+    };
+    uint64_t streamID{0};
+    uint64_t flowID{0}; // For SYN/FIN of a flow on the multiplexed streams
+    uint64_t numMuxStreams{0}; // With the control stream announcement
+    // Bytes of the flow the sender of a RESUME sent and received so far
+    uint64_t sentBytes{0};
+    uint64_t receivedBytes{0};
+    enum ControlAction action{NO_ACTION};
+    enum StreamType streamType{};
+    enum connectionStatus connStatus{ONGOING};
+    std::string_view clientAddress{};
+    std::string_view clientPort{};
+    std::string_view serverAddress{};
+    std::string_view serverPort{};
+  };
+
+  /**
+   * @brief Copy the addresses of a decoded SYN (truncating them if needed)
+   * @param event The decoded SYN
+   * @param addrPair The address pair to copy the addresses to
+   */
+  void copyAddresses(const ControlEvent &event, addressPair &addrPair);
+
+  /**
+   * @brief Batches control messages into one frame. The frame format is:
+   * | version (1B) | payload length (varint) | record | record | ... |
+   * and each record is:
+   * | type (1B) | value length (varint) | value |
+   * where the value is the stream (or flow) ID (varint), followed (for a
+   * SYN) by the client address, client port, server address and server port,
+   * each prefixed with its length (varint). The control stream announcement
+   * is followed by the number of multiplexed streams (if any), and the flow
+   * ID of a resume by the bytes sent and received. Varints are LEB128 encoded.
+   * A batch whose payload exceeds MAX_CONTROL_FRAME_PAYLOAD is sent as
+   * several consecutive frames
+   */
+  class ControlFrameEncoder {
+  public:
+    /**
+     * @brief Constructor for the encoder
+     * @param maxEvents The number of messages to reserve space for
+     */
+    explicit ControlFrameEncoder(size_t maxEvents);
+
+    /**
+     * @brief Announce the control or dummy stream
+     * @param streamType The type of the stream (Control or Dummy)
+     * @param streamID The ID of the stream
+     * @param numMuxStreams The number of multiplexed streams the flows are
+     * sent on (control stream only). 0 if every flow has its own stream
+     */
+    void addStream(enum StreamType streamType, uint64_t streamID,
+                   uint64_t numMuxStreams = 0);
+
+    /**
+     * @brief Add a SYN for a new client on the given data stream
+     * @param streamID The ID of the data stream the client is mapped to
+     * @param addrPair The client and server addresses of the client
+     */
+    void addSYN(uint64_t streamID, const addressPair &addrPair);
+
+    /**
+     * @brief Add a FIN for the client on the given data stream
+     * @param streamID The ID of the data stream the client is mapped to
+     */
+    void addFIN(uint64_t streamID);
+
+    /**
+     * @brief Add a SYN for a new client whose data is multiplexed
+     * @param flowID The ID of the flow the client's data is framed with
+     * @param addrPair The client and server addresses of the client
+     */
+    void addFlowSYN(uint64_t flowID, const addressPair &addrPair);
+
+    /**
+     * @brief Add a FIN for the client whose data is multiplexed
+     * @param flowID The ID of the flow the client's data is framed with
+     */
+    void addFlowFIN(uint64_t flowID);
+
+    /**
+     * @brief Ask to resume a multiplexed flow on this connection (after the
+     * previous one was lost), or accept the other middlebox's request to
+     * @param flowID The ID of the flow the client's data is framed with
+     * @param sentBytes The number of bytes of the flow sent so far
+     * @param receivedBytes The number of bytes of the flow received so far
+     */
+    void addFlowResume(uint64_t flowID, uint64_t sentBytes,
+                       uint64_t receivedBytes);
+
+    /**
+     * @brief Refuse to resume a multiplexed flow. Both middleboxes then
+     * terminate it
+     * @param flowID The ID of the flow the client's data is framed with
+     */
+    void addFlowReset(uint64_t flowID);
+
+    /**
+     * @brief Ask the other middlebox to stop sending data until the
+     * connection is replaced (this middlebox restarts)
+     */
+    void addPause();
+
+    /**
+     * @return true if no message has been added since the last frame
+     */
+    [[nodiscard]] inline bool empty() const { return payload.empty(); }
+
+    /**
+     * @brief Finish the frame(s) containing all messages added so far
+     * @param length Set to the length of the frames
+     * @return The frames, allocated with malloc (ownership passes to the
+     * caller). nullptr if there were no messages
+     */
+    uint8_t *finish(size_t &length);
+
+  private:
+    std::vector<uint8_t> payload;
+    // Offsets in payload at which a new frame starts (the first one aside)
+    std::vector<size_t> frameStarts;
+
+    /**
+     * @brief Start a new frame if the next record may not fit in this one
+     */
+    void reserveRecord();
+
+    void putVarint(uint64_t value);
+
+    void putString(std::string_view str);
+
+    void putSYN(uint8_t type, uint64_t ID, const addressPair &addrPair);
+  };
+
+  /**
+   * @brief Reassembles control frames received on the control stream (which
+   * may arrive split across several receive calls) and decodes them without
+   * allocating. The received bytes are copied in as room frees up, so only a
+   * frame (rather than everything received at once) has to fit in the buffer
+   */
+  class ControlFrameDecoder {
+  public:
+    /**
+     * @brief Constructor for the decoder
+     * @param capacity The number of bytes that can be buffered. Raised to
+     * MAX_CONTROL_FRAME_SIZE, the largest frame that the peer sends
+     */
+    explicit ControlFrameDecoder(size_t capacity);
+
+    ~ControlFrameDecoder();
+
+    /**
+     * @brief Hand the received bytes to the decoder. They are taken in by
+     * next, so they must stay valid till it returns false
+     * @param buffer The received bytes
+     * @param length The number of received bytes
+     * @return false if the decoder has failed (see failed)
+     */
+    bool push(const uint8_t *buffer, size_t length);
+
+    /**
+     * @brief Decode the next message of the received frames
+     * @param event Set to the decoded message
+     * @return false if there is no complete message left (all received bytes
+     * have then been taken in), or if the decoder failed
+     */
+    bool next(ControlEvent &event);
+
+    /**
+     * @return true if a malformed frame, a frame of an unsupported version or
+     * a frame larger than the buffer was received. Everything buffered is
+     * dropped in that case. The rest of the stream can't be decoded anymore
+     * (the frame boundaries are lost), so the connection must be reset
+     */
+    [[nodiscard]] inline bool failed() const { return isCorrupt; }
+
+    /**
+     * @brief Drop all buffered bytes (e.g. when the stream is replaced)
+     */
+    void clear();
+
+  private:
+    uint8_t *storage;
+    const size_t capacity;
+    size_t begin = 0; // Start of the bytes that have not been decoded yet
+    size_t end = 0; // End of the buffered bytes
+    size_t frameEnd = 0; // End of the frame being decoded (0 if none)
+    bool isCorrupt = false;
+    // The received bytes that have not been taken in yet
+    const uint8_t *input = nullptr;
+    size_t inputLength = 0;
+
+    /**
+     * @brief Take in as many received bytes as fit in the buffer
+     * @return false if none could be taken in
+     */
+    bool refill();
+
+    static bool getString(const uint8_t *&pos, const uint8_t *limit,
+                          std::string_view &str);
+
+    void fail();
+  };
+}
+
+#endif //MINESVPN_CONTROL_FRAME_H
@@ -0,0 +1,96 @@
+//
+// Created by Rut Vora
+//
+
+#ifndef MINESVPN_FLOW_FRAME_H
+#define MINESVPN_FLOW_FRAME_H
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include "Varint.h"
+
+namespace helpers {
+  /**
+   * @brief Maximum size of the header of a flow frame
+   */
+  inline constexpr size_t MAX_FLOW_HEADER_SIZE = 2 * MAX_VARINT_SIZE;
+
+  /**
+   * @param flowID The ID of the flow
+   * @param length The length of the payload
+   * @return The size of the header of a flow frame
+   */
+  inline size_t flowHeaderSize(uint64_t flowID, size_t length) {
+    return varintSize(flowID) + varintSize(length);
+  }
+
+  /**
+   * @brief Write the header of a flow frame. On a multiplexed stream, the
+   * data of every flow is sent as frames of:
+   * | flow ID (varint) | payload length (varint) | payload |
+   * Frames with an empty payload are ignored (they are used to start a
+   * stream without sending any data)
+   * @param buffer Where to write the header (needs flowHeaderSize bytes)
+   * @param flowID The ID of the flow
+   * @param length The length of the payload that follows
+   * @return The size of the header
+   */
+  inline size_t putFlowHeader(uint8_t *buffer, uint64_t flowID,
+                              size_t length) {
+    auto pos = putVarint(buffer, flowID);
+    return putVarint(pos, length) - buffer;
+  }
+
+  /**
+   * @brief Splits the bytes received on one multiplexed stream into the
+   * payloads of the flows. Frames may arrive split across any number of
+   * receive calls; payloads are handed out in place, without copying
+   */
+  class FlowDemuxer {
+  public:
+    /**
+     * @brief Demultiplex the received bytes
+     * @param buffer The received bytes
+     * @param length The number of received bytes
+     * @param onPayload Called with (flowID, payload, length) for every piece
+     * of payload, in order. The payload of one frame may be handed out in
+     * several pieces
+     * @return false if a malformed frame header was received
+     */
+    template<typename F>
+    bool demux(uint8_t *buffer, size_t length, F &&onPayload) {
+      while (length > 0) {
+        if (remaining > 0) {
+          auto size = std::min(remaining, length);
+          onPayload(flowID, buffer, size);
+          buffer += size;
+          length -= size;
+          remaining -= size;
+          continue;
+        }
+        // Collect the header byte by byte (it is at most a few bytes)
+        if (headerLength == MAX_FLOW_HEADER_SIZE) return false;
+        header[headerLength++] = *buffer++;
+        length--;
+        const uint8_t *pos = header;
+        const uint8_t *limit = header + headerLength;
+        uint64_t payloadLength;
+        if (getVarint(pos, limit, flowID)
+            && getVarint(pos, limit, payloadLength)) {
+          remaining = payloadLength;
+          headerLength = 0;
+        }
+      }
+      return true;
+    }
+
+  private:
+    uint8_t header[MAX_FLOW_HEADER_SIZE]{};
+    size_t headerLength = 0;
+    uint64_t flowID = 0;
+    size_t remaining = 0; // Bytes left in the payload of the current frame
+  };
+}
+
+#endif //MINESVPN_FLOW_FRAME_H
@@ -0,0 +1,110 @@
+//
+// Created by Rut Vora
+//
+
+#ifndef MINESVPN_SPSC_RING_H
+#define MINESVPN_SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace helpers {
+  /**
+   * @brief A bounded ring between exactly one producer and one consumer
+   * thread. The slots are constructed once and reused: the producer fills
+   * the next free slot in place (claim, then publish) and the consumer uses
+   * the oldest one in place (front, then release), so nothing is copied or
+   * allocated per item. Either side can block till the other one catches up
+   * @tparam T The type of the slots
+   */
+  template<typename T>
+  class SPSCRing {
+  public:
+    /**
+     * @brief Constructor for the ring
+     * @param minCapacity The number of slots (rounded up to a power of 2)
+     * @param args Every slot is constructed with these
+     */
+    template<typename... Args>
+    explicit SPSCRing(size_t minCapacity, const Args &... args) {
+      capacity = 1;
+      while (capacity < minCapacity) capacity <<= 1;
+      slots.reserve(capacity);
+      for (size_t i = 0; i < capacity; i++) slots.emplace_back(args...);
+    }
+
+    /**
+     * @brief (Producer) The next free slot, to be filled and then published
+     * @return The slot (nullptr if the ring is full)
+     */
+    inline T *claim() {
+      auto pos = tail.load(std::memory_order_relaxed);
+      if (pos - head.load(std::memory_order_acquire) == capacity)
+        return nullptr;
+      return &slots[pos & (capacity - 1)];
+    }
+
+    /**
+     * @brief (Producer) Wait for a free slot
+     * @return The slot, to be filled and then published
+     */
+    inline T *waitClaim() {
+      auto pos = tail.load(std::memory_order_relaxed);
+      auto consumed = head.load(std::memory_order_acquire);
+      while (pos - consumed == capacity) {
+        head.wait(consumed, std::memory_order_acquire);
+        consumed = head.load(std::memory_order_acquire);
+      }
+      return &slots[pos & (capacity - 1)];
+    }
+
+    /**
+     * @brief (Producer) Hand the claimed slot to the consumer
+     */
+    inline void publish() {
+      tail.fetch_add(1, std::memory_order_release);
+      tail.notify_one();
+    }
+
+    /**
+     * @brief (Consumer) The oldest published slot
+     * @return The slot (nullptr if the ring is empty)
+     */
+    inline T *front() {
+      auto pos = head.load(std::memory_order_relaxed);
+      if (tail.load(std::memory_order_acquire) == pos) return nullptr;
+      return &slots[pos & (capacity - 1)];
+    }
+
+    /**
+     * @brief (Consumer) Wait for a published slot
+     * @return The oldest published slot, to be released once used
+     */
+    inline T *waitFront() {
+      auto pos = head.load(std::memory_order_relaxed);
+      auto produced = tail.load(std::memory_order_acquire);
+      while (produced == pos) {
+        tail.wait(produced, std::memory_order_acquire);
+        produced = tail.load(std::memory_order_acquire);
+      }
+      return &slots[pos & (capacity - 1)];
+    }
+
+    /**
+     * @brief (Consumer) Hand the used slot back to the producer
+     */
+    inline void release() {
+      head.fetch_add(1, std::memory_order_release);
+      head.notify_one();
+    }
+
+  private:
+    std::vector<T> slots;
+    size_t capacity;
+    alignas(64) std::atomic<size_t> tail{0}; // Written by the producer only
+    alignas(64) std::atomic<size_t> head{0}; // Written by the consumer only
+  };
+}
+
+#endif //MINESVPN_SPSC_RING_H
@@ -0,0 +1,135 @@
+//
+// Created by Rut Vora
+//
+
+#ifndef MINESVPN_SEND_QUEUE_H
+#define MINESVPN_SEND_QUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include "msquic.hpp"
+
+namespace helpers {
+  /**
+   * @brief A buffer waiting to be handed to QUIC
+   */
+  struct SendRequest {
+    MsQuicStream *stream = nullptr;
+    uint8_t *buffer = nullptr;
+    size_t length = 0;
+  };
+
+  /**
+   * @brief Serializes the sends of one connection. Any thread can push to it
+   * without locking (bounded MPSC ring). The buffers are handed to QUIC by
+   * whichever thread finds the queue idle after its push, so there is only
+   * ever one thread sending on the connection at a time and no thread waits
+   * for another
+   */
+  class SendQueue {
+  public:
+    /**
+     * @brief Constructor for the send queue
+     * @param minCapacity The number of buffers that can be waiting at once
+     * (rounded up to a power of 2)
+     */
+    explicit SendQueue(size_t minCapacity) {
+      capacity = 1;
+      while (capacity < minCapacity) capacity <<= 1;
+      cells = new Cell[capacity];
+      for (size_t i = 0; i < capacity; i++) {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    ~SendQueue() {
+      delete[] cells;
+    }
+
+    /**
+     * @brief Queue the buffer and then send everything that is queued (unless
+     * another thread is already doing that)
+     * @param request The buffer to send
+     * @param sendFunc Called with every SendRequest to hand it to QUIC (or to
+     * free it if its stream is gone)
+     */
+    template<typename F>
+    void send(SendRequest request, F &&sendFunc) {
+      while (!push(request)) {
+        // Full. Help drain it and try again
+        drain(sendFunc);
+      }
+      drain(sendFunc);
+    }
+
+  private:
+    struct Cell {
+      std::atomic<size_t> sequence;
+      SendRequest request;
+    };
+
+    Cell *cells;
+    size_t capacity;
+    alignas(64) std::atomic<size_t> enqueuePos{0};
+    alignas(64) std::atomic<size_t> dequeuePos{0};
+    std::atomic_flag isDraining = ATOMIC_FLAG_INIT;
+
+    bool push(const SendRequest &request) {
+      auto pos = enqueuePos.load(std::memory_order_relaxed);
+      while (true) {
+        auto &cell = cells[pos & (capacity - 1)];
+        auto sequence = cell.sequence.load(std::memory_order_acquire);
+        auto diff = (intptr_t) sequence - (intptr_t) pos;
+        if (diff == 0) {
+          if (enqueuePos.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+            cell.request = request;
+            // seq_cst (like isDraining) so that a drainer that is finishing
+            // up cannot miss this buffer while this thread sees it draining
+            cell.sequence.store(pos + 1, std::memory_order_seq_cst);
+            return true;
+          }
+        } else if (diff < 0) {
+          return false; // Full
+        } else {
+          pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    // Only called by the thread that holds isDraining
+    bool pop(SendRequest &request) {
+      auto pos = dequeuePos.load(std::memory_order_relaxed);
+      auto &cell = cells[pos & (capacity - 1)];
+      if (cell.sequence.load(std::memory_order_acquire) != pos + 1) {
+        return false;
+      }
+      request = cell.request;
+      cell.sequence.store(pos + capacity, std::memory_order_release);
+      dequeuePos.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    [[nodiscard]] bool isEmpty() const {
+      auto pos = dequeuePos.load(std::memory_order_seq_cst);
+      return cells[pos & (capacity - 1)].sequence.load(
+          std::memory_order_seq_cst) != pos + 1;
+    }
+
+    template<typename F>
+    void drain(F &&sendFunc) {
+      // A push that lands while the previous drainer is finishing up is
+      // picked up by the re-check of isEmpty
+      while (!isEmpty()) {
+        if (isDraining.test_and_set(std::memory_order_seq_cst)) return;
+        SendRequest request;
+        while (pop(request)) sendFunc(request);
+        isDraining.clear(std::memory_order_seq_cst);
+      }
+    }
+  };
+}
+
+#endif //MINESVPN_SEND_QUEUE_H
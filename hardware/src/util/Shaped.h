@@ -10,6 +10,9 @@
 #include <unordered_map>
 #include "msquic.hpp"
 #include "helpers.h"
+#include "ControlFrame.h"
+#include "SendQueue.h"
+#include "TrafficClasses.h"
 #include "Base.h"
 
 class Shaped : public Base {
@@ -26,7 +29,24 @@ protected:
   MsQuicStream *dummyStream;
 
   NoiseGenerator *noiseGenerator;
-  LamportQueue *controlMessageQueue;
+
+  // Every traffic class is shaped by a loop of its own (noiseGenerator
+  // shapes the default one)
+  helpers::TrafficClasses trafficClasses;
+
+  // Control messages are batched into one frame per send (see ControlFrame.h)
+  helpers::ControlFrameEncoder *controlEncoder;
+  helpers::ControlFrameDecoder *controlDecoder;
+  std::mutex controlLock; // Guards controlEncoder
+
+  // Serializes the sends on the connection to the other middlebox
+  helpers::SendQueue *sendQueue;
+
+  // Multiplexed flows are kept this long after the connection to the other
+  // middlebox is lost, to resume them on the next one (0 terminates them)
+  std::chrono::milliseconds resumeTimeout{0};
+  // Set while either middlebox is about to restart. No data is sent
+  std::atomic<bool> paused = false;
 
   /**
    * @brief Send dummy of given size on the dummy stream
@@ -37,10 +57,13 @@ protected:
 
   /**
  * @brief Send data to the receiving middleBox
+ * @param trafficClass The traffic class whose flows the data is taken from
  * @param dataSize The number of bytes to send out
- * @return Vector containing the prepared buffer (stream, buffer and size)
+ * @param preparedBuffers Filled with the prepared buffers (stream, buffer
+ * and size), as many as it can hold
  */
-  virtual std::vector<helpers::PreparedBuffer> prepareData(size_t dataSize) = 0;
+  virtual void prepareData(uint32_t trafficClass, size_t dataSize,
+                           helpers::PreparedBuffers &preparedBuffers) = 0;
 
 
   /**
@@ -48,10 +71,22 @@ protected:
  * @param ctrlStream The control stream this message was received on
  * @param buffer The buffer containing the messages
  * @param length The length of the buffer
+ * @return false if the control stream can't be decoded anymore. The
+ * connection must then be reset
  */
-  virtual void handleControlMessages(MsQuicStream *ctrlStream,
+  virtual bool handleControlMessages(MsQuicStream *ctrlStream,
                                      uint8_t *buffer, size_t length) = 0;
 
+  /**
+   * @brief Send the buffer on the stream (through sendQueue). The buffer is
+   * freed instead if the stream is not of the live connection by the time
+   * it is sent. Must be called with mapLock held
+   * @param stream The stream to send the buffer on
+   * @param buffer The buffer to send (ownership passes to QUIC)
+   * @param length The length of the buffer
+   */
+  virtual void send(MsQuicStream *stream, uint8_t *buffer, size_t length) = 0;
+
   /**
    * @brief Find a stream by it's ID
    * @param ID The ID to look for
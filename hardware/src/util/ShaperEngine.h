@@ -0,0 +1,498 @@
+//
+// Created by Rut Vora
+//
+
+#ifndef MINESVPN_SHAPER_ENGINE_H
+#define MINESVPN_SHAPER_ENGINE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "helpers.h"
+#include "SPSCRing.h"
+#include "../modules/shaper/NoiseGenerator.h"
+
+namespace helpers {
+  /**
+   * @brief The shaper loop of a shaped process. Every decision interval, the
+   * DP decision is taken on the queued data, which is then prepared (padded
+   * with dummy) and handed to QUIC, in one sending interval (BURST) or
+   * spread over all of them (UNIFORM). Either all on one thread (run), or
+   * pipelined over three (runPipelined). An engine only shapes the flows of
+   * one traffic class (as tagged on their toShaped queues).
+   * Peer is the shaped class itself (final), so that its calls are resolved
+   * (and inlined) at compile time. It must befriend the engine, and have:
+   * - mapLock and queuesToStream
+   * - void prepareData(uint32_t trafficClass, size_t dataSize,
+   *   PreparedBuffers &preparedBuffers)
+   * - PreparedBuffer prepareDummy(size_t dummySize)
+   * - void send(MsQuicStream *stream, uint8_t *buffer, size_t length)
+   * @tparam Peer ShapedClient or ShapedServer
+   * @tparam strategy The sending strategy
+   */
+  template<class Peer, sendingStrategy strategy>
+  class ShaperEngine {
+  public:
+    /**
+     * @brief Constructor for the engine
+     * @param peer The shaped peer whose queues are shaped
+     * @param noiseGenerator The configured noise generator instance
+     * @param sendingInterval The interval (in us) of the sending loop
+     * @param decisionInterval The interval (in us) of the DP decisions
+     * @param maxBuffers The most buffers prepared in one sending interval (one
+     * per queue pair, and the dummy)
+     * @param trafficClass The traffic class shaped (0 for the default one)
+     * @param className The name of that class (its counters and statistics
+     * are reported under it)
+     */
+    ShaperEngine(Peer &peer, NoiseGenerator *noiseGenerator,
+                 __useconds_t sendingInterval, __useconds_t decisionInterval,
+                 size_t maxBuffers, uint32_t trafficClass = 0,
+                 std::string className = "default") :
+        peer(peer), noiseGenerator(noiseGenerator), trafficClass(trafficClass),
+        className(std::move(className)), sendingInterval(sendingInterval),
+        decisionInterval(decisionInterval),
+        divisor(strategy == UNIFORM ? decisionInterval / sendingInterval : 1),
+        maxBuffers(maxBuffers), preparedBuffers(maxBuffers) {}
+
+    /**
+     * @brief Run the loop on the calling thread
+     * @param cores The cores to pin the loop to
+     * @param realTimePriority The SCHED_FIFO priority to run the loop with (0
+     * for normal scheduling)
+     */
+    [[noreturn]] void run(std::vector<int> cores, int realTimePriority) {
+      if (!cores.empty()) setCPUAffinity(cores);
+      if (realTimePriority > 0) setRealTimePriority(realTimePriority);
+      auto now = std::chrono::steady_clock::now();
+      decisionSleepUntil = sendingSleepUntil = now;
+      // Real-time mode reports failed masks as they happen
+      auto nextReport = now + std::chrono::seconds(MASK_REPORT_INTERVAL);
+      auto reportedFailures = 0;
+      while (true) {
+        tick();
+        now = std::chrono::steady_clock::now();
+        if (realTimePriority > 0 && now >= nextReport) {
+          nextReport = now + std::chrono::seconds(MASK_REPORT_INTERVAL);
+          auto failures = counters->failedDPMask +
+                          counters->failedPrepMask +
+                          counters->failedEnqueueMask;
+          if (failures > reportedFailures)
+            printMaskFailures(className, *counters);
+          reportedFailures = failures;
+        }
+        if (now < decisionSleepUntil) {
+          std::this_thread::sleep_until(decisionSleepUntil);
+        }
+      }
+    }
+
+    /**
+     * @brief Run the loop as a pipeline of three stages, each on its own
+     * thread: while the decision of window t+1 is taken, window t is
+     * prepared and window t-1 is enqueued. Each stage then only has to fit
+     * in the decision interval by itself. Every window is enqueued two
+     * decision intervals after its decision (with SHAPING)
+     * @param cores The cores to pin the stages to (in turn: decision,
+     * preparation, enqueueing)
+     * @param realTimePriority The SCHED_FIFO priority to run the stages with
+     * (0 for normal scheduling)
+     */
+    [[noreturn]] void runPipelined(std::vector<int> cores,
+                                   int realTimePriority) {
+      // Two windows in flight between each pair of stages
+      SPSCRing<Decision> decisions{2 * numSends()};
+      SPSCRing<Batch> batches{2 * numSends(), maxBuffers};
+      auto startStage = [&cores, realTimePriority](size_t stage) {
+        if (!cores.empty()) {
+          std::vector<int> core{cores[stage % cores.size()]};
+          setCPUAffinity(core);
+        }
+        if (realTimePriority > 0) setRealTimePriority(realTimePriority);
+      };
+      decisionSleepUntil = std::chrono::steady_clock::now();
+      std::thread decisionThread([this, &decisions, &startStage]() {
+        startStage(0);
+        while (true) {
+          decide(decisions);
+          if (std::chrono::steady_clock::now() < decisionSleepUntil)
+            std::this_thread::sleep_until(decisionSleepUntil);
+        }
+      });
+      decisionThread.detach();
+      std::thread prepThread([this, &decisions, &batches, &startStage]() {
+        startStage(1);
+        while (true) prepare(decisions, batches);
+      });
+      prepThread.detach();
+
+      startStage(2);
+      auto nextReport = std::chrono::steady_clock::now() +
+                        std::chrono::seconds(MASK_REPORT_INTERVAL);
+      auto reportedFailures = 0;
+      while (true) {
+        enqueue(batches);
+        auto now = std::chrono::steady_clock::now();
+        if (realTimePriority > 0 && now >= nextReport) {
+          nextReport = now + std::chrono::seconds(MASK_REPORT_INTERVAL);
+          auto failures = counters->failedDPMask +
+                          counters->failedPrepMask +
+                          counters->failedEnqueueMask;
+          if (failures > reportedFailures)
+            printMaskFailures(className, *counters);
+          reportedFailures = failures;
+        }
+      }
+    }
+
+    /**
+     * @brief One decision interval, up to the wait for the next one
+     */
+    inline void tick() {
+#ifdef SHAPING
+      decisionSleepUntil += std::chrono::microseconds(decisionInterval);
+#else
+      decisionSleepUntil = std::chrono::steady_clock::now() +
+                           std::chrono::microseconds(decisionInterval);
+#endif
+      auto loopStart = std::chrono::steady_clock::now();
+      // Masked DP Decision Time
+      auto mask = loopStart + std::chrono::microseconds(MASK_DP_DECISION);
+      peer.mapLock.lock_shared();
+      auto aggregatedSize = getAggregatedQueueSize(peer.queuesToStream,
+                                                   trafficClass);
+      peer.mapLock.unlock_shared();
+      auto DPDecision = noiseGenerator->getDPDecision(aggregatedSize);
+#ifdef RECORD_STATS
+      auto end = std::chrono::steady_clock::now();
+#endif
+      waitForMask<MASK_DP_DECISION>(mask, counters->failedDPMask);
+
+#ifndef SHAPING
+      DPDecision = aggregatedSize;
+#endif
+      if (DPDecision == 0) {
+        // For state management of client who disconnected
+        preparedBuffers.clear();
+        peer.prepareData(trafficClass, 0, preparedBuffers);
+        return;
+      }
+      counters->iterations++;
+#ifdef RECORD_STATS
+      updateStats(*stats, DECISION, (end - loopStart).count() / 1000);
+#endif
+      // Enqueue data for quic to send.
+      auto maxBytesToSend = DPDecision / numSends();
+      for (unsigned int i = 0; i < numSends(); i++) {
+        sendingSleepUntil += std::chrono::microseconds(sendingInterval);
+
+        // Masked Prep time
+        auto start = std::chrono::steady_clock::now();
+        mask = start + std::chrono::microseconds(MASK_PREP);
+        size_t dataSize = std::min(aggregatedSize, maxBytesToSend);
+        size_t dummySize = maxBytesToSend - dataSize;
+        aggregatedSize -= dataSize;
+        preparedBuffers.clear();
+        peer.prepareData(trafficClass, dataSize, preparedBuffers);
+        auto dummy = peer.prepareDummy(dummySize);
+        if (!preparedBuffers.push(dummy)) free(dummy.buffer);
+#ifdef RECORD_STATS
+        end = std::chrono::steady_clock::now();
+        updateStats(*stats, PREP, (end - start).count() / 1000);
+        updateStats(*stats, DECISION_PREP,
+                    (end - loopStart).count() / 1000);
+#endif
+        waitForMask<MASK_PREP>(mask, counters->failedPrepMask);
+
+        // Sends are serialized per connection by send
+#ifdef RECORD_STATS
+        start = std::chrono::steady_clock::now();
+#endif
+        mask = std::chrono::steady_clock::now() +
+               std::chrono::microseconds(MASK_ENQUEUE);
+        peer.mapLock.lock_shared();
+        for (const auto &preparedBuffer: preparedBuffers) {
+          if (preparedBuffer.stream == nullptr
+              || preparedBuffer.buffer == nullptr)
+            continue;
+          peer.send(preparedBuffer.stream, preparedBuffer.buffer,
+                    preparedBuffer.length);
+        }
+        peer.mapLock.unlock_shared();
+#ifdef RECORD_STATS
+        end = std::chrono::steady_clock::now();
+        updateStats(*stats, ENQUEUE, (end - start).count() / 1000);
+#endif
+        waitForMask<MASK_ENQUEUE>(mask, counters->failedEnqueueMask);
+        if (std::chrono::steady_clock::now() < sendingSleepUntil)
+          std::this_thread::sleep_until(sendingSleepUntil);
+      }
+#ifdef RECORD_STATS
+      updateStats(*stats, LOOP,
+                  (std::chrono::steady_clock::now() - loopStart).count()
+                  / 1000);
+#endif
+    }
+
+  private:
+    /**
+     * @brief The share of a decision to send in one sending interval, passed
+     * from the decision to the preparation stage
+     */
+    struct Decision {
+      size_t dataSize = 0;
+      size_t dummySize = 0;
+      bool send = false; // Nothing is sent for a decision of 0
+      std::chrono::steady_clock::time_point decidedAt;
+      std::chrono::steady_clock::time_point due; // When to enqueue it
+    };
+
+    /**
+     * @brief The prepared buffers of one sending interval, passed from the
+     * preparation to the enqueueing stage
+     */
+    struct Batch {
+      PreparedBuffers preparedBuffers;
+      std::chrono::steady_clock::time_point decidedAt;
+      std::chrono::steady_clock::time_point due;
+
+      explicit Batch(size_t maxBuffers) : preparedBuffers(maxBuffers) {}
+    };
+
+    // The masks (in us) of the DP decision, prep and enqueue windows
+#ifdef SHAPING
+    static constexpr int MASK_DP_DECISION = 0;
+    static constexpr int MASK_PREP = 6000;
+    static constexpr int MASK_ENQUEUE = 1000;
+#else
+    static constexpr int MASK_DP_DECISION = 0;
+    static constexpr int MASK_PREP = 0;
+    static constexpr int MASK_ENQUEUE = 0;
+#endif
+
+    Peer &peer;
+    NoiseGenerator *noiseGenerator;
+    const uint32_t trafficClass;
+    const std::string className;
+    const __useconds_t sendingInterval;
+    const __useconds_t decisionInterval;
+    const unsigned int divisor;
+    const size_t maxBuffers;
+    PreparedBuffers preparedBuffers;
+    std::chrono::steady_clock::time_point decisionSleepUntil =
+        std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point sendingSleepUntil =
+        decisionSleepUntil;
+    // Bytes decided on by the decision stage, but not yet taken from the
+    // queues by the preparation stage
+    std::atomic<size_t> inFlightData = 0;
+    // Of this loop only: the engines of other traffic classes run at the same
+    // time
+    ShaperCounters *counters = newShaperCounters(className);
+#ifdef RECORD_STATS
+    ShaperStats *stats = newStats(className);
+#endif
+
+    /**
+     * @brief (Decision stage) Take the decision of the next window and hand
+     * its share of every sending interval to the preparation stage
+     * @param decisions The ring to the preparation stage
+     */
+    inline void decide(SPSCRing<Decision> &decisions) {
+#ifdef SHAPING
+      auto windowStart = decisionSleepUntil;
+      decisionSleepUntil += std::chrono::microseconds(decisionInterval);
+      // The two windows ahead of it are being prepared and enqueued
+      auto due = windowStart + 2 * std::chrono::microseconds(decisionInterval);
+#else
+      auto windowStart = std::chrono::steady_clock::now();
+      decisionSleepUntil = windowStart +
+                           std::chrono::microseconds(decisionInterval);
+      auto due = windowStart;
+#endif
+      auto loopStart = std::chrono::steady_clock::now();
+      // Read before the queues: the preparation stage takes the data from
+      // the queues before it's no longer in flight, so the data available
+      // can only be underestimated
+      auto inFlight = inFlightData.load();
+      peer.mapLock.lock_shared();
+      auto aggregatedSize = getAggregatedQueueSize(peer.queuesToStream,
+                                                   trafficClass);
+      peer.mapLock.unlock_shared();
+      aggregatedSize = aggregatedSize > inFlight ? aggregatedSize - inFlight
+                                                 : 0;
+      auto DPDecision = noiseGenerator->getDPDecision(aggregatedSize);
+#ifndef SHAPING
+      DPDecision = aggregatedSize;
+#endif
+      if (DPDecision == 0) {
+        // For state management of client who disconnected
+        auto decision = decisions.waitClaim();
+        *decision = {0, 0, false, loopStart, due};
+        decisions.publish();
+        return;
+      }
+      counters->iterations++;
+#ifdef RECORD_STATS
+      updateStats(*stats, DECISION,
+                  (std::chrono::steady_clock::now() - loopStart).count()
+                  / 1000);
+#endif
+      auto maxBytesToSend = DPDecision / numSends();
+      for (unsigned int i = 0; i < numSends(); i++) {
+        size_t dataSize = std::min(aggregatedSize, maxBytesToSend);
+        aggregatedSize -= dataSize;
+        inFlightData += dataSize;
+        auto decision = decisions.waitClaim();
+        *decision = {dataSize, maxBytesToSend - dataSize, true, loopStart,
+                     due + i * std::chrono::microseconds(sendingInterval)};
+        decisions.publish();
+      }
+    }
+
+    /**
+     * @brief (Preparation stage) Prepare the next decision and hand the
+     * buffers to the enqueueing stage
+     * @param decisions The ring from the decision stage
+     * @param batches The ring to the enqueueing stage
+     */
+    inline void prepare(SPSCRing<Decision> &decisions,
+                        SPSCRing<Batch> &batches) {
+      auto decision = decisions.waitFront();
+      if (!decision->send) {
+        preparedBuffers.clear();
+        peer.prepareData(trafficClass, 0, preparedBuffers);
+        decisions.release();
+        return;
+      }
+      auto start = std::chrono::steady_clock::now();
+      auto batch = batches.waitClaim();
+      batch->preparedBuffers.clear();
+      peer.prepareData(trafficClass, decision->dataSize,
+                       batch->preparedBuffers);
+      inFlightData -= decision->dataSize;
+      auto dummy = peer.prepareDummy(decision->dummySize);
+      if (!batch->preparedBuffers.push(dummy)) free(dummy.buffer);
+      batch->decidedAt = decision->decidedAt;
+      batch->due = decision->due;
+      decisions.release();
+      batches.publish();
+#ifdef RECORD_STATS
+      auto end = std::chrono::steady_clock::now();
+      updateStats(*stats, PREP, (end - start).count() / 1000);
+      updateStats(*stats, DECISION_PREP,
+                  (end - batch->decidedAt).count() / 1000);
+#else
+      (void) (start);
+#endif
+    }
+
+    /**
+     * @brief (Enqueueing stage) Hand the next prepared buffers to QUIC once
+     * they are due
+     * @param batches The ring from the preparation stage
+     */
+    inline void enqueue(SPSCRing<Batch> &batches) {
+      auto batch = batches.waitFront();
+      // The preparation must be done by the time the window is due
+      if (std::chrono::steady_clock::now() < batch->due)
+        std::this_thread::sleep_until(batch->due);
+      else if constexpr (MASK_PREP > 0) counters->failedPrepMask++;
+#ifdef RECORD_STATS
+      auto start = std::chrono::steady_clock::now();
+#endif
+      peer.mapLock.lock_shared();
+      for (const auto &preparedBuffer: batch->preparedBuffers) {
+        if (preparedBuffer.stream == nullptr
+            || preparedBuffer.buffer == nullptr)
+          continue;
+        peer.send(preparedBuffer.stream, preparedBuffer.buffer,
+                  preparedBuffer.length);
+      }
+      peer.mapLock.unlock_shared();
+      auto end = std::chrono::steady_clock::now();
+      if constexpr (MASK_ENQUEUE > 0) {
+        if (end > batch->due + std::chrono::microseconds(MASK_ENQUEUE))
+          counters->failedEnqueueMask++;
+      }
+#ifdef RECORD_STATS
+      updateStats(*stats, ENQUEUE, (end - start).count() / 1000);
+      updateStats(*stats, LOOP, (end - batch->decidedAt).count() / 1000);
+#endif
+      batches.release();
+    }
+
+    /**
+     * @return The number of sending intervals a decision is spread over
+     */
+    [[nodiscard]] inline unsigned int numSends() const {
+      if constexpr (strategy == BURST) return 1;
+      else return divisor;
+    }
+
+    /**
+     * @brief Wait till the end of a masked window (a no-op without a mask)
+     * @tparam maskUs The length of the mask
+     * @param mask The end of the window
+     * @param failures Counts the windows that took longer than the mask
+     */
+    template<int maskUs>
+    static inline void waitForMask(std::chrono::steady_clock::time_point mask,
+                                   std::atomic<int> &failures) {
+      if constexpr (maskUs > 0) {
+        if (std::chrono::steady_clock::now() < mask)
+          std::this_thread::sleep_until(mask);
+        else failures++;
+      } else {
+        (void) (mask);
+        (void) (failures);
+      }
+    }
+  };
+
+  /**
+   * @brief Run the shaper loop of the given peer on the calling thread, with
+   * the engine of the configured strategy
+   * @param peer The shaped peer whose queues are shaped
+   * @param noiseGenerator The configured noise generator instance
+   * @param sendingInterval The interval (in us) of the sending loop
+   * @param decisionInterval The interval (in us) of the DP decisions
+   * @param strategy The sending strategy (when decisionInterval >= 2 *
+   * sendingInterval). Can be "BURST" or "UNIFORM"
+   * @param maxBuffers The most buffers prepared in one sending interval
+   * @param cores The cores to pin the loop to
+   * @param realTimePriority The SCHED_FIFO priority to run the loop with (0
+   * for normal scheduling)
+   * @param pipelined Run the decision, preparation and enqueueing on three
+   * threads (see ShaperEngine::runPipelined)
+   * @param trafficClass The traffic class shaped (0 for the default one)
+   * @param className The name of that class
+   */
+  template<class Peer>
+  [[noreturn]] void runShaper(Peer &peer, NoiseGenerator *noiseGenerator,
+                              __useconds_t sendingInterval,
+                              __useconds_t decisionInterval,
+                              sendingStrategy strategy, size_t maxBuffers,
+                              std::vector<int> cores, int realTimePriority,
+                              bool pipelined, uint32_t trafficClass = 0,
+                              const std::string &className = "default") {
+    if (strategy == UNIFORM) {
+      ShaperEngine<Peer, UNIFORM> engine{peer, noiseGenerator,
+                                         sendingInterval, decisionInterval,
+                                         maxBuffers, trafficClass, className};
+      if (pipelined) engine.runPipelined(std::move(cores), realTimePriority);
+      engine.run(std::move(cores), realTimePriority);
+    }
+    ShaperEngine<Peer, BURST> engine{peer, noiseGenerator, sendingInterval,
+                                     decisionInterval, maxBuffers,
+                                     trafficClass, className};
+    if (pipelined) engine.runPipelined(std::move(cores), realTimePriority);
+    engine.run(std::move(cores), realTimePriority);
+  }
+}
+
+#endif //MINESVPN_SHAPER_ENGINE_H
@@ -0,0 +1,102 @@
+//
+// Created by Rut Vora
+//
+
+#ifndef MINESVPN_TRAFFIC_CLASSES_H
+#define MINESVPN_TRAFFIC_CLASSES_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../modules/Common.h"
+#include "config.h"
+#include "helpers.h"
+
+namespace helpers {
+  /**
+   * @brief The traffic classes of a middlebox, each shaped by its own shaper
+   * loop. Class 0 holds the flows that match none of the configured classes,
+   * class i the flows of the i-th configured class. Flows draw their queues
+   * from the shared pool and are tagged with their class at SYN (on the
+   * toShaped queue), when the shaped process learns their addresses. Both
+   * middleboxes match the same address pair, so configured alike, they
+   * agree on the class of every flow
+   */
+  class TrafficClasses {
+  public:
+    TrafficClasses() = default;
+
+    /**
+     * @param trafficClasses The configured traffic classes
+     */
+    explicit TrafficClasses(std::vector<config::TrafficClass> trafficClasses)
+        : trafficClasses(std::move(trafficClasses)) {}
+
+    /**
+     * @return The number of classes (including the default one)
+     */
+    [[nodiscard]] inline size_t size() const {
+      return trafficClasses.size() + 1;
+    }
+
+    /**
+     * @param trafficClass The index of a class
+     * @return The name of that class
+     */
+    [[nodiscard]] inline std::string name(size_t trafficClass) const {
+      if (trafficClass == 0) return "default";
+      return trafficClasses[trafficClass - 1].name;
+    }
+
+    /**
+     * @param addrPair The client and server of a flow
+     * @return The class of the flow (0 if it matches none)
+     */
+    [[nodiscard]] uint32_t match(const addressPair &addrPair) const {
+      std::string_view clientAddress{
+          addrPair.clientAddress,
+          strnlen(addrPair.clientAddress, sizeof(addrPair.clientAddress))};
+      std::string_view serverAddress{
+          addrPair.serverAddress,
+          strnlen(addrPair.serverAddress, sizeof(addrPair.serverAddress))};
+      auto serverPort = (uint16_t) std::strtoul(addrPair.serverPort, nullptr,
+                                                10);
+      for (size_t i = 0; i < trafficClasses.size(); i++) {
+        const auto &trafficClass = trafficClasses[i];
+        if (std::find(trafficClass.ports.begin(), trafficClass.ports.end(),
+                      serverPort) != trafficClass.ports.end()) {
+          return i + 1;
+        }
+        for (const auto &addresses: trafficClass.addressPairs) {
+          if (matches(addresses.client, clientAddress)
+              && matches(addresses.server, serverAddress)) {
+            return i + 1;
+          }
+        }
+      }
+      return 0;
+    }
+
+    /**
+     * @brief Tag the queues of a new flow with its class. Must be done before
+     * its data can be sent
+     * @param queues The queues of the flow (with its addresses)
+     */
+    inline void classify(QueuePair queues) const {
+      queues.toShaped->trafficClass = match(queues.toShaped->addrPair);
+    }
+
+  private:
+    std::vector<config::TrafficClass> trafficClasses;
+
+    static inline bool matches(const std::string &pattern,
+                               std::string_view address) {
+      return pattern == "*" || pattern == address;
+    }
+  };
+}
+
+#endif //MINESVPN_TRAFFIC_CLASSES_H
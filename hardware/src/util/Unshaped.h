@@ -6,18 +6,140 @@
 #define MINESVPN_UNSHAPED_H
 
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <vector>
 #include "Base.h"
+#include "../modules/tcp_wrapper/SendBatch.h"
 
 class Unshaped : public Base {
 protected:
   __useconds_t shapedProcessLoopInterval;
 
+  // The part of the SHM that holds the queues (data is sent straight from it)
+  uint8_t *queueMemory = nullptr;
+  size_t queueMemorySize = 0;
+  // The number of queue pairs (not counting the dummy queues)
+  uint64_t numQueuePairs = 0;
+
+  // The number of threads draining the fromShaped queues
+  int numDrainWorkers = 1;
+
 /**
  * @brief Check queues for data periodically and send it to corresponding socket
+ * @param worker The index of this drain worker. It only handles the queue
+ * pairs it owns (see ownedRange)
  * @param interval The interval at which the queues are checked
  */
-  [[noreturn]] virtual void checkQueuesForData(__useconds_t interval,
+  [[noreturn]] virtual void checkQueuesForData(int worker,
+                                               __useconds_t interval,
                                                size_t queueSize) = 0;
+
+/**
+ * @brief Start the drain workers. Each one runs checkQueuesForData on its own
+ * range of queue pairs, so that one slow socket only holds up the sockets of
+ * its own range
+ * @param numWorkers The number of drain workers
+ * @param cores The cores to run on. With one worker, it may run on any of
+ * them. Else, each worker is pinned to one of them (round robin)
+ * @param interval The interval at which the queues are checked
+ * @param queueSize The size of each queue
+ */
+  void startDrainWorkers(int numWorkers, const std::vector<int> &cores,
+                         __useconds_t interval, size_t queueSize) {
+    numDrainWorkers = std::max(numWorkers, 1);
+    for (int worker = 0; worker < numDrainWorkers; worker++) {
+      std::thread drainWorker([=, this]() {
+        std::vector<int> workerCores = cores;
+        if (numDrainWorkers > 1 && !cores.empty())
+          workerCores = {cores[worker % cores.size()]};
+        if (!workerCores.empty()) helpers::setCPUAffinity(workerCores);
+        checkQueuesForData(worker, interval, queueSize);
+      });
+      drainWorker.detach();
+    }
+  }
+
+/**
+ * @param worker The index of a drain worker
+ * @return The first and one past the last index of the queue pairs the given
+ * worker owns. Every worker owns a contiguous range of queue pairs. The dummy
+ * queues take IDs 0 and 1, so pair n holds IDs 2n + 2 and 2n + 3
+ */
+  [[nodiscard]] inline std::pair<uint64_t, uint64_t>
+  ownedRange(int worker) const {
+    auto first = (worker * numQueuePairs + numDrainWorkers - 1)
+                 / numDrainWorkers;
+    auto last = ((worker + 1) * numQueuePairs + numDrainWorkers - 1)
+                / numDrainWorkers;
+    return {first, last};
+  }
+
+/**
+ * @brief Push all of the given data to the (toShaped) queue. If it doesn't
+ * fit, the caller waits (and so reads no more data from its socket, holding
+ * the sender back through TCP flow control) until the shaped process has made
+ * space for the rest
+ * @param queue The queue to push to
+ * @param buffer The data
+ * @param length The length of the data
+ */
+  void pushAll(LamportQueue *queue, uint8_t *buffer, size_t length) {
+    auto pushed = queue->pushPartial(buffer, length);
+    if (pushed == length) return;
+    log(WARNING, "(toShaped) " + std::to_string(queue->ID) +
+                 " is full, holding back the sender");
+    while ((pushed += queue->pushPartial(buffer + pushed, length - pushed))
+           < length) {
+#ifdef SHAPING
+      // The shaped process frees space once per loop, wait for the next one
+      std::this_thread::sleep_for(
+          std::chrono::microseconds(shapedProcessLoopInterval));
+#else
+      std::this_thread::yield();
+#endif
+    }
+  }
+
+/**
+ * @brief Queue the data in the given queue to be sent (straight from the SHM)
+ * with the next flush of the batch. Whatever a non-blocking send leaves
+ * behind stays in the queue for the next pass
+ * @param sendBatch The batch of sends of this pass over the queues
+ * @param socket The socket to send the data on
+ * @param queue The queue holding the data
+ */
+  static inline void batchSend(TCP::SendBatch &sendBatch, int socket,
+                               LamportQueue *queue) {
+    uint8_t *first, *second;
+    size_t firstLength, secondLength;
+    if (queue->peek(first, firstLength, second, secondLength) == 0) return;
+    // Both parts go in the same batch, so the second is only sent if the
+    // first was sent completely. A non-blocking send is often cut short, so
+    // then the second part waits for the next pass
+    if (sendBatch.available() < 2) sendBatch.flush(sentFromQueue);
+    sendBatch.send(socket, first, firstLength, queue);
+    if (secondLength > 0 && !sendBatch.isNonBlocking())
+      sendBatch.send(socket, second, secondLength, queue);
+  }
+
+/**
+ * @brief Remove the data that was sent from its queue (passed to
+ * SendBatch::flush)
+ * @param context The queue the data was sent from
+ * @param sent The number of bytes sent (negative if the send failed)
+ */
+  static void sentFromQueue(void *context, ssize_t sent) {
+    auto queue = static_cast<LamportQueue *>(context);
+    if (sent > 0) {
+      queue->advance(sent);
+    } else if (sent != -ECANCELED && sent != -EAGAIN && sent != -EWOULDBLOCK) {
+      // The socket is broken. Drop the data, the FIN follows
+      queue->advance(queue->size());
+    }
+  }
 };
 
 
@@ -0,0 +1,65 @@
+//
+// Created by Rut Vora
+//
+
+#ifndef MINESVPN_VARINT_H
+#define MINESVPN_VARINT_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace helpers {
+  /**
+   * @brief Maximum size of a LEB128 encoded 64-bit integer
+   */
+  inline constexpr size_t MAX_VARINT_SIZE = 10;
+
+  /**
+   * @param value The value to encode
+   * @return The number of bytes the value takes when LEB128 encoded
+   */
+  inline size_t varintSize(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+      value >>= 7;
+      size++;
+    }
+    return size;
+  }
+
+  /**
+   * @brief LEB128 encode the value
+   * @param pos Where to write the value (needs varintSize(value) bytes)
+   * @param value The value to encode
+   * @return The position right after the encoded value
+   */
+  inline uint8_t *putVarint(uint8_t *pos, uint64_t value) {
+    while (value >= 0x80) {
+      *pos++ = (uint8_t) (value | 0x80);
+      value >>= 7;
+    }
+    *pos++ = (uint8_t) value;
+    return pos;
+  }
+
+  /**
+   * @brief Decode a LEB128 encoded value
+   * @param pos Where to read the value from. Moved past the bytes read
+   * @param limit The end of the readable bytes
+   * @param value Set to the decoded value
+   * @return false if the value is incomplete (or longer than
+   * MAX_VARINT_SIZE bytes)
+   */
+  inline bool getVarint(const uint8_t *&pos, const uint8_t *limit,
+                        uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < limit; shift += 7) {
+      uint8_t byte = *pos++;
+      value |= (uint64_t) (byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) return true;
+    }
+    return false;
+  }
+}
+
+#endif //MINESVPN_VARINT_H
@@ -6,7 +6,9 @@
 #define MINESVPN_CONFIG_H
 
 #include "../modules/Common.h"
+#include <algorithm>
 #include <string>
+#include <vector>
 #include <nlohmann/json.hpp>
 
 using json = nlohmann::json;
@@ -49,6 +51,13 @@ namespace config {
    * @param serverAddr The server (on the other side of the 2nd middlebox)
    * you want to connect to
    * @param cores The cores on which this process should run
+   * @param ioThreads The number of threads that accept and read from the
+   * clients (pinned to the cores round robin). Each has its own listener
+   * @param backlog The number of pending connections each listener holds
+   * @param incomingCPU Steer new connections to the I/O thread pinned to the
+   * core that received them (SO_INCOMING_CPU)
+   * @param drainThreads The number of threads that send the responses to the
+   * clients (pinned to the cores round robin). Each owns a range of the queues
    */
   struct UnshapedServer {
     std::string bindAddr;
@@ -56,6 +65,10 @@ namespace config {
     __useconds_t checkQueuesInterval = 50000;
     std::string serverAddr = "localhost:5555";
     std::vector<int> cores{};
+    int ioThreads = 1;
+    int backlog = 1024;
+    bool incomingCPU = false;
+    int drainThreads = 1;
   };
   /**
    * @param peer2Addr The address of the other middlebox
@@ -79,6 +92,22 @@ namespace config {
    * connection between the middleboxes will be terminated
    * @param shaperCores The core/s on which the shaper thread should run
    * @param workerCores The core/s on which the QUIC worker thread/s should run
+   * @param realTimePriority The SCHED_FIFO priority of the shaper thread
+   * (1-99). Also locks the memory of the shaped process and prefaults the
+   * SHM. 0 for normal scheduling
+   * @param pipelined Take the DP decisions, prepare the data and enqueue it
+   * on three threads (pinned to the shaperCores in turn), each a decision
+   * interval apart
+   * @param resumptionTicketPath The file in which the resumption ticket of
+   * the other middlebox is stored, to reconnect to it with 0-RTT
+   * @param warmStreams The number of data streams kept open ahead of time.
+   * Data streams are bound to queues lazily, on the first SYN of a client
+   * @param multiplexStreams The number of data streams that the data of all
+   * clients is multiplexed on. 0 gives every client its own data stream
+   * @param resumeTimeout The time (in milliseconds) a multiplexed flow is
+   * kept for, after the connection to the other middlebox is lost (or this
+   * process restarts), to resume it on the next connection. 0 terminates
+   * the flows at once
    */
   struct ShapedClient {
     std::string peer2Addr = "localhost";
@@ -93,6 +122,75 @@ namespace config {
     uint64_t idleTimeout = 100000;
     std::vector<int> shaperCores{};
     std::vector<int> workerCores{};
+    int realTimePriority = 0;
+    bool pipelined = false;
+    std::string resumptionTicketPath = "resumption.ticket";
+    int warmStreams = 4;
+    int multiplexStreams = 0;
+    uint64_t resumeTimeout = 0;
+  };
+  /**
+   * @param client The address of the client ("*" for any)
+   * @param server The address of the server ("*" for any)
+   */
+  struct AddressMatch {
+    std::string client = "*";
+    std::string server = "*";
+  };
+  /**
+   * @brief Flows that are shaped apart from all others, with their own
+   * parameters and by their own shaper thread. A flow belongs to the first
+   * class it matches at its SYN, else it is shaped with the parameters of
+   * the shaped process. Parameters that are not given are taken from the
+   * shaped process as well
+   * @param name The name of the class
+   * @param ports The server ports of the flows of the class
+   * @param addressPairs The client and server addresses of the flows of the
+   * class
+   * @param noiseMultiplier The privacy budget of the class
+   * @param sensitivity The max "distance" between 2 queues of the class that
+   * we want to hide
+   * @param maxDecisionSize The maximum DP decision of the class
+   * @param minDecisionSize The minimum DP decision of the class
+   * @param DPCreditorLoopInterval The interval (in microseconds) of the DP
+   * decisions of the class
+   * @param sendingLoopInterval The interval (in microseconds) with which the
+   * data of the class is sent
+   * @param strategy The sending strategy of the class
+   * @param shaperCores The core/s on which the shaper thread of the class
+   * should run
+   */
+  struct TrafficClass {
+    std::string name;
+    std::vector<uint16_t> ports{};
+    std::vector<AddressMatch> addressPairs{};
+    double noiseMultiplier = 38;
+    double sensitivity = 500000;
+    uint64_t maxDecisionSize = 500000;
+    uint64_t minDecisionSize = 0;
+    __useconds_t DPCreditorLoopInterval = 50000;
+    __useconds_t sendingLoopInterval = 50000;
+    sendingStrategy strategy = BURST;
+    std::vector<int> shaperCores{};
+
+    /**
+     * @param shaped The config of the shaped process (ShapedClient or
+     * ShapedServer)
+     * @return A class that is shaped like the flows of no class
+     */
+    template<class Shaped>
+    static TrafficClass inheriting(const Shaped &shaped) {
+      TrafficClass trafficClass;
+      trafficClass.noiseMultiplier = shaped.noiseMultiplier;
+      trafficClass.sensitivity = shaped.sensitivity;
+      trafficClass.maxDecisionSize = shaped.maxDecisionSize;
+      trafficClass.minDecisionSize = shaped.minDecisionSize;
+      trafficClass.DPCreditorLoopInterval = shaped.DPCreditorLoopInterval;
+      trafficClass.sendingLoopInterval = shaped.sendingLoopInterval;
+      trafficClass.strategy = shaped.strategy;
+      trafficClass.shaperCores = shaped.shaperCores;
+      return trafficClass;
+    }
   };
   /**
    * @param logLevel The level of logging required. For DEBUG, the program
@@ -100,14 +198,33 @@ namespace config {
    * @param maxClients The maximum number of clients we will support
    * @param appName The name of this application instance. Used as key to
    * create the shared memory between the shaped and the unshaped processes
+   * @param segmentSize The size of the segments the queues take their memory
+   * from while they hold data (0 for queues of queueSize bytes each)
+   * @param slabPoolSize The number of segments shared by all queues (0 for
+   * enough to fill all of them at the same time)
+   * @param hugePageSize The size of the huge pages to put the shared memory
+   * in (0 for normal pages)
+   * @param prefaultSHM Fault in the whole shared memory at startup
+   * @param numaAware Keep the shared memory and the buffers of both processes
+   * on the NUMA node of the shaper cores
+   * @param fused Run the shaped and the unshaped halves in one process,
+   * sharing the queues directly, instead of forking them
+   * @param trafficClasses The classes of flows that are shaped apart
    */
   struct Peer1Config {
     logLevels logLevel = WARNING;
     int maxClients = 40;
     std::string appName = "minesVPNPeer1";
     size_t queueSize = 2097152;
+    size_t segmentSize = 65536;
+    size_t slabPoolSize = 0;
+    size_t hugePageSize = 0;
+    bool prefaultSHM = false;
+    bool numaAware = false;
+    bool fused = false;
     struct UnshapedServer unshapedServer;
     struct ShapedClient shapedClient;
+    std::vector<TrafficClass> trafficClasses{};
   };
 
   /**
@@ -132,6 +249,16 @@ namespace config {
    * connection between the middleboxes will be terminated
    * @param shaperCores The core/s on which the shaper thread should run
    * @param workerCores The core/s on which the QUIC worker thread/s should run
+   * @param realTimePriority The SCHED_FIFO priority of the shaper thread
+   * (1-99). Also locks the memory of the shaped process and prefaults the
+   * SHM. 0 for normal scheduling
+   * @param pipelined Take the DP decisions, prepare the data and enqueue it
+   * on three threads (pinned to the shaperCores in turn), each a decision
+   * interval apart
+   * @param resumeTimeout The time (in milliseconds) a multiplexed flow is
+   * kept for, after the connection to the other middlebox is lost (or this
+   * process restarts), to resume it on the next connection. 0 terminates
+   * the flows at once
    */
   struct ShapedServer {
     std::string serverCert = "server.cert";
@@ -147,15 +274,45 @@ namespace config {
     uint64_t idleTimeout = 100000;
     std::vector<int> shaperCores{};
     std::vector<int> workerCores{};
+    int realTimePriority = 0;
+    bool pipelined = false;
+    uint64_t resumeTimeout = 0;
   };
   /**
    * @param checkQueuesInterval The interval with which to check the queues
    * for data to be forwarded
    * @param cores The cores on which this process should run
+   * @param connectTimeout The time (in ms) to wait for each address of the
+   * destination to accept the connection
+   * @param addressCacheTTL The time (in s) for which resolved addresses are
+   * re-used
+   * @param ioThreads The number of threads that read the responses of the
+   * destinations (pinned to the cores round robin)
+   * @param drainThreads The number of threads that send the data to the
+   * destinations (pinned to the cores round robin). Each owns a range of the
+   * queues
+   * @param poolSize The number of idle connections kept open to each
+   * destination (0 disables the pool)
+   * @param poolMaxDestinations The maximum number of destinations kept warm
+   * @param poolMaxIdle The time (in s) after which an idle connection is
+   * replaced, and an unused destination is no longer kept warm
+   * @param poolCheckInterval The interval (in ms) with which the idle
+   * connections are checked and the pools refilled
+   * @param poolDestinations The destinations ("host:port") kept warm from
+   * the start
    */
   struct UnshapedClient {
     __useconds_t checkQueuesInterval = 50000;
     std::vector<int> cores{};
+    int connectTimeout = 5000;
+    int addressCacheTTL = 60;
+    int ioThreads = 1;
+    int drainThreads = 1;
+    int poolSize = 2;
+    int poolMaxDestinations = 16;
+    int poolMaxIdle = 30;
+    int poolCheckInterval = 1000;
+    std::vector<std::string> poolDestinations{};
   };
   /**
    * @param logLevel The level of logging required. For DEBUG, the program
@@ -165,6 +322,18 @@ namespace config {
    * on the other side supports
    * @param appName The name of this application instance. Used as key to
    * create the shared memory between the shaped and the unshaped processes
+   * @param segmentSize The size of the segments the queues take their memory
+   * from while they hold data (0 for queues of queueSize bytes each)
+   * @param slabPoolSize The number of segments shared by all queues (0 for
+   * enough to fill all of them at the same time)
+   * @param hugePageSize The size of the huge pages to put the shared memory
+   * in (0 for normal pages)
+   * @param prefaultSHM Fault in the whole shared memory at startup
+   * @param numaAware Keep the shared memory and the buffers of both processes
+   * on the NUMA node of the shaper cores
+   * @param fused Run the shaped and the unshaped halves in one process,
+   * sharing the queues directly, instead of forking them
+   * @param trafficClasses The classes of flows that are shaped apart
    */
   struct Peer2Config {
     logLevels logLevel = WARNING;
@@ -172,10 +341,89 @@ namespace config {
     int maxStreamsPerPeer = 40;
     std::string appName = "minesVPNPeer2";
     size_t queueSize = 2097152;
+    size_t segmentSize = 65536;
+    size_t slabPoolSize = 0;
+    size_t hugePageSize = 0;
+    bool prefaultSHM = false;
+    bool numaAware = false;
+    bool fused = false;
     struct ShapedServer shapedServer;
     struct UnshapedClient unshapedClient;
+    std::vector<TrafficClass> trafficClasses{};
   };
 
+  /**
+   * @param shaped The config of the shaped process (ShapedClient or
+   * ShapedServer)
+   * @param trafficClasses The traffic classes of the middlebox
+   * @return The shortest interval with which any of the shaper loops takes
+   * data from the queues
+   */
+  template<class Shaped>
+  inline __useconds_t
+  shortestShaperInterval(const Shaped &shaped,
+                         const std::vector<TrafficClass> &trafficClasses) {
+    auto interval = [](const auto &shaper) {
+      return shaper.strategy == UNIFORM ? shaper.sendingLoopInterval
+                                        : shaper.DPCreditorLoopInterval;
+    };
+    auto shortest = interval(shaped);
+    for (const auto &trafficClass: trafficClasses) {
+      shortest = std::min(shortest, interval(trafficClass));
+    }
+    return shortest;
+  }
+
+  [[maybe_unused]] inline void from_json(const json &j,
+                                         AddressMatch &addressMatch) {
+    if (j.contains("client")) {
+      addressMatch.client = j["client"].get<std::string>();
+    }
+    if (j.contains("server")) {
+      addressMatch.server = j["server"].get<std::string>();
+    }
+  }
+
+  [[maybe_unused]] inline void from_json(const json &j,
+                                         TrafficClass &trafficClass) {
+    if (j.contains("name")) {
+      trafficClass.name = j["name"].get<std::string>();
+    }
+    if (j.contains("ports")) {
+      trafficClass.ports = j["ports"].get<std::vector<uint16_t>>();
+    }
+    if (j.contains("addressPairs")) {
+      trafficClass.addressPairs =
+          j["addressPairs"].get<std::vector<AddressMatch>>();
+    }
+    if (j.contains("noiseMultiplier")) {
+      trafficClass.noiseMultiplier = j["noiseMultiplier"].get<double>();
+    }
+    if (j.contains("sensitivity")) {
+      trafficClass.sensitivity = j["sensitivity"].get<double>();
+    }
+    if (j.contains("maxDecisionSize")) {
+      trafficClass.maxDecisionSize = j["maxDecisionSize"].get<uint64_t>();
+    }
+    if (j.contains("minDecisionSize")) {
+      trafficClass.minDecisionSize = j["minDecisionSize"].get<uint64_t>();
+    }
+    if (j.contains("DPCreditorLoopInterval")) {
+      trafficClass.DPCreditorLoopInterval =
+          j["DPCreditorLoopInterval"].get<__useconds_t>();
+    }
+    if (j.contains("sendingLoopInterval")) {
+      trafficClass.sendingLoopInterval =
+          j["sendingLoopInterval"].get<__useconds_t>();
+    }
+    if (j.contains("sendingStrategy")) {
+      trafficClass.strategy = j["sendingStrategy"].get<sendingStrategy>();
+    }
+    if (j.contains("shaperCores")) {
+      trafficClass.shaperCores = j["shaperCores"].get<std::vector<int>>();
+    }
+  }
+
   [[maybe_unused]] inline void from_json(const json &j, Peer1Config &config) {
     // Deserialize JSON values if present
     if (j.contains("logLevel")) {
@@ -190,6 +438,24 @@ namespace config {
     if (j.contains("queueSize")) {
       config.queueSize = j["queueSize"].get<size_t>();
     }
+    if (j.contains("segmentSize")) {
+      config.segmentSize = j["segmentSize"].get<size_t>();
+    }
+    if (j.contains("slabPoolSize")) {
+      config.slabPoolSize = j["slabPoolSize"].get<size_t>();
+    }
+    if (j.contains("hugePageSize")) {
+      config.hugePageSize = j["hugePageSize"].get<size_t>();
+    }
+    if (j.contains("prefaultSHM")) {
+      config.prefaultSHM = j["prefaultSHM"].get<bool>();
+    }
+    if (j.contains("numaAware")) {
+      config.numaAware = j["numaAware"].get<bool>();
+    }
+    if (j.contains("fused")) {
+      config.fused = j["fused"].get<bool>();
+    }
     if (j.contains("shapedClient")) {
       const auto &shapedClientJson = j["shapedClient"];
       if (shapedClientJson.contains("peer2Addr")) {
@@ -235,6 +501,37 @@ namespace config {
         config.shapedClient.workerCores =
             shapedClientJson["workerCores"].get<std::vector<int>>();
       }
+      if (shapedClientJson.contains("realTimePriority")) {
+        config.shapedClient.realTimePriority =
+            shapedClientJson["realTimePriority"].get<int>();
+      }
+      if (shapedClientJson.contains("pipelined")) {
+        config.shapedClient.pipelined =
+            shapedClientJson["pipelined"].get<bool>();
+      }
+      if (shapedClientJson.contains("resumptionTicketPath")) {
+        config.shapedClient.resumptionTicketPath =
+            shapedClientJson["resumptionTicketPath"].get<std::string>();
+      }
+      if (shapedClientJson.contains("warmStreams")) {
+        config.shapedClient.warmStreams =
+            shapedClientJson["warmStreams"].get<int>();
+      }
+      if (shapedClientJson.contains("multiplexStreams")) {
+        config.shapedClient.multiplexStreams =
+            shapedClientJson["multiplexStreams"].get<int>();
+      }
+      if (shapedClientJson.contains("resumeTimeout")) {
+        config.shapedClient.resumeTimeout =
+            shapedClientJson["resumeTimeout"].get<uint64_t>();
+      }
+    }
+    if (j.contains("trafficClasses")) {
+      for (const auto &trafficClassJson: j["trafficClasses"]) {
+        auto trafficClass = TrafficClass::inheriting(config.shapedClient);
+        from_json(trafficClassJson, trafficClass);
+        config.trafficClasses.push_back(trafficClass);
+      }
     }
     if (j.contains("unshapedServer")) {
       const auto &unshapedServerJson = j["unshapedServer"];
@@ -258,6 +555,22 @@ namespace config {
         config.unshapedServer.cores =
             unshapedServerJson["cores"].get<std::vector<int>>();
       }
+      if (unshapedServerJson.contains("ioThreads")) {
+        config.unshapedServer.ioThreads =
+            unshapedServerJson["ioThreads"].get<int>();
+      }
+      if (unshapedServerJson.contains("backlog")) {
+        config.unshapedServer.backlog =
+            unshapedServerJson["backlog"].get<int>();
+      }
+      if (unshapedServerJson.contains("incomingCPU")) {
+        config.unshapedServer.incomingCPU =
+            unshapedServerJson["incomingCPU"].get<bool>();
+      }
+      if (unshapedServerJson.contains("drainThreads")) {
+        config.unshapedServer.drainThreads =
+            unshapedServerJson["drainThreads"].get<int>();
+      }
     }
   }
 
@@ -278,6 +591,24 @@ namespace config {
     if (j.contains("queueSize")) {
       config.queueSize = j["queueSize"].get<size_t>();
     }
+    if (j.contains("segmentSize")) {
+      config.segmentSize = j["segmentSize"].get<size_t>();
+    }
+    if (j.contains("slabPoolSize")) {
+      config.slabPoolSize = j["slabPoolSize"].get<size_t>();
+    }
+    if (j.contains("hugePageSize")) {
+      config.hugePageSize = j["hugePageSize"].get<size_t>();
+    }
+    if (j.contains("prefaultSHM")) {
+      config.prefaultSHM = j["prefaultSHM"].get<bool>();
+    }
+    if (j.contains("numaAware")) {
+      config.numaAware = j["numaAware"].get<bool>();
+    }
+    if (j.contains("fused")) {
+      config.fused = j["fused"].get<bool>();
+    }
     if (j.contains("shapedServer")) {
       const auto &shapedServerJson = j["shapedServer"];
       if (shapedServerJson.contains("serverCert")) {
@@ -328,6 +659,25 @@ namespace config {
         config.shapedServer.workerCores =
             shapedServerJson["workerCores"].get<std::vector<int>>();
       }
+      if (shapedServerJson.contains("realTimePriority")) {
+        config.shapedServer.realTimePriority =
+            shapedServerJson["realTimePriority"].get<int>();
+      }
+      if (shapedServerJson.contains("pipelined")) {
+        config.shapedServer.pipelined =
+            shapedServerJson["pipelined"].get<bool>();
+      }
+      if (shapedServerJson.contains("resumeTimeout")) {
+        config.shapedServer.resumeTimeout =
+            shapedServerJson["resumeTimeout"].get<uint64_t>();
+      }
+    }
+    if (j.contains("trafficClasses")) {
+      for (const auto &trafficClassJson: j["trafficClasses"]) {
+        auto trafficClass = TrafficClass::inheriting(config.shapedServer);
+        from_json(trafficClassJson, trafficClass);
+        config.trafficClasses.push_back(trafficClass);
+      }
     }
     if (j.contains("unshapedClient")) {
       const auto &unshapedClientJson = j["unshapedClient"];
@@ -339,6 +689,43 @@ namespace config {
         config.unshapedClient.cores =
             unshapedClientJson["cores"].get<std::vector<int>>();
       }
+      if (unshapedClientJson.contains("connectTimeout")) {
+        config.unshapedClient.connectTimeout =
+            unshapedClientJson["connectTimeout"].get<int>();
+      }
+      if (unshapedClientJson.contains("addressCacheTTL")) {
+        config.unshapedClient.addressCacheTTL =
+            unshapedClientJson["addressCacheTTL"].get<int>();
+      }
+      if (unshapedClientJson.contains("ioThreads")) {
+        config.unshapedClient.ioThreads =
+            unshapedClientJson["ioThreads"].get<int>();
+      }
+      if (unshapedClientJson.contains("drainThreads")) {
+        config.unshapedClient.drainThreads =
+            unshapedClientJson["drainThreads"].get<int>();
+      }
+      if (unshapedClientJson.contains("poolSize")) {
+        config.unshapedClient.poolSize =
+            unshapedClientJson["poolSize"].get<int>();
+      }
+      if (unshapedClientJson.contains("poolMaxDestinations")) {
+        config.unshapedClient.poolMaxDestinations =
+            unshapedClientJson["poolMaxDestinations"].get<int>();
+      }
+      if (unshapedClientJson.contains("poolMaxIdle")) {
+        config.unshapedClient.poolMaxIdle =
+            unshapedClientJson["poolMaxIdle"].get<int>();
+      }
+      if (unshapedClientJson.contains("poolCheckInterval")) {
+        config.unshapedClient.poolCheckInterval =
+            unshapedClientJson["poolCheckInterval"].get<int>();
+      }
+      if (unshapedClientJson.contains("poolDestinations")) {
+        config.unshapedClient.poolDestinations =
+            unshapedClientJson["poolDestinations"]
+                .get<std::vector<std::string>>();
+      }
     }
   }
 
@@ -350,6 +737,11 @@ namespace config {
        << unshapedServer.checkQueuesInterval << "\n";
     os << "Server Address: " << unshapedServer.serverAddr << "\n";
     os << "Cores: " << unshapedServer.cores << "\n";
+    os << "I/O Threads: " << unshapedServer.ioThreads << "\n";
+    os << "Backlog: " << unshapedServer.backlog << "\n";
+    os << "Steer Incoming CPU: "
+       << (unshapedServer.incomingCPU ? "true" : "false") << "\n";
+    os << "Drain Threads: " << unshapedServer.drainThreads << "\n";
     return os;
   }
 
@@ -369,6 +761,38 @@ namespace config {
     os << "Idle Timeout: " << shapedClient.idleTimeout << "\n";
     os << "Shaper Cores: " << shapedClient.shaperCores << "\n";
     os << "Worker Cores: " << shapedClient.workerCores << "\n";
+    os << "Real-Time Priority: " << shapedClient.realTimePriority << "\n";
+    os << "Pipelined: " << (shapedClient.pipelined ? "true" : "false")
+       << "\n";
+    os << "Resumption Ticket Path: " << shapedClient.resumptionTicketPath
+       << "\n";
+    os << "Warm Streams: " << shapedClient.warmStreams << "\n";
+    os << "Multiplex Streams: " << shapedClient.multiplexStreams << "\n";
+    os << "Resume Timeout: " << shapedClient.resumeTimeout << "\n";
+    return os;
+  }
+
+  inline std::ostream &
+  operator<<(std::ostream &os, const AddressMatch &addressMatch) {
+    os << addressMatch.client << " -> " << addressMatch.server;
+    return os;
+  }
+
+  inline std::ostream &
+  operator<<(std::ostream &os, const TrafficClass &trafficClass) {
+    os << "Name: " << trafficClass.name << "\n";
+    os << "Ports: " << trafficClass.ports << "\n";
+    os << "Address Pairs: " << trafficClass.addressPairs << "\n";
+    os << "Noise Multiplier: " << trafficClass.noiseMultiplier << "\n";
+    os << "Sensitivity: " << trafficClass.sensitivity << "\n";
+    os << "Max Decision Size: " << trafficClass.maxDecisionSize << "\n";
+    os << "Min Decision Size: " << trafficClass.minDecisionSize << "\n";
+    os << "DPCreditor Loop Interval: " << trafficClass.DPCreditorLoopInterval
+       << "\n";
+    os << "Sending Loop Interval: " << trafficClass.sendingLoopInterval
+       << "\n";
+    os << "Sending Strategy: " << trafficClass.strategy << "\n";
+    os << "Shaper Cores: " << trafficClass.shaperCores << "\n";
     return os;
   }
 
@@ -378,8 +802,19 @@ namespace config {
     os << "Max Clients: " << peer1Config.maxClients << "\n";
     os << "App Name: " << peer1Config.appName << "\n";
     os << "Queue Size: " << peer1Config.queueSize << "\n";
+    os << "Segment Size: " << peer1Config.segmentSize << "\n";
+    os << "Slab Pool Size: " << peer1Config.slabPoolSize << "\n";
+    os << "Huge Page Size: " << peer1Config.hugePageSize << "\n";
+    os << "Prefault SHM: " << (peer1Config.prefaultSHM ? "true" : "false")
+       << "\n";
+    os << "NUMA Aware: " << (peer1Config.numaAware ? "true" : "false")
+       << "\n";
+    os << "Fused: " << (peer1Config.fused ? "true" : "false") << "\n";
     os << "\nUnshaped Server: \n" << peer1Config.unshapedServer << "\n";
     os << "\nShaped Client: \n" << peer1Config.shapedClient << "\n";
+    for (const auto &trafficClass: peer1Config.trafficClasses) {
+      os << "\nTraffic Class: \n" << trafficClass << "\n";
+    }
     return os;
   }
 
@@ -400,6 +835,10 @@ namespace config {
     os << "Idle Timeout: " << shapedServer.idleTimeout << "\n";
     os << "Shaper Cores: " << shapedServer.shaperCores << "\n";
     os << "Worker Cores: " << shapedServer.workerCores << "\n";
+    os << "Real-Time Priority: " << shapedServer.realTimePriority << "\n";
+    os << "Pipelined: " << (shapedServer.pipelined ? "true" : "false")
+       << "\n";
+    os << "Resume Timeout: " << shapedServer.resumeTimeout << "\n";
     return os;
   }
 
@@ -408,6 +847,16 @@ namespace config {
     os << "Check Queues Interval: " << unshapedClient.checkQueuesInterval
        << "\n";
     os << "Cores: " << unshapedClient.cores << "\n";
+    os << "Connect Timeout: " << unshapedClient.connectTimeout << "\n";
+    os << "Address Cache TTL: " << unshapedClient.addressCacheTTL << "\n";
+    os << "I/O Threads: " << unshapedClient.ioThreads << "\n";
+    os << "Drain Threads: " << unshapedClient.drainThreads << "\n";
+    os << "Pool Size: " << unshapedClient.poolSize << "\n";
+    os << "Pool Max Destinations: " << unshapedClient.poolMaxDestinations
+       << "\n";
+    os << "Pool Max Idle: " << unshapedClient.poolMaxIdle << "\n";
+    os << "Pool Check Interval: " << unshapedClient.poolCheckInterval << "\n";
+    os << "Pool Destinations: " << unshapedClient.poolDestinations << "\n";
     return os;
   }
 
@@ -419,8 +868,19 @@ namespace config {
        << "\n";
     os << "App Name: " << peer2Config.appName << "\n";
     os << "Queue Size: " << peer2Config.queueSize << "\n";
+    os << "Segment Size: " << peer2Config.segmentSize << "\n";
+    os << "Slab Pool Size: " << peer2Config.slabPoolSize << "\n";
+    os << "Huge Page Size: " << peer2Config.hugePageSize << "\n";
+    os << "Prefault SHM: " << (peer2Config.prefaultSHM ? "true" : "false")
+       << "\n";
+    os << "NUMA Aware: " << (peer2Config.numaAware ? "true" : "false")
+       << "\n";
+    os << "Fused: " << (peer2Config.fused ? "true" : "false") << "\n";
     os << "\nUnshaped Client: \n" << peer2Config.unshapedClient << "\n";
     os << "\nShaped Server: \n" << peer2Config.shapedServer << "\n";
+    for (const auto &trafficClass: peer2Config.trafficClasses) {
+      os << "\nTraffic Class: \n" << trafficClass << "\n";
+    }
     return os;
   }
 }
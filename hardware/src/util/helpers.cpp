@@ -7,20 +7,32 @@
 #include <sstream>
 #include <fstream>
 #include <shared_mutex>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <filesystem>
+#include <set>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include "helpers.h"
 #include "config.h"
 #include "../modules/PerfEval.h"
 
-extern pthread_rwlock_t quicSendLock;
+namespace helpers {
+  // The counters of every shaper loop, by name
+  std::vector<std::pair<std::string, ShaperCounters *>> shaperCountersList{};
+  std::mutex shaperCountersLock;
 #ifdef RECORD_STATS
-std::unordered_map<statElem, shaperStats *> shaperStatsMap{5};
-static std::atomic<int> totalIter = 0;
-static std::atomic<int> failedDPMask = 0;
-static std::atomic<int> failedPrepMask = 0;
-static std::atomic<int> failedEnqueueMask = 0;
+  // The statistics of every shaper loop, by name
+  std::vector<std::pair<std::string, ShaperStats *>> shaperStatsList{};
+  std::mutex shaperStatsLock;
 #endif
 
-namespace helpers {
   void setCPUAffinity(std::vector<int> &cpus) {
     cpu_set_t mask;
     CPU_ZERO(&mask);
@@ -34,6 +46,161 @@ namespace helpers {
     }
   }
 
+  int numaNodeOf(const std::vector<int> &cores) {
+    if (cores.empty()) return -1;
+    // The directory of the core links to its node (e.g. node0)
+    std::error_code error;
+    std::filesystem::directory_iterator cpuDir(
+        "/sys/devices/system/cpu/cpu" + std::to_string(cores[0]), error);
+    if (error) return -1;
+    for (const auto &entry: cpuDir) {
+      auto name = entry.path().filename().string();
+      if (name.rfind("node", 0) == 0 && name.size() > 4
+          && isdigit(name[4])) {
+        return std::stoi(name.substr(4));
+      }
+    }
+    return -1;
+  }
+
+  void warnIfCoresSpanNUMANodes(
+      const std::vector<std::pair<std::string, std::vector<int>>> &cores) {
+    std::set<int> nodes;
+    std::string placement;
+    for (const auto &[setting, settingCores]: cores) {
+      for (auto core: settingCores) {
+        auto node = numaNodeOf({core});
+        if (node < 0) continue;
+        nodes.insert(node);
+        placement += " " + setting + "[" + std::to_string(core) + "]: node " +
+                     std::to_string(node) + ",";
+      }
+    }
+    if (nodes.size() > 1) {
+      placement.pop_back();
+      std::cerr << "The configured cores span " << nodes.size()
+                << " NUMA nodes (" << placement.substr(1)
+                << "). Memory shared by them crosses the interconnect"
+                << std::endl;
+    }
+  }
+
+  /**
+   * @param node A NUMA node
+   * @param mask Set to the node mask with only that node
+   * @return The number of bits in the mask
+   */
+  static unsigned long numaNodeMask(int node,
+                                    std::array<unsigned long, 16> &mask) {
+    auto bits = sizeof(unsigned long) * 8;
+    mask.fill(0);
+    mask[node / bits] = 1UL << (node % bits);
+    return mask.size() * bits;
+  }
+
+  void preferNUMANode(int node) {
+    if (node < 0) return;
+    std::array<unsigned long, 16> mask{};
+    auto maxNode = numaNodeMask(node, mask);
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.data(), maxNode) < 0) {
+      std::cerr << "Could not prefer the memory of NUMA node " << node << ": "
+                << strerror(errno) << std::endl;
+    }
+  }
+
+  void setRealTimePriority(int priority) {
+    sched_param param{};
+    param.sched_priority = priority;
+    int result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (result != 0) {
+      std::cerr << "Could not schedule the shaper with SCHED_FIFO (priority "
+                << priority << "): " << strerror(result)
+                << ". It needs CAP_SYS_NICE or ulimit -r" << std::endl;
+    }
+  }
+
+  void lockMemory(size_t heapSize) {
+    mallopt(M_MMAP_MAX, 0);
+    mallopt(M_TRIM_THRESHOLD, -1);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+      std::cerr << "Could not lock the memory of the process: "
+                << strerror(errno) << ". It needs CAP_IPC_LOCK or ulimit -l"
+                << std::endl;
+      return;
+    }
+    // Locked memory is faulted in when it is mapped. The heap it grows to
+    // now stays
+    auto heap = reinterpret_cast<uint8_t *>(malloc(heapSize));
+    if (heap == nullptr) return;
+    for (size_t i = 0; i < heapSize; i += getpagesize()) {
+      reinterpret_cast<volatile uint8_t *>(heap)[i] = 0;
+    }
+    free(heap);
+  }
+
+  /**
+   * @param path A file with a CPU list (e.g. 2-3,6)
+   * @return The CPUs in it (none if the file doesn't exist)
+   */
+  static std::set<int> readCPUList(const std::string &path) {
+    std::set<int> cpus;
+    std::ifstream file(path);
+    std::string range;
+    while (std::getline(file, range, ',')) {
+      if (range.empty() || !isdigit(range[0])) continue;
+      auto separator = range.find('-');
+      auto first = std::stoi(range);
+      auto last = separator == std::string::npos
+                  ? first : std::stoi(range.substr(separator + 1));
+      for (auto cpu = first; cpu <= last; cpu++) cpus.insert(cpu);
+    }
+    return cpus;
+  }
+
+  void warnIfCoresNotIsolated(const std::vector<int> &cores) {
+    if (cores.empty()) {
+      std::cerr << "shaperCores is empty. The real-time shaper can be "
+                   "preempted by everything else on its core" << std::endl;
+      return;
+    }
+    auto isolated = readCPUList("/sys/devices/system/cpu/isolated");
+    auto noTick = readCPUList("/sys/devices/system/cpu/nohz_full");
+    for (auto core: cores) {
+      if (!isolated.contains(core)) {
+        std::cerr << "Shaper core " << core << " is not isolated (isolcpus)"
+                  << std::endl;
+      }
+      if (!noTick.contains(core)) {
+        std::cerr << "Shaper core " << core << " has the timer tick "
+                                               "(nohz_full)" << std::endl;
+      }
+    }
+  }
+
+  ShaperCounters *newShaperCounters(const std::string &name) {
+    auto counters = new ShaperCounters{};
+    std::scoped_lock lock(shaperCountersLock);
+    shaperCountersList.emplace_back(name, counters);
+    return counters;
+  }
+
+  void printMaskFailures(const std::string &name,
+                         const ShaperCounters &counters) {
+    std::cout << "Shaper iterations (" << name << "): "
+              << counters.iterations
+              << ", failed masks: DP " << counters.failedDPMask
+              << ", prep " << counters.failedPrepMask
+              << ", enqueue " << counters.failedEnqueueMask
+              << std::endl;
+  }
+
+  void printMaskFailures() {
+    std::scoped_lock lock(shaperCountersLock);
+    for (const auto &[name, counters]: shaperCountersList) {
+      printMaskFailures(name, *counters);
+    }
+  }
+
   bool SignalInfo::dequeue(Direction direction, SignalInfo::queueInfo &info) {
     switch (direction) {
       case toShaped:
@@ -52,19 +219,59 @@ namespace helpers {
 
   ssize_t
   SignalInfo::enqueue(Direction direction, SignalInfo::queueInfo &info) {
+    auto handler = handlers[direction].load(std::memory_order_acquire);
+    if (handler != nullptr) {
+      handler(handlerContexts[direction], info);
+      return 0;
+    }
+    ssize_t result;
     switch (direction) {
       case toShaped:
-        return ((LamportQueue *) ((uint8_t *) this + signalQueueToShapedOffset))
-            ->push(reinterpret_cast<uint8_t *>(&info),
-                   sizeof(info));
+        result =
+            ((LamportQueue *) ((uint8_t *) this + signalQueueToShapedOffset))
+                ->push(reinterpret_cast<uint8_t *>(&info),
+                       sizeof(info));
+        break;
       case fromShaped:
-        return ((LamportQueue *) ((uint8_t *) this +
-                                  signalQueueFromShapedOffset))
+        result = ((LamportQueue *) ((uint8_t *) this +
+                                    signalQueueFromShapedOffset))
             ->push(reinterpret_cast<uint8_t *>(&info),
                    sizeof(info));
+        break;
       default:
         return false;
     }
+    if (result < 0) return result;
+
+    // Ring the doorbell. Only wake the consumer up if it sleeps
+    doorbell[direction].fetch_add(1);
+    if (sleepers[direction].load() > 0) {
+      syscall(SYS_futex, &doorbell[direction], FUTEX_WAKE, INT_MAX, nullptr,
+              nullptr, 0);
+    }
+    return result;
+  }
+
+  void SignalInfo::waitForSignal(Direction direction, uint32_t &seen,
+                                 std::chrono::milliseconds timeout) {
+    auto current = doorbell[direction].load();
+    if (current == seen) {
+      struct timespec waitTime{timeout.count() / 1000,
+                               (timeout.count() % 1000) * 1000000};
+      sleepers[direction].fetch_add(1);
+      // Sleeps only if the doorbell still is at the value that was seen
+      syscall(SYS_futex, &doorbell[direction], FUTEX_WAIT, seen,
+              timeout.count() < 0 ? nullptr : &waitTime, nullptr, 0);
+      sleepers[direction].fetch_sub(1);
+      current = doorbell[direction].load();
+    }
+    seen = current;
+  }
+
+  void SignalInfo::setHandler(Direction direction, Handler handler,
+                              void *context) {
+    handlerContexts[direction] = context;
+    handlers[direction].store(handler, std::memory_order_release);
   }
 
   void addSignal(sigset_t *set, int numSignals, ...) {
@@ -78,8 +285,15 @@ namespace helpers {
 
 #ifdef RECORD_STATS
 
-  void updateStats(statElem elem, uint64_t val) {
-    auto *stats = shaperStatsMap[elem];
+  ShaperStats *newStats(const std::string &name) {
+    auto stats = new ShaperStats{};
+    std::scoped_lock lock(shaperStatsLock);
+    shaperStatsList.emplace_back(name, stats);
+    return stats;
+  }
+
+  void updateStats(ShaperStats &loopStats, statElem elem, uint64_t val) {
+    auto *stats = &loopStats.elems[elem];
     if (stats->min > val) {
       stats->min = val;
       stats->minIndex = stats->count;
@@ -103,29 +317,28 @@ namespace helpers {
 
   void printStats(bool isShapedProcess) {
     if (isShapedProcess) {
-      {
-        std::cout << "Total iters: " << totalIter
-                  << "\nFailed DP Masks: " << failedDPMask
-                  << "\nFailed Prep Masks: " << failedPrepMask
-                  << "\nFailed Enqueue Masks: " << failedEnqueueMask
-                  << std::endl;
-      }
       {
         std::ofstream maskDurations;
         maskDurations.open("maskDurations.json");
         maskDurations << "{\n";
-        for (auto &[elem, stats]: shaperStatsMap) {
-          maskDurations << elem << *stats;
+        std::scoped_lock lock(shaperStatsLock);
+        for (const auto &[name, stats]: shaperStatsList) {
+          maskDurations << "\"" << name << "\": {\n";
+          for (auto elem = 0; elem <= LOOP; elem++) {
+            maskDurations << (statElem) elem << stats->elems[elem];
+          }
+          maskDurations << "},\n";
         }
         maskDurations << "\n}";
         maskDurations << std::endl;
         maskDurations.close();
       }
     }
+    // The caller of waitForSignal exits once it is done (a shaped process
+    // first hands its queues over, see suspendForRestart)
     std::cout << "Stats written. Exiting "
               << (isShapedProcess ? "shaped" : "unshaped") << " process"
               << std::endl;
-    exit(0);
   }
 
 #endif
@@ -145,11 +358,11 @@ namespace helpers {
     if (ret_val == -1)
       perror("The signal wait failed\n");
     else {
-      pthread_rwlock_destroy(&quicSendLock);
       if (sigismember(&set, sig)) {
         std::cout << "\nReceived SIG" << sigabbrev_np(sig) << " on "
                   << (isShapedProcess ? "shaped" : "unshaped")
                   << " process. Writing stats..." << std::endl;
+        if (isShapedProcess) printMaskFailures();
 #ifdef RECORD_STATS
         printStats(isShapedProcess);
 #endif
@@ -157,166 +370,358 @@ namespace helpers {
     }
   }
 
-  uint8_t *initialiseSHM(int numStreams, std::string &appName, size_t queueSize,
-                         bool markForDeletion) {
-    size_t shmSize =
-        (sizeof(SignalInfo) + (2 * sizeof(LamportQueue)) +
-         (4 * numStreams * sizeof(SignalInfo::queueInfo))) +
-        ((numStreams * 2 + 2) * (sizeof(class LamportQueue) + queueSize));
+  SHMLayout layoutSHM(int numStreams, size_t queueSize, size_t segmentSize,
+                      size_t numSegments) {
+    SHMLayout layout{};
+    layout.numQueuePairs = numStreams;
+    layout.queueSize = queueSize;
+    layout.segmentSize = segmentSize;
+    // Keep the signal info off the cache line of the header
+    layout.signalInfoOffset = (sizeof(SHMHeader) + 63) & ~(size_t) 63;
+    layout.queuesOffset =
+        layout.signalInfoOffset + sizeof(SignalInfo) +
+        (2 * sizeof(LamportQueue)) +
+        (4 * numStreams * sizeof(SignalInfo::queueInfo));
+    layout.queueStride = LamportQueue::footprint(queueSize, segmentSize);
+    auto numQueues = (size_t) numStreams * 2 + 2;
+    layout.size = layout.queuesOffset + numQueues * layout.queueStride;
+    if (segmentSize == 0) return layout;
 
-    int shmId = shmget((int) std::hash<std::string>()(appName),
-                       shmSize,
-                       IPC_CREAT | 0644);
-    if (shmId < 0) {
-      std::cerr << "Failed to create shared memory!" << std::endl;
-      exit(1);
+    if (numSegments == 0) {
+      // Every queue can be full at the same time, as with contiguous queues
+      numSegments =
+          numQueues * ((queueSize + segmentSize - 1) / segmentSize + 1);
     }
-    auto shmAddr = static_cast<uint8_t *>(shmat(shmId, nullptr, 0));
-    if (shmAddr == (void *) -1) {
-      std::cerr << "Failed to attach shared memory!" << std::endl;
-      exit(1);
+    layout.numSegments = numSegments;
+    layout.poolOffset = (layout.size + 4095) & ~(size_t) 4095;
+    layout.size =
+        layout.poolOffset + SlabPool::footprint(segmentSize, numSegments);
+    return layout;
+  }
+
+  /**
+   * @param appName The unique key of the SHM
+   * @return The name of the SHM of the given app
+   */
+  static std::string shmName(const std::string &appName) {
+    auto name = "/minesVPN-" + appName;
+    std::replace(name.begin() + 1, name.end(), '/', '_');
+    return name;
+  }
+
+  // The SHMs kept to this process (fused mode), by their name
+  static std::mutex inProcessSHMLock;
+  static std::unordered_map<std::string, uint8_t *> inProcessSHMs;
+
+  static std::ostream &operator<<(std::ostream &os, const SHMLayout &layout) {
+    return os << "{queue pairs: " << layout.numQueuePairs << ", queue size: "
+              << layout.queueSize << ", segment size: " << layout.segmentSize
+              << ", segments: " << layout.numSegments << ", size: "
+              << layout.size << "}";
+  }
+
+  /**
+   * @param size A size as in the options of hugetlbfs (e.g. 2M or 1G)
+   * @return The size in bytes
+   */
+  static size_t parsePageSize(const std::string &size) {
+    size_t end;
+    auto bytes = std::stoul(size, &end);
+    switch (end < size.size() ? toupper(size[end]) : 0) {
+      case 'G':
+        return bytes << 30;
+      case 'M':
+        return bytes << 20;
+      case 'K':
+        return bytes << 10;
+      default:
+        return bytes;
+    }
+  }
+
+  /**
+   * @return The mount points of hugetlbfs, with the size of their pages
+   */
+  static std::vector<std::pair<std::string, size_t>> hugetlbfsMounts() {
+    size_t defaultSize = 0;
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    while (std::getline(meminfo, line)) {
+      if (line.rfind("Hugepagesize:", 0) == 0) {
+        defaultSize = std::stoul(line.substr(13)) << 10; // In kB
+      }
     }
 
-    // Marks the shm for deletion
-    // SHM is deleted once all attached processes exit
-    if (markForDeletion) shmctl(shmId, IPC_RMID, nullptr);
+    std::vector<std::pair<std::string, size_t>> mounts;
+    std::ifstream mountsFile("/proc/mounts");
+    std::string device, mountPoint, type, options;
+    while (mountsFile >> device >> mountPoint >> type >> options) {
+      std::getline(mountsFile, line); // The rest of the line
+      if (type != "hugetlbfs") continue;
+      auto pageSize = defaultSize;
+      auto option = options.find("pagesize=");
+      if (option != std::string::npos) {
+        pageSize = parsePageSize(options.substr(option + 9));
+      }
+      mounts.emplace_back(mountPoint, pageSize);
+    }
+    return mounts;
+  }
+
+  void removeSHM(const std::string &appName) {
+    auto name = shmName(appName);
+    shm_unlink(name.c_str());
+    for (const auto &[mountPoint, pageSize]: hugetlbfsMounts()) {
+      unlink((mountPoint + name).c_str());
+      unlink((mountPoint + name + ".tmp").c_str());
+    }
+  }
+
+  /**
+   * @brief Fault in all pages of a new SHM, so that the queues don't take
+   * page faults on the data path
+   * @param shmAddr The start of the SHM (still all zeros)
+   * @param size The size of the SHM
+   * @param pageSize The size of its pages
+   */
+  static void prefaultSHM(uint8_t *shmAddr, size_t size, size_t pageSize) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(shmAddr, size, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    // Older kernels: write to every page (it is all zeros still)
+    for (size_t i = 0; i < size; i += pageSize) {
+      reinterpret_cast<volatile uint8_t *>(shmAddr)[i] = 0;
+    }
+  }
+
+  /**
+   * @brief Create the SHM as a file on hugetlbfs. It is created under a
+   * temporary name, and only renamed once it is mapped: without enough free
+   * huge pages the mapping fails, and the shaped process must not attach to
+   * it in the meantime
+   * @return The start of the SHM. nullptr if there are no huge pages of
+   * that size (to fall back to normal pages)
+   */
+  static uint8_t *createHugeSHM(const std::string &name,
+                                const SHMLayout &layout,
+                                size_t hugePageSize) {
+    auto mounts = hugetlbfsMounts();
+    auto mount = std::find_if(mounts.begin(), mounts.end(),
+                              [hugePageSize](const auto &mount) {
+                                return mount.second == hugePageSize;
+                              });
+    if (mount == mounts.end()) {
+      std::cerr << "No hugetlbfs is mounted with pages of " << hugePageSize
+                << " bytes. Using normal pages for the shared memory"
+                << std::endl;
+      return nullptr;
+    }
+    auto path = mount->first + name;
+    auto tempPath = path + ".tmp";
+    int fd = open(tempPath.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (fd < 0) {
+      std::cerr << "Failed to create " << tempPath << ": " << strerror(errno)
+                << ". Using normal pages for the shared memory" << std::endl;
+      return nullptr;
+    }
+    auto size = (layout.size + hugePageSize - 1) / hugePageSize * hugePageSize;
+    void *shmAddr = MAP_FAILED;
+    if (ftruncate(fd, (off_t) size) == 0) {
+      shmAddr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (shmAddr == MAP_FAILED) {
+      std::cerr << "Failed to map " << size << " bytes of huge pages ("
+                << strerror(errno) << "). Using normal pages for the shared "
+                                      "memory" << std::endl;
+      unlink(tempPath.c_str());
+      return nullptr;
+    }
+    rename(tempPath.c_str(), path.c_str());
+    return static_cast<uint8_t *>(shmAddr);
+  }
+
+  uint8_t *createSHM(const std::string &appName, const SHMLayout &layout,
+                     size_t hugePageSize, bool prefault, int numaNode) {
+    auto name = shmName(appName);
+    uint8_t *shmAddr = nullptr;
+    size_t size = layout.size, pageSize = getpagesize();
+    if (hugePageSize > 0) {
+      shmAddr = createHugeSHM(name, layout, hugePageSize);
+      if (shmAddr != nullptr) {
+        size = (size + hugePageSize - 1) / hugePageSize * hugePageSize;
+        pageSize = hugePageSize;
+      }
+    }
+    if (shmAddr == nullptr) {
+      int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+      if (fd < 0) {
+        std::cerr << "Failed to create shared memory " << name << ": "
+                  << strerror(errno) << std::endl;
+        exit(1);
+      }
+      if (ftruncate(fd, (off_t) layout.size) < 0) {
+        std::cerr << "Failed to size shared memory!" << std::endl;
+        exit(1);
+      }
+      shmAddr = static_cast<uint8_t *>(
+          mmap(nullptr, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+               0));
+      close(fd);
+      if (shmAddr == MAP_FAILED) {
+        std::cerr << "Failed to attach shared memory!" << std::endl;
+        exit(1);
+      }
+      // Transparent huge pages, if the kernel allows them for shmem
+      // (/sys/kernel/mm/transparent_hugepage/shmem_enabled)
+      if (hugePageSize > 0) madvise(shmAddr, layout.size, MADV_HUGEPAGE);
+    }
+    // Before any page is faulted in
+    if (numaNode >= 0) {
+      std::array<unsigned long, 16> mask{};
+      auto maxNode = numaNodeMask(numaNode, mask);
+      if (syscall(SYS_mbind, shmAddr, size, MPOL_BIND, mask.data(), maxNode,
+                  0) < 0) {
+        std::cerr << "Could not bind the shared memory to NUMA node "
+                  << numaNode << ": " << strerror(errno) << std::endl;
+      }
+    }
+    if (prefault) prefaultSHM(shmAddr, size, pageSize);
+
+    auto header = new(shmAddr) SHMHeader{};
+    header->magic = SHM_MAGIC;
+    header->version = SHM_VERSION;
+    header->unshapedPID = getpid();
+    header->layout = layout;
     return shmAddr;
   }
 
-  [[noreturn]]
-  void shaperLoop(std::unordered_map<QueuePair, MsQuicStream *,
-      QueuePairHash> *queuesToStream,
-                  NoiseGenerator *noiseGenerator,
-                  const std::function<PreparedBuffer(size_t)>
-                  &prepareDummy,
-                  const std::function<std::vector<PreparedBuffer>(size_t)>
-                  &prepareData,
-                  const std::function<void(MsQuicStream *, uint8_t *, size_t)>
-                  &placeInQuicQueues,
-                  __useconds_t sendingInterval, __useconds_t decisionInterval,
-                  sendingStrategy strategy, std::shared_mutex &mapLock,
-                  std::vector<int> cores) {
-    if (!cores.empty())
-      setCPUAffinity(cores);
-    unsigned int divisor;
-    switch (strategy) {
-      case BURST:
-        divisor = 1;
-        break;
-      case UNIFORM:
-        divisor = decisionInterval / sendingInterval;
-        break;
+  void publishSHM(uint8_t *shmAddr) {
+    auto header = reinterpret_cast<SHMHeader *>(shmAddr);
+    header->ready.store(1);
+    syscall(SYS_futex, &header->ready, FUTEX_WAKE, INT_MAX, nullptr, nullptr,
+            0);
+  }
+
+  void keepSHMInProcess(const std::string &appName, uint8_t *shmAddr) {
+    removeSHM(appName);
+    std::scoped_lock lock(inProcessSHMLock);
+    inProcessSHMs[shmName(appName)] = shmAddr;
+  }
+
+  /**
+   * @brief Exit if the SHM was not created by a matching unshaped process
+   * @param name The name of the SHM
+   * @param header The header of the SHM
+   * @param layout The layout this process expects
+   */
+  static void checkSHMHeader(const std::string &name, const SHMHeader *header,
+                             const SHMLayout &layout) {
+    if (header->magic != SHM_MAGIC) {
+      std::cerr << "Shared memory " << name << " was not created by minesVPN!"
+                << std::endl;
+      exit(1);
     }
-    auto maskDPDecisionUs = 0;
-    auto maskPrepDurationUs = 0;
-    auto maskEnqueueDurationUs = 0;
-#ifdef RECORD_STATS
-    for (auto i = 0; i < 5; i++) {
-      auto shaperStat = new shaperStats{};
-      shaperStatsMap[(statElem) i] = shaperStat;
+    if (header->version != SHM_VERSION) {
+      std::cerr << "Shared memory " << name << " is of version "
+                << header->version << ", expected " << SHM_VERSION
+                << std::endl;
+      exit(1);
     }
-#endif
-#ifdef SHAPING
-    maskDPDecisionUs = 0;
-    maskPrepDurationUs = 6000;
-    maskEnqueueDurationUs = 1000;
-#endif
-    auto mask = std::chrono::steady_clock::now();
-    auto decisionSleepUntil = std::chrono::steady_clock::now();
-    auto sendingSleepUntil = std::chrono::steady_clock::now();
-    auto start = std::chrono::steady_clock::now();
-    auto end = start;
-    while (true) {
-#ifdef SHAPING
-      decisionSleepUntil += std::chrono::microseconds(decisionInterval);
-#else
-      decisionSleepUntil = std::chrono::steady_clock::now() +
-                           std::chrono::microseconds(decisionInterval);
-#endif
-      auto loopStart = std::chrono::steady_clock::now();
-      // Masked DP Decision Time
-      mask = std::chrono::steady_clock::now() +
-             std::chrono::microseconds(maskDPDecisionUs);
-      start = std::chrono::steady_clock::now();
-      mapLock.lock_shared();
-      auto aggregatedSize = helpers::getAggregatedQueueSize(queuesToStream);
-      mapLock.unlock_shared();
-      auto DPDecision = noiseGenerator->getDPDecision(aggregatedSize);
-      end = std::chrono::steady_clock::now();
-      if (std::chrono::steady_clock::now() < mask)
-        std::this_thread::sleep_until(mask);
-#ifdef RECORD_STATS
-      else if (maskDPDecisionUs > 0) failedDPMask++;
-#endif
+    if (!(header->layout == layout)) {
+      std::cerr << "Shared memory " << name << " has the layout "
+                << header->layout << ", expected " << layout << std::endl;
+      exit(1);
+    }
+  }
 
-#ifndef SHAPING
-      DPDecision = aggregatedSize;
-#endif
-      if (DPDecision != 0) {
-#ifdef RECORD_STATS
-        totalIter++;
-        updateStats(DECISION, (end - start).count() / 1000);
-#endif
-        // Enqueue data for quic to send.
-        auto maxBytesToSend = DPDecision / divisor;
-        for (unsigned int i = 0; i < divisor; i++) {
-          sendingSleepUntil += std::chrono::microseconds(sendingInterval);
-
-          // Masked Prep time
-          mask = std::chrono::steady_clock::now() +
-                 std::chrono::microseconds(maskPrepDurationUs);
-          start = std::chrono::steady_clock::now();
-          size_t dataSize = std::min(aggregatedSize, maxBytesToSend);
-          size_t dummySize = maxBytesToSend - dataSize;
-          auto preparedBuffers = prepareData(dataSize);
-          preparedBuffers.push_back(prepareDummy(dummySize));
-          end = std::chrono::steady_clock::now();
-#ifdef RECORD_STATS
-          updateStats(PREP, (end - start).count() / 1000);
-          updateStats(DECISION_PREP, (end - loopStart).count() / 1000);
-#endif
-          if (std::chrono::steady_clock::now() < mask)
-            std::this_thread::sleep_until(mask);
-#ifdef RECORD_STATS
-          else if (maskPrepDurationUs > 0) failedPrepMask++;
-#endif
-          int err = pthread_rwlock_wrlock(&quicSendLock);
-          mask = std::chrono::steady_clock::now() +
-                 std::chrono::microseconds(maskEnqueueDurationUs);
-          start = std::chrono::steady_clock::now();
-          if (err == 0) {
-            for (auto preparedBuffer: preparedBuffers) {
-              if (preparedBuffer.stream == nullptr
-                  || preparedBuffer.buffer == nullptr)
-                continue;
-              placeInQuicQueues(preparedBuffer.stream, preparedBuffer.buffer,
-                                preparedBuffer.length);
-            }
-            end = std::chrono::steady_clock::now();
-#ifdef RECORD_STATS
-            updateStats(ENQUEUE, (end - start).count() / 1000);
-#endif
-            if (std::chrono::steady_clock::now() < mask)
-              std::this_thread::sleep_until(mask);
-#ifdef RECORD_STATS
-            else if (maskEnqueueDurationUs > 0) failedEnqueueMask++;
-#endif
-            pthread_rwlock_unlock(&quicSendLock);
-          }
-          if (std::chrono::steady_clock::now() < sendingSleepUntil)
-            std::this_thread::sleep_until(sendingSleepUntil);
+  uint8_t *attachSHM(const std::string &appName, const SHMLayout &layout,
+                     bool prefault) {
+    auto name = shmName(appName);
+    {
+      // Fused mode: created by the unshaped half, and published already
+      std::scoped_lock lock(inProcessSHMLock);
+      auto shm = inProcessSHMs.find(name);
+      if (shm != inProcessSHMs.end()) {
+        auto header = reinterpret_cast<SHMHeader *>(shm->second);
+        checkSHMHeader(name, header, layout);
+        header->shapedAttaches++;
+        return shm->second;
+      }
+    }
+    // The unshaped process may have created it on hugetlbfs
+    std::vector<std::string> hugePaths;
+    for (const auto &[mountPoint, pageSize]: hugetlbfsMounts()) {
+      hugePaths.push_back(mountPoint + name);
+    }
+    std::string hugePath;
+    auto openSHM = [&name, &hugePaths, &hugePath]() {
+      for (const auto &path: hugePaths) {
+        int fd = open(path.c_str(), O_RDWR);
+        if (fd >= 0) {
+          hugePath = path;
+          return fd;
         }
-      } else {
-        prepareData(0); // For state management of client who disconnected
       }
-      auto loopEnd = std::chrono::steady_clock::now();
-#ifdef RECORD_STATS
-      if (DPDecision > 0)
-        updateStats(LOOP, (loopEnd - loopStart).count() / 1000);
-#endif
-      if (std::chrono::steady_clock::now() < decisionSleepUntil) {
-        std::this_thread::sleep_until(decisionSleepUntil);
+      return shm_open(name.c_str(), O_RDWR, 0);
+    };
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::seconds(SHM_ATTACH_TIMEOUT);
+    auto timedOut = [&deadline]() {
+      return std::chrono::steady_clock::now() >= deadline;
+    };
+
+    // Wait for the unshaped process to create and size the SHM
+    int fd;
+    struct stat shmStat{};
+    while ((fd = openSHM()) < 0
+           || fstat(fd, &shmStat) < 0 || shmStat.st_size == 0) {
+      if (fd >= 0) close(fd);
+      if (timedOut()) {
+        std::cerr << "Shared memory " << name << " was not created in time!"
+                  << std::endl;
+        exit(1);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    // On hugetlbfs, it is rounded up to a whole number of huge pages
+    auto size = (size_t) shmStat.st_size;
+    if (size != layout.size && (hugePath.empty() || size < layout.size)) {
+      close(fd);
+      std::cerr << "Shared memory " << name << " has a size of "
+                << shmStat.st_size << ", expected " << layout << std::endl;
+      exit(1);
+    }
+    // The pages are in already. Only map them all
+    auto shmAddr = static_cast<uint8_t *>(
+        mmap(nullptr, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | (prefault ? MAP_POPULATE : 0), fd, 0));
+    close(fd);
+    if (shmAddr == MAP_FAILED) {
+      std::cerr << "Failed to attach shared memory!" << std::endl;
+      exit(1);
+    }
+
+    // Sleep until it is published
+    auto header = reinterpret_cast<SHMHeader *>(shmAddr);
+    while (header->ready.load() == 0) {
+      if (timedOut()) {
+        std::cerr << "Shared memory " << name << " was not initialised in "
+                                                 "time!" << std::endl;
+        exit(1);
       }
+      struct timespec waitTime{0, 100000000};
+      syscall(SYS_futex, &header->ready, FUTEX_WAIT, 0, &waitTime, nullptr,
+              0);
+    }
+    checkSHMHeader(name, header, layout);
+    // A restarted shaped process may find the SHM of a crashed unshaped one
+    if (kill(header->unshapedPID, 0) < 0 && errno == ESRCH) {
+      std::cerr << "The unshaped process of shared memory " << name
+                << " is gone!" << std::endl;
+      exit(1);
     }
+    header->shapedAttaches++;
+    return shmAddr;
   }
 }
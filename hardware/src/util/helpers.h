@@ -9,13 +9,24 @@
 #include "../modules/Common.h"
 #include "msquic.hpp"
 #include "../modules/shaper/NoiseGenerator.h"
+#include "../modules/PerfEval.h"
+#include <atomic>
+#include <chrono>
 #include <csignal>
 #include <cstdarg>
 #include <unistd.h>
+#include <memory>
 #include <mutex>
 #include <shared_mutex>
 #include <unordered_map>
 
+#define SHM_MAGIC 0x4e5056736e694dULL // "MinsVPN"
+#define SHM_VERSION 5 // Bump on every change of the SHM layout
+#define SHM_ATTACH_TIMEOUT 30 // Time (s) to wait for the unshaped process
+#define MASK_REPORT_INTERVAL 10 // Time (s) between reports of failed masks
+#define RESTART_DRAIN_TIME 500 // Time (ms) a restarting shaped process
+// waits for the data in flight to arrive
+
 namespace helpers {
   /**
    * @brief Stores the queue pair (toShaped and fromShaped)
@@ -46,6 +57,13 @@ namespace helpers {
     size_t signalQueueToShapedOffset;
     size_t signalQueueFromShapedOffset;
 
+    // Doorbells (one per direction): bumped after every enqueue. The consumer
+    // sleeps on them (futex, shared between the processes through the SHM)
+    std::atomic<uint32_t> doorbell[2]{0, 0};
+    // The number of consumers sleeping on each doorbell (the producer only
+    // makes the wake-up system call if there is one)
+    std::atomic<uint32_t> sleepers[2]{0, 0};
+
   public:
     enum Direction {
       toShaped, fromShaped
@@ -84,18 +102,131 @@ namespace helpers {
      * @return
      */
     ssize_t enqueue(Direction direction, queueInfo &info);
+
+    /**
+     * @brief Sleep until a signal is enqueued in the given direction. Returns
+     * at once if one was enqueued since the last call. Dequeue all signals
+     * after it returns
+     * @param direction The direction of the signals
+     * @param seen The doorbell value of the last call (start with 0). Updated
+     * @param timeout The maximum time to sleep (negative to sleep until a
+     * signal is enqueued)
+     */
+    void waitForSignal(Direction direction, uint32_t &seen,
+                       std::chrono::milliseconds timeout =
+                       std::chrono::milliseconds(-1));
+
+    /**
+     * @brief Handles a signal on the thread that enqueues it
+     */
+    using Handler = void (*)(void *context, queueInfo &info);
+
+    /**
+     * @brief Hand the signals of the given direction straight to the given
+     * handler instead of queueing them. Only for fused mode, where both
+     * halves are in one process
+     * @param direction The direction of the signals
+     * @param handler The handler
+     * @param context Passed to the handler
+     */
+    void setHandler(Direction direction, Handler handler, void *context);
+
+  private:
+    // The handlers of the directions (see setHandler)
+    std::atomic<Handler> handlers[2]{nullptr, nullptr};
+    void *handlerContexts[2]{nullptr, nullptr};
+  };
+
+  /**
+   * @brief Where everything is in the shared memory. Computed once (see
+   * layoutSHM) and recorded in the header of the SHM, so that the processes
+   * can't disagree about it
+   */
+  struct SHMLayout {
+    uint64_t numQueuePairs; // Not counting the dummy queue pair
+    uint64_t queueSize;
+    uint64_t signalInfoOffset;
+    uint64_t queuesOffset;
+    uint64_t queueStride; // The distance between the starts of two queues
+    uint64_t segmentSize; // 0 if the queues are contiguous
+    uint64_t numSegments; // In the slab pool
+    uint64_t poolOffset;
+    uint64_t size; // The size of the whole SHM
+
+    bool operator==(const SHMLayout &layout) const = default;
+
+    /**
+     * @param shmAddr The start of the SHM
+     * @param index The index of the queue (0 and 1 are the dummy queues)
+     * @return The queue at the given index
+     */
+    [[nodiscard]] inline uint8_t *queue(uint8_t *shmAddr,
+                                        uint64_t index) const {
+      return shmAddr + queuesOffset + index * queueStride;
+    }
+
+    /**
+     * @param shmAddr The start of the SHM
+     * @return The slab pool of the queues (nullptr if they are contiguous)
+     */
+    [[nodiscard]] inline SlabPool *pool(uint8_t *shmAddr) const {
+      if (segmentSize == 0) return nullptr;
+      return reinterpret_cast<SlabPool *>(shmAddr + poolOffset);
+    }
+  };
+
+  /**
+   * @brief The start of the SHM. Written by the unshaped process, checked by
+   * the shaped process before it touches anything else
+   */
+  struct SHMHeader {
+    uint64_t magic;
+    uint32_t version;
+    // 0 until the unshaped process has initialised the SHM. The shaped
+    // process sleeps on it (futex)
+    std::atomic<uint32_t> ready;
+    // The number of shaped processes that attached so far. From the second
+    // one on, the shaped process was restarted and rebuilds its state from
+    // the queues
+    std::atomic<uint32_t> shapedAttaches;
+    pid_t unshapedPID;
+    SHMLayout layout;
   };
 
+  /**
+   * @param shmAddr The start of the SHM (attached by the shaped process)
+   * @return true if a shaped process was attached to it before this one
+   */
+  inline bool isReattached(uint8_t *shmAddr) {
+    return reinterpret_cast<SHMHeader *>(shmAddr)->shapedAttaches.load() > 1;
+  }
+
+  /**
+   * @brief Compute the layout of the SHM
+   * @param numStreams The number of queue pairs (not counting the dummy pair)
+   * @param queueSize The size of each queue
+   * @param segmentSize The size of the segments of the slab pool the queues
+   * take their memory from. 0 for contiguous queues of queueSize each
+   * @param numSegments The number of segments in the slab pool. 0 for as many
+   * as all queues need to be full at the same time
+   * @return The layout
+   */
+  SHMLayout layoutSHM(int numStreams, size_t queueSize, size_t segmentSize,
+                      size_t numSegments);
+
 
   /**
-   * @brief Types of stream we support
+   * @brief Types of stream we support. Multiplexed streams carry the data
+   * of many flows, each framed with its flow ID (see FlowFrame.h)
    */
   enum StreamType {
-    Control, Dummy, Data
+    Control, Dummy, Data, Multiplexed
   };
 
   /**
-   * @brief The control message sent from one peer to the other peer
+   * @brief A control message received from the other peer (kept around
+   * when it arrives before the stream it refers to). On the wire, control
+   * messages are batched into control frames (see ControlFrame.h)
    */
   struct ControlMessage {
     uint64_t streamID{QUIC_UINT62_MAX};
@@ -110,12 +241,158 @@ namespace helpers {
     size_t length = 0;
   };
 
+  /**
+   * @brief The buffers prepared in one sending interval. Allocated once, with
+   * room for one buffer per queue pair and the dummy, and reused every
+   * interval
+   */
+  class PreparedBuffers {
+  public:
+    /**
+     * @param capacity The most buffers prepared in one sending interval
+     */
+    explicit PreparedBuffers(size_t capacity) :
+        buffers(new PreparedBuffer[capacity]), capacity(capacity) {}
+
+    /**
+     * @param preparedBuffer The buffer to add
+     * @return false if there is no room left (the buffer is not added)
+     */
+    inline bool push(const PreparedBuffer &preparedBuffer) {
+      if (count == capacity) return false;
+      buffers[count++] = preparedBuffer;
+      return true;
+    }
+
+    /**
+     * @return true if no more buffers can be added
+     */
+    [[nodiscard]] inline bool full() const { return count == capacity; }
+
+    [[nodiscard]] inline size_t size() const { return count; }
+
+    inline void clear() { count = 0; }
+
+    inline PreparedBuffer *begin() { return buffers.get(); }
+
+    inline PreparedBuffer *end() { return buffers.get() + count; }
+
+  private:
+    std::unique_ptr<PreparedBuffer[]> buffers;
+    const size_t capacity;
+    size_t count = 0;
+  };
+
+  /**
+   * @brief The iterations of a shaper loop, and the masked windows of it
+   * (DP decision, prep and enqueue) that took longer than their mask
+   */
+  struct ShaperCounters {
+    std::atomic<int> iterations = 0;
+    std::atomic<int> failedDPMask = 0;
+    std::atomic<int> failedPrepMask = 0;
+    std::atomic<int> failedEnqueueMask = 0;
+  };
+
   /**
    * @brief Set the CPU affinity of the calling thread
    * @param cpus The CPUs to set the affinity to
    */
   void setCPUAffinity(std::vector<int> &cpus);
 
+  /**
+   * @param cores CPU cores
+   * @return The NUMA node of the first of them. -1 if there are none, or the
+   * kernel doesn't tell
+   */
+  int numaNodeOf(const std::vector<int> &cores);
+
+  /**
+   * @brief Warn if the given cores are on more than one NUMA node: memory
+   * they share then crosses the interconnect
+   * @param cores The cores, each with the name of its setting
+   */
+  void warnIfCoresSpanNUMANodes(
+      const std::vector<std::pair<std::string, std::vector<int>>> &cores);
+
+  /**
+   * @brief Prefer the memory of the given NUMA node for everything the
+   * calling thread allocates from now on. Threads and processes it starts
+   * afterwards inherit it, so their buffers are on that node as well
+   * @param node The NUMA node (-1 does nothing)
+   */
+  void preferNUMANode(int node);
+
+  /**
+   * @brief Schedule the calling thread with SCHED_FIFO
+   * @param priority The real-time priority (1-99)
+   */
+  void setRealTimePriority(int priority);
+
+  /**
+   * @brief Lock all memory of the process, now and in the future, so that it
+   * takes no page faults. Freed heap memory is kept (and large buffers come
+   * from the heap), so that buffers allocated later are faulted in already
+   * @param heapSize The amount of heap to fault in now
+   */
+  void lockMemory(size_t heapSize);
+
+  /**
+   * @brief Warn about the given cores that are not isolated from the
+   * scheduler and the timer tick (isolcpus and nohz_full)
+   * @param cores The cores
+   */
+  void warnIfCoresNotIsolated(const std::vector<int> &cores);
+
+  /**
+   * @brief Create the counters of a shaper loop. They are printed with those
+   * of the other loops by printMaskFailures
+   * @param name The name the counters are printed under
+   * @return The counters (never freed)
+   */
+  ShaperCounters *newShaperCounters(const std::string &name);
+
+  /**
+   * @brief Print how many of the masked windows of a shaper loop (DP
+   * decision, prep and enqueue) took longer than their mask
+   * @param name The name of the loop
+   * @param counters The counters of the loop
+   */
+  void printMaskFailures(const std::string &name,
+                         const ShaperCounters &counters);
+
+  /**
+   * @brief Print the failed masks of every shaper loop
+   */
+  void printMaskFailures();
+
+#ifdef RECORD_STATS
+  /**
+   * @brief The statistics of one shaper loop, by the part of the loop they
+   * time. In a pipelined loop, each part is timed by one stage only, so no
+   * two threads update the same statistics
+   */
+  struct ShaperStats {
+    shaperStats elems[LOOP + 1]{};
+  };
+
+  /**
+   * @brief Create the statistics of a shaper loop. They are written with
+   * those of the other loops by printStats
+   * @param name The name the statistics are written under
+   * @return The statistics (never freed)
+   */
+  ShaperStats *newStats(const std::string &name);
+
+  /**
+   * @brief Add a duration (in us) to the statistics of a shaper loop
+   * @param stats The statistics of the loop
+   * @param elem The part of the loop that took it
+   * @param val The duration
+   */
+  void updateStats(ShaperStats &stats, statElem elem, uint64_t val);
+#endif
+
 /**
  * @brief Add given signal to the signal set
  * @param set The signal set to add the signal in
@@ -125,7 +402,8 @@ namespace helpers {
   void addSignal(sigset_t *set, int numSignals, ...);
 
 /**
- * @brief Waits for signal and then processes it
+ * @brief Waits for signal and then processes it. Returns once the stats are
+ * written, the caller then exits
  * @param isShapedProcess Used to identify whether the process is the shaped
  * or the unshaped process (only used when compiled with RECORD_STATS) to
  * print/save the relevant statistics
@@ -133,16 +411,62 @@ namespace helpers {
   void waitForSignal(bool isShapedProcess);
 
   /**
-   * @brief Initialise Shared Memory in the given process
-   * @param numStreams The number of streams supported (sets the size of SHM)
-   * @param appName The unique key to use when creating/attaching to SHM
-   * @param markForDeletion Whether the SHM should be marked for deletion
-   * (deletes when all attached processes exit)
+   * @brief Remove the SHM of the given app. Call it before the processes are
+   * started (if a previous run left it behind), so that the shaped process
+   * can't attach to a stale SHM, and once the unshaped process exits
+   * @param appName The unique key of the SHM
+   */
+  void removeSHM(const std::string &appName);
+
+  /**
+   * @brief Create the SHM (in the unshaped process) and write its header.
+   * The shaped process can't attach until publishSHM is called
+   * @param appName The unique key of the SHM
+   * @param layout The layout of the SHM
+   * @param hugePageSize The size of the huge pages to put the SHM in (on the
+   * hugetlbfs mounted with that page size). Falls back to normal pages (and
+   * asks for transparent huge pages) if there are not enough of them. 0 for
+   * normal pages
+   * @param prefault Fault in all pages of the SHM now, instead of on the data
+   * path
+   * @param numaNode Bind the SHM to the memory of this NUMA node (-1 for
+   * no binding)
    * @return pointer to the shared memory (uint8_t * is used so that C++
    * allows pointer arithmetic later)
    */
-  uint8_t *initialiseSHM(int numStreams, std::string &appName, size_t queueSize,
-                         bool markForDeletion = false);
+  uint8_t *createSHM(const std::string &appName, const SHMLayout &layout,
+                     size_t hugePageSize, bool prefault, int numaNode);
+
+  /**
+   * @brief Let the shaped process attach, once everything in the SHM is
+   * initialised
+   * @param shmAddr The start of the SHM
+   */
+  void publishSHM(uint8_t *shmAddr);
+
+  /**
+   * @brief Keep the SHM to this process (fused mode): the shaped half
+   * attaches to it directly, and its name is removed so that no other process
+   * can
+   * @param appName The unique key of the SHM
+   * @param shmAddr The start of the SHM
+   */
+  void keepSHMInProcess(const std::string &appName, uint8_t *shmAddr);
+
+  /**
+   * @brief Attach to the SHM (in the shaped process) as soon as the unshaped
+   * process has published it. Exits if it doesn't within SHM_ATTACH_TIMEOUT,
+   * if its header doesn't match the given layout, or if its unshaped process
+   * is gone. The name of the SHM is kept, so that a restarted shaped process
+   * can attach again (see isReattached). If the unshaped half runs in this
+   * process (see keepSHMInProcess), its SHM is returned at once
+   * @param appName The unique key of the SHM
+   * @param layout The layout this process expects
+   * @param prefault Map all pages of the SHM now
+   * @return pointer to the shared memory
+   */
+  uint8_t *attachSHM(const std::string &appName, const SHMLayout &layout,
+                     bool prefault);
 
   /**
    * @brief Get the total data available to be sent out. We currently assume
@@ -161,33 +485,20 @@ namespace helpers {
   }
 
   /**
-   * @brief DP Decision function (runs in a separate thread at decisionInterval interval)
-   * @param queuesToStream The map containing all queues to get the
-   * aggregated size of
-   * @param noiseGenerator The configured noise generator instance
-   * @param sendDummy The function to call when the decision is made to send
-   * dummy bytes
-   * @param sendData The function to call when the decision is made to send
-   * actual data
-   * @param sendingInterval The interval with which this loop should iterate
-   * @param decisionInterval The interval with which this loop will run
-   * @param strategy The sending strategy (when decisionInterval >= 2 *
-   * sendingInterval). Can be "BURST" or "UNIFORM"
-   * @param mapLock The mapLock shared mutex used for locking the
-   * queuesToStream map
-   */
-  [[noreturn]]
-  void shaperLoop(std::unordered_map<QueuePair, MsQuicStream *,
-      QueuePairHash> *queuesToStream,
-                  NoiseGenerator *noiseGenerator,
-                  const std::function<PreparedBuffer(size_t)>
-                  &prepareDummy,
-                  const std::function<std::vector<PreparedBuffer>(size_t)>
-                  &prepareData,
-                  const std::function<void(MsQuicStream *, uint8_t *, size_t)>
-                  &placeInQuicQueues,
-                  __useconds_t sendingInterval, __useconds_t decisionInterval,
-                  sendingStrategy strategy, std::shared_mutex &mapLock,
-                  std::vector<int> cores);
+   * @brief Get the total data of one traffic class available to be sent out
+   * @param queuesToStream The unordered map to iterate over
+   * @param trafficClass The traffic class (as tagged on the toShaped queues)
+   * @return The aggregated size of the queues of that class
+   */
+  inline size_t getAggregatedQueueSize(std::unordered_map<QueuePair,
+      MsQuicStream *,
+      QueuePairHash> *queuesToStream, uint32_t trafficClass) {
+    size_t aggregatedSize = 0;
+    for (auto &iterator: *queuesToStream) {
+      if (iterator.first.toShaped->trafficClass != trafficClass) continue;
+      aggregatedSize += iterator.first.toShaped->size();
+    }
+    return aggregatedSize;
+  }
 }
 #endif //MINESVPN_HELPERS_H
@@ -0,0 +1,435 @@
+//
+// Created by Rut Vora
+//
+
+// Decoding of the wire formats: LEB128 varints (Varint.h), the control
+// frames (ControlFrame.h) and the flow frames of the multiplexed streams
+// (FlowFrame.h). Random batches of control messages are encoded and fed
+// back to the decoder in random chunks (frames split across pushes, and
+// batches large enough to be split into several frames). Then malformed
+// input: oversize frames, a wrong version, unknown record types, truncated
+// and overlong varints, and records that overrun their frame.
+// Usage: ./test [batches]
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "../../ControlFrame.h"
+#include "../../FlowFrame.h"
+
+using namespace helpers;
+
+static void check(bool condition, const std::string &what) {
+  if (condition) return;
+  std::cerr << "FAILED: " << what << std::endl;
+  exit(1);
+}
+
+/**
+ * @brief A control message as it was encoded, to compare the decoded
+ * ControlEvent with
+ */
+struct Message {
+  enum Kind {
+    CONTROL, DUMMY, SYN_, FIN_, FLOW_SYN, FLOW_FIN, FLOW_RESUME, FLOW_RESET,
+    PAUSE_
+  } kind;
+  uint64_t ID = 0;
+  uint64_t numMuxStreams = 0;
+  uint64_t sentBytes = 0;
+  uint64_t receivedBytes = 0;
+  addressPair addrPair{};
+};
+
+static uint64_t randomValue(std::mt19937_64 &random) {
+  // Every varint size, from 1 to MAX_VARINT_SIZE bytes
+  auto bits = std::uniform_int_distribution<int>(0, 64)(random);
+  return bits == 64 ? random() : random() & ((1ULL << bits) - 1);
+}
+
+static void randomString(std::mt19937_64 &random, char *to, size_t size) {
+  auto length = std::uniform_int_distribution<size_t>(0, size - 1)(random);
+  for (size_t i = 0; i < length; i++) to[i] = (char) ('a' + random() % 26);
+  to[length] = '\0';
+}
+
+static Message randomMessage(std::mt19937_64 &random) {
+  Message message{(Message::Kind) (random() % 9)};
+  message.ID = randomValue(random);
+  switch (message.kind) {
+    case Message::CONTROL:
+      message.numMuxStreams = random() % 2 == 0 ? 0 : randomValue(random);
+      break;
+    case Message::SYN_:
+    case Message::FLOW_SYN: {
+      auto &addrPair = message.addrPair;
+      randomString(random, addrPair.clientAddress,
+                   sizeof(addrPair.clientAddress));
+      randomString(random, addrPair.clientPort, sizeof(addrPair.clientPort));
+      randomString(random, addrPair.serverAddress,
+                   sizeof(addrPair.serverAddress));
+      randomString(random, addrPair.serverPort, sizeof(addrPair.serverPort));
+      break;
+    }
+    case Message::FLOW_RESUME:
+      message.sentBytes = randomValue(random);
+      message.receivedBytes = randomValue(random);
+      break;
+    case Message::PAUSE_:
+      message.ID = 0;
+      break;
+    default:
+      break;
+  }
+  return message;
+}
+
+static void encode(ControlFrameEncoder &encoder, const Message &message) {
+  switch (message.kind) {
+    case Message::CONTROL:
+      encoder.addStream(Control, message.ID, message.numMuxStreams);
+      break;
+    case Message::DUMMY:
+      encoder.addStream(Dummy, message.ID);
+      break;
+    case Message::SYN_:
+      encoder.addSYN(message.ID, message.addrPair);
+      break;
+    case Message::FIN_:
+      encoder.addFIN(message.ID);
+      break;
+    case Message::FLOW_SYN:
+      encoder.addFlowSYN(message.ID, message.addrPair);
+      break;
+    case Message::FLOW_FIN:
+      encoder.addFlowFIN(message.ID);
+      break;
+    case Message::FLOW_RESUME:
+      encoder.addFlowResume(message.ID, message.sentBytes,
+                            message.receivedBytes);
+      break;
+    case Message::FLOW_RESET:
+      encoder.addFlowReset(message.ID);
+      break;
+    case Message::PAUSE_:
+      encoder.addPause();
+      break;
+  }
+}
+
+static void compare(const Message &message, const ControlEvent &event) {
+  bool isFlow = message.kind == Message::FLOW_SYN ||
+                message.kind == Message::FLOW_FIN ||
+                message.kind == Message::FLOW_RESUME ||
+                message.kind == Message::FLOW_RESET;
+  check((isFlow ? event.flowID : event.streamID) == message.ID, "ID");
+  check(event.numMuxStreams == message.numMuxStreams, "numMuxStreams");
+  check(event.sentBytes == message.sentBytes, "sentBytes");
+  check(event.receivedBytes == message.receivedBytes, "receivedBytes");
+  switch (message.kind) {
+    case Message::CONTROL:
+      check(event.streamType == Control, "control stream");
+      break;
+    case Message::DUMMY:
+      check(event.streamType == Dummy, "dummy stream");
+      break;
+    case Message::SYN_:
+    case Message::FLOW_SYN: {
+      check(event.connStatus == SYN, "SYN");
+      check(event.streamType ==
+            (message.kind == Message::SYN_ ? Data : Multiplexed), "SYN type");
+      addressPair decoded{};
+      copyAddresses(event, decoded);
+      check(memcmp(&decoded, &message.addrPair, sizeof(decoded)) == 0,
+            "SYN addresses");
+      break;
+    }
+    case Message::FIN_:
+    case Message::FLOW_FIN:
+      check(event.connStatus == FIN, "FIN");
+      check(event.streamType ==
+            (message.kind == Message::FIN_ ? Data : Multiplexed), "FIN type");
+      break;
+    case Message::FLOW_RESUME:
+      check(event.action == ControlEvent::RESUME, "RESUME");
+      break;
+    case Message::FLOW_RESET:
+      check(event.action == ControlEvent::RESET, "RESET");
+      break;
+    case Message::PAUSE_:
+      check(event.action == ControlEvent::PAUSE, "PAUSE");
+      break;
+  }
+}
+
+/**
+ * @brief Push the bytes to the decoder in chunks of random length (up to
+ * maxChunk) and collect the decoded messages
+ * @param numDecoded Set to the number of messages decoded (before the
+ * decoder failed, if it did)
+ * @return false if the decoder failed
+ */
+static bool decode(ControlFrameDecoder &decoder, const uint8_t *bytes,
+                   size_t length, size_t maxChunk, std::mt19937_64 &random,
+                   const std::vector<Message> *expected,
+                   size_t *numDecoded = nullptr) {
+  size_t decoded = 0;
+  if (numDecoded == nullptr) numDecoded = &decoded;
+  while (length > 0) {
+    auto chunk = std::min(
+        length, std::uniform_int_distribution<size_t>(1, maxChunk)(random));
+    if (!decoder.push(bytes, chunk)) return false;
+    ControlEvent event;
+    while (decoder.next(event)) {
+      if (expected != nullptr) {
+        check(decoded < expected->size(), "more messages than encoded");
+        compare((*expected)[decoded], event);
+      }
+      decoded++;
+      *numDecoded = decoded;
+    }
+    if (decoder.failed()) return false;
+    bytes += chunk;
+    length -= chunk;
+  }
+  *numDecoded = decoded;
+  if (expected != nullptr)
+    check(decoded == expected->size(), "fewer messages than encoded");
+  return true;
+}
+
+static void varints() {
+  std::vector<uint64_t> values{0, 1, 127, 128, 16383, 16384, 1ULL << 35,
+                               (1ULL << 63) - 1, 1ULL << 63, UINT64_MAX};
+  for (auto value: values) {
+    uint8_t encoded[MAX_VARINT_SIZE + 1];
+    auto end = putVarint(encoded, value);
+    check((size_t) (end - encoded) == varintSize(value), "varintSize");
+    const uint8_t *pos = encoded;
+    uint64_t decoded;
+    check(getVarint(pos, end, decoded) && decoded == value && pos == end,
+          "varint round trip");
+    // Every prefix is incomplete
+    for (auto limit = encoded; limit < end; limit++) {
+      pos = encoded;
+      check(!getVarint(pos, limit, decoded), "truncated varint");
+    }
+  }
+  check(varintSize(UINT64_MAX) == MAX_VARINT_SIZE, "largest varint");
+  // More continuation bytes than a 64-bit value has
+  uint8_t overlong[MAX_VARINT_SIZE + 1];
+  memset(overlong, 0x80, sizeof(overlong));
+  overlong[MAX_VARINT_SIZE] = 0;
+  const uint8_t *pos = overlong;
+  uint64_t decoded;
+  check(!getVarint(pos, overlong + sizeof(overlong), decoded),
+        "overlong varint");
+}
+
+static void roundTrips(size_t batches) {
+  std::mt19937_64 random(42);
+  size_t numMessages = 0, numFrames = 0;
+  ControlFrameDecoder decoder{0};
+  for (size_t batch = 0; batch < batches; batch++) {
+    // Now and then a batch that takes several frames
+    auto size = batch % 50 == 0 ? 2000 : random() % 40 + 1;
+    ControlFrameEncoder encoder{size};
+    std::vector<Message> messages{};
+    for (size_t i = 0; i < size; i++) {
+      messages.push_back(randomMessage(random));
+      encode(encoder, messages.back());
+    }
+    size_t length;
+    auto frames = encoder.finish(length);
+    check(frames != nullptr && encoder.empty(), "finish");
+    for (size_t offset = 0; offset < length; numFrames++) {
+      const uint8_t *pos = frames + offset + 1;
+      uint64_t payload;
+      check(frames[offset] == CONTROL_FRAME_VERSION &&
+            getVarint(pos, frames + length, payload) &&
+            payload <= MAX_CONTROL_FRAME_PAYLOAD, "frame header");
+      offset = pos - frames + payload;
+      check(offset <= length, "frame length");
+    }
+    // Chunks from single bytes to more than a frame
+    auto maxChunk = batch % 3 == 0 ? 8 : batch % 3 == 1 ? 1000 : 100000;
+    check(decode(decoder, frames, length, maxChunk, random, &messages),
+          "decoder failed on a valid batch");
+    numMessages += size;
+    free(frames);
+  }
+  ControlFrameEncoder encoder{1};
+  size_t length;
+  check(encoder.finish(length) == nullptr && length == 0, "empty batch");
+  std::cout << "round trips: " << numMessages << " messages in " << numFrames
+            << " frames" << std::endl;
+}
+
+/**
+ * @param payload The payload of the frame
+ * @param version The version of the frame
+ * @return A frame with the given payload
+ */
+static std::vector<uint8_t> frame(const std::vector<uint8_t> &payload,
+                                  uint8_t version = CONTROL_FRAME_VERSION) {
+  std::vector<uint8_t> bytes(1 + MAX_VARINT_SIZE);
+  bytes[0] = version;
+  bytes.resize(putVarint(bytes.data() + 1, payload.size()) - bytes.data());
+  bytes.insert(bytes.end(), payload.begin(), payload.end());
+  return bytes;
+}
+
+/**
+ * @return The frame (one FIN on stream 4) the encoder makes
+ */
+static std::vector<uint8_t> validFrame() {
+  ControlFrameEncoder encoder{1};
+  encoder.addFIN(4);
+  size_t length;
+  auto frames = encoder.finish(length);
+  std::vector<uint8_t> bytes(frames, frames + length);
+  free(frames);
+  return bytes;
+}
+
+/**
+ * @brief Decode the bytes (in chunks of up to maxChunk) with a new decoder
+ * @param validBefore The number of messages before the malformed one
+ * @return The number of messages decoded, -1 if the decoder failed
+ */
+static long decodeAll(const std::vector<uint8_t> &bytes, size_t maxChunk = 7,
+                      size_t validBefore = 0) {
+  static std::mt19937_64 random(7);
+  ControlFrameDecoder decoder{0};
+  size_t decoded = 0;
+  if (!decode(decoder, bytes.data(), bytes.size(), maxChunk, random, nullptr,
+              &decoded)) {
+    check(decoded == validBefore, "message decoded from a malformed frame");
+    check(decoder.failed() && !decoder.push(bytes.data(), 1),
+          "failed decoder takes more bytes");
+    ControlEvent event;
+    check(!decoder.next(event), "failed decoder decodes");
+    return -1;
+  }
+  return (long) decoded;
+}
+
+static void malformed() {
+  auto valid = validFrame();
+  check(decodeAll(valid) == 1, "valid frame");
+
+  // Wrong version (also after a valid frame)
+  auto bytes = valid;
+  bytes[0] = CONTROL_FRAME_VERSION + 1;
+  check(decodeAll(bytes) == -1, "wrong version");
+  bytes = valid;
+  bytes.insert(bytes.end(), valid.begin(), valid.end());
+  bytes[valid.size()] = 0;
+  check(decodeAll(bytes, 7, 1) == -1, "wrong version of the second frame");
+
+  // A frame that the buffer can never hold, and the largest one it can
+  auto oversize = frame(std::vector<uint8_t>(MAX_CONTROL_FRAME_SIZE, 0));
+  check(decodeAll(oversize, 100000) == -1, "oversize frame");
+  // One unknown record filling the largest payload. Its value (like those
+  // below) is no valid ID, so decoding it as a known record would fail
+  std::vector<uint8_t> records(MAX_CONTROL_FRAME_PAYLOAD, 0x80);
+  records[0] = 200;
+  putVarint(records.data() + 1, MAX_CONTROL_FRAME_PAYLOAD - 4);
+  check(decodeAll(frame(records), 100000) == 0, "largest frame");
+
+  // Unknown record types are skipped, the records around them decoded
+  std::vector<uint8_t> payload(valid.begin() + 2, valid.end());
+  std::vector<uint8_t> mixed = {0, 1, 0x80};
+  mixed.insert(mixed.end(), payload.begin(), payload.end());
+  mixed.insert(mixed.end(), {250, 3, 0x80, 0x80, 0x80});
+  mixed.insert(mixed.end(), payload.begin(), payload.end());
+  check(decodeAll(frame(mixed)) == 2, "unknown record types");
+
+  // Truncated varints: of the frame length (just wait for the rest), of a
+  // value length or an ID in a record, and overlong ones
+  bytes = {CONTROL_FRAME_VERSION, 0x80};
+  check(decodeAll(bytes) == 0, "frame length cut off by the end");
+  bytes = {CONTROL_FRAME_VERSION};
+  bytes.insert(bytes.end(), MAX_VARINT_SIZE, 0x80);
+  check(decodeAll(bytes) == -1, "overlong frame length");
+  check(decodeAll(frame({4, 0x80})) == -1, "value length cut off");
+  check(decodeAll(frame({4, 1, 0x80})) == -1, "ID cut off");
+  check(decodeAll(frame({4, 5, 1})) == -1, "value beyond the frame");
+  check(decodeAll(frame({4, 0})) == -1, "empty value");
+  check(decodeAll(frame({7, 2, 1, 0x80})) == -1, "resume bytes cut off");
+  // A SYN whose server port runs past its value
+  check(decodeAll(frame({3, 6, 1, 0, 0, 0, 5, 'a', 0, 0, 0, 0})) == -1,
+        "SYN string cut off");
+
+  // clear makes a failed decoder usable again
+  ControlFrameDecoder decoder{0};
+  std::mt19937_64 random(3);
+  bytes = valid;
+  bytes[0] = 0;
+  check(!decode(decoder, bytes.data(), bytes.size(), 4, random, nullptr),
+        "wrong version");
+  decoder.clear();
+  size_t decoded;
+  check(decode(decoder, valid.data(), valid.size(), 4, random, nullptr,
+               &decoded) && decoded == 1, "decoder after clear");
+  std::cout << "malformed frames: OK" << std::endl;
+}
+
+static void flowFrames() {
+  std::mt19937_64 random(5);
+  std::vector<uint8_t> stream{};
+  std::vector<std::vector<uint8_t>> sent(8), received(8);
+  for (int i = 0; i < 5000; i++) {
+    auto flow = random() % sent.size();
+    // Some empty frames (to start a stream) and some large ones
+    auto length = random() % 10 == 0 ? 0 : random() % 10 == 0
+                                           ? random() % 100000
+                                           : random() % 200;
+    uint8_t header[MAX_FLOW_HEADER_SIZE];
+    auto headerSize = putFlowHeader(header, flow, length);
+    check(headerSize == flowHeaderSize(flow, length), "flowHeaderSize");
+    stream.insert(stream.end(), header, header + headerSize);
+    for (size_t j = 0; j < length; j++) {
+      stream.push_back((uint8_t) random());
+      sent[flow].push_back(stream.back());
+    }
+  }
+  FlowDemuxer demuxer{};
+  size_t offset = 0;
+  while (offset < stream.size()) {
+    auto chunk = std::min(stream.size() - offset,
+                          (size_t) (random() % 3 == 0 ? random() % 4 + 1
+                                                      : random() % 5000 + 1));
+    check(demuxer.demux(stream.data() + offset, chunk,
+                        [&](uint64_t flow, uint8_t *payload, size_t length) {
+                          check(flow < received.size(), "flow ID");
+                          received[flow].insert(received[flow].end(), payload,
+                                                payload + length);
+                        }), "demux of valid frames");
+    offset += chunk;
+  }
+  check(sent == received, "demultiplexed payloads");
+
+  // A header that never ends
+  FlowDemuxer malformed{};
+  std::vector<uint8_t> overlong(MAX_FLOW_HEADER_SIZE + 1, 0x80);
+  check(!malformed.demux(overlong.data(), overlong.size(),
+                         [](uint64_t, uint8_t *, size_t) {}),
+        "overlong flow header");
+  std::cout << "flow frames: " << stream.size() << " bytes demultiplexed"
+            << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  size_t batches = argc > 1 ? std::stoul(argv[1]) : 2000;
+  varints();
+  roundTrips(batches);
+  malformed();
+  flowFrames();
+  std::cout << "OK" << std::endl;
+  return 0;
+}
@@ -0,0 +1,178 @@
+//
+// Created by Rut Vora
+//
+
+// Per-tick overhead of the shaper loop itself, without any real preparing
+// or sending: the peer hands out one prepared buffer per flow (static
+// memory, nothing is popped) and its send only counts the bytes. Compares
+// the previous loop (virtual calls through std::function wrappers, a fresh
+// vector of prepared buffers per tick and a lock per sent buffer) with
+// ShaperEngine (calls resolved at compile time, a reused buffer span and one
+// lock per batch). Both run without SHAPING, so no masks and no sleeps.
+// Usage: ./benchmark [flows] [ticks]
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <shared_mutex>
+#include <vector>
+#include "../../ShaperEngine.h"
+
+#define QUEUE_SIZE 65536
+#define SEGMENT_SIZE 65536
+
+static uint8_t data[QUEUE_SIZE];
+// Allocated once: the engine frees the dummy if there is no room for it
+static auto dummy = reinterpret_cast<uint8_t *>(calloc(QUEUE_SIZE, 1));
+
+// The interface the previous loop reached the peer through
+class PeerBase {
+public:
+  virtual ~PeerBase() = default;
+
+  virtual helpers::PreparedBuffer prepareDummy(size_t dummySize) = 0;
+
+  virtual std::vector<helpers::PreparedBuffer>
+  prepareVector(size_t dataSize) = 0;
+
+  virtual void prepareData(uint32_t trafficClass, size_t dataSize,
+                           helpers::PreparedBuffers &preparedBuffers) = 0;
+
+  virtual void send(MsQuicStream *stream, uint8_t *buffer, size_t length) = 0;
+};
+
+class FakePeer final : public PeerBase {
+public:
+  std::unordered_map<helpers::QueuePair, MsQuicStream *,
+      helpers::QueuePairHash> *queuesToStream;
+  std::shared_mutex mapLock;
+  size_t sink = 0;
+
+  explicit FakePeer(std::unordered_map<helpers::QueuePair, MsQuicStream *,
+      helpers::QueuePairHash> *queuesToStream) :
+      queuesToStream(queuesToStream) {}
+
+  helpers::PreparedBuffer prepareDummy(size_t dummySize) override {
+    return {stream(0), dummy, std::min(dummySize, sizeof(data))};
+  }
+
+  std::vector<helpers::PreparedBuffer>
+  prepareVector(size_t dataSize) override {
+    std::vector<helpers::PreparedBuffer> preparedBuffers{};
+    for (size_t i = 1; i <= queuesToStream->size(); i++) {
+      preparedBuffers.push_back({stream(i), data, dataSize % sizeof(data)});
+    }
+    return preparedBuffers;
+  }
+
+  void prepareData(uint32_t trafficClass, size_t dataSize,
+                   helpers::PreparedBuffers &preparedBuffers) override {
+    (void) (trafficClass);
+    for (size_t i = 1; i <= queuesToStream->size(); i++) {
+      preparedBuffers.push({stream(i), data, dataSize % sizeof(data)});
+    }
+  }
+
+  void send(MsQuicStream *stream, uint8_t *buffer, size_t length) override {
+    (void) (stream);
+    sink += length + buffer[0];
+  }
+
+private:
+  // Never dereferenced
+  static MsQuicStream *stream(size_t i) {
+    return reinterpret_cast<MsQuicStream *>(0x1000 + i);
+  }
+};
+
+// One tick of the previous loop (BURST, no masks)
+static void legacyTick(
+    std::unordered_map<helpers::QueuePair, MsQuicStream *,
+        helpers::QueuePairHash> *queuesToStream,
+    NoiseGenerator *noiseGenerator,
+    const std::function<helpers::PreparedBuffer(size_t)> &prepareDummy,
+    const std::function<std::vector<helpers::PreparedBuffer>(size_t)>
+    &prepareData,
+    const std::function<void(MsQuicStream *, uint8_t *, size_t)>
+    &placeInQuicQueues, std::shared_mutex &mapLock) {
+  mapLock.lock_shared();
+  auto aggregatedSize = helpers::getAggregatedQueueSize(queuesToStream);
+  mapLock.unlock_shared();
+  auto DPDecision = noiseGenerator->getDPDecision(aggregatedSize);
+  DPDecision = aggregatedSize;
+  size_t dataSize = std::min(aggregatedSize, DPDecision);
+  auto preparedBuffers = prepareData(dataSize);
+  preparedBuffers.push_back(prepareDummy(DPDecision - dataSize));
+  for (auto preparedBuffer: preparedBuffers) {
+    if (preparedBuffer.stream == nullptr || preparedBuffer.buffer == nullptr)
+      continue;
+    placeInQuicQueues(preparedBuffer.stream, preparedBuffer.buffer,
+                      preparedBuffer.length);
+  }
+}
+
+template<class Tick>
+static double measure(int ticks, Tick &&tick) {
+  for (int i = 0; i < ticks / 10; i++) tick(); // Warm up
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ticks; i++) tick();
+  return std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start).count() / ticks;
+}
+
+int main(int argc, char **argv) {
+  int flows = argc > 1 ? std::stoi(argv[1]) : 48;
+  int ticks = argc > 2 ? std::stoi(argv[2]) : 1000000;
+
+  // Every flow has a byte queued, so that each tick prepares and sends
+  std::string appName = "shaperEngineBenchmark";
+  helpers::removeSHM(appName);
+  auto layout = helpers::layoutSHM(flows, QUEUE_SIZE, SEGMENT_SIZE, 0);
+  auto shmAddr = helpers::createSHM(appName, layout, 0, false, -1);
+  helpers::removeSHM(appName);
+  auto pool = new(layout.pool(shmAddr))
+      SlabPool{layout.segmentSize, layout.numSegments};
+  auto queuesToStream = new std::unordered_map<helpers::QueuePair,
+      MsQuicStream *, helpers::QueuePairHash>();
+  for (int i = 0; i < flows; i++) {
+    auto ID = (uint64_t) (2 * i + 3);
+    auto fromShaped = new(layout.queue(shmAddr, ID - 1))
+        LamportQueue{ID - 1, QUEUE_SIZE, pool};
+    auto toShaped = new(layout.queue(shmAddr, ID))
+        LamportQueue{ID, QUEUE_SIZE, pool};
+    toShaped->push(data, 1);
+    (*queuesToStream)[helpers::QueuePair{fromShaped, toShaped}] = nullptr;
+  }
+
+  FakePeer fakePeer{queuesToStream};
+  PeerBase *peer = &fakePeer;
+  NoiseGenerator noiseGenerator{0.5, 1, 1000000, 0};
+
+  std::function<helpers::PreparedBuffer(size_t)> prepareDummy =
+      [peer](size_t dummySize) { return peer->prepareDummy(dummySize); };
+  std::function<std::vector<helpers::PreparedBuffer>(size_t)> prepareData =
+      [peer](size_t dataSize) { return peer->prepareVector(dataSize); };
+  std::function<void(MsQuicStream *, uint8_t *, size_t)> send =
+      [peer, &fakePeer](MsQuicStream *stream, uint8_t *buffer,
+                        size_t length) {
+        fakePeer.mapLock.lock_shared();
+        peer->send(stream, buffer, length);
+        fakePeer.mapLock.unlock_shared();
+      };
+  auto legacy = measure(ticks, [&]() {
+    legacyTick(queuesToStream, &noiseGenerator, prepareDummy, prepareData,
+               send, fakePeer.mapLock);
+  });
+
+  helpers::ShaperEngine<FakePeer, BURST> engine{fakePeer, &noiseGenerator,
+                                                0, 0, flows + 1ul};
+  auto templated = measure(ticks, [&]() { engine.tick(); });
+
+  std::cout << flows << " flows, " << ticks << " ticks (sink "
+            << fakePeer.sink % 10 << ")" << std::endl;
+  std::cout << "std::function loop: " << legacy << " ns/tick" << std::endl;
+  std::cout << "ShaperEngine:       " << templated << " ns/tick"
+            << std::endl;
+  return 0;
+}
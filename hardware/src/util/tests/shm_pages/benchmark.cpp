@@ -0,0 +1,100 @@
+//
+// Created by Rut Vora
+//
+
+// Shaper preparation time over queues in normal and in huge pages. Every
+// tick, the unshaped side tops up the toShaped queues of all flows (not
+// timed), then a shaper decision is prepared as in ShapedClient::prepareData:
+// up to the decision size is popped from the flows into freshly allocated
+// buffers (timed). With 40+ flows the queues span far more memory than the
+// TLB covers with 4 KB pages.
+// Usage: ./benchmark [flows] [huge page size] [ticks]
+// Huge pages need a hugetlbfs mounted with that page size and enough free
+// huge pages, e.g. echo 128 > /proc/sys/vm/nr_hugepages (2 MB pages). Without
+// them, the last run falls back to normal pages (and says so)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "../../helpers.h"
+
+#define QUEUE_SIZE 2097152
+#define SEGMENT_SIZE 65536
+#define DECISION_SIZE 500000
+
+static void run(const std::string &label, int flows, size_t hugePageSize,
+                bool prefault, int ticks) {
+  auto appName = "shmPagesBenchmark" + std::to_string(hugePageSize) +
+                 (prefault ? "p" : "");
+  helpers::removeSHM(appName);
+  auto layout = helpers::layoutSHM(flows, QUEUE_SIZE, SEGMENT_SIZE, 0);
+  auto start = std::chrono::steady_clock::now();
+  auto shmAddr = helpers::createSHM(appName, layout, hugePageSize, prefault,
+                                    -1);
+  auto setup = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+  helpers::removeSHM(appName);
+
+  auto pool = new(layout.pool(shmAddr))
+      SlabPool{layout.segmentSize, layout.numSegments};
+  std::vector<LamportQueue *> queues;
+  for (int i = 0; i < flows; i++) {
+    auto ID = (uint64_t) (2 * i + 3);
+    queues.push_back(new(layout.queue(shmAddr, ID))
+                         LamportQueue{ID, QUEUE_SIZE, pool});
+  }
+
+  std::mt19937 random(42);
+  std::vector<uint8_t> data(QUEUE_SIZE, 0x5a);
+  std::vector<double> prepTimes;
+  size_t first = 0;
+  for (int tick = 0; tick < ticks; tick++) {
+    // The unshaped side: some flows get a lot, most a bit
+    for (auto queue: queues) {
+      auto length = random() % 8 == 0 ? random() % QUEUE_SIZE
+                                      : random() % (4 * DECISION_SIZE / flows);
+      queue->pushPartial(data.data(), length);
+    }
+
+    auto prepStart = std::chrono::steady_clock::now();
+    std::vector<std::pair<uint8_t *, size_t>> prepared;
+    size_t dataSize = DECISION_SIZE;
+    for (int i = 0; i < flows && dataSize > 0; i++) {
+      auto queue = queues[(first + i) % flows];
+      auto queueSize = queue->size();
+      if (queueSize == 0) continue;
+      auto sizeToSend = std::min(dataSize, queueSize);
+      auto buffer = reinterpret_cast<uint8_t *>(malloc(sizeToSend));
+      queue->pop(buffer, sizeToSend);
+      prepared.emplace_back(buffer, sizeToSend);
+      dataSize -= sizeToSend;
+    }
+    prepTimes.push_back(std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - prepStart).count());
+    for (auto &[buffer, length]: prepared) free(buffer);
+    first = (first + 1) % flows;
+  }
+
+  std::sort(prepTimes.begin(), prepTimes.end());
+  double sum = 0;
+  for (auto time: prepTimes) sum += time;
+  std::cout << label << ": setup " << setup << " ms, prep mean "
+            << sum / (double) prepTimes.size() << " us, p50 "
+            << prepTimes[prepTimes.size() / 2] << " us, p99 "
+            << prepTimes[prepTimes.size() * 99 / 100] << " us" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  int flows = argc > 1 ? std::stoi(argv[1]) : 48;
+  size_t hugePageSize = argc > 2 ? std::stoul(argv[2]) : 2097152;
+  int ticks = argc > 3 ? std::stoi(argv[3]) : 2000;
+  std::cout << flows << " flows, " << ticks << " ticks of "
+            << DECISION_SIZE << " bytes" << std::endl;
+  run("4 KB pages", flows, 0, false, ticks);
+  run("4 KB pages, prefaulted", flows, 0, true, ticks);
+  run("Huge pages, prefaulted", flows, hugePageSize, true, ticks);
+  return 0;
+}